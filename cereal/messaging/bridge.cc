@@ -2,7 +2,14 @@
 #include <string>
 #include <cassert>
 #include <csignal>
+#include <cstring>
+#include <chrono>
 #include <map>
+#include <set>
+#include <sstream>
+#include <vector>
+
+#include <zlib.h>
 
 typedef void (*sighandler_t)(int sig);
 
@@ -11,54 +18,405 @@ typedef void (*sighandler_t)(int sig);
 #include "impl_msgq.hpp"
 #include "impl_zmq.hpp"
 
+// Batched mode sends all services as framed batches over a single socket
+#define BRIDGE_BATCH_PORT 8099
+#define BRIDGE_BATCH_SIZE (64 * 1024)
+#define BRIDGE_BATCH_INTERVAL_MS 10
+
+#define BRIDGE_FRAME_MAGIC 0x47445242 // "BRDG"
+#define BRIDGE_FLAG_COMPRESSED 1
+#define BRIDGE_FRAME_MAX_SIZE DEFAULT_SEGMENT_SIZE // nothing larger fits in a msgq segment
+
+#define BRIDGE_RECV_MAX 256
+#define BRIDGE_ARENA_SIZE (4 * 1024 * 1024)
+
+// A frame is this header followed by num_msgs records of
+// { uint8_t name_len, char name[name_len], uint32_t size, char data[size] },
+// deflated as a whole if BRIDGE_FLAG_COMPRESSED is set
+struct bridge_frame_header_t {
+  uint32_t magic;
+  uint32_t flags;
+  uint32_t raw_size;
+  uint32_t num_msgs;
+};
+
+struct BridgeConfig {
+  std::set<std::string> allow;
+  std::set<std::string> deny = {"plusFrame", "uiLayoutState"};
+  bool decimate = false;
+  bool batch = false;
+  bool compress = false;
+  std::string receive_address;
+};
+
+struct ForwardedService {
+  std::string name;
+  PubSocket *pub = NULL;
+  int decimation = -1;
+  int counter = 0;
+};
+
+volatile sig_atomic_t do_exit = 0;
+
+static void set_do_exit(int sig) {
+  do_exit = 1;
+}
+
 void sigpipe_handler(int sig) {
   assert(sig == SIGPIPE);
   std::cout << "SIGPIPE received" << std::endl;
 }
 
-static std::vector<std::string> get_services() {
-  std::vector<std::string> name_list;
+static std::set<std::string> split_list(const char *list) {
+  std::set<std::string> r;
+  std::stringstream ss(list);
+  std::string name;
+  while (std::getline(ss, name, ',')) {
+    if (!name.empty()) r.insert(name);
+  }
+  return r;
+}
+
+static bool is_forwarded(const BridgeConfig &config, const std::string &name) {
+  if (!config.allow.empty() && config.allow.count(name) == 0) return false;
+  return config.deny.count(name) == 0;
+}
 
+static bool is_known_service(const std::string &name) {
   for (const auto& it : services) {
-    std::string name = it.name;
-    if (name == "plusFrame" || name == "uiLayoutState") continue;
-    name_list.push_back(name);
+    if (name == it.name) return true;
   }
+  return false;
+}
 
-  return name_list;
+static void usage(const char *argv0) {
+  std::cout << "usage: " << argv0 << " [options]                    forward local msgq services over ZMQ" << std::endl;
+  std::cout << "       " << argv0 << " --receive <address> [options] republish a batched stream into local msgq" << std::endl;
+  std::cout << "options:" << std::endl;
+  std::cout << "  --allow a,b   only forward these services" << std::endl;
+  std::cout << "  --deny a,b    never forward these services" << std::endl;
+  std::cout << "  --decimate    forward every nth message, using the qlog decimation from service_list.yaml" << std::endl;
+  std::cout << "  --batch       coalesce all services into framed batches on port " << BRIDGE_BATCH_PORT << std::endl;
+  std::cout << "  --compress    deflate batches (implies --batch)" << std::endl;
 }
 
+class BatchWriter {
+public:
+  BatchWriter(void *sock, bool compress) : sock(sock), compress(compress) {
+    payload.reserve(2 * BRIDGE_BATCH_SIZE);
+  }
 
-int main(void){
-  signal(SIGPIPE, (sighandler_t)sigpipe_handler);
+  void append(const std::string &name, const char *data, size_t size) {
+    if (num_msgs == 0) {
+      first_msg_time = std::chrono::steady_clock::now();
+    }
+
+    uint8_t name_len = name.size();
+    uint32_t msg_size = size;
+    payload.push_back(name_len);
+    payload.insert(payload.end(), name.begin(), name.end());
+    payload.insert(payload.end(), (const char *)&msg_size, (const char *)&msg_size + sizeof(msg_size));
+    payload.insert(payload.end(), data, data + size);
+    num_msgs++;
+
+    if (payload.size() >= BRIDGE_BATCH_SIZE) {
+      flush();
+    }
+  }
+
+  // Don't hold on to messages for longer than the batch interval
+  void flush_if_due() {
+    if (num_msgs > 0 && std::chrono::steady_clock::now() - first_msg_time >= std::chrono::milliseconds(BRIDGE_BATCH_INTERVAL_MS)) {
+      flush();
+    }
+  }
+
+  void flush() {
+    if (num_msgs == 0) return;
+
+    bridge_frame_header_t header = {BRIDGE_FRAME_MAGIC, 0, (uint32_t)payload.size(), num_msgs};
+    const char *body = payload.data();
+    size_t body_size = payload.size();
+
+    if (compress) {
+      uLongf compressed_size = compressBound(payload.size());
+      if (compressed.size() < compressed_size) {
+        compressed.resize(compressed_size);
+      }
+
+      // Only use the compressed payload if it actually got smaller
+      int err = compress2((Bytef *)compressed.data(), &compressed_size, (const Bytef *)payload.data(), payload.size(), Z_BEST_SPEED);
+      if (err == Z_OK && compressed_size < payload.size()) {
+        header.flags |= BRIDGE_FLAG_COMPRESSED;
+        body = compressed.data();
+        body_size = compressed_size;
+      }
+    }
+
+    frame.resize(sizeof(header) + body_size);
+    memcpy(frame.data(), &header, sizeof(header));
+    memcpy(frame.data() + sizeof(header), body, body_size);
+    zmq_send(sock, frame.data(), frame.size(), ZMQ_DONTWAIT);
 
-  auto endpoints = get_services();
+    payload.clear();
+    num_msgs = 0;
+  }
 
-  std::map<SubSocket*, PubSocket*> sub2pub;
+private:
+  void *sock;
+  bool compress;
+  std::vector<char> payload, compressed, frame;
+  uint32_t num_msgs = 0;
+  std::chrono::steady_clock::time_point first_msg_time;
+};
 
+static int run_forward(const BridgeConfig &config) {
   Context *zmq_context = new ZMQContext();
   Context *msgq_context = new MSGQContext();
   Poller *poller = new MSGQPoller();
 
-  for (auto endpoint: endpoints){
+  std::map<SubSocket*, ForwardedService> forwarded;
+
+  void *batch_sock = NULL;
+  BatchWriter *batch_writer = NULL;
+  if (config.batch) {
+    batch_sock = zmq_socket(zmq_context->getRawContext(), ZMQ_PUB);
+    std::string endpoint = "tcp://*:" + std::to_string(BRIDGE_BATCH_PORT);
+    int r = zmq_bind(batch_sock, endpoint.c_str());
+    assert(r == 0);
+    batch_writer = new BatchWriter(batch_sock, config.compress);
+  }
+
+  for (const auto& it : services) {
+    std::string name = it.name;
+    if (!is_forwarded(config, name)) continue;
+
     SubSocket * msgq_sock = new MSGQSubSocket();
-    msgq_sock->connect(msgq_context, endpoint, "127.0.0.1", false);
+    msgq_sock->connect(msgq_context, name, "127.0.0.1", false);
     poller->registerSocket(msgq_sock);
 
-    PubSocket * zmq_sock = new ZMQPubSocket();
-    zmq_sock->connect(zmq_context, endpoint);
+    ForwardedService &service = forwarded[msgq_sock];
+    service.name = name;
+    service.decimation = config.decimate ? it.decimation : -1;
 
-    sub2pub[msgq_sock] = zmq_sock;
+    if (!config.batch) {
+      service.pub = new ZMQPubSocket();
+      service.pub->connect(zmq_context, name);
+    }
   }
 
+  auto arena = kj::heapArray<capnp::word>(BRIDGE_ARENA_SIZE / sizeof(capnp::word));
+  char *batch_data[BRIDGE_RECV_MAX];
+  size_t batch_sizes[BRIDGE_RECV_MAX];
+
+  auto forward = [&](ForwardedService &service, char *data, size_t size) {
+    if (service.decimation > 0) {
+      bool skip = service.counter != 0;
+      service.counter = (service.counter + 1) % service.decimation;
+      if (skip) return;
+    }
+
+    if (batch_writer) {
+      batch_writer->append(service.name, data, size);
+    } else {
+      service.pub->send(data, size);
+    }
+  };
+
+  while (!do_exit) {
+    for (auto sub_sock : poller->poll(config.batch ? BRIDGE_BATCH_INTERVAL_MS : 100)) {
+      ForwardedService &service = forwarded[sub_sock];
 
-  while (true){
-    for (auto sub_sock : poller->poll(100)){
-      Message * msg = sub_sock->receive();
-      if (msg == NULL) continue;
-      sub2pub[sub_sock]->sendMessage(msg);
-      delete msg;
+      while (true) {
+        int n = sub_sock->receiveBatch((char*)arena.begin(), BRIDGE_ARENA_SIZE, batch_data, batch_sizes, BRIDGE_RECV_MAX);
+        if (n == 0) break;
+
+        if (n < 0) {
+          // message is larger than the arena
+          Message *msg = sub_sock->receive(true);
+          if (msg == NULL) break;
+          forward(service, msg->getData(), msg->getSize());
+          delete msg;
+          continue;
+        }
+
+        for (int i = 0; i < n; i++) {
+          forward(service, batch_data[i], batch_sizes[i]);
+        }
+      }
     }
+
+    if (batch_writer) {
+      batch_writer->flush_if_due();
+    }
+  }
+
+  if (batch_writer) {
+    batch_writer->flush();
+    delete batch_writer;
+    zmq_close(batch_sock);
   }
+
+  for (auto &kv : forwarded) {
+    delete kv.second.pub;
+    delete kv.first;
+  }
+  delete poller;
+  delete msgq_context;
+  delete zmq_context;
   return 0;
 }
+
+static int run_receive(const BridgeConfig &config) {
+  Context *zmq_context = new ZMQContext();
+  Context *msgq_context = new MSGQContext();
+
+  void *sock = zmq_socket(zmq_context->getRawContext(), ZMQ_SUB);
+  zmq_setsockopt(sock, ZMQ_SUBSCRIBE, "", 0);
+  int timeout = 100;
+  zmq_setsockopt(sock, ZMQ_RCVTIMEO, &timeout, sizeof(timeout));
+
+  std::string endpoint = "tcp://" + config.receive_address + ":" + std::to_string(BRIDGE_BATCH_PORT);
+  int r = zmq_connect(sock, endpoint.c_str());
+  assert(r == 0);
+
+  std::map<std::string, PubSocket*> pubs;
+  std::vector<char> decompressed;
+
+  struct PendingBatch {
+    std::vector<char *> data;
+    std::vector<size_t> sizes;
+  };
+  std::map<PubSocket*, PendingBatch> pending;
+
+  while (!do_exit) {
+    zmq_msg_t msg;
+    zmq_msg_init(&msg);
+    if (zmq_msg_recv(&msg, sock, 0) < 0) {
+      zmq_msg_close(&msg);
+      continue;
+    }
+
+    char *frame = (char *)zmq_msg_data(&msg);
+    size_t frame_size = zmq_msg_size(&msg);
+
+    bridge_frame_header_t header;
+    if (frame_size < sizeof(header)) {
+      zmq_msg_close(&msg);
+      continue;
+    }
+    memcpy(&header, frame, sizeof(header));
+    if (header.magic != BRIDGE_FRAME_MAGIC) {
+      std::cout << "Dropping frame with bad magic" << std::endl;
+      zmq_msg_close(&msg);
+      continue;
+    }
+
+    char *p = frame + sizeof(header);
+    size_t size = frame_size - sizeof(header);
+
+    // Sizes come off the network, don't let a corrupt frame allocate arbitrary amounts of memory
+    if (size > BRIDGE_FRAME_MAX_SIZE || header.raw_size > BRIDGE_FRAME_MAX_SIZE) {
+      std::cout << "Dropping oversized frame" << std::endl;
+      zmq_msg_close(&msg);
+      continue;
+    }
+
+    if (header.flags & BRIDGE_FLAG_COMPRESSED) {
+      if (decompressed.size() < header.raw_size) {
+        decompressed.resize(header.raw_size);
+      }
+
+      uLongf raw_size = header.raw_size;
+      int err = uncompress((Bytef *)decompressed.data(), &raw_size, (const Bytef *)p, size);
+      if (err != Z_OK || raw_size != header.raw_size) {
+        std::cout << "Dropping corrupted frame" << std::endl;
+        zmq_msg_close(&msg);
+        continue;
+      }
+      p = decompressed.data();
+      size = raw_size;
+    }
+
+    // Group messages per service, so each service is republished with a single sendBatch
+    char *end = p + size;
+    for (uint32_t i = 0; i < header.num_msgs; i++) {
+      if (p + 1 > end) break;
+      uint8_t name_len = *p++;
+
+      uint32_t msg_size;
+      if (p + name_len + sizeof(msg_size) > end) break;
+      std::string name(p, name_len);
+      p += name_len;
+      memcpy(&msg_size, p, sizeof(msg_size));
+      p += sizeof(msg_size);
+
+      if (p + msg_size > end) break;
+      char *data = p;
+      p += msg_size;
+
+      if (!is_forwarded(config, name) || !is_known_service(name)) continue;
+
+      PubSocket *&pub = pubs[name];
+      if (pub == NULL) {
+        pub = new MSGQPubSocket();
+        pub->connect(msgq_context, name);
+      }
+
+      pending[pub].data.push_back(data);
+      pending[pub].sizes.push_back(msg_size);
+    }
+
+    for (auto &kv : pending) {
+      if (kv.second.data.size() > 0) {
+        kv.first->sendBatch(kv.second.data.data(), kv.second.sizes.data(), kv.second.data.size());
+        kv.second.data.clear();
+        kv.second.sizes.clear();
+      }
+    }
+
+    zmq_msg_close(&msg);
+  }
+
+  for (auto &kv : pubs) {
+    delete kv.second;
+  }
+  zmq_close(sock);
+  delete msgq_context;
+  delete zmq_context;
+  return 0;
+}
+
+int main(int argc, char **argv){
+  signal(SIGPIPE, (sighandler_t)sigpipe_handler);
+  signal(SIGINT, (sighandler_t)set_do_exit);
+  signal(SIGTERM, (sighandler_t)set_do_exit);
+
+  BridgeConfig config;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--allow" && i + 1 < argc) {
+      config.allow = split_list(argv[++i]);
+    } else if (arg == "--deny" && i + 1 < argc) {
+      auto deny = split_list(argv[++i]);
+      config.deny.insert(deny.begin(), deny.end());
+    } else if (arg == "--decimate") {
+      config.decimate = true;
+    } else if (arg == "--batch") {
+      config.batch = true;
+    } else if (arg == "--compress") {
+      config.batch = true;
+      config.compress = true;
+    } else if (arg == "--receive" && i + 1 < argc) {
+      config.receive_address = argv[++i];
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (!config.receive_address.empty()) {
+    return run_receive(config);
+  }
+  return run_forward(config);
+}
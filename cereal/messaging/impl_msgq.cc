@@ -6,6 +6,7 @@
 #include <cerrno>
 
 
+#include "services.h"
 #include "impl_msgq.hpp"
 
 volatile sig_atomic_t msgq_do_exit = 0;
@@ -16,6 +17,17 @@ void sig_handler(int signal) {
 }
 
 
+static size_t get_num_reader_slots(std::string endpoint) {
+  for (const auto& it : services) {
+    std::string name = it.name;
+    if (name == endpoint && it.readers > 0) {
+      return it.readers;
+    }
+  }
+
+  return NUM_READERS;
+}
+
 MSGQContext::MSGQContext() {
 }
 
@@ -36,10 +48,17 @@ void MSGQMessage::init(char * d, size_t sz) {
 void MSGQMessage::takeOwnership(char * d, size_t sz) {
   size = sz;
   data = d;
+  owned = true;
+}
+
+void MSGQMessage::borrow(char * d, size_t sz) {
+  size = sz;
+  data = d;
+  owned = false;
 }
 
 void MSGQMessage::close() {
-  if (size > 0){
+  if (size > 0 && owned){
     delete[] data;
   }
   size = 0;
@@ -55,7 +74,7 @@ int MSGQSubSocket::connect(Context *context, std::string endpoint, std::string a
   assert(address == "127.0.0.1");
 
   q = new msgq_queue_t;
-  int r = msgq_new_queue(q, endpoint.c_str(), DEFAULT_SEGMENT_SIZE);
+  int r = msgq_new_queue(q, endpoint.c_str(), DEFAULT_SEGMENT_SIZE, get_num_reader_slots(endpoint));
   if (r != 0){
     return r;
   }
@@ -72,7 +91,7 @@ int MSGQSubSocket::connect(Context *context, std::string endpoint, std::string a
 }
 
 
-Message * MSGQSubSocket::receive(bool non_blocking){
+int MSGQSubSocket::recv(msgq_msg_t *msg, bool non_blocking, int (*recv_fn)(msgq_msg_t *, msgq_queue_t *)){
   msgq_do_exit = 0;
 
   void (*prev_handler_sigint)(int);
@@ -82,11 +101,7 @@ Message * MSGQSubSocket::receive(bool non_blocking){
     prev_handler_sigterm = std::signal(SIGTERM, sig_handler);
   }
 
-  msgq_msg_t msg;
-
-  MSGQMessage *r = NULL;
-
-  int rc = msgq_msg_recv(&msg, q);
+  int rc = recv_fn(msg, q);
 
   // Hack to implement blocking read with a poller. Don't use this
   while (!non_blocking && rc == 0 && msgq_do_exit == 0){
@@ -96,7 +111,7 @@ Message * MSGQSubSocket::receive(bool non_blocking){
     int t = (timeout != -1) ? timeout : 100;
 
     int n = msgq_poll(items, 1, t);
-    rc = msgq_msg_recv(&msg, q);
+    rc = recv_fn(msg, q);
 
     // The poll indicated a message was ready, but the receive failed. Try again
     if (n == 1 && rc == 0){
@@ -116,6 +131,16 @@ Message * MSGQSubSocket::receive(bool non_blocking){
 
   errno = msgq_do_exit ? EINTR : 0;
 
+  return rc;
+}
+
+Message * MSGQSubSocket::receive(bool non_blocking){
+  msgq_msg_t msg;
+
+  MSGQMessage *r = NULL;
+
+  int rc = recv(&msg, non_blocking, msgq_msg_recv);
+
   if (rc > 0){
     if (msgq_do_exit){
       msgq_msg_close(&msg); // Free unused message on exit
@@ -128,6 +153,45 @@ Message * MSGQSubSocket::receive(bool non_blocking){
   return (Message*)r;
 }
 
+Message * MSGQSubSocket::borrow(bool non_blocking){
+  msgq_msg_t msg;
+
+  int rc = recv(&msg, non_blocking, msgq_msg_borrow);
+
+  // Only one message can be borrowed at a time, it lives in the shared ring
+  if (rc > 0 && !msgq_do_exit){
+    borrowed.borrow(msg.data, msg.size);
+    return &borrowed;
+  }
+
+  return NULL;
+}
+
+bool MSGQSubSocket::release(Message *message){
+  assert(message == &borrowed);
+
+  msgq_msg_t msg;
+  msg.data = borrowed.getData();
+  msg.size = borrowed.getSize();
+  borrowed.close();
+
+  return msgq_msg_release(&msg, q) == 0;
+}
+
+int MSGQSubSocket::receiveBatch(char *arena, size_t arena_size, char **data, size_t *sizes, size_t max_count){
+  if (batch.size() < max_count){
+    batch.resize(max_count);
+  }
+
+  int n = msgq_msg_recv_many(batch.data(), max_count, arena, arena_size, q);
+  for (int i = 0; i < n; i++){
+    data[i] = batch[i].data;
+    sizes[i] = batch[i].size;
+  }
+
+  return n;
+}
+
 void MSGQSubSocket::setTimeout(int t){
   timeout = t;
 }
@@ -143,7 +207,7 @@ int MSGQPubSocket::connect(Context *context, std::string endpoint){
   assert(context);
 
   q = new msgq_queue_t;
-  int r = msgq_new_queue(q, endpoint.c_str(), DEFAULT_SEGMENT_SIZE);
+  int r = msgq_new_queue(q, endpoint.c_str(), DEFAULT_SEGMENT_SIZE, get_num_reader_slots(endpoint));
   if (r != 0){
     return r;
   }
@@ -169,6 +233,19 @@ int MSGQPubSocket::send(char *data, size_t size){
   return msgq_msg_send(&msg, q);
 }
 
+int MSGQPubSocket::sendBatch(char **data, size_t *sizes, size_t count){
+  if (batch.size() < count){
+    batch.resize(count);
+  }
+
+  for (size_t i = 0; i < count; i++){
+    batch[i].data = data[i];
+    batch[i].size = sizes[i];
+  }
+
+  return msgq_msg_send_many(batch.data(), count, q);
+}
+
 MSGQPubSocket::~MSGQPubSocket(){
   if (q != NULL){
     msgq_close_queue(q);
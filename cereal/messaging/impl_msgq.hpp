@@ -3,6 +3,7 @@
 #include "msgq.hpp"
 #include <zmq.h>
 #include <string>
+#include <vector>
 
 #define MAX_POLLERS 128
 
@@ -17,12 +18,14 @@ public:
 
 class MSGQMessage : public Message {
 private:
-  char * data;
-  size_t size;
+  char * data = NULL;
+  size_t size = 0;
+  bool owned = true;
 public:
   void init(size_t size);
   void init(char *data, size_t size);
   void takeOwnership(char *data, size_t size);
+  void borrow(char *data, size_t size);
   size_t getSize(){return size;}
   char * getData(){return data;}
   void close();
@@ -33,21 +36,29 @@ class MSGQSubSocket : public SubSocket {
 private:
   msgq_queue_t * q = NULL;
   int timeout;
+  MSGQMessage borrowed;
+  std::vector<msgq_msg_t> batch;
+  int recv(msgq_msg_t *msg, bool non_blocking, int (*recv_fn)(msgq_msg_t *, msgq_queue_t *));
 public:
   int connect(Context *context, std::string endpoint, std::string address, bool conflate=false);
   void setTimeout(int timeout);
   void * getRawSocket() {return (void*)q;}
   Message *receive(bool non_blocking=false);
+  Message *borrow(bool non_blocking=false);
+  bool release(Message *message);
+  int receiveBatch(char *arena, size_t arena_size, char **data, size_t *sizes, size_t max_count);
   ~MSGQSubSocket();
 };
 
 class MSGQPubSocket : public PubSocket {
 private:
   msgq_queue_t * q = NULL;
+  std::vector<msgq_msg_t> batch;
 public:
   int connect(Context *context, std::string endpoint);
   int sendMessage(Message *message);
   int send(char *data, size_t size);
+  int sendBatch(char **data, size_t *sizes, size_t count);
   ~MSGQPubSocket();
 };
 
@@ -78,6 +78,15 @@ int ZMQSubSocket::connect(Context *context, std::string endpoint, std::string ad
 
 
 Message * ZMQSubSocket::receive(bool non_blocking){
+  // Hand out a message left over by receiveBatch first
+  if (has_pending){
+    ZMQMessage *r = new ZMQMessage;
+    r->init((char*)zmq_msg_data(&pending), zmq_msg_size(&pending));
+    zmq_msg_close(&pending);
+    has_pending = false;
+    return r;
+  }
+
   zmq_msg_t msg;
   assert(zmq_msg_init(&msg) == 0);
 
@@ -95,11 +104,52 @@ Message * ZMQSubSocket::receive(bool non_blocking){
   return r;
 }
 
+int ZMQSubSocket::receiveBatch(char *arena, size_t arena_size, char **data, size_t *sizes, size_t max_count){
+  size_t n = 0;
+  size_t used = 0;
+
+  while (n < max_count){
+    // A message that didn't fit in the previous arena is kept around for the next call
+    if (!has_pending){
+      assert(zmq_msg_init(&pending) == 0);
+      if (zmq_msg_recv(&pending, sock, ZMQ_DONTWAIT) < 0){
+        zmq_msg_close(&pending);
+        break;
+      }
+      has_pending = true;
+    }
+
+    size_t size = zmq_msg_size(&pending);
+    size_t aligned_size = (size + 7) & ~(size_t)7;
+    if (used + aligned_size > arena_size){
+      if (n == 0){
+        errno = ENOBUFS;
+        return -1;
+      }
+      break;
+    }
+
+    memcpy(arena + used, zmq_msg_data(&pending), size);
+    zmq_msg_close(&pending);
+    has_pending = false;
+
+    data[n] = arena + used;
+    sizes[n] = size;
+    used += aligned_size;
+    n++;
+  }
+
+  return n;
+}
+
 void ZMQSubSocket::setTimeout(int timeout){
   zmq_setsockopt(sock, ZMQ_RCVTIMEO, &timeout, sizeof(int));
 }
 
 ZMQSubSocket::~ZMQSubSocket(){
+  if (has_pending){
+    zmq_msg_close(&pending);
+  }
   zmq_close(sock);
 }
 
@@ -123,6 +173,15 @@ int ZMQPubSocket::send(char *data, size_t size){
   return zmq_send(sock, data, size, ZMQ_DONTWAIT);
 }
 
+int ZMQPubSocket::sendBatch(char **data, size_t *sizes, size_t count){
+  for (size_t i = 0; i < count; i++){
+    if (zmq_send(sock, data[i], sizes[i], ZMQ_DONTWAIT) < 0){
+      return -1;
+    }
+  }
+  return count;
+}
+
 ZMQPubSocket::~ZMQPubSocket(){
   zmq_close(sock);
 }
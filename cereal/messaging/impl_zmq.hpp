@@ -31,11 +31,14 @@ class ZMQSubSocket : public SubSocket {
 private:
   void * sock;
   std::string full_endpoint;
+  zmq_msg_t pending;
+  bool has_pending = false;
 public:
   int connect(Context *context, std::string endpoint, std::string address, bool conflate=false);
   void setTimeout(int timeout);
   void * getRawSocket() {return sock;}
   Message *receive(bool non_blocking=false);
+  int receiveBatch(char *arena, size_t arena_size, char **data, size_t *sizes, size_t max_count);
   ~ZMQSubSocket();
 };
 
@@ -47,6 +50,7 @@ public:
   int connect(Context *context, std::string endpoint);
   int sendMessage(Message *message);
   int send(char *data, size_t size);
+  int sendBatch(char **data, size_t *sizes, size_t count);
   ~ZMQPubSocket();
 };
 
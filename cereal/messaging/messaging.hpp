@@ -31,6 +31,13 @@ public:
   virtual int connect(Context *context, std::string endpoint, std::string address, bool conflate=false) = 0;
   virtual void setTimeout(int timeout) = 0;
   virtual Message *receive(bool non_blocking=false) = 0;
+  // Zero-copy receive where the transport supports it. The returned message is only
+  // valid until release, which returns false if the data was overwritten while in use.
+  virtual Message *borrow(bool non_blocking=false) { return receive(non_blocking); }
+  virtual bool release(Message *message) { delete message; return true; }
+  // Drains pending messages without blocking, word aligned and back to back into arena.
+  // Message i is data[i] with sizes[i]. Returns the number of messages, or -1 if the next message doesn't fit
+  virtual int receiveBatch(char *arena, size_t arena_size, char **data, size_t *sizes, size_t max_count) = 0;
   virtual void * getRawSocket() = 0;
   static SubSocket * create();
   static SubSocket * create(Context * context, std::string endpoint);
@@ -44,6 +51,8 @@ public:
   virtual int connect(Context *context, std::string endpoint) = 0;
   virtual int sendMessage(Message *message) = 0;
   virtual int send(char *data, size_t size) = 0;
+  // Publishes count messages at once. Returns the number of messages sent, or -1 on error
+  virtual int sendBatch(char **data, size_t *sizes, size_t count) = 0;
   static PubSocket * create();
   static PubSocket * create(Context * context, std::string endpoint);
   virtual ~PubSocket(){};
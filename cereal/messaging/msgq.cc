@@ -21,6 +21,11 @@
 
 #include <stdio.h>
 
+#ifdef __linux__
+#include <linux/futex.h>
+#define MSGQ_USE_FUTEX
+#endif
+
 #include "msgq.hpp"
 
 void sigusr2_handler(int signal) {
@@ -41,6 +46,47 @@ uint64_t msgq_get_uid(void){
   return uid;
 }
 
+#ifdef MSGQ_USE_FUTEX
+// Table of futex words shared by all processes. A reader blocked in msgq_poll sleeps on the
+// doorbell of its thread and advertises it in read_waiting, publishers only ring waiting readers.
+static std::atomic<uint32_t> * msgq_doorbells(void){
+  static std::atomic<uint32_t> * doorbells = [](){
+    std::atomic<uint32_t> * r = NULL;
+    size_t size = NUM_DOORBELLS * sizeof(uint32_t);
+
+    int fd = open("/dev/shm/msgq_doorbells", O_RDWR | O_CREAT, 0777);
+    if (fd < 0) {
+      std::cout << "Warning, could not open doorbells, falling back to signals" << std::endl;
+      return r;
+    }
+
+    if (ftruncate(fd, size) == 0){
+      void * mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (mem != MAP_FAILED){
+        r = reinterpret_cast<std::atomic<uint32_t>*>(mem);
+      }
+    }
+    close(fd);
+    return r;
+  }();
+
+  return doorbells;
+}
+
+static long futex(std::atomic<uint32_t> * addr, int op, uint32_t val, const struct timespec * ts){
+  return syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), op, val, ts, NULL, 0);
+}
+
+static void msgq_ring_doorbell(uint64_t bell){
+  std::atomic<uint32_t> * doorbells = msgq_doorbells();
+  if (doorbells == NULL || bell >= NUM_DOORBELLS) return;
+
+  // Doorbells are shared by threads whose tid hashes to the same slot, wake all of them
+  doorbells[bell]++;
+  futex(&doorbells[bell], FUTEX_WAKE, INT32_MAX, NULL);
+}
+#endif
+
 int msgq_msg_init_size(msgq_msg_t * msg, size_t size){
   msg->size = size;
   msg->data = new(std::nothrow) char[size];
@@ -83,8 +129,9 @@ void msgq_wait_for_subscriber(msgq_queue_t *q){
 
 
 
-int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size){
+int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size, size_t num_reader_slots){
   assert(size < 0xFFFFFFFF); // Buffer must be smaller than 2^32 bytes
+  assert(num_reader_slots > 0 && num_reader_slots <= MAX_READERS);
 
   std::signal(SIGUSR2, sigusr2_handler);
 
@@ -101,11 +148,13 @@ int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size){
   }
   delete[] full_path;
 
-  int rc = ftruncate(fd, size + sizeof(msgq_header_t));
+  size_t header_size = sizeof(msgq_header_t) + num_reader_slots * sizeof(msgq_reader_t);
+
+  int rc = ftruncate(fd, size + header_size);
   if (rc < 0)
     return -1;
 
-  char * mem = (char*)mmap(NULL, size + sizeof(msgq_header_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  char * mem = (char*)mmap(NULL, size + header_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
   close(fd);
 
   if (mem == NULL)
@@ -119,15 +168,22 @@ int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size){
   q->num_readers = reinterpret_cast<std::atomic<uint64_t>*>(&header->num_readers);
   q->write_pointer = reinterpret_cast<std::atomic<uint64_t>*>(&header->write_pointer);
   q->write_uid = reinterpret_cast<std::atomic<uint64_t>*>(&header->write_uid);
-
-  for (size_t i = 0; i < NUM_READERS; i++){
-    q->read_pointers[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_pointers[i]);
-    q->read_valids[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_valids[i]);
-    q->read_uids[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_uids[i]);
+  q->reader_generation = reinterpret_cast<std::atomic<uint64_t>*>(&header->reader_generation);
+  q->waiting_readers = reinterpret_cast<std::atomic<uint64_t>*>(&header->waiting_readers);
+
+  // Reader table directly follows the fixed part of the header
+  msgq_reader_t *readers = (msgq_reader_t *)(mem + sizeof(msgq_header_t));
+  for (size_t i = 0; i < num_reader_slots; i++){
+    q->read_pointers[i] = reinterpret_cast<std::atomic<uint64_t>*>(&readers[i].read_pointer);
+    q->read_valids[i] = reinterpret_cast<std::atomic<uint64_t>*>(&readers[i].read_valid);
+    q->read_uids[i] = reinterpret_cast<std::atomic<uint64_t>*>(&readers[i].read_uid);
+    q->read_waiting[i] = reinterpret_cast<std::atomic<uint64_t>*>(&readers[i].read_waiting);
   }
 
-  q->data = mem + sizeof(msgq_header_t);
+  q->data = mem + header_size;
   q->size = size;
+  q->header_size = header_size;
+  q->num_reader_slots = num_reader_slots;
   q->reader_id = -1;
 
   q->endpoint = path;
@@ -138,7 +194,7 @@ int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size){
 
 void msgq_close_queue(msgq_queue_t *q){
   if (q->mmap_p != NULL){
-    munmap(q->mmap_p, q->size + sizeof(msgq_header_t));
+    munmap(q->mmap_p, q->size + q->header_size);
   }
 }
 
@@ -149,13 +205,19 @@ void msgq_init_publisher(msgq_queue_t * q) {
 
   *q->write_uid = uid;
   *q->num_readers = 0;
+  *q->waiting_readers = 0;
 
-  for (size_t i = 0; i < NUM_READERS; i++){
+  for (size_t i = 0; i < q->num_reader_slots; i++){
     *q->read_valids[i] = false;
     *q->read_uids[i] = 0;
+    *q->read_waiting[i] = 0;
   }
 
   q->write_uid_local = uid;
+
+  // Force a full scan of the readers on the first send
+  q->slowest_reader_local = 0;
+  q->reader_generation_local = *q->reader_generation - 1;
 }
 
 static void thread_signal(uint32_t tid) {
@@ -167,6 +229,22 @@ static void thread_signal(uint32_t tid) {
   #endif
 }
 
+static void msgq_notify_reader(msgq_queue_t * q, uint64_t i) {
+#ifdef MSGQ_USE_FUTEX
+  if (msgq_doorbells() != NULL){
+    uint64_t waiting = q->read_waiting[i]->exchange(0);
+    if (waiting != 0){
+      msgq_ring_doorbell(waiting - 1);
+    }
+    return;
+  }
+#endif
+
+  // Without doorbells readers sleep in msgq_poll, interrupt the sleep
+  uint64_t reader_uid = *q->read_uids[i];
+  thread_signal(reader_uid & 0xFFFFFFFF);
+}
+
 void msgq_init_subscriber(msgq_queue_t * q) {
   assert(q != NULL);
   assert(q->num_readers != NULL);
@@ -179,18 +257,16 @@ void msgq_init_subscriber(msgq_queue_t * q) {
     uint64_t new_num_readers = cur_num_readers + 1;
 
     // No more slots available. Reset all subscribers to kick out inactive ones
-    if (new_num_readers > NUM_READERS){
+    if (new_num_readers > q->num_reader_slots){
       std::cout << "Warning, evicting all subscribers!" << std::endl;
       *q->num_readers = 0;
 
-      for (size_t i = 0; i < NUM_READERS; i++){
+      for (size_t i = 0; i < q->num_reader_slots; i++){
         *q->read_valids[i] = false;
 
-        uint64_t old_uid = *q->read_uids[i];
-        *q->read_uids[i] = 0;
-
         // Wake up reader in case they are in a poll
-        thread_signal(old_uid & 0xFFFFFFFF);
+        msgq_notify_reader(q, i);
+        *q->read_uids[i] = 0;
       }
 
       continue;
@@ -215,9 +291,14 @@ void msgq_init_subscriber(msgq_queue_t * q) {
 
   //std::cout << "New subscriber id: " << q->reader_id << " uid: " << q->read_uid_local << " " << q->endpoint << std::endl;
   msgq_reset_reader(q);
+
+  // Make the publisher rescan the read pointers
+  (*q->reader_generation)++;
 }
 
-int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
+// Writes a batch of messages into a single block of the ring,
+// with one write pointer update and one round of wakeups
+static int msgq_msg_write(msgq_msg_t * msgs, size_t num_msgs, msgq_queue_t *q){
   // Die if we are no longer the active publisher
   if (q->write_uid_local != *q->write_uid){
     std::cout << "Killing old publisher: " << q->endpoint << std::endl;
@@ -225,9 +306,12 @@ int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
     return -1;
   }
 
-  uint64_t total_msg_size = ALIGN(msg->size + sizeof(int64_t));
+  uint64_t total_msg_size = 0;
+  for (size_t i = 0; i < num_msgs; i++){
+    total_msg_size += ALIGN(msgs[i].size + sizeof(int64_t));
+  }
 
-  // We need to fit at least three messages in the queue,
+  // We need to fit at least three messages (or batches) in the queue,
   // then we can always safely access the last message
   assert(3 * total_msg_size <= q->size);
 
@@ -268,37 +352,106 @@ int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
 
   // Invalidate readers that are in the area that will be written
   uint64_t start = write_pointer;
-  uint64_t end = ALIGN(start + sizeof(int64_t) + msg->size);
+  uint64_t end = start + total_msg_size;
+
+  // Read pointers only move forward, so the slowest reader seen during the last scan is a lower bound
+  // for all of them. Only rescan when that bound could be inside the area, or a new reader showed up
+  uint64_t reader_generation = *q->reader_generation;
+  if (reader_generation != q->reader_generation_local){
+    q->reader_generation_local = reader_generation;
+    q->slowest_reader_local = 0;
+  }
 
-  for (uint64_t i = 0; i < num_readers; i++){
-    uint32_t read_cycles, read_pointer;
-    UNPACK64(read_cycles, read_pointer, *q->read_pointers[i]);
+  uint32_t prev_cycles = write_cycles - 1;
+  uint64_t area_end;
+  PACK64(area_end, prev_cycles, end);
+
+  if (q->slowest_reader_local < area_end){
+    uint64_t slowest_reader = UINT64_MAX;
 
-    if ((read_pointer >= start) && (read_pointer < end) && (read_cycles != write_cycles)) {
-      *q->read_valids[i] = false;
+    for (uint64_t i = 0; i < num_readers; i++){
+      uint64_t packed_read_pointer = *q->read_pointers[i];
+      slowest_reader = std::min(slowest_reader, packed_read_pointer);
+
+      uint32_t read_cycles, read_pointer;
+      UNPACK64(read_cycles, read_pointer, packed_read_pointer);
+
+      if ((read_pointer >= start) && (read_pointer < end) && (read_cycles != write_cycles)) {
+        *q->read_valids[i] = false;
+      }
     }
-  }
 
+    q->slowest_reader_local = slowest_reader;
+  }
 
-  // Write size tag
-  std::atomic<int64_t> *size_p = reinterpret_cast<std::atomic<int64_t>*>(p);
-  *size_p = msg->size;
+  for (size_t i = 0; i < num_msgs; i++){
+    // Write size tag
+    std::atomic<int64_t> *size_p = reinterpret_cast<std::atomic<int64_t>*>(p);
+    *size_p = msgs[i].size;
 
-  // Copy data
-  memcpy(p + sizeof(int64_t), msg->data, msg->size);
+    // Copy data
+    memcpy(p + sizeof(int64_t), msgs[i].data, msgs[i].size);
+    p += ALIGN(msgs[i].size + sizeof(int64_t));
+  }
   __sync_synchronize();
 
   // Update write pointer
-  uint32_t new_ptr = ALIGN(write_pointer + msg->size + sizeof(int64_t));
+  uint32_t new_ptr = write_pointer + total_msg_size;
   PACK64(*q->write_pointer, write_cycles, new_ptr);
 
   // Notify readers
+#ifdef MSGQ_USE_FUTEX
+  // Only readers blocked in a poll need a wakeup, the others will see the new data on their next read
+  if (msgq_doorbells() != NULL){
+    uint64_t waiting_readers = q->waiting_readers->exchange(0);
+    for (uint64_t i = 0; waiting_readers != 0; i++, waiting_readers >>= 1){
+      if (waiting_readers & 1){
+        msgq_notify_reader(q, i);
+      }
+    }
+    return 0;
+  }
+#endif
+
   for (uint64_t i = 0; i < num_readers; i++){
-    uint64_t reader_uid = *q->read_uids[i];
-    thread_signal(reader_uid & 0xFFFFFFFF);
+    msgq_notify_reader(q, i);
   }
 
-  return msg->size;
+  return 0;
+}
+
+int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
+  int r = msgq_msg_write(msg, 1, q);
+  return (r < 0) ? r : msg->size;
+}
+
+int msgq_msg_send_many(msgq_msg_t * msgs, size_t num_msgs, msgq_queue_t *q){
+  // Reject the whole batch up front if a single message can never fit
+  for (size_t i = 0; i < num_msgs; i++){
+    if (3 * ALIGN(msgs[i].size + sizeof(int64_t)) > q->size){
+      errno = EMSGSIZE;
+      return -1;
+    }
+  }
+
+  // Split batches that are too large to be written as one block
+  size_t start = 0;
+  while (start < num_msgs){
+    uint64_t batch_size = 0;
+    size_t end = start;
+    while (end < num_msgs){
+      uint64_t msg_size = ALIGN(msgs[end].size + sizeof(int64_t));
+      if (3 * (batch_size + msg_size) > q->size) break;
+      batch_size += msg_size;
+      end++;
+    }
+
+    int r = msgq_msg_write(msgs + start, end - start, q);
+    if (r < 0) return r;
+    start = end;
+  }
+
+  return num_msgs;
 }
 
 
@@ -329,7 +482,7 @@ int msgq_msg_ready(msgq_queue_t * q){
   return (read_pointer != write_pointer);
 }
 
-int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
+int msgq_msg_borrow(msgq_msg_t * msg, msgq_queue_t * q){
  start:
   int id = q->reader_id;
   assert(id >= 0); // Make sure subscriber is initialized
@@ -393,30 +546,140 @@ int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
     }
   }
 
-  // Copy message
-  if (msgq_msg_init_size(msg, size) < 0)
-    return -1;
+  // Hand out the message in place. The read pointer stays on this message until it is
+  // released, so the publisher invalidates us if it gets overwritten in the meantime
+  msg->data = p + sizeof(int64_t);
+  msg->size = size;
+
+  return msg->size;
+}
+
+int msgq_msg_release(msgq_msg_t * msg, msgq_queue_t * q){
+  int id = q->reader_id;
+  assert(id >= 0); // Make sure subscriber is initialized
 
-  __sync_synchronize();
-  memcpy(msg->data, p + sizeof(int64_t), size);
   __sync_synchronize();
 
+  // Check if the data that was used is valid. Eviction and reset are handled on the next read
+  if (q->read_uid_local != *q->read_uids[id] || !*q->read_valids[id]){
+    return -1;
+  }
+
+  uint32_t read_cycles, read_pointer;
+  UNPACK64(read_cycles, read_pointer, *q->read_pointers[id]);
+
   // Update read pointer
+  uint32_t new_read_pointer = ALIGN(read_pointer + sizeof(std::int64_t) + msg->size);
   PACK64(*q->read_pointers[id], read_cycles, new_read_pointer);
 
-  // Check if the actual data that was copied is valid
-  if (!*q->read_valids[id]){
+  return 0;
+}
+
+int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
+  msgq_msg_t borrowed;
+
+  while (true){
+    int r = msgq_msg_borrow(&borrowed, q);
+    if (r <= 0){
+      msg->size = 0;
+      return r;
+    }
+
+    // Copy message
+    if (msgq_msg_init_size(msg, borrowed.size) < 0)
+      return -1;
+
+    __sync_synchronize();
+    memcpy(msg->data, borrowed.data, borrowed.size);
+
+    // Check if the actual data that was copied is valid
+    if (msgq_msg_release(&borrowed, q) == 0){
+      return msg->size;
+    }
+
     msgq_msg_close(msg);
-    msgq_reset_reader(q);
-    goto start;
   }
+}
 
+int msgq_msg_recv_many(msgq_msg_t * msgs, size_t max_msgs, char * arena, size_t arena_size, msgq_queue_t * q){
+  size_t num_msgs = 0;
+  size_t used = 0;
+  msgq_msg_t borrowed;
+
+  while (num_msgs < max_msgs && msgq_msg_borrow(&borrowed, q) > 0){
+    // Keep messages word aligned, so they can be parsed in place
+    size_t msg_size = ALIGN(borrowed.size);
+    if (used + msg_size > arena_size){
+      // Leave the message in the queue for the next call
+      if (num_msgs == 0){
+        errno = ENOBUFS;
+        return -1;
+      }
+      break;
+    }
 
-  return msg->size;
+    __sync_synchronize();
+    memcpy(arena + used, borrowed.data, borrowed.size);
+
+    // Drop the copy if it was overwritten while copying
+    if (msgq_msg_release(&borrowed, q) == 0){
+      msgs[num_msgs].data = arena + used;
+      msgs[num_msgs].size = borrowed.size;
+      num_msgs++;
+      used += msg_size;
+    }
+  }
+
+  return num_msgs;
 }
 
 
 
+#ifdef MSGQ_USE_FUTEX
+static int msgq_poll_futex(msgq_pollitem_t * items, size_t nitems, int timeout, std::atomic<uint32_t> * doorbells){
+  uint64_t bell = syscall(SYS_gettid) % NUM_DOORBELLS;
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+
+  int num = 0;
+  while (num == 0) {
+    uint32_t seq = doorbells[bell];
+
+    // Advertise the doorbell before checking for messages, so a publisher
+    // either sees us waiting or we see its write pointer update
+    for (size_t i = 0; i < nitems; i++) {
+      msgq_queue_t * q = items[i].q;
+      *q->read_waiting[q->reader_id] = bell + 1;
+      q->waiting_readers->fetch_or(1ULL << q->reader_id);
+    }
+
+    for (size_t i = 0; i < nitems; i++) {
+      items[i].revents = msgq_msg_ready(items[i].q);
+      if (items[i].revents) num++;
+    }
+    if (num > 0) break;
+
+    auto remaining = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - std::chrono::steady_clock::now()).count();
+    if (remaining <= 0) break;
+
+    struct timespec ts;
+    ts.tv_sec = remaining / 1000000000;
+    ts.tv_nsec = remaining % 1000000000;
+
+    // Returns immediately if the doorbell was rung after we read seq
+    futex(&doorbells[bell], FUTEX_WAIT, seq, &ts);
+  }
+
+  // Stop publishers from waking us up, unless another thread took over the slot
+  for (size_t i = 0; i < nitems; i++) {
+    msgq_queue_t * q = items[i].q;
+    uint64_t expected = bell + 1;
+    q->read_waiting[q->reader_id]->compare_exchange_strong(expected, 0);
+  }
+
+  return num;
+}
+#endif
+
 int msgq_poll(msgq_pollitem_t * items, size_t nitems, int timeout){
   assert(timeout >= 0);
 
@@ -428,6 +691,13 @@ int msgq_poll(msgq_pollitem_t * items, size_t nitems, int timeout){
     if (items[i].revents) num++;
   }
 
+#ifdef MSGQ_USE_FUTEX
+  std::atomic<uint32_t> * doorbells = msgq_doorbells();
+  if (num == 0 && doorbells != NULL){
+    return msgq_poll_futex(items, nitems, timeout, doorbells);
+  }
+#endif
+
   int ms = (timeout == -1) ? 100 : timeout;
   struct timespec ts;
   ts.tv_sec = ms / 1000;
@@ -6,34 +6,52 @@
 
 #define DEFAULT_SEGMENT_SIZE (10 * 1024 * 1024)
 #define NUM_READERS 8
+#define MAX_READERS 64 // waiting_readers is a 64 bit mask
+#define NUM_DOORBELLS 1024
 #define ALIGN(n) ((n + (8 - 1)) & -8)
 
 #define UNPACK64(higher, lower, input) do {uint64_t tmp = input; higher = tmp >> 32; lower = tmp & 0xFFFFFFFF;} while (0)
 #define PACK64(output, higher, lower) output = ((uint64_t)higher << 32 ) | ((uint64_t)lower & 0xFFFFFFFF)
 
-struct  msgq_header_t {
+struct msgq_reader_t {
+  uint64_t read_pointer;
+  uint64_t read_valid;
+  uint64_t read_uid;
+  uint64_t read_waiting; // doorbell index + 1 of a reader blocked in msgq_poll, 0 if not waiting
+};
+
+// The header is followed by num_reader_slots msgq_reader_t entries, then the data segment
+struct msgq_header_t {
   uint64_t num_readers;
   uint64_t write_pointer;
   uint64_t write_uid;
-  uint64_t read_pointers[NUM_READERS];
-  uint64_t read_valids[NUM_READERS];
-  uint64_t read_uids[NUM_READERS];
+  uint64_t reader_generation; // bumped every time a subscriber takes a slot
+  uint64_t waiting_readers; // bitmask of reader slots that are blocked in msgq_poll
 };
 
 struct msgq_queue_t {
   std::atomic<uint64_t> *num_readers;
   std::atomic<uint64_t> *write_pointer;
   std::atomic<uint64_t> *write_uid;
-  std::atomic<uint64_t> *read_pointers[NUM_READERS];
-  std::atomic<uint64_t> *read_valids[NUM_READERS];
-  std::atomic<uint64_t> *read_uids[NUM_READERS];
+  std::atomic<uint64_t> *reader_generation;
+  std::atomic<uint64_t> *waiting_readers;
+  std::atomic<uint64_t> *read_pointers[MAX_READERS];
+  std::atomic<uint64_t> *read_valids[MAX_READERS];
+  std::atomic<uint64_t> *read_uids[MAX_READERS];
+  std::atomic<uint64_t> *read_waiting[MAX_READERS];
   char * mmap_p;
   char * data;
   size_t size;
+  size_t header_size;
+  size_t num_reader_slots;
   int reader_id;
   uint64_t read_uid_local;
   uint64_t write_uid_local;
 
+  // Publisher side lower bound of all read pointers, valid while reader_generation is unchanged
+  uint64_t slowest_reader_local;
+  uint64_t reader_generation_local;
+
   bool read_conflate;
   std::string endpoint;
 };
@@ -55,12 +73,25 @@ int msgq_msg_init_size(msgq_msg_t *msg, size_t size);
 int msgq_msg_init_data(msgq_msg_t *msg, char * data, size_t size);
 int msgq_msg_close(msgq_msg_t *msg);
 
-int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size);
+int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size, size_t num_reader_slots = NUM_READERS);
 void msgq_close_queue(msgq_queue_t *q);
 void msgq_init_publisher(msgq_queue_t * q);
 void msgq_init_subscriber(msgq_queue_t * q);
 
 int msgq_msg_send(msgq_msg_t *msg, msgq_queue_t *q);
 int msgq_msg_recv(msgq_msg_t *msg, msgq_queue_t *q);
+
+// Batched versions. send_many publishes all messages with one write pointer update and one wakeup,
+// batches too large for the queue are split. A message that can never fit fails with EMSGSIZE.
+// recv_many drains pending messages into a caller supplied arena, the messages point into the
+// arena and must not be closed. Both return the number of messages, or -1 on error.
+int msgq_msg_send_many(msgq_msg_t *msgs, size_t num_msgs, msgq_queue_t *q);
+int msgq_msg_recv_many(msgq_msg_t *msgs, size_t max_msgs, char *arena, size_t arena_size, msgq_queue_t *q);
+
+// Zero-copy receive: msg points into the shared ring and must not be closed.
+// The data is only safe to use after msgq_msg_release returned 0, otherwise it
+// was overwritten by the publisher and anything derived from it must be discarded.
+int msgq_msg_borrow(msgq_msg_t *msg, msgq_queue_t *q);
+int msgq_msg_release(msgq_msg_t *msg, msgq_queue_t *q);
 int msgq_msg_ready(msgq_queue_t * q);
 int msgq_poll(msgq_pollitem_t * items, size_t nitems, int timeout);
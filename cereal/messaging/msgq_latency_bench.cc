@@ -0,0 +1,106 @@
+#include <iostream>
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+#include <unistd.h>
+
+#include "msgq.hpp"
+
+#define NUM_MESSAGES 1000
+#define MESSAGE_SIZE 1024
+#define SEND_INTERVAL_US 2000
+
+static inline uint64_t nanos_monotonic() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static std::atomic<int> readers_ready;
+
+static void reader_thread(std::vector<uint64_t> *latencies) {
+  msgq_queue_t q;
+  int r = msgq_new_queue(&q, "msgq_latency_bench", DEFAULT_SEGMENT_SIZE);
+  assert(r == 0);
+  msgq_init_subscriber(&q);
+  readers_ready++;
+
+  while (true) {
+    msgq_pollitem_t items[1];
+    items[0].q = &q;
+    if (msgq_poll(items, 1, 100) == 0) continue;
+
+    msgq_msg_t msg;
+    if (msgq_msg_recv(&msg, &q) <= 0) continue;
+
+    uint64_t recv_time = nanos_monotonic();
+    uint64_t send_time = *(uint64_t*)msg.data;
+    msgq_msg_close(&msg);
+
+    // A zero timestamp marks the end of the run
+    if (send_time == 0) break;
+    latencies->push_back(recv_time - send_time);
+  }
+
+  msgq_close_queue(&q);
+}
+
+static void run(int num_readers) {
+  msgq_queue_t q;
+  int r = msgq_new_queue(&q, "msgq_latency_bench", DEFAULT_SEGMENT_SIZE);
+  assert(r == 0);
+  msgq_init_publisher(&q);
+
+  readers_ready = 0;
+  std::vector<std::vector<uint64_t>> latencies(num_readers);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < num_readers; i++) {
+    latencies[i].reserve(NUM_MESSAGES);
+    threads.emplace_back(reader_thread, &latencies[i]);
+  }
+  while (readers_ready < num_readers) usleep(1000);
+
+  // Give the readers time to block in their poll
+  usleep(10000);
+
+  char data[MESSAGE_SIZE] = {0};
+  msgq_msg_t msg;
+  msg.data = data;
+  msg.size = sizeof(data);
+
+  for (int i = 0; i < NUM_MESSAGES; i++) {
+    *(uint64_t*)data = nanos_monotonic();
+    msgq_msg_send(&msg, &q);
+    usleep(SEND_INTERVAL_US);
+  }
+
+  *(uint64_t*)data = 0;
+  msgq_msg_send(&msg, &q);
+
+  for (auto &t : threads) t.join();
+  msgq_close_queue(&q);
+
+  std::vector<uint64_t> all;
+  for (auto &l : latencies) all.insert(all.end(), l.begin(), l.end());
+  std::sort(all.begin(), all.end());
+  assert(all.size() > 0);
+
+  double p50 = all[all.size() * 50 / 100] / 1000.0;
+  double p99 = all[all.size() * 99 / 100] / 1000.0;
+  double max = all.back() / 1000.0;
+  printf("readers: %d  received: %zu/%d  p50: %8.1f us  p99: %8.1f us  max: %8.1f us\n",
+         num_readers, all.size(), num_readers * NUM_MESSAGES, p50, p99, max);
+}
+
+int main(int argc, char **argv) {
+  for (int num_readers = 1; num_readers <= NUM_READERS; num_readers++) {
+    run(num_readers);
+  }
+  return 0;
+}
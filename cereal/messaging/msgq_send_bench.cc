@@ -0,0 +1,70 @@
+#include <iostream>
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <vector>
+
+#include "msgq.hpp"
+
+#define NUM_MESSAGES 200000
+#define MESSAGE_SIZE 128
+#define READ_INTERVAL 10
+
+static inline uint64_t nanos_monotonic() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+// Average cost of a send with num_readers subscribers, that either keep up by
+// draining every READ_INTERVAL messages or never read and get lapped by the publisher
+static double send_cost(size_t num_readers, bool reading) {
+  msgq_queue_t pub;
+  int r = msgq_new_queue(&pub, "msgq_send_bench", DEFAULT_SEGMENT_SIZE, MAX_READERS);
+  assert(r == 0);
+  msgq_init_publisher(&pub);
+
+  std::vector<msgq_queue_t> subs(num_readers);
+  for (auto &sub : subs) {
+    r = msgq_new_queue(&sub, "msgq_send_bench", DEFAULT_SEGMENT_SIZE, MAX_READERS);
+    assert(r == 0);
+    msgq_init_subscriber(&sub);
+  }
+
+  char data[MESSAGE_SIZE] = {0};
+  msgq_msg_t msg;
+  msg.data = data;
+  msg.size = sizeof(data);
+
+  uint64_t send_time = 0;
+  for (int i = 0; i < NUM_MESSAGES; i++) {
+    uint64_t start = nanos_monotonic();
+    msgq_msg_send(&msg, &pub);
+    send_time += nanos_monotonic() - start;
+
+    if (reading && (i % READ_INTERVAL) == 0) {
+      for (auto &sub : subs) {
+        msgq_msg_t recv_msg;
+        while (msgq_msg_borrow(&recv_msg, &sub) > 0) {
+          msgq_msg_release(&recv_msg, &sub);
+        }
+      }
+    }
+  }
+
+  for (auto &sub : subs) msgq_close_queue(&sub);
+  msgq_close_queue(&pub);
+
+  return (double)send_time / NUM_MESSAGES;
+}
+
+int main(int argc, char **argv) {
+  printf("readers   reading (ns/send)   idle (ns/send)\n");
+  for (size_t num_readers = 0; num_readers <= MAX_READERS; num_readers = num_readers ? num_readers * 2 : 1) {
+    double reading = send_cost(num_readers, true);
+    double idle = send_cost(num_readers, false);
+    printf("%7zu   %17.1f   %14.1f\n", num_readers, reading, idle);
+  }
+  return 0;
+}
@@ -0,0 +1,325 @@
+#include <cstdio>
+#include <cerrno>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "catch2/catch.hpp"
+#include "msgq.hpp"
+
+static void new_queue(msgq_queue_t *q, const char *path, size_t size, size_t num_reader_slots = NUM_READERS) {
+  std::string full_path = std::string("/dev/shm/") + path;
+  remove(full_path.c_str());
+
+  int r = msgq_new_queue(q, path, size, num_reader_slots);
+  REQUIRE(r == 0);
+}
+
+static void send_fill(msgq_queue_t *q, size_t size, char fill) {
+  std::vector<char> data(size, fill);
+  msgq_msg_t msg;
+  msgq_msg_init_data(&msg, data.data(), data.size());
+  REQUIRE(msgq_msg_send(&msg, q) == (int)size);
+  msgq_msg_close(&msg);
+}
+
+static bool all_equal(const char *data, size_t size, char fill) {
+  for (size_t i = 0; i < size; i++) {
+    if (data[i] != fill) return false;
+  }
+  return true;
+}
+
+TEST_CASE("ALIGN") {
+  REQUIRE(ALIGN(0) == 0);
+  REQUIRE(ALIGN(1) == 8);
+  REQUIRE(ALIGN(7) == 8);
+  REQUIRE(ALIGN(8) == 8);
+  REQUIRE(ALIGN(99999) == 100000);
+}
+
+#ifdef __linux__
+TEST_CASE("msgq_poll wakes up on a publish from another process") {
+  const char *path = "test_queue_doorbell";
+  remove("/dev/shm/test_queue_doorbell");
+
+  int ready[2];
+  REQUIRE(pipe(ready) == 0);
+
+  pid_t pid = fork();
+  REQUIRE(pid >= 0);
+  if (pid == 0) {
+    close(ready[0]);
+
+    msgq_queue_t pub;
+    if (msgq_new_queue(&pub, path, 1024) != 0) _exit(1);
+    msgq_init_publisher(&pub);
+    char c = 0;
+    if (write(ready[1], &c, 1) != 1) _exit(1);
+
+    // Publish only once the reader is blocked on its doorbell
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (*pub.waiting_readers == 0) {
+      if (std::chrono::steady_clock::now() > deadline) _exit(2);
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    std::vector<char> data(100, 'd');
+    msgq_msg_t msg;
+    msgq_msg_init_data(&msg, data.data(), data.size());
+    if (msgq_msg_send(&msg, &pub) != (int)data.size()) _exit(3);
+    msgq_msg_close(&msg);
+    _exit(0);
+  }
+
+  close(ready[1]);
+  char c;
+  REQUIRE(read(ready[0], &c, 1) == 1);
+  close(ready[0]);
+
+  msgq_queue_t sub;
+  REQUIRE(msgq_new_queue(&sub, path, 1024) == 0);
+  msgq_init_subscriber(&sub);
+
+  msgq_pollitem_t item = {&sub, 0};
+  auto start = std::chrono::steady_clock::now();
+  REQUIRE(msgq_poll(&item, 1, 10000) == 1);
+  auto elapsed = std::chrono::steady_clock::now() - start;
+
+  // Woken by the publisher, not by the timeout
+  REQUIRE(item.revents);
+  REQUIRE(elapsed < std::chrono::seconds(5));
+  REQUIRE(*sub.read_waiting[sub.reader_id] == 0);
+
+  msgq_msg_t msg;
+  REQUIRE(msgq_msg_borrow(&msg, &sub) == 100);
+  REQUIRE(all_equal(msg.data, msg.size, 'd'));
+  REQUIRE(msgq_msg_release(&msg, &sub) == 0);
+
+  int status;
+  REQUIRE(waitpid(pid, &status, 0) == pid);
+  REQUIRE(WIFEXITED(status));
+  REQUIRE(WEXITSTATUS(status) == 0);
+
+  msgq_close_queue(&sub);
+}
+#endif
+
+TEST_CASE("msgq_msg_borrow hands out the message in place") {
+  msgq_queue_t pub, sub;
+  new_queue(&pub, "test_queue_borrow", 1024);
+  msgq_init_publisher(&pub);
+  REQUIRE(msgq_new_queue(&sub, "test_queue_borrow", 1024) == 0);
+  msgq_init_subscriber(&sub);
+
+  send_fill(&pub, 100, 'a');
+  send_fill(&pub, 100, 'b');
+
+  msgq_msg_t msg;
+  REQUIRE(msgq_msg_borrow(&msg, &sub) == 100);
+  REQUIRE(msg.data >= sub.data);
+  REQUIRE(msg.data < sub.data + sub.size);
+  REQUIRE(all_equal(msg.data, msg.size, 'a'));
+
+  // Borrowing again without a release returns the same message
+  msgq_msg_t again;
+  REQUIRE(msgq_msg_borrow(&again, &sub) == 100);
+  REQUIRE(again.data == msg.data);
+
+  REQUIRE(msgq_msg_release(&msg, &sub) == 0);
+
+  REQUIRE(msgq_msg_borrow(&msg, &sub) == 100);
+  REQUIRE(all_equal(msg.data, msg.size, 'b'));
+  REQUIRE(msgq_msg_release(&msg, &sub) == 0);
+
+  // Queue is drained
+  REQUIRE(msgq_msg_borrow(&msg, &sub) == 0);
+  REQUIRE(msg.size == 0);
+
+  msgq_close_queue(&sub);
+  msgq_close_queue(&pub);
+}
+
+TEST_CASE("msgq_msg_release detects an overwrite") {
+  msgq_queue_t pub, sub;
+  new_queue(&pub, "test_queue_overwrite", 1024);
+  msgq_init_publisher(&pub);
+  REQUIRE(msgq_new_queue(&sub, "test_queue_overwrite", 1024) == 0);
+  msgq_init_subscriber(&sub);
+
+  send_fill(&pub, 100, 'a');
+
+  msgq_msg_t msg;
+  REQUIRE(msgq_msg_borrow(&msg, &sub) == 100);
+
+  // Lap the reader while it holds on to the message
+  for (int i = 0; i < 20; i++) {
+    send_fill(&pub, 100, 'b' + i);
+  }
+  REQUIRE(!all_equal(msg.data, msg.size, 'a'));
+  REQUIRE(msgq_msg_release(&msg, &sub) == -1);
+
+  // The reader resynchronizes with the publisher on the next read
+  REQUIRE(msgq_msg_borrow(&msg, &sub) == 0);
+  send_fill(&pub, 100, 'z');
+  REQUIRE(msgq_msg_borrow(&msg, &sub) == 100);
+  REQUIRE(all_equal(msg.data, msg.size, 'z'));
+  REQUIRE(msgq_msg_release(&msg, &sub) == 0);
+
+  msgq_close_queue(&sub);
+  msgq_close_queue(&pub);
+}
+
+TEST_CASE("msgq_msg_send_many and msgq_msg_recv_many") {
+  const size_t num_msgs = 5;
+  const size_t msg_size = 100;
+
+  msgq_queue_t pub, sub;
+  new_queue(&pub, "test_queue_many", 4096);
+  msgq_init_publisher(&pub);
+  REQUIRE(msgq_new_queue(&sub, "test_queue_many", 4096) == 0);
+  msgq_init_subscriber(&sub);
+
+  std::vector<std::vector<char>> data(num_msgs);
+  std::vector<char> arena(num_msgs * ALIGN(msg_size));
+  msgq_msg_t msgs[num_msgs];
+  msgq_msg_t received[num_msgs + 1];
+
+  SECTION("batches that wrap the ring") {
+    uint32_t write_cycles, write_pointer;
+
+    // Each batch takes 560 bytes, the ring wraps after seven of them
+    for (int batch = 0; batch < 20; batch++) {
+      for (size_t i = 0; i < num_msgs; i++) {
+        data[i].assign(msg_size, (char)(batch * num_msgs + i));
+        msgs[i].data = data[i].data();
+        msgs[i].size = data[i].size();
+      }
+
+      REQUIRE(msgq_msg_send_many(msgs, num_msgs, &pub) == (int)num_msgs);
+      REQUIRE(msgq_msg_ready(&sub));
+
+      int r = msgq_msg_recv_many(received, num_msgs + 1, arena.data(), arena.size(), &sub);
+      REQUIRE(r == (int)num_msgs);
+      for (size_t i = 0; i < num_msgs; i++) {
+        REQUIRE(received[i].size == msg_size);
+        REQUIRE(all_equal(received[i].data, received[i].size, (char)(batch * num_msgs + i)));
+      }
+      REQUIRE(!msgq_msg_ready(&sub));
+    }
+
+    UNPACK64(write_cycles, write_pointer, *pub.write_pointer);
+    REQUIRE(write_cycles >= 2);
+  }
+
+  SECTION("arena smaller than the pending messages") {
+    for (size_t i = 0; i < num_msgs; i++) {
+      data[i].assign(msg_size, (char)i);
+      msgs[i].data = data[i].data();
+      msgs[i].size = data[i].size();
+    }
+    REQUIRE(msgq_msg_send_many(msgs, num_msgs, &pub) == (int)num_msgs);
+
+    // Not even one message fits
+    REQUIRE(msgq_msg_recv_many(received, num_msgs, arena.data(), msg_size - 1, &sub) == -1);
+    REQUIRE(errno == ENOBUFS);
+
+    // The rest stays in the queue for the next call
+    REQUIRE(msgq_msg_recv_many(received, num_msgs, arena.data(), 2 * ALIGN(msg_size), &sub) == 2);
+    REQUIRE(all_equal(received[1].data, received[1].size, 1));
+    REQUIRE(msgq_msg_recv_many(received, num_msgs, arena.data(), arena.size(), &sub) == 3);
+    REQUIRE(all_equal(received[0].data, received[0].size, 2));
+    REQUIRE(all_equal(received[2].data, received[2].size, 4));
+  }
+
+  SECTION("batch larger than the queue") {
+    // 40 messages take 4480 bytes, more than fits in a single block
+    std::vector<std::vector<char>> big_data(40);
+    std::vector<msgq_msg_t> big_msgs(big_data.size());
+    for (size_t i = 0; i < big_data.size(); i++) {
+      big_data[i].assign(msg_size, (char)i);
+      big_msgs[i].data = big_data[i].data();
+      big_msgs[i].size = big_data[i].size();
+    }
+    REQUIRE(msgq_msg_send_many(big_msgs.data(), big_msgs.size(), &pub) == (int)big_msgs.size());
+
+    // The reader was lapped and resynchronizes with the publisher
+    msgq_msg_t msg;
+    REQUIRE(msgq_msg_borrow(&msg, &sub) == 0);
+    REQUIRE(msgq_msg_send_many(big_msgs.data(), 1, &pub) == 1);
+    REQUIRE(msgq_msg_borrow(&msg, &sub) == (int)msg_size);
+    REQUIRE(all_equal(msg.data, msg.size, 0));
+    REQUIRE(msgq_msg_release(&msg, &sub) == 0);
+
+    // A message that can never fit fails the whole batch
+    std::vector<char> huge(2048);
+    big_msgs[1].data = huge.data();
+    big_msgs[1].size = huge.size();
+    REQUIRE(msgq_msg_send_many(big_msgs.data(), 3, &pub) == -1);
+    REQUIRE(errno == EMSGSIZE);
+    REQUIRE(!msgq_msg_ready(&sub));
+  }
+
+  SECTION("empty batch") {
+    REQUIRE(msgq_msg_send_many(msgs, 0, &pub) == 0);
+    REQUIRE(!msgq_msg_ready(&sub));
+    REQUIRE(msgq_msg_recv_many(received, num_msgs, arena.data(), arena.size(), &sub) == 0);
+  }
+
+  msgq_close_queue(&sub);
+  msgq_close_queue(&pub);
+}
+
+TEST_CASE("reader slots are sized per queue") {
+  // The default, the size service_list.yaml gives to busy services, and the maximum
+  size_t num_reader_slots = GENERATE(1, NUM_READERS, 16, MAX_READERS);
+  std::string path = "test_queue_slots_" + std::to_string(num_reader_slots);
+
+  msgq_queue_t pub;
+  new_queue(&pub, path.c_str(), 1024, num_reader_slots);
+  msgq_init_publisher(&pub);
+  REQUIRE(pub.num_reader_slots == num_reader_slots);
+  REQUIRE(pub.header_size == sizeof(msgq_header_t) + num_reader_slots * sizeof(msgq_reader_t));
+
+  std::vector<msgq_queue_t> subs(num_reader_slots + 1);
+  for (size_t i = 0; i < num_reader_slots; i++) {
+    REQUIRE(msgq_new_queue(&subs[i], path.c_str(), 1024, num_reader_slots) == 0);
+    msgq_init_subscriber(&subs[i]);
+    REQUIRE(subs[i].reader_id == (int)i);
+  }
+  REQUIRE(*pub.num_readers == num_reader_slots);
+
+  // All slots are in use and every subscriber receives
+  send_fill(&pub, 16, 'a');
+  for (size_t i = 0; i < num_reader_slots; i++) {
+    REQUIRE(subs[i].read_uid_local == *pub.read_uids[i]);
+    REQUIRE(msgq_msg_ready(&subs[i]));
+  }
+
+  // One more subscriber evicts everyone and takes the first slot
+  msgq_queue_t &extra = subs[num_reader_slots];
+  REQUIRE(msgq_new_queue(&extra, path.c_str(), 1024, num_reader_slots) == 0);
+  msgq_init_subscriber(&extra);
+  REQUIRE(extra.reader_id == 0);
+  REQUIRE(*pub.num_readers == 1);
+  for (size_t i = 0; i < num_reader_slots; i++) {
+    REQUIRE(subs[i].read_uid_local != *pub.read_uids[subs[i].reader_id]);
+  }
+
+  // An evicted subscriber reconnects on its next read, with a single slot it evicts again
+  size_t expected_readers = std::min<size_t>(2, num_reader_slots);
+  REQUIRE(!msgq_msg_ready(&subs[num_reader_slots - 1]));
+  REQUIRE(*pub.num_readers == expected_readers);
+  REQUIRE(subs[num_reader_slots - 1].reader_id == (int)expected_readers - 1);
+
+  for (auto &sub : subs) {
+    msgq_close_queue(&sub);
+  }
+  msgq_close_queue(&pub);
+}
@@ -43,7 +43,7 @@ struct SubMaster::SubMessage {
   uint64_t rcv_time = 0, rcv_frame = 0;
   void *allocated_msg_reader = nullptr;
   capnp::FlatArrayMessageReader *msg_reader = nullptr;
-  kj::Array<capnp::word> buf;
+  kj::Array<capnp::word> buf, next_buf;
   cereal::Event::Reader event;
 };
 
@@ -61,7 +61,8 @@ SubMaster::SubMaster(const std::initializer_list<const char *> &service_list, co
       .freq = serv->frequency,
       .ignore_alive = inList(ignore_alive, name),
       .allocated_msg_reader = malloc(sizeof(capnp::FlatArrayMessageReader)),
-      .buf = kj::heapArray<capnp::word>(1024)};
+      .buf = kj::heapArray<capnp::word>(1024),
+      .next_buf = kj::heapArray<capnp::word>(1024)};
     messages_[socket] = m;
     services_[name] = m;
   }
@@ -75,16 +76,19 @@ int SubMaster::update(int timeout) {
   auto sockets = poller_->poll(timeout);
   uint64_t current_time = nanos_since_boot();
   for (auto s : sockets) {
-    Message *msg = s->receive(true);
+    // Borrow the message to copy it straight from the transport into the spare buffer,
+    // the current event stays intact if the data turns out to be overwritten
+    Message *msg = s->borrow(true);
     if (msg == nullptr) continue;
 
     SubMessage *m = messages_.at(s);
     const size_t size = (msg->getSize() / sizeof(capnp::word)) + 1;
-    if (m->buf.size() < size) {
-      m->buf = kj::heapArray<capnp::word>(size);
+    if (m->next_buf.size() < size) {
+      m->next_buf = kj::heapArray<capnp::word>(size);
     }
-    memcpy(m->buf.begin(), msg->getData(), msg->getSize());
-    delete msg;
+    memcpy(m->next_buf.begin(), msg->getData(), msg->getSize());
+    if (!s->release(msg)) continue;
+    std::swap(m->buf, m->next_buf);
 
     if (m->msg_reader) {
       m->msg_reader->~FlatArrayMessageReader();
@@ -124,8 +128,8 @@ void SubMaster::drain() {
       break;
 
     for (auto sock : polls) {
-      Message *msg = sock->receive(true);
-      delete msg;
+      Message *msg = sock->borrow(true);
+      if (msg) sock->release(msg);
     }
   }
 }
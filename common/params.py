@@ -19,12 +19,17 @@ before deleting the old <params_dir>/<d> directory.
 
 Writers that only modify a single key can simply take the lock, then swap the corresponding value
 file in place without messing with <params_dir>/d.
+
+The C++ params code keeps a cache of <params_dir> in /dev/shm. Writers here must call
+invalidate_cache with the lock still held, once their changes are on disk.
 """
 import time
 import os
 import errno
+import mmap
 import shutil
 import fcntl
+import struct
 import tempfile
 import threading
 from enum import Enum
@@ -123,6 +128,32 @@ def fsync_dir(path):
     os.close(fd)
 
 
+# layout of the cache header in selfdrive/common/params.cc
+CACHE_MAGIC = 0x3148434d52415001
+CACHE_GENERATION_OFFSET = 16
+CACHE_FLUSH_GENERATION_OFFSET = 20
+
+
+def invalidate_cache(params_path):
+  """Marks everything cached for params_path stale. Callers should hold the lock."""
+  cache_path = "/dev/shm/params_cache" + params_path.replace("/", "_")
+  try:
+    with open(cache_path, "r+b") as f:
+      mm = mmap.mmap(f.fileno(), mmap.PAGESIZE)
+  except (OSError, IOError, ValueError):
+    return
+
+  try:
+    magic, = struct.unpack_from("<Q", mm, 0)
+    if magic == CACHE_MAGIC:
+      generation, = struct.unpack_from("<I", mm, CACHE_GENERATION_OFFSET)
+      generation = (generation + 1) & 0xffffffff
+      struct.pack_into("<I", mm, CACHE_FLUSH_GENERATION_OFFSET, generation)
+      struct.pack_into("<I", mm, CACHE_GENERATION_OFFSET, generation)
+  finally:
+    mm.close()
+
+
 class FileLock():
   def __init__(self, path, create):
     self._path = path
@@ -282,6 +313,7 @@ class DBWriter(DBAccessor):
         os.symlink(os.path.basename(tempdir_path), new_data_path)
         os.rename(new_data_path, data_path)
         fsync_dir(self._path)
+        invalidate_cache(self._path)
       finally:
         # If the rename worked, we can delete the old data. Otherwise delete the new one.
         success = new_data_path is not None and os.path.exists(data_path) and (
@@ -333,6 +365,7 @@ def write_db(params_path, key, value):
     path = "%s/d/%s" % (params_path, key)
     os.rename(tmp_path.name, path)
     fsync_dir(os.path.dirname(path))
+    invalidate_cache(params_path)
   finally:
     os.umask(prev_umask)
     lock.release()
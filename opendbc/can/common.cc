@@ -215,3 +215,15 @@ uint64_t read_u64_le(const uint8_t* v) {
           | ((uint64_t)v[6] << 48)
           | ((uint64_t)v[7] << 56));
 }
+
+void write_u64_be(uint8_t* v, uint64_t x) {
+  for (int i = 0; i < 8; i++) {
+    v[i] = x >> (56 - 8*i);
+  }
+}
+
+void write_u64_le(uint8_t* v, uint64_t x) {
+  for (int i = 0; i < 8; i++) {
+    v[i] = x >> (8*i);
+  }
+}
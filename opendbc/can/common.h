@@ -1,6 +1,7 @@
 #pragma once
 
 #include <vector>
+#include <algorithm>
 #include <map>
 #include <unordered_map>
 
@@ -9,6 +10,10 @@
 #include "cereal/gen/cpp/log.capnp.h"
 
 #define MAX_BAD_COUNTER 5
+#define CANFD_MAX_DLEN 64
+
+// addresses below this are indexed directly, extended addresses by binary search
+#define CAN_STD_ADDRESS_COUNT 0x800
 
 // Helper functions
 unsigned int honda_checksum(unsigned int address, uint64_t d, int l);
@@ -20,6 +25,8 @@ unsigned int volkswagen_crc(unsigned int address, uint64_t d, int l);
 unsigned int pedal_checksum(uint64_t d, int l);
 uint64_t read_u64_be(const uint8_t* v);
 uint64_t read_u64_le(const uint8_t* v);
+void write_u64_be(uint8_t* v, uint64_t x);
+void write_u64_le(uint8_t* v, uint64_t x);
 
 class MessageState {
 public:
@@ -36,28 +43,84 @@ public:
   uint8_t counter;
   uint8_t counter_fail;
 
+  bool updated; // parsed since the last query_updated
+
+  // decode plan built from parse_sigs, checksum and counter checks are hoisted
+  // out of the value extraction, which is a branch free loop over flat arrays
+  std::vector<int> check_sigs; // checksum and counter signals, in signal order
+  std::vector<uint64_t> plan_big_endian; // all ones for big endian signals
+  std::vector<uint64_t> plan_shift;
+  std::vector<uint64_t> plan_mask;
+  std::vector<uint64_t> plan_sign_bit;
+  std::vector<double> plan_factor;
+  std::vector<double> plan_offset;
+
+  void build_plan();
+  // dat is zero padded to at least 8 bytes and to the message size
   bool parse(uint64_t sec, uint16_t ts_, uint8_t * dat);
   bool update_counter_generic(int64_t v, int cnt_size);
 };
 
 class CANParser {
 private:
-  const int bus;
-
   const DBC *dbc = NULL;
-  std::unordered_map<uint32_t, MessageState> message_states;
+  std::vector<MessageState> message_states; // sorted by address
+  std::vector<uint32_t> state_addresses; // address of each entry in message_states
+  std::vector<int16_t> std_address_index; // index into message_states, -1 if not tracked
+  std::vector<size_t> updated_states;
+
+  inline int find_state(uint32_t address) const {
+    if (address < CAN_STD_ADDRESS_COUNT) {
+      return std_address_index[address];
+    }
+    auto it = std::lower_bound(state_addresses.begin(), state_addresses.end(), address);
+    return (it != state_addresses.end() && *it == address) ? it - state_addresses.begin() : -1;
+  }
 
 public:
+  const int bus;
   bool can_valid = false;
   uint64_t last_sec = 0;
 
   CANParser(int abus, const std::string& dbc_name,
             const std::vector<MessageParseOptions> &options,
             const std::vector<SignalParseOptions> &sigoptions);
+  void UpdateCan(uint64_t sec, const cereal::CanData::Reader& cmsg);
   void UpdateCans(uint64_t sec, const capnp::List<cereal::CanData>::Reader& cans);
   void UpdateValid(uint64_t sec);
   void update_string(std::string data, bool sendcan);
   std::vector<SignalValue> query_latest();
+  // fills vals with the signals of messages parsed since the previous call,
+  // reusing its storage
+  void query_updated(std::vector<SignalValue> &vals);
+};
+
+// Feeds several CANParsers, one per bus or DBC, from a single pass over each can
+// event instead of every parser copying and decoding the event on its own
+class CANParserGroup {
+private:
+  std::vector<CANParser*> parsers;
+  std::vector<std::vector<CANParser*>> bus_parsers; // indexed by src
+
+public:
+  uint64_t last_sec = 0;
+
+  CANParserGroup(const std::vector<CANParser*> &parsers);
+  void UpdateCans(uint64_t sec, const capnp::List<cereal::CanData>::Reader& cans);
+  void UpdateValid(uint64_t sec);
+  void update_string(std::string data, bool sendcan);
+  bool bus_valid(int bus) const;
+};
+
+// message and signal layout resolved once by CANPacker::prepare
+struct PreparedMessage {
+  uint32_t address;
+  unsigned int size;
+  std::vector<Signal> signals; // in the order values are passed to pack_prepared
+  uint64_t le_mask; // bits of the little endian signals, in packed byte order
+  bool mixed_overlap; // little and big endian signals share bits, pack them one by one
+  const Signal *counter; // NULL if not defined
+  const Signal *checksum; // NULL if not defined
 };
 
 class CANPacker {
@@ -65,8 +128,20 @@ private:
   const DBC *dbc = NULL;
   std::map<std::pair<uint32_t, std::string>, Signal> signal_lookup;
   std::map<uint32_t, Msg> message_lookup;
+  std::vector<PreparedMessage> prepared;
+
+  uint64_t set_checksum(uint32_t address, const Signal &sig, uint64_t ret, unsigned int size);
 
 public:
   CANPacker(const std::string& dbc_name);
   uint64_t pack(uint32_t address, const std::vector<SignalPackValue> &signals, int counter);
+
+  // returns a handle for packing address with values for signal_names, or -1
+  // if the message or a signal is not defined
+  int prepare(uint32_t address, const std::vector<std::string> &signal_names);
+  // values in the order of the signal_names passed to prepare, for classic
+  // frames of up to 8 bytes
+  uint64_t pack_prepared(int handle, const double *values, int counter);
+  // writes the message size bytes of the frame to dat, also for CAN FD frames
+  void pack_prepared_bytes(int handle, const double *values, int counter, uint8_t *dat);
 };
@@ -1,7 +1,7 @@
 # distutils: language = c++
 #cython: language_level=3
 
-from libc.stdint cimport uint32_t, uint64_t, uint16_t
+from libc.stdint cimport uint8_t, uint32_t, uint64_t, uint16_t
 from libcpp.vector cimport vector
 from libcpp.map cimport map
 from libcpp.string cimport string
@@ -71,14 +71,26 @@ cdef extern from "common_dbc.h":
 
 
 cdef extern from "common.h":
+  enum: CANFD_MAX_DLEN
+
   cdef const DBC* dbc_lookup(const string);
 
   cdef cppclass CANParser:
+    int bus
     bool can_valid
     CANParser(int, string, vector[MessageParseOptions], vector[SignalParseOptions])
     void update_string(string, bool)
     vector[SignalValue] query_latest()
+    void query_updated(vector[SignalValue]&)
+
+  cdef cppclass CANParserGroup:
+    CANParserGroup(vector[CANParser*])
+    void update_string(string, bool)
+    bool bus_valid(int)
 
   cdef cppclass CANPacker:
    CANPacker(string)
    uint64_t pack(uint32_t, vector[SignalPackValue], int counter)
+   int prepare(uint32_t, vector[string])
+   uint64_t pack_prepared(int, const double*, int counter)
+   void pack_prepared_bytes(int, const double*, int counter, uint8_t*)
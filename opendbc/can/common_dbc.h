@@ -49,6 +49,12 @@ struct Signal {
   double factor, offset;
   bool is_little_endian;
   SignalType type;
+
+  // decode plan, precomputed by dbc_template.cc
+  int byte_offset; // start of the 8 byte word holding the signal, 0 unless CAN FD
+  int shift; // within that word, b1 for little endian, bo for big endian signals
+  uint64_t mask;
+  uint64_t sign_bit; // 0 for unsigned signals
 };
 
 struct Msg {
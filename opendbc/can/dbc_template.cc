@@ -11,6 +11,7 @@ const Signal sigs_{{address}}[] = {
       {% else %}
         {% set b1 = (sig.start_bit//8)*8  + (-sig.start_bit-1) % 8 %}
       {% endif %}
+      {% set byte_offset = [b1 // 8, [msg_size - 8, 0]|max]|min %}
       .name = "{{sig.name}}",
       .b1 = {{b1}},
       .b2 = {{sig.size}},
@@ -40,6 +41,10 @@ const Signal sigs_{{address}}[] = {
       {% else %}
       .type = SignalType::DEFAULT,
       {% endif %}
+      .byte_offset = {{byte_offset}},
+      .shift = {{b1 - 8*byte_offset if sig.is_little_endian else 64 - (b1 - 8*byte_offset + sig.size)}},
+      .mask = {{"0x%X" % (2 ** sig.size - 1)}}ULL,
+      .sign_bit = {{"0x%X" % 2 ** (sig.size - 1) if sig.is_signed else 0}}ULL,
     },
   {% endfor %}
 };
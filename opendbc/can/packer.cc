@@ -3,6 +3,7 @@
 #include <algorithm>
 #include <map>
 #include <cmath>
+#include <cstring>
 
 #include "common.h"
 
@@ -33,6 +34,19 @@ uint64_t set_value(uint64_t ret, Signal sig, int64_t ival){
   return ret;
 }
 
+// CAN FD signals are written to the 8 byte word starting at their byte_offset
+static void set_value_bytes(uint8_t *dat, const Signal &sig, int64_t ival) {
+  uint8_t *word = dat + sig.byte_offset;
+  uint64_t ret = sig.is_little_endian ? read_u64_le(word) : read_u64_be(word);
+  ret &= ~(sig.mask << sig.shift);
+  ret |= (ival & sig.mask) << sig.shift;
+  if (sig.is_little_endian) {
+    write_u64_le(word, ret);
+  } else {
+    write_u64_be(word, ret);
+  }
+}
+
 CANPacker::CANPacker(const std::string& dbc_name) {
   dbc = dbc_lookup(dbc_name);
   assert(dbc);
@@ -48,6 +62,31 @@ CANPacker::CANPacker(const std::string& dbc_name) {
   init_crc_lookup_tables();
 }
 
+uint64_t CANPacker::set_checksum(uint32_t address, const Signal &sig, uint64_t ret, unsigned int size) {
+  if (sig.type == SignalType::HONDA_CHECKSUM) {
+    unsigned int chksm = honda_checksum(address, ret, size);
+    ret = set_value(ret, sig, chksm);
+  } else if (sig.type == SignalType::TOYOTA_CHECKSUM) {
+    unsigned int chksm = toyota_checksum(address, ret, size);
+    ret = set_value(ret, sig, chksm);
+  } else if (sig.type == SignalType::VOLKSWAGEN_CHECKSUM) {
+    // FIXME: Hackish fix for an endianness issue. The message is in reverse byte order
+    // until later in the pack process. Checksums can be run backwards, CRCs not so much.
+    // The correct fix is unclear but this works for the moment.
+    unsigned int chksm = volkswagen_crc(address, ReverseBytes(ret), size);
+    ret = set_value(ret, sig, chksm);
+  } else if (sig.type == SignalType::SUBARU_CHECKSUM) {
+    unsigned int chksm = subaru_checksum(address, ret, size);
+    ret = set_value(ret, sig, chksm);
+  } else if (sig.type == SignalType::CHRYSLER_CHECKSUM) {
+    unsigned int chksm = chrysler_checksum(address, ReverseBytes(ret), size);
+    ret = set_value(ret, sig, chksm);
+  } else {
+    //WARN("CHECKSUM signal type not valid\n");
+  }
+  return ret;
+}
+
 uint64_t CANPacker::pack(uint32_t address, const std::vector<SignalPackValue> &signals, int counter) {
   uint64_t ret = 0;
   for (const auto& sigval : signals) {
@@ -86,29 +125,132 @@ uint64_t CANPacker::pack(uint32_t address, const std::vector<SignalPackValue> &s
 
   auto sig_it_checksum = signal_lookup.find(std::make_pair(address, "CHECKSUM"));
   if (sig_it_checksum != signal_lookup.end()) {
-    auto sig = sig_it_checksum->second;
-    if (sig.type == SignalType::HONDA_CHECKSUM) {
-      unsigned int chksm = honda_checksum(address, ret, message_lookup[address].size);
-      ret = set_value(ret, sig, chksm);
-    } else if (sig.type == SignalType::TOYOTA_CHECKSUM) {
-      unsigned int chksm = toyota_checksum(address, ret, message_lookup[address].size);
-      ret = set_value(ret, sig, chksm);
-    } else if (sig.type == SignalType::VOLKSWAGEN_CHECKSUM) {
-      // FIXME: Hackish fix for an endianness issue. The message is in reverse byte order
-      // until later in the pack process. Checksums can be run backwards, CRCs not so much.
-      // The correct fix is unclear but this works for the moment.
-      unsigned int chksm = volkswagen_crc(address, ReverseBytes(ret), message_lookup[address].size);
-      ret = set_value(ret, sig, chksm);
-    } else if (sig.type == SignalType::SUBARU_CHECKSUM) {
-      unsigned int chksm = subaru_checksum(address, ret, message_lookup[address].size);
-      ret = set_value(ret, sig, chksm);
-    } else if (sig.type == SignalType::CHRYSLER_CHECKSUM) {
-      unsigned int chksm = chrysler_checksum(address, ReverseBytes(ret), message_lookup[address].size);
-      ret = set_value(ret, sig, chksm);
+    ret = set_checksum(address, sig_it_checksum->second, ret, message_lookup[address].size);
+  }
+
+  return ret;
+}
+
+int CANPacker::prepare(uint32_t address, const std::vector<std::string> &signal_names) {
+  auto msg_it = message_lookup.find(address);
+  if (msg_it == message_lookup.end()) {
+    WARN("undefined message %d\n", address);
+    return -1;
+  }
+
+  PreparedMessage msg = {
+    .address = address,
+    .size = msg_it->second.size,
+    .le_mask = 0,
+    .mixed_overlap = false,
+    .counter = NULL,
+    .checksum = NULL,
+  };
+
+  uint64_t be_mask = 0;
+  for (const auto& name : signal_names) {
+    auto sig_it = signal_lookup.find(std::make_pair(address, name));
+    if (sig_it == signal_lookup.end()) {
+      WARN("undefined signal %s - %d\n", name.c_str(), address);
+      return -1;
+    }
+    const Signal &sig = sig_it->second;
+    msg.signals.push_back(sig);
+    if (sig.is_little_endian) {
+      msg.le_mask |= sig.mask << sig.shift;
     } else {
-      //WARN("CHECKSUM signal type not valid\n");
+      be_mask |= sig.mask << sig.shift;
+    }
+  }
+  msg.le_mask = ReverseBytes(msg.le_mask);
+  msg.mixed_overlap = (msg.le_mask & be_mask) != 0;
+
+  auto sig_it = signal_lookup.find(std::make_pair(address, "COUNTER"));
+  if (sig_it != signal_lookup.end()) {
+    msg.counter = &sig_it->second;
+  }
+
+  sig_it = signal_lookup.find(std::make_pair(address, "CHECKSUM"));
+  if (sig_it != signal_lookup.end()) {
+    msg.checksum = &sig_it->second;
+    if (msg.size > 8 && msg.checksum->type != SignalType::DEFAULT) {
+      WARN("CHECKSUM not supported on CAN FD message %d\n", address);
+    }
+  }
+
+  prepared.push_back(msg);
+  return prepared.size() - 1;
+}
+
+uint64_t CANPacker::pack_prepared(int handle, const double *values, int counter) {
+  const PreparedMessage &msg = prepared[handle];
+
+  uint64_t ret = 0;
+  if (msg.mixed_overlap) {
+    // the last signal written has to win, same as in pack
+    for (size_t i = 0; i < msg.signals.size(); i++) {
+      const Signal &sig = msg.signals[i];
+      int64_t ival = (int64_t)(round((values[i] - sig.offset) / sig.factor));
+      ret = set_value(ret, sig, ival);
+    }
+  } else {
+    // little and big endian signals are packed separately so the byte swap
+    // happens once per message instead of twice per signal
+    uint64_t ret_be = 0, ret_le = 0;
+    for (size_t i = 0; i < msg.signals.size(); i++) {
+      const Signal &sig = msg.signals[i];
+      int64_t ival = (int64_t)(round((values[i] - sig.offset) / sig.factor));
+
+      uint64_t &r = sig.is_little_endian ? ret_le : ret_be;
+      r &= ~(sig.mask << sig.shift);
+      r |= (ival & sig.mask) << sig.shift;
+    }
+    ret = (ret_be & ~msg.le_mask) | ReverseBytes(ret_le);
+  }
+
+  if (counter >= 0) {
+    if (msg.counter == NULL) {
+      WARN("COUNTER not defined\n");
+      return ret;
+    }
+
+    if ((msg.counter->type != SignalType::HONDA_COUNTER) && (msg.counter->type != SignalType::VOLKSWAGEN_COUNTER)) {
+      WARN("COUNTER signal type not valid\n");
     }
+
+    ret = set_value(ret, *msg.counter, counter);
+  }
+
+  if (msg.checksum != NULL) {
+    ret = set_checksum(msg.address, *msg.checksum, ret, msg.size);
   }
 
   return ret;
 }
+
+void CANPacker::pack_prepared_bytes(int handle, const double *values, int counter, uint8_t *dat) {
+  const PreparedMessage &msg = prepared[handle];
+
+  if (msg.size <= 8) {
+    uint64_t ret = pack_prepared(handle, values, counter);
+    for (int i = 0; i < msg.size; i++) {
+      dat[i] = ret >> (56 - 8*i);
+    }
+    return;
+  }
+
+  memset(dat, 0, msg.size);
+  for (size_t i = 0; i < msg.signals.size(); i++) {
+    const Signal &sig = msg.signals[i];
+    int64_t ival = (int64_t)(round((values[i] - sig.offset) / sig.factor));
+    set_value_bytes(dat, sig, ival);
+  }
+
+  if (counter >= 0) {
+    if (msg.counter == NULL) {
+      WARN("COUNTER not defined\n");
+      return;
+    }
+    set_value_bytes(dat, *msg.counter, counter);
+  }
+}
@@ -0,0 +1,87 @@
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+#define ITERATIONS 2000
+
+static inline uint64_t nanos_monotonic() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+struct BenchMessage {
+  uint32_t address;
+  std::vector<std::string> names;
+  std::vector<SignalPackValue> values;
+  std::vector<double> prepared_values;
+  int handle;
+};
+
+// Packs every message of the DBC with all its signals set, through the
+// name based pack and through a prepared handle
+static void bench(const std::string &dbc_name) {
+  const DBC *dbc = dbc_lookup(dbc_name);
+  assert(dbc);
+
+  CANPacker packer(dbc_name);
+
+  std::vector<BenchMessage> msgs;
+  for (int i = 0; i < dbc->num_msgs; i++) {
+    const Msg &msg = dbc->msgs[i];
+    BenchMessage bench_msg = {.address = msg.address};
+    for (int j = 0; j < msg.num_sigs; j++) {
+      const Signal &sig = msg.sigs[j];
+      if (sig.type != SignalType::DEFAULT) continue;
+
+      double value = (j % 4) * sig.factor + sig.offset;
+      bench_msg.names.push_back(sig.name);
+      bench_msg.values.push_back({sig.name, value});
+      bench_msg.prepared_values.push_back(value);
+    }
+    bench_msg.handle = packer.prepare(msg.address, bench_msg.names);
+    assert(bench_msg.handle >= 0);
+    msgs.push_back(bench_msg);
+  }
+
+  uint64_t checksum = 0;
+  uint64_t start = nanos_monotonic();
+  for (int it = 0; it < ITERATIONS; it++) {
+    for (const auto &msg : msgs) {
+      checksum += packer.pack(msg.address, msg.values, -1);
+    }
+  }
+  uint64_t pack_time = nanos_monotonic() - start;
+
+  uint64_t prepared_checksum = 0;
+  start = nanos_monotonic();
+  for (int it = 0; it < ITERATIONS; it++) {
+    for (const auto &msg : msgs) {
+      prepared_checksum += packer.pack_prepared(msg.handle, msg.prepared_values.data(), -1);
+    }
+  }
+  uint64_t prepared_time = nanos_monotonic() - start;
+
+  // both paths must produce the same frames
+  assert(checksum == prepared_checksum);
+
+  double num_packed = (double)ITERATIONS * msgs.size();
+  printf("%s: %zu messages\n", dbc_name.c_str(), msgs.size());
+  printf("  pack:          %8.1f ns/message\n", pack_time / num_packed);
+  printf("  pack_prepared: %8.1f ns/message\n", prepared_time / num_packed);
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1) {
+    for (int i = 1; i < argc; i++) bench(argv[i]);
+  } else {
+    bench("honda_civic_touring_2016_can_generated");
+    bench("toyota_rav4_2017_pt_generated");
+  }
+  return 0;
+}
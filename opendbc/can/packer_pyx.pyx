@@ -1,7 +1,7 @@
 # distutils: language = c++
 # cython: c_string_encoding=ascii, language_level=3
 
-from libc.stdint cimport uint32_t, uint64_t
+from libc.stdint cimport uint8_t, uint32_t, uint64_t
 from libcpp.vector cimport vector
 from libcpp.map cimport map
 from libcpp.string cimport string
@@ -9,7 +9,7 @@ from libcpp cimport bool
 from posix.dlfcn cimport dlopen, dlsym, RTLD_LAZY
 
 from common cimport CANPacker as cpp_CANPacker
-from common cimport dbc_lookup, SignalPackValue, DBC
+from common cimport dbc_lookup, SignalPackValue, DBC, CANFD_MAX_DLEN
 
 
 cdef class CANPacker:
@@ -18,10 +18,14 @@ cdef class CANPacker:
     const DBC *dbc
     map[string, (int, int)] name_to_address_and_size
     map[int, int] address_to_size
+    dict prepared_handles
+    vector[uint32_t] prepared_address
+    vector[double] prepared_values
 
   def __init__(self, dbc_name):
     self.packer = new cpp_CANPacker(dbc_name)
     self.dbc = dbc_lookup(dbc_name)
+    self.prepared_handles = {}
 
     num_msgs = self.dbc[0].num_msgs
     for i in range(num_msgs):
@@ -29,7 +33,53 @@ cdef class CANPacker:
       self.name_to_address_and_size[string(msg.name)] = (msg.address, msg.size)
       self.address_to_size[msg.address] = msg.size
 
+  cpdef prepare(self, name_or_addr, signal_names):
+    """Resolves a message and its signals once, returns a handle for
+    make_can_msg_prepared or -1 if the message or a signal is not defined"""
+    cdef int addr
+    if type(name_or_addr) == int:
+      addr = name_or_addr
+    else:
+      addr, _ = self.name_to_address_and_size[name_or_addr.encode('utf8')]
+
+    cdef vector[string] names
+    for name in signal_names:
+      names.push_back(name.encode('utf8'))
+
+    handle = self.packer.prepare(addr, names)
+    if handle >= 0:
+      self.prepared_address.push_back(addr)
+    return handle
+
+  cdef uint64_t pack_prepared(self, int handle, values, counter):
+    self.prepared_values.clear()
+    for value in values:
+      self.prepared_values.push_back(value)
+    return self.packer.pack_prepared(handle, self.prepared_values.data(), counter)
+
+  cdef bytes pack_prepared_bytes(self, int handle, values, counter, int size):
+    cdef uint8_t dat[CANFD_MAX_DLEN]
+    self.prepared_values.clear()
+    for value in values:
+      self.prepared_values.push_back(value)
+    self.packer.pack_prepared_bytes(handle, self.prepared_values.data(), counter, dat)
+    return (<char *>dat)[:size]
+
+  cdef get_handle(self, addr, values):
+    # messages are prepared on first use for each set of signal names
+    key = (addr, tuple(values))
+    handle = self.prepared_handles.get(key)
+    if handle is None:
+      handle = self.prepare(addr, key[1])
+      self.prepared_handles[key] = handle
+    return handle
+
   cdef uint64_t pack(self, addr, values, counter):
+    handle = self.get_handle(addr, values)
+    if handle >= 0:
+      return self.pack_prepared(handle, values.values(), counter)
+
+    # fall back to looking up each signal, warning about the undefined ones
     cdef vector[SignalPackValue] values_thing
     cdef SignalPackValue spv
 
@@ -62,6 +112,25 @@ cdef class CANPacker:
       size = self.address_to_size[name_or_addr]
     else:
       addr, size = self.name_to_address_and_size[name_or_addr.encode('utf8')]
+
+    if size > 8:
+      # CAN FD, only through a prepared message
+      handle = self.get_handle(addr, values)
+      if handle < 0:
+        raise ValueError("cannot pack message %d" % addr)
+      return [addr, 0, self.pack_prepared_bytes(handle, values.values(), counter, size), bus]
+
     cdef uint64_t val = self.pack(addr, values, counter)
     val = self.ReverseBytes(val)
     return [addr, 0, (<char *>&val)[:size], bus]
+
+  cpdef make_can_msg_prepared(self, int handle, bus, values, counter=-1):
+    """values are in the order of the signal names passed to prepare"""
+    cdef uint32_t addr = self.prepared_address[handle]
+    cdef int size = self.address_to_size[addr]
+    if size > 8:
+      return [addr, 0, self.pack_prepared_bytes(handle, values, counter, size), bus]
+
+    cdef uint64_t val = self.pack_prepared(handle, values, counter)
+    val = self.ReverseBytes(val)
+    return [addr, 0, (<char *>&val)[:size], bus]
@@ -14,35 +14,66 @@
 #define INFO printf
 
 
-bool MessageState::parse(uint64_t sec, uint16_t ts_, uint8_t * dat) {
-  uint64_t dat_le = read_u64_le(dat);
-  uint64_t dat_be = read_u64_be(dat);
+static inline int64_t extract_signal(const Signal &sig, uint64_t dat_le, uint64_t dat_be) {
+  int64_t tmp = ((sig.is_little_endian ? dat_le : dat_be) >> sig.shift) & sig.mask;
+  return (tmp ^ sig.sign_bit) - sig.sign_bit;
+}
 
-  for (int i=0; i < parse_sigs.size(); i++) {
-    auto& sig = parse_sigs[i];
-    int64_t tmp;
+// CAN FD signals are read from the 8 byte word starting at their byte_offset
+static inline int64_t extract_signal(const Signal &sig, const uint8_t *dat) {
+  const uint8_t *word = dat + sig.byte_offset;
+  return extract_signal(sig, read_u64_le(word), read_u64_be(word));
+}
 
-    if (sig.is_little_endian){
-      tmp = (dat_le >> sig.b1) & ((1ULL << sig.b2)-1);
-    } else {
-      tmp = (dat_be >> sig.bo) & ((1ULL << sig.b2)-1);
-    }
+void MessageState::build_plan() {
+  check_sigs.clear();
+  plan_big_endian.clear();
+  plan_shift.clear();
+  plan_mask.clear();
+  plan_sign_bit.clear();
+  plan_factor.clear();
+  plan_offset.clear();
 
-    if (sig.is_signed) {
-      tmp -= (tmp >> (sig.b2-1)) ? (1ULL << sig.b2) : 0; //signed
+  for (int i=0; i < parse_sigs.size(); i++) {
+    const Signal &sig = parse_sigs[i];
+    switch (sig.type) {
+      case SignalType::HONDA_CHECKSUM:
+      case SignalType::TOYOTA_CHECKSUM:
+      case SignalType::VOLKSWAGEN_CHECKSUM:
+      case SignalType::SUBARU_CHECKSUM:
+      case SignalType::CHRYSLER_CHECKSUM:
+      case SignalType::PEDAL_CHECKSUM:
+      case SignalType::HONDA_COUNTER:
+      case SignalType::VOLKSWAGEN_COUNTER:
+      case SignalType::PEDAL_COUNTER:
+        check_sigs.push_back(i);
+        break;
+      default:
+        break;
     }
 
-    DEBUG("parse 0x%X %s -> %lld\n", address, sig.name, tmp);
+    plan_big_endian.push_back(sig.is_little_endian ? 0 : ~0ULL);
+    plan_shift.push_back(sig.shift);
+    plan_mask.push_back(sig.mask);
+    plan_sign_bit.push_back(sig.sign_bit);
+    plan_factor.push_back(sig.factor);
+    plan_offset.push_back(sig.offset);
+  }
+}
+
+bool MessageState::parse(uint64_t sec, uint16_t ts_, uint8_t * dat) {
+  uint64_t dat_le = read_u64_le(dat);
+  uint64_t dat_be = read_u64_be(dat);
+
+  for (int idx : check_sigs) {
+    const Signal &sig = parse_sigs[idx];
+    int64_t tmp = size <= 8 ? extract_signal(sig, dat_le, dat_be) : extract_signal(sig, dat);
 
     if (sig.type == SignalType::HONDA_CHECKSUM) {
       if (honda_checksum(address, dat_be, size) != tmp) {
         INFO("0x%X CHECKSUM FAIL\n", address);
         return false;
       }
-    } else if (sig.type == SignalType::HONDA_COUNTER) {
-      if (!update_counter_generic(tmp, sig.b2)) {
-        return false;
-      }
     } else if (sig.type == SignalType::TOYOTA_CHECKSUM) {
       if (toyota_checksum(address, dat_be, size) != tmp) {
         INFO("0x%X CHECKSUM FAIL\n", address);
@@ -53,10 +84,6 @@ bool MessageState::parse(uint64_t sec, uint16_t ts_, uint8_t * dat) {
         INFO("0x%X CRC FAIL\n", address);
         return false;
       }
-    } else if (sig.type == SignalType::VOLKSWAGEN_COUNTER) {
-        if (!update_counter_generic(tmp, sig.b2)) {
-        return false;
-      }
     } else if (sig.type == SignalType::SUBARU_CHECKSUM) {
       if (subaru_checksum(address, dat_be, size) != tmp) {
         INFO("0x%X CHECKSUM FAIL\n", address);
@@ -72,14 +99,38 @@ bool MessageState::parse(uint64_t sec, uint16_t ts_, uint8_t * dat) {
         INFO("0x%X PEDAL CHECKSUM FAIL\n", address);
         return false;
       }
-    } else if (sig.type == SignalType::PEDAL_COUNTER) {
-      if (!update_counter_generic(tmp, sig.b2)) {
-        return false;
-      }
+    } else if (!update_counter_generic(tmp, sig.b2)) {
+      return false;
+    }
+  }
+
+  if (size > 8) {
+    for (int i=0; i < parse_sigs.size(); i++) {
+      const Signal &sig = parse_sigs[i];
+      vals[i] = extract_signal(sig, dat) * sig.factor + sig.offset;
     }
 
-    vals[i] = tmp * sig.factor + sig.offset;
+    ts = ts_;
+    seen = sec;
+    return true;
+  }
+
+  // extract all signals in one pass, written so the compiler can vectorize it
+  const size_t num_sigs = plan_shift.size();
+  const uint64_t *big_endian = plan_big_endian.data();
+  const uint64_t *shift = plan_shift.data();
+  const uint64_t *mask = plan_mask.data();
+  const uint64_t *sign_bit = plan_sign_bit.data();
+  const double *factor = plan_factor.data();
+  const double *offset = plan_offset.data();
+  double *out = vals.data();
+
+  for (size_t i = 0; i < num_sigs; i++) {
+    uint64_t dat = dat_le ^ ((dat_le ^ dat_be) & big_endian[i]);
+    int64_t tmp = ((dat >> shift[i]) & mask[i]) ^ sign_bit[i];
+    out[i] = (tmp - (int64_t)sign_bit[i]) * factor[i] + offset[i];
   }
+
   ts = ts_;
   seen = sec;
 
@@ -114,6 +165,7 @@ CANParser::CANParser(int abus, const std::string& dbc_name,
   assert(dbc);
   init_crc_lookup_tables();
 
+  std::map<uint32_t, MessageState> states;
   for (const auto& op : options) {
     MessageState state = {
       .address = op.address,
@@ -165,7 +217,45 @@ CANParser::CANParser(int abus, const std::string& dbc_name,
 
     }
 
-    message_states[state.address] = state;
+    state.build_plan();
+    // every message reports its default values on the first query
+    state.updated = true;
+    states[state.address] = state;
+  }
+
+  std_address_index.assign(CAN_STD_ADDRESS_COUNT, -1);
+  for (const auto& kv : states) {
+    if (kv.first < CAN_STD_ADDRESS_COUNT) {
+      std_address_index[kv.first] = message_states.size();
+    }
+    updated_states.push_back(message_states.size());
+    state_addresses.push_back(kv.first);
+    message_states.push_back(kv.second);
+  }
+}
+
+void CANParser::UpdateCan(uint64_t sec, const cereal::CanData::Reader& cmsg) {
+  int idx = find_state(cmsg.getAddress());
+  if (idx < 0) {
+    // DEBUG("skip %d: not specified\n", cmsg.getAddress());
+    return;
+  }
+
+  const size_t len = cmsg.getDat().size();
+  if (len > CANFD_MAX_DLEN) return; //shouldnt ever happen
+
+  // zero padded up to the last word read for this message
+  MessageState &state = message_states[idx];
+  const size_t padded_len = std::max<size_t>(8, state.size);
+  uint8_t dat[CANFD_MAX_DLEN];
+  memcpy(dat, cmsg.getDat().begin(), len);
+  if (len < padded_len) {
+    memset(dat + len, 0, padded_len - len);
+  }
+
+  if (state.parse(sec, cmsg.getBusTime(), dat) && !state.updated) {
+    state.updated = true;
+    updated_states.push_back(idx);
   }
 }
 
@@ -181,24 +271,13 @@ void CANParser::UpdateCans(uint64_t sec, const capnp::List<cereal::CanData>::Rea
         // DEBUG("skip %d: wrong bus\n", cmsg.getAddress());
         continue;
       }
-      auto state_it = message_states.find(cmsg.getAddress());
-      if (state_it == message_states.end()) {
-        // DEBUG("skip %d: not specified\n", cmsg.getAddress());
-        continue;
-      }
-
-      if (cmsg.getDat().size() > 8) continue; //shouldnt ever happen
-      uint8_t dat[8] = {0};
-      memcpy(dat, cmsg.getDat().begin(), cmsg.getDat().size());
-
-      state_it->second.parse(sec, cmsg.getBusTime(), dat);
+      UpdateCan(sec, cmsg);
     }
 }
 
 void CANParser::UpdateValid(uint64_t sec) {
   can_valid = true;
-  for (const auto& kv : message_states) {
-    const auto& state = kv.second;
+  for (const auto& state : message_states) {
     if (state.check_threshold > 0 && (sec - state.seen) > state.check_threshold) {
       if (state.seen > 0) {
         DEBUG("0x%X TIMEOUT\n", state.address);
@@ -229,8 +308,7 @@ void CANParser::update_string(std::string data, bool sendcan) {
 std::vector<SignalValue> CANParser::query_latest() {
   std::vector<SignalValue> ret;
 
-  for (const auto& kv : message_states) {
-    const auto& state = kv.second;
+  for (const auto& state : message_states) {
     if (last_sec != 0 && state.seen != last_sec) continue;
 
     for (int i=0; i<state.parse_sigs.size(); i++) {
@@ -246,3 +324,81 @@ std::vector<SignalValue> CANParser::query_latest() {
 
   return ret;
 }
+
+void CANParser::query_updated(std::vector<SignalValue> &vals) {
+  vals.clear();
+
+  for (size_t idx : updated_states) {
+    auto& state = message_states[idx];
+    state.updated = false;
+
+    for (int i=0; i<state.parse_sigs.size(); i++) {
+      vals.push_back((SignalValue){
+        .address = state.address,
+        .ts = state.ts,
+        .name = state.parse_sigs[i].name,
+        .value = state.vals[i],
+      });
+    }
+  }
+  updated_states.clear();
+}
+
+
+CANParserGroup::CANParserGroup(const std::vector<CANParser*> &aparsers)
+  : parsers(aparsers) {
+
+  for (auto p : parsers) {
+    assert(p->bus >= 0 && p->bus < 256);
+    if (p->bus >= bus_parsers.size()) {
+      bus_parsers.resize(p->bus + 1);
+    }
+    bus_parsers[p->bus].push_back(p);
+  }
+}
+
+void CANParserGroup::UpdateCans(uint64_t sec, const capnp::List<cereal::CanData>::Reader& cans) {
+  int msg_count = cans.size();
+
+  for (int i = 0; i < msg_count; i++) {
+    auto cmsg = cans[i];
+    uint8_t src = cmsg.getSrc();
+    if (src >= bus_parsers.size()) continue;
+
+    for (auto p : bus_parsers[src]) {
+      p->UpdateCan(sec, cmsg);
+    }
+  }
+}
+
+void CANParserGroup::UpdateValid(uint64_t sec) {
+  for (auto p : parsers) {
+    p->last_sec = sec;
+    p->UpdateValid(sec);
+  }
+}
+
+void CANParserGroup::update_string(std::string data, bool sendcan) {
+  // decoded once for all parsers, see CANParser::update_string
+  auto amsg = kj::heapArray<capnp::word>((data.length() / sizeof(capnp::word)) + 1);
+  memcpy(amsg.begin(), data.data(), data.length());
+
+  capnp::FlatArrayMessageReader cmsg(amsg);
+  cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
+
+  last_sec = event.getLogMonoTime();
+
+  auto cans = sendcan? event.getSendcan() : event.getCan();
+  UpdateCans(last_sec, cans);
+
+  UpdateValid(last_sec);
+}
+
+bool CANParserGroup::bus_valid(int bus) const {
+  if (bus < 0 || bus >= bus_parsers.size() || bus_parsers[bus].empty()) return false;
+
+  for (auto p : bus_parsers[bus]) {
+    if (!p->can_valid) return false;
+  }
+  return true;
+}
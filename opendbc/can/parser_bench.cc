@@ -0,0 +1,106 @@
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+#define FRAMES_PER_EVENT 100
+#define NUM_EVENTS 1000
+
+static inline uint64_t nanos_monotonic() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+// Only messages the packer can produce valid frames for, so the benchmark
+// times signal extraction and not the checksum failure path
+static bool packable(const Msg &msg) {
+  for (int i = 0; i < msg.num_sigs; i++) {
+    const Signal &sig = msg.sigs[i];
+    if (sig.type == SignalType::DEFAULT) continue;
+    if (strcmp(sig.name, "CHECKSUM") != 0 && strcmp(sig.name, "COUNTER") != 0) return false;
+    if (sig.type == SignalType::PEDAL_CHECKSUM || sig.type == SignalType::PEDAL_COUNTER) return false;
+  }
+  return msg.size <= 8;
+}
+
+static int counter_size(const Msg &msg) {
+  for (int i = 0; i < msg.num_sigs; i++) {
+    if (strcmp(msg.sigs[i].name, "COUNTER") == 0) return msg.sigs[i].b2;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    printf("usage: %s <dbc name> [iterations]\n", argv[0]);
+    return 1;
+  }
+  const std::string dbc_name = argv[1];
+  const int iterations = argc > 2 ? atoi(argv[2]) : 10;
+
+  const DBC *dbc = dbc_lookup(dbc_name);
+  assert(dbc);
+
+  std::vector<const Msg*> msgs;
+  std::vector<MessageParseOptions> options;
+  std::vector<SignalParseOptions> sigoptions;
+  for (int i = 0; i < dbc->num_msgs; i++) {
+    const Msg &msg = dbc->msgs[i];
+    if (!packable(msg)) continue;
+    msgs.push_back(&msg);
+    options.push_back({msg.address, 0});
+    for (int j = 0; j < msg.num_sigs; j++) {
+      sigoptions.push_back({msg.address, msg.sigs[j].name, 0.});
+    }
+  }
+  assert(msgs.size() > 0);
+
+  CANPacker packer(dbc_name);
+  CANParser parser(0, dbc_name, options, sigoptions);
+
+  // Round robin over the messages with valid checksums and counters, built once up front
+  std::vector<capnp::MallocMessageBuilder> events(NUM_EVENTS);
+  std::vector<int> counters(msgs.size(), 0);
+  size_t frame = 0;
+  for (auto &msg_builder : events) {
+    auto event = msg_builder.initRoot<cereal::Event>();
+    auto cans = event.initCan(FRAMES_PER_EVENT);
+    for (int i = 0; i < FRAMES_PER_EVENT; i++, frame++) {
+      size_t m = frame % msgs.size();
+      const Msg &msg = *msgs[m];
+
+      int cnt_size = counter_size(msg);
+      int counter = cnt_size > 0 ? counters[m]++ % (1 << cnt_size) : -1;
+      uint64_t val = packer.pack(msg.address, {}, counter);
+
+      uint8_t dat[8];
+      for (int j = 0; j < 8; j++) dat[j] = val >> (56 - 8*j);
+
+      cans[i].setAddress(msg.address);
+      cans[i].setBusTime(0);
+      cans[i].setDat(kj::arrayPtr(dat, msg.size));
+      cans[i].setSrc(0);
+    }
+  }
+
+  uint64_t sec = 0;
+  uint64_t start = nanos_monotonic();
+  for (int it = 0; it < iterations; it++) {
+    for (auto &msg_builder : events) {
+      parser.UpdateCans(sec++, msg_builder.getRoot<cereal::Event>().asReader().getCan());
+    }
+  }
+  uint64_t elapsed = nanos_monotonic() - start;
+
+  uint64_t num_frames = (uint64_t)iterations * NUM_EVENTS * FRAMES_PER_EVENT;
+  printf("%s: %zu messages, %zu signals\n", dbc_name.c_str(), msgs.size(), sigoptions.size());
+  printf("%lu frames in %.1f ms, %.1f ns/frame, %.2f M frames/s\n",
+         num_frames, elapsed / 1e6, (double)elapsed / num_frames, num_frames * 1e3 / elapsed);
+  return 0;
+}
@@ -4,11 +4,12 @@
 from libcpp.string cimport string
 from libcpp.vector cimport vector
 from libcpp.unordered_set cimport unordered_set
-from libc.stdint cimport uint32_t, uint64_t, uint16_t
+from libc.stdint cimport uint32_t, uint64_t, uint16_t, uintptr_t
 from libcpp.map cimport map
 from libcpp cimport bool
 
 from common cimport CANParser as cpp_CANParser
+from common cimport CANParserGroup as cpp_CANParserGroup
 from common cimport SignalParseOptions, MessageParseOptions, dbc_lookup, SignalValue, DBC
 
 import os
@@ -23,8 +24,8 @@ cdef class CANParser:
     cpp_CANParser *can
     const DBC *dbc
     map[string, uint32_t] msg_name_to_address
-    map[uint32_t, string] address_to_msg_name
     vector[SignalValue] can_values
+    dict sig_names
     bool test_mode_enabled
 
   cdef readonly:
@@ -43,6 +44,7 @@ cdef class CANParser:
     self.dbc = dbc_lookup(dbc_name)
     self.vl = {}
     self.ts = {}
+    self.sig_names = {}
 
     self.can_invalid_cnt = CAN_INVALID_CNT
 
@@ -53,11 +55,11 @@ cdef class CANParser:
       name = msg.name.decode('utf8')
 
       self.msg_name_to_address[name] = msg.address
-      self.address_to_msg_name[msg.address] = name
+      # two ways to lookup: address or msg name, sharing the same dict
       self.vl[msg.address] = {}
-      self.vl[name] = {}
+      self.vl[name] = self.vl[msg.address]
       self.ts[msg.address] = {}
-      self.ts[name] = {}
+      self.ts[name] = self.ts[msg.address]
 
     # Convert message names into addresses
     for i in range(len(signals)):
@@ -96,10 +98,10 @@ cdef class CANParser:
     self.update_vl()
 
   cdef unordered_set[uint32_t] update_vl(self):
-    cdef string sig_name
     cdef unordered_set[uint32_t] updated_val
 
-    can_values = self.can.query_latest()
+    # only messages parsed since the last call, into a buffer reused across calls
+    self.can.query_updated(self.can_values)
     valid = self.can.can_valid
 
     # Update invalid flag
@@ -109,17 +111,16 @@ cdef class CANParser:
     self.can_valid = self.can_invalid_cnt < CAN_INVALID_CNT
 
 
-    for cv in can_values:
-      # Cast char * directly to unicde
-      name = <unicode>self.address_to_msg_name[cv.address].c_str()
-      cv_name = <unicode>cv.name
+    for cv in self.can_values:
+      # signal names point into the static DBC tables, convert each one only once
+      cv_name = self.sig_names.get(<uintptr_t>cv.name)
+      if cv_name is None:
+        cv_name = <unicode>cv.name
+        self.sig_names[<uintptr_t>cv.name] = cv_name
 
       self.vl[cv.address][cv_name] = cv.value
       self.ts[cv.address][cv_name] = cv.ts
 
-      self.vl[name][cv_name] = cv.value
-      self.ts[name][cv_name] = cv.ts
-
       updated_val.insert(cv.address)
 
     return updated_val
@@ -137,6 +138,48 @@ cdef class CANParser:
 
     return updated_vals
 
+cdef class CANParserGroup:
+  """Updates several CANParsers, one per bus or DBC, decoding each can event once"""
+  cdef:
+    cpp_CANParserGroup *group
+    list parsers
+
+  def __init__(self, parsers):
+    self.parsers = [p for p in parsers if p is not None]
+
+    cdef vector[cpp_CANParser*] parsers_v
+    cdef CANParser p
+    for p in self.parsers:
+      parsers_v.push_back(p.can)
+
+    self.group = new cpp_CANParserGroup(parsers_v)
+
+  def __dealloc__(self):
+    # the parsers themselves belong to the CANParser objects in self.parsers
+    del self.group
+
+  def update_string(self, dat, sendcan=False):
+    cdef CANParser p
+    self.group.update_string(dat, sendcan)
+
+    updated_vals = []
+    for p in self.parsers:
+      updated_vals.append(p.update_vl())
+    return updated_vals
+
+  def update_strings(self, strings, sendcan=False):
+    updated_vals = [set() for _ in self.parsers]
+
+    for s in strings:
+      for updated, updated_val in zip(updated_vals, self.update_string(s, sendcan)):
+        updated.update(updated_val)
+
+    return updated_vals
+
+  def bus_valid(self, bus):
+    return self.group.bus_valid(bus)
+
+
 cdef class CANDefine():
   cdef:
     const DBC *dbc
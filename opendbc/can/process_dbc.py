@@ -70,9 +70,18 @@ def process(in_fn, out_fn):
     little_endian = None
 
   # sanity checks on expected COUNTER and CHECKSUM rules, as packer and parser auto-compute those signals
-  for address, msg_name, _, sigs in msgs:
+  for address, msg_name, msg_size, sigs in msgs:
     dbc_msg_name = dbc_name + " " + msg_name
+    if msg_size > 64:
+      sys.exit("%s: message is longer than 64 bytes" % dbc_msg_name)
     for sig in sigs:
+      # signals are read from a single 8 byte word, see byte_offset in dbc_template.cc
+      b1 = sig.start_bit if sig.is_little_endian else (sig.start_bit//8)*8 + (-sig.start_bit-1) % 8
+      byte_offset = min(b1 // 8, max(msg_size - 8, 0))
+      if msg_size > 8 and b1 - 8*byte_offset + sig.size > 64:
+        sys.exit("%s: %s spans more than 8 bytes" % (dbc_msg_name, sig.name))
+      if msg_size > 8 and checksum_type is not None and sig.name == "CHECKSUM":
+        sys.exit("%s: CHECKSUM is not supported on CAN FD messages" % dbc_msg_name)
       if checksum_type is not None:
         # checksum rules
         if sig.name == "CHECKSUM":
@@ -31,6 +31,10 @@ void can_init_all(void);
 bool can_tx_check_min_slots_free(uint32_t min);
 void can_send(CAN_FIFOMailBox_TypeDef *to_push, uint8_t bus_number, bool skip_tx_hook);
 bool can_pop(can_ring *q, CAN_FIFOMailBox_TypeDef *elem);
+uint32_t can_time_field(uint32_t rdtr);
+
+// set by the host, see can_time_field
+extern bool can_timestamps;
 
 // Ignition detected from CAN meessages
 bool ignition_can = false;
@@ -43,6 +47,7 @@ uint32_t ignition_can_cnt = 0U;
 #define ALL_CAN_LIVE 0
 
 int can_live = 0, pending_can_live = 0, can_loopback = 0, can_silent = ALL_CAN_SILENT;
+bool can_timestamps = false;
 
 // ********************* instantiate queues *********************
 
@@ -287,6 +292,13 @@ void can_sce(CAN_TypeDef *CAN) {
 
 // ***************************** CAN *****************************
 
+// time field of the RDTR. The CAN bit time stamp by default, if the host turned on
+// can_timestamps the low 16 bits of the microsecond timer, so it can line frames up
+// with its own clock
+uint32_t can_time_field(uint32_t rdtr) {
+  return can_timestamps ? ((TIM2->CNT & 0xFFFFU) << 16) : (rdtr & 0xFFFF0000U);
+}
+
 void process_can(uint8_t can_number) {
   if (can_number != 0xffU) {
 
@@ -305,7 +317,7 @@ void process_can(uint8_t can_number) {
         if ((CAN->TSR & CAN_TSR_TXOK0) == CAN_TSR_TXOK0) {
           CAN_FIFOMailBox_TypeDef to_push;
           to_push.RIR = CAN->sTxMailBox[0].TIR;
-          to_push.RDTR = (CAN->sTxMailBox[0].TDTR & 0xFFFF000FU) | ((CAN_BUS_RET_FLAG | bus_number) << 4);
+          to_push.RDTR = can_time_field(CAN->sTxMailBox[0].TDTR) | (CAN->sTxMailBox[0].TDTR & 0xFU) | ((CAN_BUS_RET_FLAG | bus_number) << 4);
           to_push.RDLR = CAN->sTxMailBox[0].TDLR;
           to_push.RDHR = CAN->sTxMailBox[0].TDHR;
           can_send_errs += can_push(&can_rx_q, &to_push) ? 0U : 1U;
@@ -393,7 +405,7 @@ void can_rx(uint8_t can_number) {
     to_push.RDHR = CAN->sFIFOMailBox[0].RDHR;
 
     // modify RDTR for our API
-    to_push.RDTR = (to_push.RDTR & 0xFFFF000F) | (bus_number << 4);
+    to_push.RDTR = can_time_field(to_push.RDTR) | (to_push.RDTR & 0xFU) | (bus_number << 4);
 
     // forwarding (panda only)
     int bus_fwd_num = (can_forwarding[bus_number] != -1) ? can_forwarding[bus_number] : safety_fwd_hook(bus_number, &to_push);
@@ -606,6 +606,10 @@ int usb_cb_control_msg(USB_Setup_TypeDef *setup, uint8_t *resp, bool hardwired)
         }
       }
       break;
+    // **** 0xf5: set CAN timestamp mode, microsecond timer instead of CAN bit time in the frame time field
+    case 0xf5:
+      can_timestamps = (setup->b.wValue.w > 0U);
+      break;
     default:
       puts("NO HANDLER ");
       puth(setup->b.bRequest);
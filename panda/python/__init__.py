@@ -457,6 +457,10 @@ class Panda(object):
     # set can loopback mode for all buses
     self._handle.controlWrite(Panda.REQUEST_OUT, 0xe5, int(enable), 0, b'')
 
+  def set_can_timestamps(self, enable):
+    # microsecond timer instead of CAN bit time in the frame time field
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xf5, int(enable), 0, b'')
+
   def set_can_enable(self, bus_num, enable):
     # sets the can transciever enable pin
     self._handle.controlWrite(Panda.REQUEST_OUT, 0xf4, int(bus_num), int(enable), b'')
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstring>
+#include <new>
+#include <type_traits>
+
+#include <capnp/serialize.h>
+#include <kj/io.h>
+
+#include "cereal/gen/cpp/log.capnp.h"
+
+// a full RECV_SIZE read of classic frames builds ~1050 words
+#define CAN_ARENA_WORDS 2048
+
+// Scratch space for the boardd hot loops, reused from one message to the next so
+// steady state building and parsing doesn't touch the heap
+
+// Builds events into a preallocated first segment. MallocMessageBuilder zeroes the part
+// of a caller owned first segment it used when destroyed, so starting a new message is
+// destroy + placement new over the same words. A message outgrowing the segment still
+// works, its extra segments are heap allocated for that message only.
+class MessageArena {
+public:
+  MessageArena(size_t words) : segment(kj::heapArray<capnp::word>(words)), output(kj::heapArray<capnp::word>(words)) {
+    memset(segment.begin(), 0, segment.asBytes().size());
+  }
+  ~MessageArena() {
+    if (builder) builder->~MallocMessageBuilder();
+  }
+
+  cereal::Event::Builder init_event() {
+    if (builder) builder->~MallocMessageBuilder();
+    builder = new (&builder_storage) capnp::MallocMessageBuilder(segment);
+    return builder->initRoot<cereal::Event>();
+  }
+
+  // flat serialization of the current message, valid until the next serialize()
+  kj::ArrayPtr<capnp::byte> serialize() {
+    size_t size = capnp::computeSerializedSizeInWords(*builder);
+    if (output.size() < size) {
+      output = kj::heapArray<capnp::word>(size);
+    }
+    kj::ArrayOutputStream stream(output.asBytes());
+    capnp::writeMessage(stream, *builder);
+    return stream.getArray();
+  }
+
+private:
+  kj::Array<capnp::word> segment, output;
+  capnp::MallocMessageBuilder *builder = nullptr;
+  std::aligned_storage<sizeof(capnp::MallocMessageBuilder), alignof(capnp::MallocMessageBuilder)>::type builder_storage;
+};
+
+// Copies received messages into a reused word aligned buffer and reads them in place
+// there, like SubMaster does, instead of a kj::heapArray copy per message
+class EventReader {
+public:
+  EventReader(size_t words) : buf(kj::heapArray<capnp::word>(words)) {}
+  ~EventReader() {
+    if (reader) reader->~FlatArrayMessageReader();
+  }
+
+  void copy(const char *data, size_t size) {
+    buf_words = (size / sizeof(capnp::word)) + 1;
+    if (buf.size() < buf_words) {
+      buf = kj::heapArray<capnp::word>(buf_words);
+    }
+    memcpy(buf.begin(), data, size);
+  }
+
+  cereal::Event::Reader event() {
+    if (reader) reader->~FlatArrayMessageReader();
+    reader = new (&reader_storage) capnp::FlatArrayMessageReader(kj::ArrayPtr<capnp::word>(buf.begin(), buf_words));
+    return reader->getRoot<cereal::Event>();
+  }
+
+private:
+  kj::Array<capnp::word> buf;
+  size_t buf_words = 0;
+  capnp::FlatArrayMessageReader *reader = nullptr;
+  std::aligned_storage<sizeof(capnp::FlatArrayMessageReader), alignof(capnp::FlatArrayMessageReader)>::type reader_storage;
+};
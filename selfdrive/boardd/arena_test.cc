@@ -0,0 +1,109 @@
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "common/timing.h"
+
+#include "panda.h"
+#include "arena.h"
+
+// Runs the boardd can and sendcan message paths in a loop and counts heap allocations.
+// Once the first round has sized the scratch buffers, steady state must not allocate.
+
+#define NUM_ITERATIONS 10000
+#define NUM_SENDCAN 32
+
+// every operator new ends up in malloc, capnp segments come from calloc (glibc only)
+static size_t allocations = 0;
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t n, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+extern "C" void *malloc(size_t size) { allocations++; return __libc_malloc(size); }
+extern "C" void *calloc(size_t n, size_t size) { allocations++; return __libc_calloc(n, size); }
+extern "C" void *realloc(void *ptr, size_t size) { allocations++; return __libc_realloc(ptr, size); }
+
+static kj::Array<capnp::word> build_sendcan(int count) {
+  capnp::MallocMessageBuilder msg;
+  auto event = msg.initRoot<cereal::Event>();
+  event.setLogMonoTime(nanos_since_boot());
+  auto cans = event.initSendcan(count);
+  for (int i = 0; i < count; i++) {
+    uint8_t dat[8] = {(uint8_t)i, 1, 2, 3, 4, 5, 6, 7};
+    cans[i].setAddress(0x100 + i);
+    cans[i].setBusTime(0);
+    cans[i].setDat(kj::arrayPtr(dat, sizeof(dat)));
+    cans[i].setSrc(i % 3);
+  }
+  return capnp::messageToFlatArray(msg);
+}
+
+int main(int argc, char **argv) {
+  // a full RECV_SIZE bulk read worth of classic frames
+  auto full_read = build_sendcan(RECV_SIZE / CAN_RECORD_SIZE);
+  capnp::FlatArrayMessageReader full_read_msg(full_read);
+  std::vector<uint32_t> records;
+  int records_len = Panda::can_pack(full_read_msg.getRoot<cereal::Event>().getSendcan(), records);
+  assert(records_len == RECV_SIZE);
+
+  auto sendcan = build_sendcan(NUM_SENDCAN);
+  auto sendcan_bytes = sendcan.asChars();
+
+  MessageArena arena(CAN_ARENA_WORDS);
+  EventReader reader(CAN_ARENA_WORDS);
+  std::vector<uint32_t> send_buf;
+
+  size_t recv_allocations = 0, send_allocations = 0;
+  uint64_t recv_time = 0, send_time = 0;
+  for (int i = 0; i <= NUM_ITERATIONS; i++) {
+    // the first round sizes the buffers and isn't counted
+    if (i == 1) {
+      recv_allocations = send_allocations = 0;
+      recv_time = send_time = 0;
+    }
+
+    // can_recv: records -> can event -> flat bytes for PubMaster
+    size_t start_allocations = allocations;
+    uint64_t start = nanos_since_boot();
+    cereal::Event::Builder event = arena.init_event();
+    event.setLogMonoTime(start);
+    int num_msg = Panda::can_unpack(records.data(), records_len, event);
+    auto bytes = arena.serialize();
+    recv_time += nanos_since_boot() - start;
+    recv_allocations += allocations - start_allocations;
+    assert(num_msg == RECV_SIZE / CAN_RECORD_SIZE && bytes.size() > 0);
+
+    // can_send_thread: sendcan bytes -> event -> USB records
+    start_allocations = allocations;
+    start = nanos_since_boot();
+    reader.copy(sendcan_bytes.begin(), sendcan_bytes.size());
+    int send_len = Panda::can_pack(reader.event().getSendcan(), send_buf);
+    send_time += nanos_since_boot() - start;
+    send_allocations += allocations - start_allocations;
+    assert(send_len == NUM_SENDCAN * CAN_RECORD_SIZE);
+  }
+
+  // the per message builder, flat array copy and heapArray copy these replace
+  size_t start_allocations = allocations;
+  {
+    capnp::MallocMessageBuilder msg;
+    cereal::Event::Builder event = msg.initRoot<cereal::Event>();
+    Panda::can_unpack(records.data(), records_len, event);
+    auto words = capnp::messageToFlatArray(msg);
+
+    auto amsg = kj::heapArray<capnp::word>((sendcan_bytes.size() / sizeof(capnp::word)) + 1);
+    memcpy(amsg.begin(), sendcan_bytes.begin(), sendcan_bytes.size());
+    capnp::FlatArrayMessageReader cmsg(amsg);
+    Panda::can_pack(cmsg.getRoot<cereal::Event>().getSendcan(), send_buf);
+  }
+  size_t old_allocations = allocations - start_allocations;
+
+  printf("can:     %zu allocations in %d iterations, %.2f us/iteration\n", recv_allocations, NUM_ITERATIONS, recv_time / 1e3 / NUM_ITERATIONS);
+  printf("sendcan: %zu allocations in %d iterations, %.2f us/iteration\n", send_allocations, NUM_ITERATIONS, send_time / 1e3 / NUM_ITERATIONS);
+  printf("per message allocations before: %zu\n", old_allocations);
+
+  assert(recv_allocations == 0);
+  assert(send_allocations == 0);
+  return 0;
+}
@@ -28,6 +28,7 @@
 #include "messaging.hpp"
 
 #include "panda.h"
+#include "arena.h"
 
 
 #define MAX_IR_POWER 0.5f
@@ -50,6 +51,8 @@ std::atomic<bool> safety_setter_thread_running(false);
 volatile sig_atomic_t do_exit = 0;
 bool spoofing_started = false;
 bool fake_send = false;
+bool async_can = false;
+bool can_timestamps = false;
 bool connected_once = false;
 
 struct tm get_time(){
@@ -79,6 +82,7 @@ void safety_setter_thread() {
       return;
     };
 
+    uint32_t generation = params_generation();
     std::vector<char> value_vin = read_db_bytes("CarVin");
     if (value_vin.size() > 0) {
       // sanity check VIN format
@@ -87,7 +91,8 @@ void safety_setter_thread() {
       LOGW("got CarVin %s", str_vin.c_str());
       break;
     }
-    usleep(100*1000);
+    // woken by the next params write, still checking do_exit every 100 ms
+    params_wait(generation, 100);
   }
 
   // VIN query done, stop listening to OBDII
@@ -101,9 +106,10 @@ void safety_setter_thread() {
       return;
     };
 
+    uint32_t generation = params_generation();
     params = read_db_bytes("CarParams");
     if (params.size() > 0) break;
-    usleep(100*1000);
+    params_wait(generation, 100);
   }
   LOGW("got %d bytes CarParams", params.size());
 
@@ -139,6 +145,10 @@ bool usb_connect() {
     panda->set_loopback(true);
   }
 
+  // the panda keeps the CAN bit time in the frame time field unless asked for its timer,
+  // also clears the mode if a previous boardd turned it on
+  panda->set_can_timestamps(can_timestamps);
+
   const char *fw_sig_buf = panda->get_firmware_version();
   if (fw_sig_buf){
     write_db_value("PandaFirmware", fw_sig_buf, 128);
@@ -198,17 +208,17 @@ void usb_retry_connect() {
   LOGW("connected to board");
 }
 
-void can_recv(PubMaster &pm) {
+void can_recv(PubMaster &pm, MessageArena &arena, CanClock *clock) {
   uint64_t start_time = nanos_since_boot();
 
   // create message
-  capnp::MallocMessageBuilder msg;
-  cereal::Event::Builder event = msg.initRoot<cereal::Event>();
+  cereal::Event::Builder event = arena.init_event();
   event.setLogMonoTime(start_time);
 
-  int recv = panda->can_receive(event);
+  int recv = panda->can_receive(event, clock);
   if (recv){
-    pm.send("can", msg);
+    auto bytes = arena.serialize();
+    pm.send("can", bytes.begin(), bytes.size());
   }
 }
 
@@ -220,9 +230,11 @@ void can_send_thread() {
   assert(subscriber != NULL);
   subscriber->setTimeout(100);
 
+  EventReader reader(CAN_ARENA_WORDS);
+
   // run as fast as messages come in
   while (!do_exit && panda->connected) {
-    Message * msg = subscriber->receive();
+    Message * msg = subscriber->borrow();
 
     if (!msg){
       if (errno == EINTR) {
@@ -231,38 +243,71 @@ void can_send_thread() {
       continue;
     }
 
-    auto amsg = kj::heapArray<capnp::word>((msg->getSize() / sizeof(capnp::word)) + 1);
-    memcpy(amsg.begin(), msg->getData(), msg->getSize());
+    // copy out of the transport, drop it if the publisher overwrote it meanwhile
+    reader.copy(msg->getData(), msg->getSize());
+    if (!subscriber->release(msg)) continue;
 
-    capnp::FlatArrayMessageReader cmsg(amsg);
-    cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
+    cereal::Event::Reader event = reader.event();
 
     //Dont send if older than 1 second
     if (nanos_since_boot() - event.getLogMonoTime() < 1e9) {
       if (!fake_send){
-        panda->can_send(event.getSendcan());
+        if (panda->can_async) {
+          panda->can_send_async(event.getSendcan());
+        } else {
+          panda->can_send(event.getSendcan());
+        }
       }
     }
-
-    delete msg;
   }
 
   delete subscriber;
   delete context;
 }
 
+// publish every bulk-IN completion as it arrives, instead of polling at 100hz
+bool can_recv_async(PubMaster &pm, MessageArena &arena, CanClock *clock) {
+  bool started = panda->can_async_start([&pm, &arena, clock](const uint32_t *data, int len) {
+    cereal::Event::Builder event = arena.init_event();
+    event.setLogMonoTime(nanos_since_boot());
+
+    Panda::can_unpack(data, len, event, clock);
+    auto bytes = arena.serialize();
+    pm.send("can", bytes.begin(), bytes.size());
+  });
+  if (!started) {
+    LOGE("async CAN failed to start, polling instead");
+    return false;
+  }
+
+  while (!do_exit && panda->connected) {
+    panda->can_async_poll(1);
+  }
+  panda->can_async_stop();
+  return true;
+}
+
 void can_recv_thread() {
   LOGD("start recv thread");
 
   // can = 8006
   PubMaster pm({"can"});
+  MessageArena arena(CAN_ARENA_WORDS);
+
+  // per frame receive times from the panda's microsecond stamps
+  CanClock clock;
+  CanClock *can_clock = can_timestamps ? &clock : nullptr;
+
+  if (async_can && can_recv_async(pm, arena, can_clock)) {
+    return;
+  }
 
   // run at 100hz
   const uint64_t dt = 10000000ULL;
   uint64_t next_frame_time = nanos_since_boot() + dt;
 
   while (!do_exit && panda->connected) {
-    can_recv(pm);
+    can_recv(pm, arena, can_clock);
 
     uint64_t cur_time = nanos_since_boot();
     int64_t remaining = next_frame_time - cur_time;
@@ -635,6 +680,14 @@ int main() {
     fake_send = true;
   }
 
+  if (getenv("BOARDD_ASYNC_CAN")) {
+    async_can = true;
+  }
+
+  if (getenv("BOARDD_CAN_TIMESTAMPS")) {
+    can_timestamps = true;
+  }
+
   while (!do_exit){
     std::vector<std::thread> threads;
     threads.push_back(std::thread(can_health_thread));
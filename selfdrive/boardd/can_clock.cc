@@ -0,0 +1,116 @@
+#include <cmath>
+#include <algorithm>
+
+#include "can_clock.h"
+
+// the panda and host crystals are within ~100ppm, a fit past 500ppm is noise
+#define CAN_CLOCK_MAX_DRIFT 0.5 // ns per us
+
+void CanClock::reset() {
+  synced = false;
+  num_windows = 0;
+  next_window = 0;
+}
+
+double CanClock::offset_at(int64_t panda_us) const {
+  return offset + drift * (panda_us - fit_us);
+}
+
+void CanClock::add_sample(int64_t panda_us, double offset_ns) {
+  if (panda_us - current_start_us >= CAN_CLOCK_WINDOW_US) {
+    windows[next_window] = current;
+    next_window = (next_window + 1) % CAN_CLOCK_WINDOWS;
+    num_windows = std::min(num_windows + 1, CAN_CLOCK_WINDOWS);
+    current = {panda_us, offset_ns};
+    current_start_us = panda_us;
+  } else if (offset_ns < current.offset_ns) {
+    current = {panda_us, offset_ns};
+  } else {
+    // the window minimums didn't move, neither does the fit
+    return;
+  }
+
+  // Fit the line that stays under every window minimum and is closest to them overall,
+  // the transport delay only ever adds to arrival times. That line runs through two
+  // of the points, which are few enough to try every pair.
+  Window points[CAN_CLOCK_WINDOWS + 1];
+  std::copy(windows, windows + num_windows, points);
+  points[num_windows] = current;
+  int num_points = num_windows + 1;
+
+  fit_us = current.panda_us;
+  double sum_x = 0., sum_y = 0.;
+  for (int i = 0; i < num_points; i++) {
+    sum_x += points[i].panda_us - fit_us;
+    sum_y += points[i].offset_ns;
+  }
+
+  drift = 0.;
+  offset = current.offset_ns;
+  for (int i = 0; i < num_points; i++) {
+    offset = std::min(offset, points[i].offset_ns);
+  }
+  double best = sum_y - num_points * offset;
+
+  for (int i = 0; i < num_points; i++) {
+    for (int j = i + 1; j < num_points; j++) {
+      double dx = points[j].panda_us - points[i].panda_us;
+      if (dx == 0.) continue;
+      double b = (points[j].offset_ns - points[i].offset_ns) / dx;
+      if (std::abs(b) > CAN_CLOCK_MAX_DRIFT) continue;
+      double a = points[i].offset_ns - b * (points[i].panda_us - fit_us);
+
+      bool under = true;
+      for (int k = 0; k < num_points && under; k++) {
+        under = points[k].offset_ns - (a + b * (points[k].panda_us - fit_us)) > -1e-3;
+      }
+      double residual = sum_y - num_points * a - b * sum_x;
+      if (under && residual < best) {
+        best = residual;
+        offset = a;
+        drift = b;
+      }
+    }
+  }
+}
+
+void CanClock::sync(uint64_t recv_ns_, uint16_t newest_bus_time) {
+  recv_ns = recv_ns_;
+
+  if (synced) {
+    // estimated panda time at arrival, the newest stamp can't be much later than that
+    int64_t arrival_us = newest_us;
+    for (int i = 0; i < 2; i++) {
+      arrival_us = ((int64_t)recv_ns - base_ns - llround(offset_at(arrival_us))) / 1000;
+    }
+    int64_t ref_us = arrival_us + CAN_CLOCK_SLACK_US;
+    int64_t unwrapped_us = ref_us - ((ref_us - newest_bus_time) & (CAN_CLOCK_WRAP_US - 1));
+
+    // the panda timer never runs backwards, the estimate must be off
+    if (unwrapped_us < newest_us) {
+      reset();
+    } else {
+      newest_us = unwrapped_us;
+    }
+  }
+
+  if (!synced) {
+    synced = true;
+    newest_us = newest_bus_time;
+    base_ns = (int64_t)recv_ns - 1000 * newest_us;
+    current = {newest_us, 0.};
+    current_start_us = newest_us;
+  }
+
+  add_sample(newest_us, (double)((int64_t)recv_ns - 1000 * newest_us - base_ns));
+}
+
+uint64_t CanClock::frame_time(uint16_t bus_time) {
+  // every frame in a batch was stamped at or before the newest one
+  int64_t panda_us = newest_us - ((newest_us - bus_time) & (CAN_CLOCK_WRAP_US - 1));
+  int64_t ns = 1000 * panda_us + base_ns + llround(offset_at(panda_us));
+
+  uint64_t t = std::max(last_ns, std::min((uint64_t)std::max(ns, (int64_t)0), recv_ns));
+  last_ns = t;
+  return t;
+}
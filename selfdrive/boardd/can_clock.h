@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+
+// with can timestamps turned on in the panda, busTime carries the low 16 bits of its microsecond timer
+#define CAN_CLOCK_WRAP_US (1 << 16)
+// each offset sample is the smallest transport delay seen over this much panda time
+#define CAN_CLOCK_WINDOW_US 1000000
+// the drift fit runs over this many samples
+#define CAN_CLOCK_WINDOWS 32
+// how far a batch may end past the panda time estimated for its arrival
+#define CAN_CLOCK_SLACK_US 5000
+
+// Maps panda microsecond stamps onto the boot clock. Stamps are unwrapped against the
+// panda time estimated for each batch's arrival, and the mapping is fit to the lower
+// envelope of arrival time minus stamp, which tracks the clock offset and drift under
+// the variable USB and polling delay. Times come out monotonic and never after arrival.
+class CanClock {
+public:
+  // start of a batch that finished arriving at recv_ns, whose newest frame has newest_bus_time
+  void sync(uint64_t recv_ns, uint16_t newest_bus_time);
+  // boot clock time of a frame in the current batch
+  uint64_t frame_time(uint16_t bus_time);
+
+private:
+  struct Window {
+    int64_t panda_us;
+    double offset_ns;
+  };
+
+  void reset();
+  void add_sample(int64_t panda_us, double offset_ns);
+  double offset_at(int64_t panda_us) const;
+
+  bool synced = false;
+  uint64_t recv_ns = 0;
+  uint64_t last_ns = 0;
+  int64_t newest_us = 0;
+
+  // host ns = 1000 * panda us + base_ns + offset + drift * (panda us - fit_us)
+  int64_t base_ns = 0;
+  double offset = 0., drift = 0.;
+  int64_t fit_us = 0;
+
+  Window windows[CAN_CLOCK_WINDOWS];
+  int num_windows = 0, next_window = 0;
+  Window current;
+  int64_t current_start_us = 0;
+};
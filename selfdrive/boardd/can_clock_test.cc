@@ -0,0 +1,117 @@
+#include <cmath>
+#include <cstdio>
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "can_clock.h"
+
+// Replays simulated panda captures through CanClock: a drifting panda timer, periodic
+// traffic with idle gaps past the 16 bit wrap, and batches that reach the host after
+// a polling delay plus a random USB delay. The reconstructed times must be monotonic,
+// never after their batch arrived, close to when the panda really got each frame, and
+// keep the period of periodic messages.
+
+#define DURATION_NS 120000000000ULL
+#define WARMUP_NS 10000000000ULL
+#define MAX_ERROR_NS 500000   // absolute error against the true receive time
+#define MAX_JITTER_NS 250000  // error of the interval between two frames of one message
+
+struct Scenario {
+  const char *name;
+  double drift_ppm;
+  uint64_t poll_interval_ns;
+  uint64_t poll_jitter_ns;
+};
+
+struct Frame {
+  uint64_t true_ns;
+  uint16_t bus_time;
+  int msg;
+};
+
+static const Scenario scenarios[] = {
+  {"100hz poll", 80., 10000000, 500000},
+  {"100hz poll, slow panda", -120., 10000000, 500000},
+  {"100hz poll, late wakeups", 30., 10000000, 8000000},
+  {"async", 50., 1000000, 200000},
+};
+
+// message periods in ns, the last one only talks in bursts
+static const uint64_t periods[] = {10000000, 20000000, 30000000, 1000000};
+
+static bool silent(uint64_t t) {
+  // idle buses, longer than the 65ms the 16 bit stamps wrap after
+  return (t % 20000000000ULL) > 19500000000ULL || (t > 40000000000ULL && t < 45000000000ULL);
+}
+
+static bool run(const Scenario &s) {
+  std::mt19937_64 rng(1);
+  const uint64_t boot_ns = 1000000000000ULL;
+  const uint64_t panda_start_us = rng() % 1000000000;
+  auto panda_us = [&](uint64_t t) {
+    return (uint64_t)(panda_start_us + (t - boot_ns) * (1. + s.drift_ppm * 1e-6) / 1000.);
+  };
+
+  std::vector<Frame> frames;
+  for (int msg = 0; msg < 4; msg++) {
+    for (uint64_t t = boot_ns + rng() % periods[msg]; t < boot_ns + DURATION_NS; t += periods[msg]) {
+      bool burst = msg == 3 && (t / 100000000) % 10 != 0;
+      if (silent(t - boot_ns) || burst) continue;
+      frames.push_back({t, (uint16_t)panda_us(t), msg});
+    }
+  }
+  std::sort(frames.begin(), frames.end(), [](const Frame &a, const Frame &b) { return a.true_ns < b.true_ns; });
+
+  std::exponential_distribution<double> usb_delay(1. / 300000.);
+  CanClock clock;
+  std::vector<uint64_t> last_true(4, 0), last_est(4, 0), last_recv(4, 0);
+  uint64_t last_est_ns = 0, max_error = 0, max_jitter = 0, max_batch_jitter = 0;
+
+  size_t next = 0;
+  for (uint64_t poll = boot_ns; next < frames.size(); poll += s.poll_interval_ns + rng() % s.poll_jitter_ns) {
+    size_t end = next;
+    while (end < frames.size() && frames[end].true_ns <= poll) end++;
+    if (end == next) continue;
+
+    uint64_t recv_ns = poll + 150000 + std::min(usb_delay(rng), 5000000.);
+    clock.sync(recv_ns, frames[end - 1].bus_time);
+
+    for (; next < end; next++) {
+      const Frame &f = frames[next];
+      uint64_t est = clock.frame_time(f.bus_time);
+      if (est < last_est_ns || est > recv_ns) {
+        printf("%s: frame at %lu got %lu, previous %lu, batch arrived %lu\n", s.name, f.true_ns, est, last_est_ns, recv_ns);
+        return false;
+      }
+      last_est_ns = est;
+
+      if (f.true_ns - boot_ns > WARMUP_NS) {
+        max_error = std::max(max_error, (uint64_t)std::llabs((int64_t)(est - f.true_ns)));
+        if (last_true[f.msg] != 0 && f.true_ns - last_true[f.msg] == periods[f.msg]) {
+          int64_t interval_error = (int64_t)(est - last_est[f.msg]) - (int64_t)(f.true_ns - last_true[f.msg]);
+          max_jitter = std::max(max_jitter, (uint64_t)std::llabs(interval_error));
+
+          // for comparison, every frame stamped with the arrival of its batch
+          int64_t batch_error = (int64_t)(recv_ns - last_recv[f.msg]) - (int64_t)(f.true_ns - last_true[f.msg]);
+          max_batch_jitter = std::max(max_batch_jitter, (uint64_t)std::llabs(batch_error));
+        }
+      }
+      last_true[f.msg] = f.true_ns;
+      last_est[f.msg] = est;
+      last_recv[f.msg] = recv_ns;
+    }
+  }
+
+  printf("%-26s %7zu frames  max error: %6.1f us  max interval error: %5.1f us (%7.1f us by batch)\n",
+         s.name, frames.size(), max_error / 1e3, max_jitter / 1e3, max_batch_jitter / 1e3);
+  return max_error < MAX_ERROR_NS && max_jitter < MAX_JITTER_NS;
+}
+
+int main(int argc, char **argv) {
+  bool ok = true;
+  for (const Scenario &s : scenarios) {
+    ok &= run(s);
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,150 @@
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <atomic>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "common/timing.h"
+
+#include "panda.h"
+
+// Drives the boardd CAN paths against a panda in CAN loopback mode, so no car is
+// needed: every frame sent on bus 0 comes straight back on RX carrying its send time.
+// Compares the 100hz synchronous poll against the async transfer pipeline.
+
+#define BENCH_ADDRESS 0x7e0 // a diagnostic address, so the ELM327 safety model lets it out
+#define NUM_LATENCY_FRAMES 500
+#define LATENCY_INTERVAL_US 2000
+#define NUM_BURST_FRAMES 20000
+#define BURST_BATCH 32
+
+struct BenchStats {
+  std::mutex lock;
+  std::vector<uint64_t> latencies;
+  std::atomic<uint64_t> frames{0};
+  std::atomic<uint64_t> last_recv{0};
+};
+
+static void handle_records(const uint32_t *data, int len, BenchStats &stats) {
+  uint64_t recv_time = nanos_since_boot();
+
+  capnp::MallocMessageBuilder msg;
+  cereal::Event::Builder event = msg.initRoot<cereal::Event>();
+  Panda::can_unpack(data, len, event);
+
+  for (auto can : event.asReader().getCan()) {
+    // the looped back RX copy, not the TX acknowledgement on src | 0x80
+    if (can.getAddress() != BENCH_ADDRESS || can.getSrc() != 0) continue;
+
+    uint64_t send_time;
+    memcpy(&send_time, can.getDat().begin(), sizeof(send_time));
+    if (send_time != 0) {
+      std::lock_guard<std::mutex> lk(stats.lock);
+      stats.latencies.push_back(recv_time - send_time);
+    }
+    stats.frames++;
+    stats.last_recv = recv_time;
+  }
+}
+
+static void send_frames(Panda &panda, bool async, int count, bool stamp) {
+  capnp::MallocMessageBuilder msg;
+  auto cans = msg.initRoot<cereal::Event>().initSendcan(count);
+
+  uint64_t send_time = stamp ? nanos_since_boot() : 0;
+  for (int i = 0; i < count; i++) {
+    cans[i].setAddress(BENCH_ADDRESS);
+    cans[i].setBusTime(0);
+    cans[i].setDat(kj::arrayPtr((uint8_t*)&send_time, sizeof(send_time)));
+    cans[i].setSrc(0);
+  }
+
+  auto sendcan = msg.getRoot<cereal::Event>().asReader().getSendcan();
+  if (async) {
+    while (!panda.can_send_async(sendcan)) usleep(100);
+  } else {
+    panda.can_send(sendcan);
+  }
+}
+
+// waits until nothing has come back for 100ms
+static void wait_idle(BenchStats &stats) {
+  while (nanos_since_boot() - stats.last_recv < 100000000ULL) usleep(10000);
+}
+
+static void run(Panda &panda, bool async) {
+  BenchStats stats;
+  std::atomic<bool> done{false};
+  std::thread recv_thread;
+
+  if (async) {
+    bool started = panda.can_async_start([&](const uint32_t *data, int len) { handle_records(data, len, stats); });
+    assert(started);
+    recv_thread = std::thread([&] {
+      while (!done) panda.can_async_poll(1);
+    });
+  } else {
+    // same loop as can_recv_thread: one bulk read every 10ms
+    recv_thread = std::thread([&] {
+      uint32_t data[RECV_SIZE/4];
+      while (!done) {
+        int recv = panda.usb_bulk_read(0x81, (unsigned char*)data, RECV_SIZE);
+        if (recv > 0) handle_records(data, recv, stats);
+        usleep(10000);
+      }
+    });
+  }
+
+  // latency: single frames spaced out so neither path is ever backed up
+  for (int i = 0; i < NUM_LATENCY_FRAMES; i++) {
+    if (i % 100 == 0) panda.send_heartbeat();
+    send_frames(panda, async, 1, true);
+    usleep(LATENCY_INTERVAL_US);
+  }
+  stats.last_recv = nanos_since_boot();
+  wait_idle(stats);
+  uint64_t latency_frames = stats.frames;
+
+  // throughput: batches back to back, until the bus is the limit
+  panda.send_heartbeat();
+  uint64_t start = nanos_since_boot();
+  for (int i = 0; i < NUM_BURST_FRAMES; i += BURST_BATCH) {
+    send_frames(panda, async, BURST_BATCH, false);
+  }
+  stats.last_recv = nanos_since_boot();
+  wait_idle(stats);
+  uint64_t burst_frames = stats.frames - latency_frames;
+  double burst_time = (stats.last_recv - start) / 1e9;
+
+  done = true;
+  recv_thread.join();
+  if (async) panda.can_async_stop();
+
+  std::sort(stats.latencies.begin(), stats.latencies.end());
+  assert(stats.latencies.size() > 0);
+  double p50 = stats.latencies[stats.latencies.size() * 50 / 100] / 1000.0;
+  double p99 = stats.latencies[stats.latencies.size() * 99 / 100] / 1000.0;
+  double max = stats.latencies.back() / 1000.0;
+  printf("%-5s  received: %4zu/%d  p50: %8.1f us  p99: %8.1f us  max: %8.1f us  burst: %6lu/%d frames, %8.0f frames/s\n",
+         async ? "async" : "sync", stats.latencies.size(), NUM_LATENCY_FRAMES, p50, p99, max,
+         burst_frames, NUM_BURST_FRAMES, burst_frames / burst_time);
+}
+
+int main(int argc, char **argv) {
+  Panda panda;
+  panda.set_safety_model(cereal::CarParams::SafetyModel::ELM327);
+  panda.set_loopback(true);
+
+  run(panda, false);
+  run(panda, true);
+
+  panda.set_loopback(false);
+  panda.set_safety_model(cereal::CarParams::SafetyModel::NO_OUTPUT);
+  return 0;
+}
@@ -1,8 +1,11 @@
 #include <stdexcept>
 #include <cassert>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 
 #include "common/swaglog.h"
+#include "common/timing.h"
 
 #include "panda.h"
 
@@ -50,6 +53,10 @@ fail:
 }
 
 Panda::~Panda(){
+  if (can_async || !can_rx_transfers.empty()) {
+    can_async_stop();
+  }
+
   pthread_mutex_lock(&usb_lock);
   cleanup();
   connected = false;
@@ -225,6 +232,10 @@ void Panda::set_loopback(bool loopback){
   usb_write(0xe5, loopback, 0);
 }
 
+void Panda::set_can_timestamps(bool can_timestamps){
+  usb_write(0xf5, can_timestamps, 0);
+}
+
 const char* Panda::get_firmware_version(){
   const char* fw_sig_buf = new char[128]();
 
@@ -265,30 +276,100 @@ void Panda::send_heartbeat(){
   usb_write(0xf3, 1, 0);
 }
 
-void Panda::can_send(capnp::List<cereal::CanData>::Reader can_data_list){
+// the 4 bit length field is the CAN FD DLC, 0-8 are classic lengths
+static const uint8_t dlc_to_len[] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64};
+
+static uint8_t len_to_dlc(size_t len) {
+  uint8_t dlc = 0;
+  while (dlc_to_len[dlc] < len) dlc++;
+  return dlc;
+}
+
+static inline size_t can_records(size_t len) {
+  return 1 + (len > 8 ? (len - 8 + CAN_RECORD_SIZE - 1) / CAN_RECORD_SIZE : 0);
+}
+
+int Panda::can_pack(capnp::List<cereal::CanData>::Reader can_data_list, std::vector<uint32_t> &send){
   int msg_count = can_data_list.size();
 
-  uint32_t *send = new uint32_t[msg_count*0x10]();
+  size_t num_records = 0;
+  for (int i = 0; i < msg_count; i++) {
+    auto can_data = can_data_list[i].getDat();
+    assert(can_data.size() <= CANFD_MAX_DLEN);
+    num_records += can_records(dlc_to_len[len_to_dlc(can_data.size())]);
+  }
+
+  // reuses the caller's buffer, it only grows
+  send.assign(num_records*4, 0);
 
+  uint32_t *record = send.data();
   for (int i = 0; i < msg_count; i++) {
     auto cmsg = can_data_list[i];
     if (cmsg.getAddress() >= 0x800) { // extended
-      send[i*4] = (cmsg.getAddress() << 3) | 5;
+      record[0] = (cmsg.getAddress() << 3) | 5;
     } else { // normal
-      send[i*4] = (cmsg.getAddress() << 21) | 1;
+      record[0] = (cmsg.getAddress() << 21) | 1;
     }
     auto can_data = cmsg.getDat();
-    assert(can_data.size() <= 8);
-    send[i*4+1] = can_data.size() | (cmsg.getSrc() << 4);
-    memcpy(&send[i*4+2], can_data.begin(), can_data.size());
+    uint8_t dlc = len_to_dlc(can_data.size());
+    record[1] = dlc | (cmsg.getSrc() << 4);
+    // payload is zero padded to the CAN FD length, past 8 bytes it runs into the next records
+    memcpy(&record[2], can_data.begin(), can_data.size());
+    record += can_records(dlc_to_len[dlc]) * 4;
+  }
+
+  return num_records*CAN_RECORD_SIZE;
+}
+
+int Panda::can_unpack(const uint32_t *data, int recv, cereal::Event::Builder &event, CanClock *clock){
+  // count the complete frames first, CAN FD frames span several records
+  size_t num_records = recv / CAN_RECORD_SIZE;
+  size_t num_msg = 0;
+  size_t newest = 0;
+  for (size_t r = 0; r < num_records; num_msg++) {
+    size_t n = can_records(dlc_to_len[data[r*4+1] & 0xF]);
+    if (r + n > num_records) break;
+    newest = r;
+    r += n;
   }
 
-  usb_bulk_write(3, (unsigned char*)send, msg_count*0x10, 5);
+  // frames come out of the panda in the order it stamped them
+  if (clock && num_msg > 0) {
+    clock->sync(nanos_since_boot(), data[newest*4+1] >> 16);
+  }
 
-  delete[] send;
+  auto canData = event.initCan(num_msg);
+
+  // populate message
+  const uint32_t *record = data;
+  for (int i = 0; i < num_msg; i++) {
+    if (record[0] & 4) {
+      // extended
+      canData[i].setAddress(record[0] >> 3);
+      //printf("got extended: %x\n", record[0] >> 3);
+    } else {
+      // normal
+      canData[i].setAddress(record[0] >> 21);
+    }
+    canData[i].setBusTime(record[1] >> 16);
+    int len = dlc_to_len[record[1]&0xF];
+    canData[i].setDat(kj::arrayPtr((const uint8_t*)&record[2], len));
+    canData[i].setSrc((record[1] >> 4) & 0xff);
+    if (clock) {
+      canData[i].setMonoTime(clock->frame_time(record[1] >> 16));
+    }
+    record += can_records(len) * 4;
+  }
+
+  return num_msg;
+}
+
+void Panda::can_send(capnp::List<cereal::CanData>::Reader can_data_list){
+  int len = can_pack(can_data_list, can_send_buf);
+  usb_bulk_write(3, (unsigned char*)can_send_buf.data(), len, 5);
 }
 
-int Panda::can_receive(cereal::Event::Builder &event){
+int Panda::can_receive(cereal::Event::Builder &event, CanClock *clock){
   uint32_t data[RECV_SIZE/4];
   int recv = usb_bulk_read(0x81, (unsigned char*)data, RECV_SIZE);
 
@@ -299,24 +380,179 @@ int Panda::can_receive(cereal::Event::Builder &event){
     LOGW("Receive buffer full");
   }
 
-  size_t num_msg = recv / 0x10;
-  auto canData = event.initCan(num_msg);
+  can_unpack(data, recv, event, clock);
+  return recv;
+}
 
-  // populate message
-  for (int i = 0; i < num_msg; i++) {
-    if (data[i*4] & 4) {
-      // extended
-      canData[i].setAddress(data[i*4] >> 3);
-      //printf("got extended: %x\n", data[i*4] >> 3);
-    } else {
-      // normal
-      canData[i].setAddress(data[i*4] >> 21);
+// Completions run inside libusb event handling, which is serialized: either the
+// can_async_poll loop or any other thread blocked in a synchronous libusb call.
+void LIBUSB_CALL Panda::can_rx_complete(libusb_transfer *transfer){
+  Panda *panda = (Panda*)transfer->user_data;
+  bool resubmit = panda->can_async && panda->connected;
+
+  switch (transfer->status) {
+  case LIBUSB_TRANSFER_COMPLETED:
+    if (transfer->actual_length == RECV_SIZE) {
+      LOGW("Receive buffer full");
     }
-    canData[i].setBusTime(data[i*4+1] >> 16);
-    int len = data[i*4+1]&0xF;
-    canData[i].setDat(kj::arrayPtr((uint8_t*)&data[i*4+2], len));
-    canData[i].setSrc((data[i*4+1] >> 4) & 0xff);
+    if (transfer->actual_length > 0) {
+      panda->can_rx_cb((uint32_t*)transfer->buffer, transfer->actual_length);
+    } else if (resubmit) {
+      // the panda answers an empty queue with a zero length packet right away, park the
+      // transfer until the next poll so an idle bus doesn't spin on empty completions
+      std::lock_guard<std::mutex> lk(panda->can_rx_idle_lock);
+      panda->can_rx_idle.push_back(transfer);
+      return;
+    }
+    break;
+  case LIBUSB_TRANSFER_OVERFLOW:
+    LOGE_100("overflow got 0x%x", transfer->actual_length);
+    break;
+  case LIBUSB_TRANSFER_CANCELLED:
+    resubmit = false;
+    break;
+  case LIBUSB_TRANSFER_NO_DEVICE:
+    LOGE("lost connection");
+    panda->connected = false;
+    resubmit = false;
+    break;
+  default:
+    LOGE_100("usb transfer status %d in %s", transfer->status, __func__);
+    break;
   }
 
-  return recv;
+  if (resubmit) {
+    int err = libusb_submit_transfer(transfer);
+    if (err == 0) return;
+    panda->handle_usb_issue(err, __func__);
+  }
+  panda->can_rx_pending--;
+}
+
+void LIBUSB_CALL Panda::can_tx_complete(libusb_transfer *transfer){
+  CanTxTransfer *tx = (CanTxTransfer*)transfer->user_data;
+  Panda *panda = tx->panda;
+
+  if (transfer->status == LIBUSB_TRANSFER_TIMED_OUT) {
+    // same as the sync path: the panda NAKs while its TX queue is full, drop after 5ms
+    LOGW("Transmit buffer full");
+  } else if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+    LOGE("lost connection");
+    panda->connected = false;
+  } else if (transfer->status != LIBUSB_TRANSFER_COMPLETED && transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+    LOGE_100("usb transfer status %d in %s", transfer->status, __func__);
+  }
+
+  {
+    std::lock_guard<std::mutex> lk(panda->can_tx_lock);
+    panda->can_tx_free.push_back(tx);
+  }
+  panda->can_tx_pending--;
+}
+
+bool Panda::can_async_start(can_rx_callback cb, int num_transfers){
+  assert(!can_async && can_rx_pending == 0);
+  can_rx_cb = cb;
+  can_rx_idle.reserve(num_transfers);
+  can_rx_resubmit.reserve(num_transfers);
+
+  for (int i = 0; i < CAN_TX_TRANSFERS; i++) {
+    CanTxTransfer *tx = new CanTxTransfer{.panda = this, .transfer = libusb_alloc_transfer(0)};
+    tx->buf.reserve(RECV_SIZE/4);
+    can_tx_transfers.push_back(tx);
+    can_tx_free.push_back(tx);
+  }
+  can_async = true;
+
+  for (int i = 0; i < num_transfers; i++) {
+    libusb_transfer *transfer = libusb_alloc_transfer(0);
+    unsigned char *buf = (unsigned char*)malloc(RECV_SIZE);
+    libusb_fill_bulk_transfer(transfer, dev_handle, 0x81, buf, RECV_SIZE, can_rx_complete, this, TIMEOUT);
+    can_rx_transfers.push_back(transfer);
+
+    can_rx_pending++;
+    int err = libusb_submit_transfer(transfer);
+    if (err != 0) {
+      can_rx_pending--;
+      handle_usb_issue(err, __func__);
+      can_async_stop();
+      return false;
+    }
+  }
+  return true;
+}
+
+void Panda::can_async_poll(int timeout_ms){
+  struct timeval tv = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+  int err = libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+  if (err != 0) handle_usb_issue(err, __func__);
+
+  // resubmit the transfers that came back empty since the last poll
+  {
+    std::lock_guard<std::mutex> lk(can_rx_idle_lock);
+    can_rx_resubmit.swap(can_rx_idle);
+  }
+  for (auto transfer : can_rx_resubmit) {
+    if (can_async && connected) {
+      err = libusb_submit_transfer(transfer);
+      if (err == 0) continue;
+      handle_usb_issue(err, __func__);
+    }
+    can_rx_pending--;
+  }
+  can_rx_resubmit.clear();
+}
+
+void Panda::can_async_stop(){
+  {
+    std::lock_guard<std::mutex> lk(can_tx_lock);
+    can_async = false;
+  }
+
+  // cancelled transfers complete through the event loop, wait until nothing is in flight
+  for (auto transfer : can_rx_transfers) {
+    libusb_cancel_transfer(transfer);
+  }
+  while (can_rx_pending > 0 || can_tx_pending > 0) {
+    can_async_poll(10);
+  }
+
+  for (auto transfer : can_rx_transfers) {
+    free(transfer->buffer);
+    libusb_free_transfer(transfer);
+  }
+  can_rx_transfers.clear();
+
+  for (auto tx : can_tx_transfers) {
+    libusb_free_transfer(tx->transfer);
+    delete tx;
+  }
+  can_tx_transfers.clear();
+  can_tx_free.clear();
+}
+
+bool Panda::can_send_async(capnp::List<cereal::CanData>::Reader can_data_list){
+  std::lock_guard<std::mutex> lk(can_tx_lock);
+  if (!can_async || !connected) {
+    return false;
+  } else if (can_tx_free.empty()) {
+    LOGW("Transmit buffer full");
+    return false;
+  }
+
+  CanTxTransfer *tx = can_tx_free.back();
+  can_tx_free.pop_back();
+
+  int len = can_pack(can_data_list, tx->buf);
+  libusb_fill_bulk_transfer(tx->transfer, dev_handle, 3, (unsigned char*)tx->buf.data(), len, can_tx_complete, tx, 5);
+
+  can_tx_pending++;
+  int err = libusb_submit_transfer(tx->transfer);
+  if (err != 0) {
+    can_tx_pending--;
+    can_tx_free.push_back(tx);
+    handle_usb_issue(err, __func__);
+    return false;
+  }
+  return true;
 }
@@ -2,6 +2,10 @@
 
 #include <ctime>
 #include <cstdint>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <vector>
 #include <pthread.h>
 
 #include <libusb-1.0/libusb.h>
@@ -9,10 +13,33 @@
 #include "cereal/gen/cpp/car.capnp.h"
 #include "cereal/gen/cpp/log.capnp.h"
 
+#include "can_clock.h"
+
 // double the FIFO size
 #define RECV_SIZE (0x1000)
+
+// USB CAN framing: a 16 byte record per frame, CAN FD payloads longer than
+// 8 bytes continue into the following records
+#define CAN_RECORD_SIZE 0x10
+#define CANFD_MAX_DLEN 64
 #define TIMEOUT 0
 
+// async CAN: bulk-IN transfers kept in flight, and the most bulk-OUT transfers queued at once
+#define CAN_RX_TRANSFERS 4
+#define CAN_TX_TRANSFERS 16
+
+// called with the raw USB records of each completed bulk-IN transfer
+typedef std::function<void(const uint32_t *data, int len)> can_rx_callback;
+
+class Panda;
+
+// bulk-OUT transfer and its record buffer, allocated once and reused
+struct CanTxTransfer {
+  Panda *panda;
+  libusb_transfer *transfer;
+  std::vector<uint32_t> buf;
+};
+
 // copied from panda/board/main.c
 struct __attribute__((packed)) health_t {
   uint32_t uptime;
@@ -42,11 +69,26 @@ class Panda {
   void handle_usb_issue(int err, const char func[]);
   void cleanup();
 
+  // async CAN pipeline, see can_async_start
+  can_rx_callback can_rx_cb;
+  std::vector<libusb_transfer*> can_rx_transfers;
+  std::vector<libusb_transfer*> can_rx_idle, can_rx_resubmit;
+  std::mutex can_rx_idle_lock;
+  std::mutex can_tx_lock;
+  std::vector<CanTxTransfer*> can_tx_transfers;
+  std::vector<CanTxTransfer*> can_tx_free;
+  std::vector<uint32_t> can_send_buf;
+  std::atomic<int> can_rx_pending{0};
+  std::atomic<int> can_tx_pending{0};
+  static void LIBUSB_CALL can_rx_complete(libusb_transfer *transfer);
+  static void LIBUSB_CALL can_tx_complete(libusb_transfer *transfer);
+
  public:
   Panda();
   ~Panda();
 
   bool connected = true;
+  std::atomic<bool> can_async{false};
   cereal::HealthData::HwType hw_type = cereal::HealthData::HwType::UNKNOWN;
   bool is_pigeon = false;
   bool has_rtc = false;
@@ -68,12 +110,24 @@ class Panda {
   void set_ir_pwr(uint16_t ir_pwr);
   health_t get_health();
   void set_loopback(bool loopback);
+  void set_can_timestamps(bool can_timestamps);
   const char* get_firmware_version();
   const char* get_serial();
   void set_power_saving(bool power_saving);
   void set_usb_power_mode(cereal::HealthData::UsbPowerMode power_mode);
   void send_heartbeat();
   void can_send(capnp::List<cereal::CanData>::Reader can_data_list);
-  int can_receive(cereal::Event::Builder &event);
+  int can_receive(cereal::Event::Builder &event, CanClock *clock=nullptr);
+
+  // Async CAN: bulk transfers stay submitted and complete through libusb events
+  // instead of a polled synchronous read, and don't take usb_lock
+  bool can_async_start(can_rx_callback cb, int num_transfers=CAN_RX_TRANSFERS);
+  void can_async_poll(int timeout_ms);
+  void can_async_stop();
+  bool can_send_async(capnp::List<cereal::CanData>::Reader can_data_list);
+
+  static int can_pack(capnp::List<cereal::CanData>::Reader can_data_list, std::vector<uint32_t> &send);
+  // with a clock, frames also get their panda receive time on the boot clock in monoTime
+  static int can_unpack(const uint32_t *data, int len, cereal::Event::Builder &event, CanClock *clock=nullptr);
 
 };
@@ -11,6 +11,7 @@
 #include "common/util.h"
 #include "common/timing.h"
 #include "common/swaglog.h"
+#include "common/efd.h"
 #include "buffering.h"
 
 extern "C" {
@@ -43,6 +44,90 @@ void camera_init(CameraState *s, int camera_id, unsigned int fps) {
   s->fps = fps;
 
   tbuffer_init2(&s->camera_tb, FRAME_BUF_COUNT, "frame", camera_release_buffer, s);
+
+  pthread_mutex_init(&s->source_lock, NULL);
+  s->source_efd = efd_init();
+  assert(s->source_efd >= 0);
+  s->source_next_seq = 0;
+  camera_source_reset(s);
+}
+
+// like tbuffer_select, also skipping what the frame source is filling. source_lock held.
+int select_free_buffer(CameraState *s) {
+  TBuffer *tb = &s->camera_tb;
+  pthread_mutex_lock(&tb->lock);
+  int i;
+  for (i=0; i<tb->num_bufs; i++) {
+    if (!tb->reading[i] && i != tb->pending_idx && !s->source_out[i]) {
+      break;
+    }
+  }
+  assert(i < tb->num_bufs);
+  pthread_mutex_unlock(&tb->lock);
+  return i;
+}
+
+// level triggered, eventfd reads block when there is nothing to clear. source_lock held.
+void source_update_efd(CameraState *s) {
+  bool ready = s->source_num_out < FRAME_SOURCE_BUFS;
+  if (ready && !s->source_efd_set) {
+    efd_write(s->source_efd);
+  } else if (!ready && s->source_efd_set) {
+    efd_clear(s->source_efd);
+  }
+  s->source_efd_set = ready;
+}
+
+// source_lock held
+void source_take_back(CameraState *s, int idx) {
+  s->source_out[idx] = false;
+  s->source_num_out--;
+}
+
+// the frame message names a buffer the source filled, it's ours again
+bool source_return(CameraState *s, int idx) {
+  int lost = 0;
+  pthread_mutex_lock(&s->source_lock);
+  bool ok = idx >= 0 && idx < FRAME_BUF_COUNT && s->source_out[idx];
+  if (ok) {
+    // the source fills buffers in the order it got them, one handed out before this
+    // one that is still out had its frame message dropped by the SubMaster
+    for (int i=0; i<FRAME_BUF_COUNT; i++) {
+      if (s->source_out[i] && s->source_seq[i] < s->source_seq[idx]) {
+        source_take_back(s, i);
+        lost++;
+      }
+    }
+    source_take_back(s, idx);
+    source_update_efd(s);
+  }
+  pthread_mutex_unlock(&s->source_lock);
+
+  if (lost > 0) {
+    LOGW("took back %d frame source buffers older than buffer %d", lost, idx);
+  }
+  return ok;
+}
+
+// nothing newer comes back if the last frames were lost, don't wait for them forever
+void source_expire(CameraState *s) {
+  int expired = 0;
+  uint64_t now = nanos_since_boot();
+  pthread_mutex_lock(&s->source_lock);
+  for (int i=0; i<FRAME_BUF_COUNT; i++) {
+    if (s->source_out[i] && now - s->source_out_ns[i] > FRAME_SOURCE_TIMEOUT_MS * 1000000ULL) {
+      source_take_back(s, i);
+      expired++;
+    }
+  }
+  if (expired > 0) {
+    source_update_efd(s);
+  }
+  pthread_mutex_unlock(&s->source_lock);
+
+  if (expired > 0) {
+    LOGW("took back %d frame source buffers after %d ms", expired, FRAME_SOURCE_TIMEOUT_MS);
+  }
 }
 
 void run_frame_stream(DualCameraState *s) {
@@ -52,11 +137,29 @@ void run_frame_stream(DualCameraState *s) {
   auto *tb = &rear_camera->camera_tb;
 
   while (!do_exit) {
-    if (sm.update(1000) == 0) continue;
+    source_expire(rear_camera);
+    if (sm.update(100) == 0) continue;
 
     auto frame = sm["frame"].getFrame();
 
-    const int buf_idx = tbuffer_select(tb);
+    int buf_idx = frame.getImageBufferIdx();
+    if (buf_idx >= 0) {
+      // written in place by the frame source, nothing to copy
+      if (!source_return(rear_camera, buf_idx)) {
+        LOGW("frame %d in buffer %d that wasn't handed out", frame.getFrameId(), buf_idx);
+        continue;
+      }
+      visionbuf_sync(&rear_camera->camera_bufs[buf_idx], VISIONBUF_SYNC_TO_DEVICE);
+    } else {
+      pthread_mutex_lock(&rear_camera->source_lock);
+      buf_idx = select_free_buffer(rear_camera);
+      pthread_mutex_unlock(&rear_camera->source_lock);
+
+      cl_command_queue q = rear_camera->camera_bufs[buf_idx].copy_q;
+      cl_mem yuv_cl = rear_camera->camera_bufs[buf_idx].buf_cl;
+      clEnqueueWriteBuffer(q, yuv_cl, CL_TRUE, 0, frame.getImage().size(), frame.getImage().begin(), 0, NULL, NULL);
+    }
+
     rear_camera->camera_bufs_metadata[buf_idx] = {
       .frame_id = frame.getFrameId(),
       .timestamp_eof = frame.getTimestampEof(),
@@ -64,11 +167,6 @@ void run_frame_stream(DualCameraState *s) {
       .integ_lines = static_cast<unsigned>(frame.getIntegLines()),
       .global_gain = static_cast<unsigned>(frame.getGlobalGain()),
     };
-
-    cl_command_queue q = rear_camera->camera_bufs[buf_idx].copy_q;
-    cl_mem yuv_cl = rear_camera->camera_bufs[buf_idx].buf_cl;
-
-    clEnqueueWriteBuffer(q, yuv_cl, CL_TRUE, 0, frame.getImage().size(), frame.getImage().begin(), 0, NULL, NULL);
     tbuffer_dispatch(tb, buf_idx);
   }
 }
@@ -111,6 +209,29 @@ void cameras_init(DualCameraState *s) {
 
 void camera_autoexposure(CameraState *s, float grey_frac) {}
 
+int camera_source_acquire(CameraState *s) {
+  pthread_mutex_lock(&s->source_lock);
+  int idx = -1;
+  if (s->source_num_out < FRAME_SOURCE_BUFS) {
+    idx = select_free_buffer(s);
+    s->source_out[idx] = true;
+    s->source_num_out++;
+    s->source_seq[idx] = s->source_next_seq++;
+    s->source_out_ns[idx] = nanos_since_boot();
+    source_update_efd(s);
+  }
+  pthread_mutex_unlock(&s->source_lock);
+  return idx;
+}
+
+void camera_source_reset(CameraState *s) {
+  pthread_mutex_lock(&s->source_lock);
+  memset(s->source_out, 0, sizeof(s->source_out));
+  s->source_num_out = 0;
+  source_update_efd(s);
+  pthread_mutex_unlock(&s->source_lock);
+}
+
 void cameras_open(DualCameraState *s, VisionBuf *camera_bufs_rear,
                   VisionBuf *camera_bufs_focus, VisionBuf *camera_bufs_stats,
                   VisionBuf *camera_bufs_front) {
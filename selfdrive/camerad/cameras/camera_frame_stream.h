@@ -2,6 +2,7 @@
 #define CAMERA_FRAME_STREAM_H
 
 #include <stdbool.h>
+#include <pthread.h>
 
 #define CL_USE_DEPRECATED_OPENCL_1_2_APIS
 #ifdef __APPLE__
@@ -17,6 +18,12 @@
 #include "camera_common.h"
 
 #define FRAME_BUF_COUNT 16
+// a client can write frames straight into the rear camera buffers, see VISION_STREAM_FRAME_SOURCE
+#define CAMERA_FRAME_SOURCE
+// buffers handed to the frame source at once
+#define FRAME_SOURCE_BUFS 2
+// a buffer whose frame message hasn't come back after this long is taken back
+#define FRAME_SOURCE_TIMEOUT_MS 1000
 
 #ifdef __cplusplus
 extern "C" {
@@ -37,6 +44,19 @@ typedef struct CameraState {
   float cur_gain_frac;
 
   mat3 transform;
+
+  // buffers the frame source is filling, back once their frame message arrives
+  pthread_mutex_t source_lock;
+  bool source_out[FRAME_BUF_COUNT];
+  int source_num_out;
+  // when and in which order buffers were handed out, to take back the ones whose
+  // frame message was lost
+  uint64_t source_seq[FRAME_BUF_COUNT];
+  uint64_t source_out_ns[FRAME_BUF_COUNT];
+  uint64_t source_next_seq;
+  // readable while another buffer can be handed out
+  int source_efd;
+  bool source_efd_set;
 } CameraState;
 
 
@@ -52,6 +72,11 @@ void cameras_open(DualCameraState *s, VisionBuf *camera_bufs_rear, VisionBuf *ca
 void cameras_run(DualCameraState *s);
 void cameras_close(DualCameraState *s);
 void camera_autoexposure(CameraState *s, float grey_frac);
+
+// A rear camera buffer for the frame source to fill, -1 if it has all it can get.
+int camera_source_acquire(CameraState *s);
+// takes back every buffer handed out, when the source goes away
+void camera_source_reset(CameraState *s);
 #ifdef __cplusplus
 }  // extern "C"
 #endif
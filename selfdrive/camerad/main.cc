@@ -17,6 +17,7 @@
 
 #include "common/ipc.h"
 #include "common/visionipc.h"
+#include "common/visionring.h"
 #include "common/visionbuf.h"
 #include "common/visionimg.h"
 
@@ -34,7 +35,10 @@
 
 #define UI_BUF_COUNT 4
 #define YUV_COUNT 40
-#define MAX_CLIENTS 5
+// frames a yuv consumer reading every frame can fall behind
+#define YUV_RING_DEPTH 16
+// ring consumers keep their client around for the hangup
+#define MAX_CLIENTS 10
 
 extern "C" {
 volatile sig_atomic_t do_exit = 0;
@@ -59,6 +63,8 @@ struct VisionClientStreamState {
   bool tb;
   TBuffer* tbuffer;
   PoolQueue* queue;
+  VisionRing* ring;
+  int ring_consumer;
 };
 
 struct VisionState {
@@ -95,6 +101,7 @@ struct VisionState {
 
   // TODO: refactor for both cameras?
   Pool yuv_pool;
+  VisionRing yuv_ring;
   VisionBuf yuv_ion[YUV_COUNT];
   cl_mem yuv_cl[YUV_COUNT];
   YUVBuf yuv_bufs[YUV_COUNT];
@@ -105,6 +112,7 @@ struct VisionState {
 
   // for front camera recording
   Pool yuv_front_pool;
+  VisionRing yuv_front_ring;
   VisionBuf yuv_front_ion[YUV_COUNT];
   cl_mem yuv_front_cl[YUV_COUNT];
   YUVBuf yuv_front_bufs[YUV_COUNT];
@@ -148,6 +156,20 @@ struct VisionState {
   VisionClientState clients[MAX_CLIENTS];
 };
 
+// the ring holds a reference of its own, it gives it back through ring_release
+static void ring_release(void *cookie, int idx) {
+  pool_release((Pool *)cookie, idx);
+}
+
+static void ring_push(VisionRing *ring, Pool *pool, int idx, const FrameMetadata *meta) {
+  VIPCBufExtra extra = {
+    .frame_id = meta->frame_id,
+    .timestamp_eof = meta->timestamp_eof,
+  };
+  pool_acquire(pool, idx);
+  visionring_publish(ring, idx, &extra);
+}
+
 // frontview thread
 void* frontview_thread(void *arg) {
   int err;
@@ -294,6 +316,7 @@ void* frontview_thread(void *arg) {
 
     // no reference required cause we don't use this in visiond
     //pool_acquire(&s->yuv_front_pool, yuv_idx);
+    ring_push(&s->yuv_front_ring, &s->yuv_front_pool, yuv_idx, &frame_data);
     pool_push(&s->yuv_front_pool, yuv_idx);
     //pool_release(&s->yuv_front_pool, yuv_idx);
 
@@ -525,6 +548,7 @@ void* processing_thread(void *arg) {
 
     // keep another reference around till were done processing
     pool_acquire(&s->yuv_pool, yuv_idx);
+    ring_push(&s->yuv_ring, &s->yuv_pool, yuv_idx, &frame_data);
     pool_push(&s->yuv_pool, yuv_idx);
 
     // send frame event
@@ -677,6 +701,22 @@ void* processing_thread(void *arg) {
 }
 
 // visionserver
+
+// a holding slot in the ring for the client, its fd goes out after the buffers'
+static bool ring_subscribe(VisionRing *ring, VisionClientStreamState *stream, VisionPacket *rep) {
+  int consumer = visionring_add_consumer(ring);
+  if (consumer < 0) {
+    LOGW("visionring full, falling back to the socket");
+    return false;
+  }
+  stream->ring = ring;
+  stream->ring_consumer = consumer;
+  rep->d.stream_bufs.ring = true;
+  rep->d.stream_bufs.ring_consumer = consumer;
+  rep->fds[rep->num_fds++] = ring->fd;
+  return true;
+}
+
 void* visionserver_client_thread(void* arg) {
   int err;
   VisionClientState *client = (VisionClientState*)arg;
@@ -705,6 +745,17 @@ void* visionserver_client_thread(void* arg) {
     for (int i=0; i<VISION_STREAM_MAX; i++) {
       if (!streams[i].subscribed) continue;
       polls[num_polls].events = ZMQ_POLLIN;
+      // ring consumers get their frames without us
+      if (streams[i].ring) continue;
+#ifdef CAMERA_FRAME_SOURCE
+      // the camera side limits the buffers a frame source gets
+      if (i == VISION_STREAM_FRAME_SOURCE) {
+        polls[num_polls].fd = s->cameras.rear.source_efd;
+        poll_to_stream[num_polls] = i;
+        num_polls++;
+        continue;
+      }
+#endif
       if (streams[i].bufs_outstanding >= 2) {
         continue;
       }
@@ -778,7 +829,9 @@ void* visionserver_client_thread(void* arg) {
           for (int i=0; i<rep.num_fds; i++) {
             rep.fds[i] = s->yuv_ion[i].fd;
           }
-          if (stream->tb) {
+          if (ring_subscribe(&s->yuv_ring, stream, &rep)) {
+            // frames go through the ring
+          } else if (stream->tb) {
             stream->tbuffer = s->yuv_tb;
           } else {
             stream->queue = pool_get_queue(&s->yuv_pool);
@@ -792,11 +845,25 @@ void* visionserver_client_thread(void* arg) {
           for (int i=0; i<rep.num_fds; i++) {
             rep.fds[i] = s->yuv_front_ion[i].fd;
           }
-          if (stream->tb) {
+          if (ring_subscribe(&s->yuv_front_ring, stream, &rep)) {
+            // frames go through the ring
+          } else if (stream->tb) {
             stream->tbuffer = s->yuv_front_tb;
           } else {
             stream->queue = pool_get_queue(&s->yuv_front_pool);
           }
+#ifdef CAMERA_FRAME_SOURCE
+        } else if (stream_type == VISION_STREAM_FRAME_SOURCE) {
+          stream_bufs->width = s->frame_width;
+          stream_bufs->height = s->frame_height;
+          stream_bufs->stride = s->frame_stride;
+          stream_bufs->buf_len = s->frame_size;
+          rep.num_fds = FRAME_BUF_COUNT;
+          for (int i=0; i<rep.num_fds; i++) {
+            rep.fds[i] = s->camera_bufs[i].fd;
+          }
+          camera_source_reset(&s->cameras.rear);
+#endif
         } else {
           assert(false);
         }
@@ -806,6 +873,10 @@ void* visionserver_client_thread(void* arg) {
         // printf("client release f %d  %d\n", p.d.stream_rel.type, p.d.stream_rel.idx);
         int si = p.d.stream_rel.type;
         assert(si < VISION_STREAM_MAX);
+#ifdef CAMERA_FRAME_SOURCE
+        // a frame source gives its buffers back through frame messages
+        if (si == VISION_STREAM_FRAME_SOURCE) continue;
+#endif
         if (streams[si].tb) {
           tbuffer_release(streams[si].tbuffer, p.d.stream_rel.idx);
         } else {
@@ -825,6 +896,22 @@ void* visionserver_client_thread(void* arg) {
           break;
         }
       }
+#ifdef CAMERA_FRAME_SOURCE
+      if (stream_i == VISION_STREAM_FRAME_SOURCE) {
+        int idx = camera_source_acquire(&s->cameras.rear);
+        if (idx >= 0) {
+          VisionPacket rep = {
+            .type = VIPC_STREAM_ACQUIRE,
+            .d = {.stream_acq = {
+              .type = VISION_STREAM_FRAME_SOURCE,
+              .idx = idx,
+            }},
+          };
+          vipc_send(fd, &rep);
+        }
+        continue;
+      }
+#endif
       if (stream_i < VISION_STREAM_MAX) {
         streams[stream_i].bufs_outstanding++;
         int idx;
@@ -859,6 +946,16 @@ void* visionserver_client_thread(void* arg) {
 
   for (int i=0; i<VISION_STREAM_MAX; i++) {
     if (!streams[i].subscribed) continue;
+    if (streams[i].ring) {
+      visionring_remove_consumer(streams[i].ring, streams[i].ring_consumer);
+      continue;
+    }
+#ifdef CAMERA_FRAME_SOURCE
+    if (i == VISION_STREAM_FRAME_SOURCE) {
+      camera_source_reset(&s->cameras.rear);
+      continue;
+    }
+#endif
     if (streams[i].tb) {
       tbuffer_release_all(streams[i].tbuffer);
     } else {
@@ -1097,6 +1194,9 @@ void init_buffers(VisionState *s) {
   // yuv back for recording and orbd
   pool_init(&s->yuv_pool, YUV_COUNT);
   s->yuv_tb = pool_get_tbuffer(&s->yuv_pool); //only for visionserver...
+  err = visionring_init(&s->yuv_ring, YUV_COUNT, YUV_RING_DEPTH,
+                        ring_release, &s->yuv_pool);
+  assert(err == 0);
 
   s->yuv_width = s->rgb_width;
   s->yuv_height = s->rgb_height;
@@ -1112,6 +1212,9 @@ void init_buffers(VisionState *s) {
   // yuv front for recording
   pool_init(&s->yuv_front_pool, YUV_COUNT);
   s->yuv_front_tb = pool_get_tbuffer(&s->yuv_front_pool);
+  err = visionring_init(&s->yuv_front_ring, YUV_COUNT, YUV_RING_DEPTH,
+                        ring_release, &s->yuv_front_pool);
+  assert(err == 0);
 
   s->yuv_front_width = s->rgb_front_width;
   s->yuv_front_height = s->rgb_front_height;
@@ -1192,6 +1295,8 @@ void free_buffers(VisionState *s) {
     visionbuf_free(&s->yuv_ion[i]);
     visionbuf_free(&s->yuv_front_ion[i]);
   }
+  visionring_destroy(&s->yuv_ring);
+  visionring_destroy(&s->yuv_front_ring);
 
   clReleaseMemObject(s->rgb_conv_roi_cl);
   clReleaseMemObject(s->rgb_conv_result_cl);
@@ -1241,6 +1346,8 @@ void party(VisionState *s) {
   tbuffer_stop(&s->ui_front_tb);
   pool_stop(&s->yuv_pool);
   pool_stop(&s->yuv_front_pool);
+  visionring_stop(&s->yuv_ring);
+  visionring_stop(&s->yuv_front_ring);
 
   zsock_signal(s->terminate_pub, 0);
 
@@ -14,6 +14,7 @@ typedef enum VisionStreamType {
   VISION_STREAM_RGB_FRONT,
   VISION_STREAM_YUV,
   VISION_STREAM_YUV_FRONT,
+  VISION_STREAM_FRAME_SOURCE,
   VISION_STREAM_MAX,
 } VisionStreamType;
 
@@ -35,6 +36,9 @@ typedef struct VisionStreamBufs {
   union {
     VisionUIInfo ui_info;
   } buf_info;
+
+  bool ring;
+  int ring_consumer;
 } VisionStreamBufs;
 
 typedef struct VIPCBuf {
@@ -56,6 +60,10 @@ typedef struct VisionStream {
   int num_bufs;
   VisionStreamBufs bufs_info;
   VIPCBuf *bufs;
+
+  void *ring;
+  bool ring_latest;
+  uint32_t ring_seq;
 } VisionStream;
 
 int visionstream_init(VisionStream *s, VisionStreamType type, bool tbuffer, VisionStreamBufs *out_bufs_info);
@@ -91,3 +99,30 @@ class VisionIPC():
     pbuf = ffi.buffer(buf.addr, buf.len)
     ret = np.frombuffer(pbuf, dtype=np.uint8).reshape((-1, self.buf_info.stride//3, 3))
     return ret[:self.buf_info.height, :self.buf_info.width, [2, 1, 0]]
+
+
+class FrameSource():
+  """Hands out camerad's rear camera buffers to write frames into, for replay and simulation.
+  Fill the buffer from get(), then publish the frame message with imageBufferIdx set to
+  its index and no image."""
+  def __init__(self):
+    self.clib = ffi.dlopen(os.path.join(gf_dir, "libvisionipc.so"))
+
+    self.s = ffi.new("VisionStream*")
+    self.buf_info = ffi.new("VisionStreamBufs*")
+
+    err = self.clib.visionstream_init(self.s, self.clib.VISION_STREAM_FRAME_SOURCE, False, self.buf_info)
+
+    if err != 0:
+      self.clib.visionstream_destroy(self.s)
+      raise VisionIPCError
+
+  def __del__(self):
+    self.clib.visionstream_destroy(self.s)
+
+  def get(self):
+    buf = self.clib.visionstream_get(self.s, ffi.NULL)
+    if buf == ffi.NULL:
+      raise VisionIPCError
+    pbuf = ffi.buffer(buf.addr, buf.len)
+    return self.s.last_idx, np.frombuffer(pbuf, dtype=np.uint8)
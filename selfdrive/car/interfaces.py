@@ -8,6 +8,7 @@ from selfdrive.config import Conversions as CV
 from selfdrive.controls.lib.events import Events
 from selfdrive.controls.lib.vehicle_model import VehicleModel
 from selfdrive.controls.lib.drive_helpers import V_CRUISE_MAX
+from opendbc.can.parser import CANParserGroup
 
 GearShifter = car.CarState.GearShifter
 EventName = car.CarEvent.EventName
@@ -28,6 +29,8 @@ class CarInterfaceBase():
       self.cp = self.CS.get_can_parser(CP)
       self.cp_cam = self.CS.get_cam_can_parser(CP)
       self.cp_body = self.CS.get_body_can_parser(CP)
+      # decodes each can message once for all buses
+      self.can_parsers = CANParserGroup(self.get_can_parsers(CP))
 
     self.CC = None
     if CarController is not None:
@@ -35,6 +38,10 @@ class CarInterfaceBase():
 
     self.dragonconf = None
 
+  # parsers updated together by can_parsers, cars with extra buses add theirs here
+  def get_can_parsers(self, CP):
+    return [self.cp, self.cp_cam, self.cp_body]
+
   @staticmethod
   def calc_accel_override(a_ego, a_target, v_ego, v_target):
     return 1.
@@ -11,10 +11,22 @@
 #include <sys/file.h>
 #include <sys/stat.h>
 
+#include <sys/mman.h>
+#include <sched.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
 #include <map>
+#include <mutex>
 #include <string>
 #include <string.h>
 
+#include "common/timing.h"
 #include "common/util.h"
 #include "common/utilpp.h"
 
@@ -34,6 +46,214 @@ static const char* persistent_params_path = null_coalesce(const_cast<const char*
 static const char* persistent_params_path = default_params_path;
 #endif
 
+// Every params dir gets a table in /dev/shm caching what read_db_value found on disk, so
+// repeated reads skip the lock and the file. The files stay the source of truth: entries
+// are only filled or changed with the params lock held, after the disk is up to date, and
+// readers go to disk for anything missing, too big or too old. Slots are seqlocked.
+// common/params.py can't update single entries, its writes move flush_generation instead.
+// Keep the layout in sync with the cache code there.
+#define PARAMS_CACHE_MAGIC 0x3148434d52415001ULL
+#define PARAMS_CACHE_SLOTS 512
+#define PARAMS_CACHE_SLOT_SIZE 8192
+#define PARAMS_CACHE_KEY_SIZE 64
+// entries are reread after this long, to catch writes that go around the params code
+#define PARAMS_CACHE_MAX_AGE_NS 1000000000ULL
+// only params.cc wakes waiters, so they also look for params.py writes this often
+#define PARAMS_WAIT_POLL_MS 100
+
+enum CacheState {
+  CACHE_EMPTY = 0,
+  CACHE_VALUE,
+  CACHE_ABSENT,
+  // too big for a slot, always read from disk
+  CACHE_UNCACHED,
+};
+
+struct CacheSlot {
+  std::atomic<uint32_t> seq;
+  uint32_t state;
+  uint32_t generation;
+  uint32_t size;
+  uint64_t filled_ns;
+  char key[PARAMS_CACHE_KEY_SIZE];
+  char value[PARAMS_CACHE_SLOT_SIZE - 88];
+};
+static_assert(sizeof(CacheSlot) == PARAMS_CACHE_SLOT_SIZE, "params cache slot size");
+
+struct CacheHeader {
+  std::atomic<uint64_t> magic;
+  uint32_t num_slots;
+  uint32_t slot_size;
+  // futex word, bumped after every write or delete is on disk
+  std::atomic<uint32_t> generation;
+  // entries filled at an earlier generation are stale
+  std::atomic<uint32_t> flush_generation;
+};
+
+#define PARAMS_CACHE_HEADER_SIZE 4096
+#define PARAMS_CACHE_SIZE (PARAMS_CACHE_HEADER_SIZE + PARAMS_CACHE_SLOTS * PARAMS_CACHE_SLOT_SIZE)
+
+static CacheHeader* cache_open(const char* params_path) {
+  const char* env = getenv("PARAMS_CACHE");
+  if (env && strcmp(env, "0") == 0) return NULL;
+
+  std::string shm_path = "/dev/shm/params_cache" + std::string(params_path);
+  for (size_t i = strlen("/dev/shm/"); i < shm_path.size(); i++) {
+    if (shm_path[i] == '/') shm_path[i] = '_';
+  }
+
+  int fd = open(shm_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  if (fd < 0) return NULL;
+  // every process using params shares it, whoever created it
+  fchmod(fd, 0666);
+
+  void* mem = MAP_FAILED;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && (st.st_size >= PARAMS_CACHE_SIZE || ftruncate(fd, PARAMS_CACHE_SIZE) == 0)) {
+    mem = mmap(NULL, PARAMS_CACHE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  return mem != MAP_FAILED ? (CacheHeader*)mem : NULL;
+}
+
+static CacheHeader* cache_get(bool persistent_param) {
+  static CacheHeader* caches[2];
+  static std::once_flag once[2];
+  std::call_once(once[persistent_param], [=] {
+    caches[persistent_param] = cache_open(persistent_param ? persistent_params_path : default_params_path);
+  });
+  return caches[persistent_param];
+}
+
+static inline CacheSlot* cache_slot(CacheHeader* h, uint32_t i) {
+  return (CacheSlot*)((char*)h + PARAMS_CACHE_HEADER_SIZE + (size_t)i * PARAMS_CACHE_SLOT_SIZE);
+}
+
+static uint32_t key_hash(const char* key) {
+  uint32_t h = 2166136261u;
+  for (; *key; key++) {
+    h = (h ^ (uint8_t)*key) * 16777619u;
+  }
+  return h;
+}
+
+enum CacheResult {
+  CACHE_MISS,
+  CACHE_HIT,
+  CACHE_HIT_ABSENT,
+};
+
+// Lock free. On a hit with a value, *value is malloced and NULL terminated like read_file's.
+static CacheResult cache_read(CacheHeader* h, const char* key, char** value, size_t* value_sz) {
+  if (h == NULL || h->magic.load(std::memory_order_acquire) != PARAMS_CACHE_MAGIC) return CACHE_MISS;
+  if (strlen(key) >= PARAMS_CACHE_KEY_SIZE) return CACHE_MISS;
+
+  uint32_t start = key_hash(key);
+  for (uint32_t i = 0; i < PARAMS_CACHE_SLOTS; i++) {
+    CacheSlot* slot = cache_slot(h, (start + i) % PARAMS_CACHE_SLOTS);
+
+    // a writer holding the slot this long is probably stuck, disk it is
+    for (int tries = 0; tries < 100; tries++) {
+      uint32_t seq = slot->seq.load(std::memory_order_acquire);
+      if (seq & 1) {
+        sched_yield();
+        continue;
+      }
+
+      uint32_t state = slot->state;
+      bool match = state != CACHE_EMPTY && strncmp(slot->key, key, PARAMS_CACHE_KEY_SIZE) == 0;
+      uint32_t generation = slot->generation;
+      uint32_t size = std::min(slot->size, (uint32_t)sizeof(slot->value));
+      uint64_t filled_ns = slot->filled_ns;
+      char* buf = NULL;
+      if (match && state == CACHE_VALUE) {
+        buf = (char*)malloc(size + 1);
+        memcpy(buf, slot->value, size);
+        buf[size] = '\0';
+      }
+
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot->seq.load(std::memory_order_relaxed) != seq) {
+        free(buf);
+        continue;
+      }
+
+      // keys are claimed in probe order and never removed, an empty slot ends the search
+      if (state == CACHE_EMPTY) return CACHE_MISS;
+      if (!match) break;
+
+      bool fresh = state != CACHE_UNCACHED
+                   && (int32_t)(generation - h->flush_generation.load(std::memory_order_acquire)) >= 0
+                   && nanos_since_boot() - filled_ns < PARAMS_CACHE_MAX_AGE_NS;
+      if (!fresh) {
+        free(buf);
+        return CACHE_MISS;
+      }
+      if (state == CACHE_ABSENT) return CACHE_HIT_ABSENT;
+      *value = buf;
+      *value_sz = size;
+      return CACHE_HIT;
+    }
+  }
+  return CACHE_MISS;
+}
+
+// Only with the params lock held, which makes this the only writer.
+static void cache_store(CacheHeader* h, const char* key, CacheState state, const char* value, size_t value_size, uint32_t generation) {
+  if (h == NULL || strlen(key) >= PARAMS_CACHE_KEY_SIZE) return;
+
+  if (h->magic.load(std::memory_order_acquire) != PARAMS_CACHE_MAGIC) {
+    // new, or left by another layout
+    memset((void*)h, 0, PARAMS_CACHE_SIZE);
+    h->num_slots = PARAMS_CACHE_SLOTS;
+    h->slot_size = PARAMS_CACHE_SLOT_SIZE;
+    h->generation.store(1);
+    h->flush_generation.store(1);
+    h->magic.store(PARAMS_CACHE_MAGIC, std::memory_order_release);
+    generation = 1;
+  }
+
+  uint32_t start = key_hash(key);
+  CacheSlot* slot = NULL;
+  for (uint32_t i = 0; i < PARAMS_CACHE_SLOTS; i++) {
+    CacheSlot* s = cache_slot(h, (start + i) % PARAMS_CACHE_SLOTS);
+    if (s->state == CACHE_EMPTY || strncmp(s->key, key, PARAMS_CACHE_KEY_SIZE) == 0) {
+      slot = s;
+      break;
+    }
+  }
+  // full, everything not in it goes to disk
+  if (slot == NULL) return;
+
+  if (state == CACHE_VALUE && value_size > sizeof(slot->value)) {
+    state = CACHE_UNCACHED;
+  }
+
+  uint32_t seq = slot->seq.load(std::memory_order_relaxed);
+  slot->seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  strncpy(slot->key, key, PARAMS_CACHE_KEY_SIZE);
+  slot->generation = generation;
+  slot->filled_ns = nanos_since_boot();
+  slot->size = state == CACHE_VALUE ? value_size : 0;
+  if (state == CACHE_VALUE) memcpy(slot->value, value, value_size);
+  slot->state = state;
+
+  slot->seq.store(seq + 2, std::memory_order_release);
+}
+
+// Only with the params lock held, once the change is on disk.
+static void cache_changed(CacheHeader* h, const char* key, CacheState state, const char* value, size_t value_size) {
+  if (h == NULL) return;
+  uint32_t generation = h->generation.load() + 1;
+  cache_store(h, key, state, value, value_size, generation);
+  h->generation.store(generation, std::memory_order_release);
+#ifdef __linux__
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(&h->generation), FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+#endif
+}
+
 } //namespace
 
 
@@ -202,6 +422,8 @@ int write_db_value(const char* key, const char* value, size_t value_size, bool p
     goto cleanup;
   }
 
+  cache_changed(cache_get(persistent_param), key, CACHE_VALUE, value, value_size);
+
 cleanup:
   // Release lock.
   if (lock_fd >= 0) {
@@ -259,6 +481,8 @@ int delete_db_value(const char* key, bool persistent_param) {
     goto cleanup;
   }
 
+  cache_changed(cache_get(persistent_param), key, CACHE_ABSENT, NULL, 0);
+
 cleanup:
   // Release lock.
   if (lock_fd >= 0) {
@@ -272,6 +496,16 @@ int read_db_value(const char* key, char** value, size_t* value_sz, bool persiste
   int result;
   char path[1024];
   const char* params_path = persistent_param ? persistent_params_path : default_params_path;
+  CacheHeader* cache = cache_get(persistent_param);
+
+  switch (cache_read(cache, key, value, value_sz)) {
+    case CACHE_HIT:
+      return 0;
+    case CACHE_HIT_ABSENT:
+      return -22;
+    case CACHE_MISS:
+      break;
+  }
 
   result = snprintf(path, sizeof(path), "%s/.lock", params_path);
   if (result < 0) {
@@ -295,10 +529,12 @@ int read_db_value(const char* key, char** value, size_t* value_sz, bool persiste
   //                 after opening the file, before reading.
   *value = static_cast<char*>(read_file(path, value_sz));
   if (*value == NULL) {
+    cache_store(cache, key, CACHE_ABSENT, NULL, 0, cache ? cache->generation.load() : 0);
     result = -22;
     goto cleanup;
   }
 
+  cache_store(cache, key, CACHE_VALUE, *value, *value_sz, cache ? cache->generation.load() : 0);
   result = 0;
 
 cleanup:
@@ -311,16 +547,46 @@ cleanup:
 
 void read_db_value_blocking(const char* key, char** value, size_t* value_sz, bool persistent_param) {
   while (1) {
+    // taken before the read, so a write in between isn't missed
+    uint32_t generation = params_generation(persistent_param);
     const int result = read_db_value(key, value, value_sz, persistent_param);
     if (result == 0) {
       return;
     } else {
-      // Sleep for 0.1 seconds.
-      usleep(100000);
+      // Wait for the next write, at most 0.1 seconds.
+      params_wait(generation, 100, persistent_param);
     }
   }
 }
 
+uint32_t params_generation(bool persistent_param) {
+  CacheHeader* cache = cache_get(persistent_param);
+  return cache ? cache->generation.load(std::memory_order_acquire) : 0;
+}
+
+uint32_t params_wait(uint32_t generation, int timeout_ms, bool persistent_param) {
+  CacheHeader* cache = cache_get(persistent_param);
+  if (cache == NULL) {
+    usleep(timeout_ms * 1000);
+    return generation;
+  }
+
+  double deadline = millis_since_boot() + timeout_ms;
+  while (true) {
+    uint32_t cur = cache->generation.load(std::memory_order_acquire);
+    double remaining = deadline - millis_since_boot();
+    if (cur != generation || remaining <= 0) return cur;
+
+    int wait_ms = std::min((int)remaining + 1, PARAMS_WAIT_POLL_MS);
+#ifdef __linux__
+    struct timespec ts = {wait_ms / 1000, (wait_ms % 1000) * 1000000L};
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&cache->generation), FUTEX_WAIT, generation, &ts, NULL, 0);
+#else
+    usleep(wait_ms * 1000);
+#endif
+  }
+}
+
 int read_db_all(std::map<std::string, std::string> *params, bool persistent_param) {
   int err = 0;
   const char* params_path = persistent_param ? persistent_params_path : default_params_path;
@@ -1,5 +1,6 @@
 #pragma once
 #include <stddef.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -30,6 +31,13 @@ int delete_db_value(const char* key, bool persistent_param = false);
 // Inputs are the same as read_db_value.
 void read_db_value_blocking(const char* key, char** value, size_t* value_sz, bool persistent_param = false);
 
+// A counter shared by every process, bumped by each write or delete once it is on disk.
+uint32_t params_generation(bool persistent_param = false);
+
+// Blocks until the counter is no longer generation, or timeout_ms passes.
+// Returns the counter. Writes from common/params.py can take up to 100 ms to show up.
+uint32_t params_wait(uint32_t generation, int timeout_ms, bool persistent_param = false);
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
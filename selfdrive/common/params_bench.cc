@@ -0,0 +1,127 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common/timing.h"
+#include "common/params.h"
+
+// Reads params from several threads the way the UI polls them, while other threads keep
+// writing, and reports reads/sec through the shared memory cache and straight from disk.
+// Every value read must be one that was written whole.
+//   ./params_bench [seconds] [reader threads]
+
+#define PARAMS_DIR "/tmp/params_bench"
+#define NUM_KEYS 16
+#define WRITE_PERIOD_US 10000
+
+static std::string key_name(int i) {
+  return "BenchKey" + std::to_string(i);
+}
+
+// a counter repeated to size, so a torn read shows up as a mix of two counters
+static std::string make_value(int key, uint32_t n) {
+  std::string value = std::to_string(n) + ";";
+  size_t size = key == 0 ? 3000 : 8 + key * 4;
+  while (value.size() < size) value += value;
+  return value.substr(0, size);
+}
+
+static bool check_value(int key, const char* value, size_t size) {
+  const char* end = (const char*)memchr(value, ';', size);
+  if (end == NULL) return false;
+  return make_value(key, strtoul(value, NULL, 10)) == std::string(value, size);
+}
+
+static void run(const char* mode, int seconds, int num_readers) {
+  for (int i = 0; i < NUM_KEYS; i++) {
+    std::string value = make_value(i, 0);
+    int err = write_db_value(key_name(i).c_str(), value.c_str(), value.size());
+    assert(err == 0);
+  }
+
+  std::atomic<bool> do_exit(false);
+  std::atomic<uint64_t> reads(0), writes(0), wakeups(0), torn(0);
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_readers; t++) {
+    threads.emplace_back([&, t] {
+      uint64_t n = 0;
+      while (!do_exit) {
+        int key = (n + t) % NUM_KEYS;
+        char* value;
+        size_t size;
+        if (read_db_value(key_name(key).c_str(), &value, &size) == 0) {
+          if (!check_value(key, value, size)) torn++;
+          free(value);
+        }
+        n++;
+      }
+      reads += n;
+    });
+  }
+
+  // half the keys keep changing
+  threads.emplace_back([&] {
+    uint32_t n = 1;
+    while (!do_exit) {
+      int key = n % (NUM_KEYS / 2);
+      std::string value = make_value(key, n);
+      write_db_value(key_name(key).c_str(), value.c_str(), value.size());
+      writes++;
+      n++;
+      usleep(WRITE_PERIOD_US);
+    }
+  });
+
+  threads.emplace_back([&] {
+    uint32_t generation = params_generation();
+    while (!do_exit) {
+      uint32_t cur = params_wait(generation, 100);
+      if (cur != generation) wakeups++;
+      generation = cur;
+    }
+  });
+
+  sleep(seconds);
+  do_exit = true;
+  for (auto &t : threads) t.join();
+
+  printf("%-6s %12.0f reads/sec, %6.0f writes/sec, %6.0f change wakeups/sec, %lu torn\n", mode,
+         reads.load() / (double)seconds, writes.load() / (double)seconds, wakeups.load() / (double)seconds, torn.load());
+  assert(torn == 0);
+}
+
+int main(int argc, char** argv) {
+  int seconds = argc > 1 ? atoi(argv[1]) : 5;
+  int num_readers = argc > 2 ? atoi(argv[2]) : 4;
+
+  // the params path is read once at startup
+  if (getenv("PARAMS_PATH") == NULL) {
+    setenv("PARAMS_PATH", PARAMS_DIR, 1);
+    execv("/proc/self/exe", argv);
+    return 1;
+  }
+
+  // each mode in a fresh process, the cache is set up on first use
+  const char* modes[] = {"disk", "cache"};
+  for (const char* mode : modes) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      setenv("PARAMS_CACHE", strcmp(mode, "disk") == 0 ? "0" : "1", 1);
+      run(mode, seconds, num_readers);
+      exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,106 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "common/timing.h"
+#include "common/params.h"
+
+// Checks that a write from another process wakes params_wait and read_db_value_blocking
+// right away through the futex, not on their 100 ms poll.
+
+#define PARAMS_DIR "/tmp/params_wait_test"
+#define ROUNDS 10
+
+// forks a writer that sets key after delay_ms and reports the boot time its write returned at
+static pid_t write_later(const char* key, const char* value, int delay_ms, int* done_fd) {
+  int fds[2];
+  int err = pipe(fds);
+  assert(err == 0);
+
+  pid_t pid = fork();
+  assert(pid >= 0);
+  if (pid == 0) {
+    close(fds[0]);
+    usleep(delay_ms * 1000);
+    if (write_db_value(key, value, strlen(value)) != 0) _exit(1);
+    uint64_t done = nanos_since_boot();
+    if (write(fds[1], &done, sizeof(done)) != sizeof(done)) _exit(1);
+    _exit(0);
+  }
+  close(fds[1]);
+  *done_fd = fds[0];
+  return pid;
+}
+
+static uint64_t join_writer(pid_t pid, int done_fd) {
+  uint64_t done = 0;
+  ssize_t n = read(done_fd, &done, sizeof(done));
+  assert(n == sizeof(done));
+  close(done_fd);
+
+  int status;
+  waitpid(pid, &status, 0);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  return done;
+}
+
+int main(int argc, char** argv) {
+  // the params path is read once at startup
+  if (getenv("PARAMS_PATH") == NULL) {
+    setenv("PARAMS_PATH", PARAMS_DIR, 1);
+    execv("/proc/self/exe", argv);
+    return 1;
+  }
+
+  // the cache is set up by the first write
+  int err = write_db_value("WaitKey", "0", 1);
+  assert(err == 0);
+
+  // params_wait returns when the write does, polling would be 50 ms late on average
+  std::vector<double> lag_ms;
+  for (int i = 0; i < ROUNDS; i++) {
+    uint32_t generation = params_generation();
+    int done_fd;
+    pid_t pid = write_later("WaitKey", "1", 50, &done_fd);
+
+    uint32_t cur = params_wait(generation, 5000);
+    uint64_t woken = nanos_since_boot();
+    uint64_t done = join_writer(pid, done_fd);
+    assert(cur != generation);
+
+    lag_ms.push_back(fabs((double)woken - (double)done) / 1e6);
+  }
+  std::sort(lag_ms.begin(), lag_ms.end());
+  printf("params_wait: median %.2f ms, max %.2f ms between the write and the wakeup\n", lag_ms[ROUNDS / 2], lag_ms.back());
+  assert(lag_ms[ROUNDS / 2] < 20);
+
+  // nothing changes, the wait runs out
+  uint32_t generation = params_generation();
+  double start = millis_since_boot();
+  assert(params_wait(generation, 250) == generation);
+  assert(millis_since_boot() - start >= 250);
+
+  // a blocking read of a missing key returns once another process writes it
+  delete_db_value("BlockingKey");
+  int done_fd;
+  pid_t pid = write_later("BlockingKey", "hello", 50, &done_fd);
+  char* value;
+  size_t value_sz;
+  read_db_value_blocking("BlockingKey", &value, &value_sz);
+  uint64_t returned = nanos_since_boot();
+  uint64_t done = join_writer(pid, done_fd);
+  assert(value_sz == 5 && memcmp(value, "hello", 5) == 0);
+  free(value);
+  printf("read_db_value_blocking: %.2f ms between the write and the return\n", fabs((double)returned - (double)done) / 1e6);
+  assert(fabs((double)returned - (double)done) / 1e6 < 50);
+
+  printf("all passed\n");
+  return 0;
+}
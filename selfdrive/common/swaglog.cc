@@ -4,11 +4,20 @@
 
 #include <string>
 #include <string.h>
+#include <stdarg.h>
+#include <stdlib.h>
 #include <assert.h>
 
 #include <pthread.h>
 #include <zmq.h>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 #include "json11.hpp"
 
 #include "common/timing.h"
@@ -16,24 +25,224 @@
 
 #include "swaglog.h"
 
-typedef struct LogState {
-  pthread_mutex_t lock;
-  bool inited;
+// Logging threads only format the message into a ring of their own. A flusher thread
+// picks records up from all rings, prints them, builds the JSON and sends what it has
+// to logmessaged as one multipart message, a record per frame. The flusher sleeps until
+// a ring gets a record while it's empty.
+
+// records per thread before they are dropped, and counted
+#define SWAGLOG_RING_SIZE 64
+// longer messages are allocated instead
+#define SWAGLOG_MSG_SIZE 480
+// how long the flusher waits for more records once woken
+#define SWAGLOG_FLUSH_MS 10
+// with nothing logged, to hand out the rings of exited threads and report drops
+#define SWAGLOG_IDLE_MS 1000
+// records per multipart message
+#define SWAGLOG_BATCH_MAX 64
+#define SWAGLOG_DROP_REPORT_MS 1000
+
+namespace {
+
+struct LogRecord {
+  int levelnum;
+  int lineno;
+  // __FILE__ and __func__, they outlive the record
+  const char* filename;
+  const char* func;
+  double created;
+  char* long_msg;
+  char msg[SWAGLOG_MSG_SIZE];
+};
+
+// one producer, the thread that owns it, and one consumer, the flusher
+struct LogRing {
+  std::atomic<uint32_t> head{0}, tail{0};
+  std::atomic<uint64_t> dropped{0};
+  // set when the owning thread exits, the flusher hands the ring out again once it's empty
+  std::atomic<bool> exited{false};
+  bool in_use = true;
+  LogRecord records[SWAGLOG_RING_SIZE];
+};
+
+struct LogState {
+  std::mutex lock;
+  bool inited = false;
   json11::Json::object ctx_j;
+  // ctx_j serialized, redone on every bind instead of on every record
+  std::string ctx_s;
   void *zctx;
   void *sock;
   int print_level;
-} LogState;
 
-static LogState s = {
-  .lock = PTHREAD_MUTEX_INITIALIZER,
+  std::vector<LogRing*> rings;
+  std::thread flusher;
+
+  // wakeups of the flusher, under their own lock so logging threads don't wait on a flush
+  std::mutex wake_lock;
+  std::condition_variable wake_cv;
+  bool wake = false;
+  // a ring is filling up, flush without waiting for more
+  bool wake_now = false;
+  bool exit = false;
+  // at exit and in forked children there is no flusher, records are sent by the thread
+  // logging them
+  std::atomic<bool> direct{false};
+
+  // dropped since the last report, full rings and sends logmessaged wasn't keeping up with
+  uint64_t dropped = 0;
+  double last_drop_report = 0;
 };
 
-static void cloudlog_bind_locked(const char* k, const char* v) {
+// Never destroyed. A forked child has the flusher's handle but not the thread, and its
+// copy of wake_cv still counts the flusher as waiting, so neither can be torn down there.
+LogState& s = *new LogState();
+
+void cloudlog_bind_locked(const char* k, const char* v) {
   s.ctx_j[k] = v;
+  s.ctx_s = json11::Json(s.ctx_j).dump();
+}
+
+// keys in the order json11 writes an object
+std::string record_json(const LogRecord& r, const char* msg) {
+  std::string out = "{\"created\": " + json11::Json(r.created).dump();
+  out += ", \"ctx\": " + s.ctx_s;
+  out += ", \"filename\": " + json11::Json(r.filename).dump();
+  out += ", \"funcname\": " + json11::Json(r.func).dump();
+  out += ", \"levelnum\": " + json11::Json(r.levelnum).dump();
+  out += ", \"lineno\": " + json11::Json(r.lineno).dump();
+  out += ", \"msg\": " + json11::Json(msg).dump() + "}";
+  return out;
+}
+
+void send_batch(std::vector<std::string>& batch) {
+  for (size_t i = 0; i < batch.size(); i++) {
+    int flags = ZMQ_NOBLOCK | (i + 1 < batch.size() ? ZMQ_SNDMORE : 0);
+    if (zmq_send(s.sock, batch[i].data(), batch[i].size(), flags) < 0) {
+      // nothing of a multipart message goes out unless the first frame does
+      s.dropped += batch.size();
+      break;
+    }
+  }
+  batch.clear();
+}
+
+// with s.lock held
+void add_record(std::vector<std::string>& batch, const LogRecord& r) {
+  const char* msg = r.long_msg ? r.long_msg : r.msg;
+  if (r.levelnum >= s.print_level) {
+    printf("%s: %s\n", r.filename, msg);
+  }
+  batch.push_back(std::string(1, (char)r.levelnum) + record_json(r, msg));
+  if (batch.size() == SWAGLOG_BATCH_MAX) {
+    send_batch(batch);
+  }
 }
 
-static void cloudlog_init() {
+void report_drops(std::vector<std::string>& batch) {
+  double now = millis_since_boot();
+  if (s.dropped == 0 || now - s.last_drop_report < SWAGLOG_DROP_REPORT_MS) return;
+
+  LogRecord r = {CLOUDLOG_WARNING, __LINE__, __FILE__, __func__, seconds_since_epoch(), NULL};
+  snprintf(r.msg, sizeof(r.msg), "swaglog: %lu messages dropped", (unsigned long)s.dropped);
+  s.dropped = 0;
+  s.last_drop_report = now;
+  add_record(batch, r);
+}
+
+// with s.lock held
+void flush_locked() {
+  std::vector<std::string> batch;
+  for (LogRing* ring : s.rings) {
+    bool exited = ring->exited.load(std::memory_order_acquire);
+    uint32_t head = ring->head.load();
+    uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+    for (; tail != head; tail++) {
+      LogRecord& r = ring->records[tail % SWAGLOG_RING_SIZE];
+      add_record(batch, r);
+      free(r.long_msg);
+    }
+    ring->tail.store(tail);
+    s.dropped += ring->dropped.exchange(0);
+
+    if (exited) ring->in_use = false;
+  }
+  report_drops(batch);
+  if (!batch.empty()) send_batch(batch);
+  fflush(stdout);
+}
+
+// with s.lock held
+bool rings_pending() {
+  for (LogRing* ring : s.rings) {
+    if (ring->head.load() != ring->tail.load()) return true;
+  }
+  return false;
+}
+
+void wake_flusher(bool now) {
+  {
+    std::lock_guard<std::mutex> lk(s.wake_lock);
+    s.wake = true;
+    s.wake_now = s.wake_now || now;
+  }
+  s.wake_cv.notify_one();
+}
+
+void flusher_thread() {
+  std::unique_lock<std::mutex> wl(s.wake_lock);
+  while (!s.exit) {
+    if (s.wake_cv.wait_for(wl, std::chrono::milliseconds(SWAGLOG_IDLE_MS), [] { return s.exit || s.wake; })) {
+      // let the rest of a burst come in
+      s.wake_cv.wait_for(wl, std::chrono::milliseconds(SWAGLOG_FLUSH_MS), [] { return s.exit || s.wake_now; });
+    }
+    s.wake = s.wake_now = false;
+    wl.unlock();
+
+    bool pending;
+    {
+      std::lock_guard<std::mutex> lk(s.lock);
+      flush_locked();
+      // a record that came in while flushing and found its ring not empty didn't wake us
+      pending = rings_pending();
+    }
+
+    wl.lock();
+    if (pending) s.wake = true;
+  }
+}
+
+// whatever is still in the rings goes out before the process does
+void cloudlog_shutdown() {
+  // a forked child has no flusher, it stayed with the parent
+  if (!s.direct) {
+    {
+      std::lock_guard<std::mutex> lk(s.wake_lock);
+      s.exit = true;
+    }
+    s.wake_cv.notify_one();
+    s.flusher.join();
+  }
+
+  std::lock_guard<std::mutex> lk(s.lock);
+  // logging threads that still see direct as false flush after their record
+  s.direct = true;
+  flush_locked();
+}
+
+// The parent flushes before forking, so the records in the child's copy of the rings are
+// either sent already or still will be by the parent.
+void fork_child() {
+  for (LogRing* ring : s.rings) {
+    ring->tail.store(ring->head.load());
+    ring->dropped = 0;
+  }
+  s.dropped = 0;
+  s.direct = true;
+  s.lock.unlock();
+}
+
+void cloudlog_init() {
   if (s.inited) return;
   s.ctx_j = json11::Json::object {};
   s.zctx = zmq_ctx_new();
@@ -59,56 +268,137 @@ static void cloudlog_init() {
   }
   cloudlog_bind_locked("version", COMMA_VERSION);
   s.ctx_j["dirty"] = !getenv("CLEAN");
+  s.ctx_s = json11::Json(s.ctx_j).dump();
+
+  s.flusher = std::thread(flusher_thread);
+  atexit(cloudlog_shutdown);
+  pthread_atfork([] { s.lock.lock(); if (!s.direct) flush_locked(); },
+                 [] { s.lock.unlock(); },
+                 fork_child);
 
   s.inited = true;
 }
 
-void cloudlog_e(int levelnum, const char* filename, int lineno, const char* func,
-                const char* fmt, ...) {
-  pthread_mutex_lock(&s.lock);
+// set once the thread's ring is handed back, logs from later thread_local destructors
+// are sent directly. Trivially destructible, so it outlives ring_owner.
+thread_local bool ring_released = false;
+
+struct RingOwner {
+  LogRing* ring = NULL;
+  ~RingOwner() {
+    if (ring) ring->exited.store(true, std::memory_order_release);
+    ring = NULL;
+    ring_released = true;
+  }
+};
+
+thread_local RingOwner ring_owner;
+
+// only locks the first time a thread logs
+LogRing* thread_ring() {
+  if (ring_owner.ring) return ring_owner.ring;
+
+  std::lock_guard<std::mutex> lk(s.lock);
   cloudlog_init();
+  LogRing* ring = NULL;
+  for (LogRing* r : s.rings) {
+    if (!r->in_use) {
+      ring = r;
+      break;
+    }
+  }
+  if (ring == NULL) {
+    ring = new LogRing();
+    s.rings.push_back(ring);
+  }
+  ring->exited.store(false);
+  ring->in_use = true;
+  ring_owner.ring = ring;
+  return ring;
+}
+
+void fill_record(LogRecord& r, int levelnum, const char* filename, int lineno, const char* func,
+                 const char* fmt, va_list args) {
+  r.levelnum = levelnum;
+  r.lineno = lineno;
+  r.filename = filename;
+  r.func = func;
+  r.created = seconds_since_epoch();
+  r.long_msg = NULL;
+
+  va_list args_long;
+  va_copy(args_long, args);
+  int len = vsnprintf(r.msg, sizeof(r.msg), fmt, args);
+  if (len >= (int)sizeof(r.msg)) {
+    vasprintf(&r.long_msg, fmt, args_long);
+  }
+  va_end(args_long);
+}
+
+}  // namespace
 
-  char* msg_buf = NULL;
+void cloudlog_e(int levelnum, const char* filename, int lineno, const char* func,
+                const char* fmt, ...) {
   va_list args;
   va_start(args, fmt);
-  vasprintf(&msg_buf, fmt, args);
-  va_end(args);
 
-  if (!msg_buf) {
-    pthread_mutex_unlock(&s.lock);
-    return;
-  }
+  if (s.direct || ring_released) {
+    LogRecord r;
+    fill_record(r, levelnum, filename, lineno, func, fmt, args);
+    va_end(args);
 
-  if (levelnum >= s.print_level) {
-    printf("%s: %s\n", filename, msg_buf);
+    std::lock_guard<std::mutex> lk(s.lock);
+    // what the thread logged before goes first
+    flush_locked();
+    std::vector<std::string> batch;
+    add_record(batch, r);
+    send_batch(batch);
+    free(r.long_msg);
+    return;
   }
 
-  json11::Json log_j = json11::Json::object {
-    {"msg", msg_buf},
-    {"ctx", s.ctx_j},
-    {"levelnum", levelnum},
-    {"filename", filename},
-    {"lineno", lineno},
-    {"funcname", func},
-    {"created", seconds_since_epoch()}
-  };
+  // errors often come right before an assert or a crash, which skip the atexit flush.
+  // They are printed and sent before returning, along with everything before them.
+  bool urgent = levelnum >= CLOUDLOG_ERROR;
 
-  char* log_s = strdup(log_j.dump().c_str());
-  assert(log_s);
+  LogRing* ring = thread_ring();
+  uint32_t head = ring->head.load(std::memory_order_relaxed);
+  if (urgent && head - ring->tail.load(std::memory_order_acquire) == SWAGLOG_RING_SIZE) {
+    std::lock_guard<std::mutex> lk(s.lock);
+    flush_locked();
+  }
+  if (head - ring->tail.load(std::memory_order_acquire) == SWAGLOG_RING_SIZE) {
+    va_end(args);
+    ring->dropped++;
+    wake_flusher(true);
+    return;
+  }
 
-  free(msg_buf);
+  fill_record(ring->records[head % SWAGLOG_RING_SIZE], levelnum, filename, lineno, func, fmt, args);
+  va_end(args);
+  // sequentially consistent with the flusher's tail store and its pending check: either
+  // the record is seen pending after a flush, or the tail load below sees the ring drained
+  ring->head.store(head + 1);
 
-  char levelnum_c = levelnum;
-  zmq_send(s.sock, &levelnum_c, 1, ZMQ_NOBLOCK | ZMQ_SNDMORE);
-  zmq_send(s.sock, log_s, strlen(log_s), ZMQ_NOBLOCK);
-  free(log_s);
+  // shut down since the check above, nothing flushes the rings anymore
+  if (urgent || s.direct) {
+    std::lock_guard<std::mutex> lk(s.lock);
+    flush_locked();
+    return;
+  }
 
-  pthread_mutex_unlock(&s.lock);
+  uint32_t tail = ring->tail.load();
+  if (tail == head) {
+    // the ring was empty, the flusher may be idle
+    wake_flusher(false);
+  } else if (head - tail == SWAGLOG_RING_SIZE / 2) {
+    // a burst, don't wait for the next flush
+    wake_flusher(true);
+  }
 }
 
 void cloudlog_bind(const char* k, const char* v) {
-  pthread_mutex_lock(&s.lock);
+  std::lock_guard<std::mutex> lk(s.lock);
   cloudlog_init();
   cloudlog_bind_locked(k, v);
-  pthread_mutex_unlock(&s.lock);
 }
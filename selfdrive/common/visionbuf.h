@@ -18,6 +18,8 @@ typedef struct VisionBuf {
   void* addr;
   int handle;
   int fd;
+  // another process's buffer, its mapping and fd aren't ours to free
+  int imported;
 
   cl_context ctx;
   cl_device_id device_id;
@@ -31,6 +33,10 @@ typedef struct VisionBuf {
 VisionBuf visionbuf_allocate(size_t len);
 VisionBuf visionbuf_allocate_cl(size_t len, cl_device_id device_id, cl_context ctx, cl_mem *out_mem);
 cl_mem visionbuf_to_cl(const VisionBuf* buf, cl_device_id device_id, cl_context ctx);
+// Wraps a buffer another process allocated, mapped here at addr from its fd, as a cl_mem
+// without copying it. VISIONBUF_SYNC_TO_DEVICE makes what the other process wrote visible
+// to the device.
+VisionBuf visionbuf_import_cl(void* addr, int fd, size_t len, cl_device_id device_id, cl_context ctx, cl_mem *out_mem);
 void visionbuf_sync(const VisionBuf* buf, int dir);
 void visionbuf_free(const VisionBuf* buf);
 
@@ -5,6 +5,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 
@@ -85,9 +86,66 @@ VisionBuf visionbuf_allocate_cl(size_t len, cl_device_id device_id, cl_context c
   };
 }
 
+// Imported buffers on a device that keeps its own copy all sync through one queue, held
+// while any of them is alive. They are all imported into the same context.
+static pthread_mutex_t import_q_lock = PTHREAD_MUTEX_INITIALIZER;
+static cl_command_queue import_q = NULL;
+static cl_context import_q_ctx = NULL;
+static int import_q_refs = 0;
+
+static cl_command_queue import_queue_get(cl_device_id device_id, cl_context ctx) {
+  pthread_mutex_lock(&import_q_lock);
+  if (import_q_refs == 0) {
+    int err;
+    import_q = clCreateCommandQueue(ctx, device_id, 0, &err);
+    assert(err == 0);
+    import_q_ctx = ctx;
+  }
+  assert(import_q_ctx == ctx);
+  import_q_refs++;
+  cl_command_queue q = import_q;
+  pthread_mutex_unlock(&import_q_lock);
+  return q;
+}
+
+static void import_queue_put(cl_command_queue q) {
+  pthread_mutex_lock(&import_q_lock);
+  assert(q == import_q && import_q_refs > 0);
+  if (--import_q_refs == 0) {
+    clReleaseCommandQueue(import_q);
+    import_q = NULL;
+    import_q_ctx = NULL;
+  }
+  pthread_mutex_unlock(&import_q_lock);
+}
+
+VisionBuf visionbuf_import_cl(void* addr, int fd, size_t len, cl_device_id device_id, cl_context ctx, cl_mem *out_mem) {
+  int err;
+  assert(out_mem);
+
+  cl_mem mem = clCreateBuffer(ctx, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, len, addr, &err);
+  assert(err == 0);
+  *out_mem = mem;
+
+  // a CPU device works on addr itself, others may keep a copy that has to be written
+  cl_device_type device_type;
+  err = clGetDeviceInfo(device_id, CL_DEVICE_TYPE, sizeof(device_type), &device_type, NULL);
+  assert(err == 0);
+  cl_command_queue q = NULL;
+  if (!(device_type & CL_DEVICE_TYPE_CPU)) {
+    q = import_queue_get(device_id, ctx);
+  }
+
+  return (VisionBuf){
+      .len = len, .addr = addr, .handle = 0, .fd = fd, .imported = 1,
+      .device_id = device_id, .ctx = ctx, .buf_cl = mem, .copy_q = q,
+  };
+}
+
 void visionbuf_sync(const VisionBuf* buf, int dir) {
   int err = 0;
   if (!buf->buf_cl) return;
+  if (buf->imported && !buf->copy_q) return;
 
 #if __OPENCL_VERSION__ < 200
   if (dir == VISIONBUF_SYNC_FROM_DEVICE) {
@@ -101,7 +159,10 @@ void visionbuf_sync(const VisionBuf* buf, int dir) {
 }
 
 void visionbuf_free(const VisionBuf* buf) {
-  if (buf->handle) {
+  if (buf->imported) {
+    clReleaseMemObject(buf->buf_cl);
+    if (buf->copy_q) import_queue_put(buf->copy_q);
+  } else if (buf->handle) {
     munmap(buf->addr, buf->len);
     close(buf->fd);
   } else {
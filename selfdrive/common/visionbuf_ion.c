@@ -78,6 +78,19 @@ VisionBuf visionbuf_allocate_cl(size_t len, cl_device_id device_id, cl_context c
   return r;
 }
 
+VisionBuf visionbuf_import_cl(void* addr, int fd, size_t len, cl_device_id device_id, cl_context ctx, cl_mem *out_mem) {
+  VisionBuf r = {
+    .len = len,
+    .mmap_len = len,
+    .addr = addr,
+    .fd = fd,
+    .imported = 1,
+  };
+  *out_mem = visionbuf_to_cl(&r, device_id, ctx);
+  r.buf_cl = *out_mem;
+  return r;
+}
+
 cl_mem visionbuf_to_cl(const VisionBuf* buf, cl_device_id device_id, cl_context ctx) {
   int err = 0;
 
@@ -140,6 +153,7 @@ void visionbuf_sync(const VisionBuf* buf, int dir) {
 
 void visionbuf_free(const VisionBuf* buf) {
   clReleaseMemObject(buf->buf_cl);
+  if (buf->imported) return;
   munmap(buf->addr, buf->mmap_len);
   close(buf->fd);
   struct ion_handle_data handle_data = {
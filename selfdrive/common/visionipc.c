@@ -5,6 +5,7 @@
 #include <unistd.h>
 #include <assert.h>
 #include <errno.h>
+#include <poll.h>
 
 #include <sys/mman.h>
 #include <sys/socket.h>
@@ -13,6 +14,7 @@
 #include "ipc.h"
 
 #include "visionipc.h"
+#include "visionring.h"
 
 typedef struct VisionPacketWire {
   int type;
@@ -105,6 +107,18 @@ int visionstream_init(VisionStream *s, VisionStreamType type, bool tbuffer, Visi
   s->bufs_info = rp.d.stream_bufs;
 
   s->num_bufs = rp.num_fds;
+  if (s->bufs_info.ring) {
+    s->num_bufs--;
+    s->ring = visionring_map(rp.fds[s->num_bufs]);
+    close(rp.fds[s->num_bufs]);
+    if (s->ring == NULL) {
+      for (int i=0; i<s->num_bufs; i++) close(rp.fds[i]);
+      close(s->ipc_fd);
+      return -1;
+    }
+    s->ring_latest = tbuffer;
+    s->ring_seq = __atomic_load_n(&s->ring->head, __ATOMIC_ACQUIRE);
+  }
   s->bufs = calloc(s->num_bufs, sizeof(VIPCBuf));
   assert(s->bufs);
 
@@ -119,7 +133,10 @@ int visionstream_init(VisionStream *s, VisionStreamType type, bool tbuffer, Visi
 
 void visionstream_release(VisionStream *s) {
   int err;
-  if (s->last_idx >= 0) {
+  if (s->ring) {
+    visionring_release(s->ring, s->bufs_info.ring_consumer);
+    s->last_idx = -1;
+  } else if (s->last_idx >= 0) {
     VisionPacket rep = {
       .type = VIPC_STREAM_RELEASE,
       .d = { .stream_rel = {
@@ -132,9 +149,35 @@ void visionstream_release(VisionStream *s) {
   }
 }
 
+// nothing comes over the socket of a ring stream after the buffers, but the hangup
+static bool server_gone(int fd) {
+  struct pollfd pfd = {.fd = fd, .events = POLLIN};
+  return poll(&pfd, 1, 0) != 0;
+}
+
+static VIPCBuf* visionstream_get_ring(VisionStream *s, VIPCBufExtra *out_extra) {
+  while (true) {
+    int idx = visionring_get(s->ring, s->bufs_info.ring_consumer, s->ring_latest, &s->ring_seq,
+                             out_extra, 100);
+    if (idx >= 0) {
+      assert(idx < s->num_bufs);
+      s->last_type = s->bufs_info.type;
+      s->last_idx = idx;
+      return &s->bufs[idx];
+    }
+    if (idx == VISIONRING_STOPPED || server_gone(s->ipc_fd)) {
+      return NULL;
+    }
+  }
+}
+
 VIPCBuf* visionstream_get(VisionStream *s, VIPCBufExtra *out_extra) {
   int err;
 
+  if (s->ring) {
+    return visionstream_get_ring(s, out_extra);
+  }
+
   VisionPacket rp;
   err = vipc_recv(s->ipc_fd, &rp);
   if (err <= 0) {
@@ -170,7 +213,12 @@ VIPCBuf* visionstream_get(VisionStream *s, VIPCBufExtra *out_extra) {
 void visionstream_destroy(VisionStream *s) {
   int err;
 
-  if (s->last_idx >= 0) {
+  if (s->ring) {
+    visionring_release(s->ring, s->bufs_info.ring_consumer);
+    visionring_unmap(s->ring);
+    s->ring = NULL;
+    s->last_idx = -1;
+  } else if (s->last_idx >= 0) {
     VisionPacket rep = {
       .type = VIPC_STREAM_RELEASE,
       .d = { .stream_rel = {
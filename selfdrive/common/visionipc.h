@@ -25,6 +25,10 @@ typedef enum VisionStreamType {
   VISION_STREAM_RGB_FRONT,
   VISION_STREAM_YUV,
   VISION_STREAM_YUV_FRONT,
+  // PC and replay camerad only. Goes the other way: each buffer visionstream_get returns
+  // is the client's to fill with a rear camera frame, which it then publishes as a frame
+  // message with imageBufferIdx set to last_idx instead of an image.
+  VISION_STREAM_FRAME_SOURCE,
   VISION_STREAM_MAX,
 } VisionStreamType;
 
@@ -46,6 +50,10 @@ typedef struct VisionStreamBufs {
   union {
     VisionUIInfo ui_info;
   } buf_info;
+
+  // frames come through a VisionRing instead of the socket, its fd after the buffers'
+  bool ring;
+  int ring_consumer;
 } VisionStreamBufs;
 
 typedef struct VIPCBufExtra {
@@ -99,6 +107,10 @@ typedef struct VisionStream {
   int num_bufs;
   VisionStreamBufs bufs_info;
   VIPCBuf *bufs;
+
+  struct VisionRingShared *ring;
+  bool ring_latest;
+  uint32_t ring_seq;
 } VisionStream;
 
 int visionstream_init(VisionStream *s, VisionStreamType type, bool tbuffer, VisionStreamBufs *out_bufs_info);
@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <limits.h>
+
+#include <sys/mman.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#include "common/timing.h"
+
+#include "visionring.h"
+
+#define VISIONRING_MAGIC 0x474e5256u
+// how often a waiting consumer comes back to check the stream is still there
+#define VISIONRING_WAIT_POLL_MS 100
+
+static void futex_wake_all(uint32_t *addr) {
+#ifdef __linux__
+  syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+static void futex_wait(uint32_t *addr, uint32_t val, int timeout_ms) {
+#ifdef __linux__
+  struct timespec ts = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+  syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+#else
+  usleep(1000);
+#endif
+}
+
+static bool is_held(VisionRingShared *shared, int idx) {
+  for (int c=0; c<VISIONRING_MAX_CONSUMERS; c++) {
+    if (__atomic_load_n(&shared->holding[c], __ATOMIC_SEQ_CST) == idx) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int visionring_init(VisionRing *r, int num_bufs, int depth,
+                    void (*release_cb)(void* c, int idx), void* cb_cookie) {
+  assert(num_bufs <= VIPC_MAX_FDS);
+  assert(depth > 0 && depth <= VISIONRING_MAX_DEPTH);
+
+  memset(r, 0, sizeof(*r));
+
+  char path[0x100];
+#if defined(__APPLE__) || defined(__ANDROID__)
+  snprintf(path, sizeof(path), "/tmp/visionring_%d_%p", getpid(), (void*)r);
+#else
+  snprintf(path, sizeof(path), "/dev/shm/visionring_%d_%p", getpid(), (void*)r);
+#endif
+  r->fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (r->fd < 0) return -1;
+  unlink(path);
+
+  if (ftruncate(r->fd, sizeof(VisionRingShared)) != 0) {
+    close(r->fd);
+    return -1;
+  }
+  r->shared = (VisionRingShared*)mmap(NULL, sizeof(VisionRingShared), PROT_READ | PROT_WRITE,
+                                      MAP_SHARED, r->fd, 0);
+  if (r->shared == MAP_FAILED) {
+    close(r->fd);
+    return -1;
+  }
+
+  VisionRingShared *shared = r->shared;
+  shared->magic = VISIONRING_MAGIC;
+  shared->num_bufs = num_bufs;
+  shared->depth = depth;
+  for (int i=0; i<VISIONRING_MAX_DEPTH; i++) {
+    shared->slots[i] = -1;
+  }
+  for (int c=0; c<VISIONRING_MAX_CONSUMERS; c++) {
+    shared->holding[c] = -1;
+  }
+
+  r->release_cb = release_cb;
+  r->cb_cookie = cb_cookie;
+  pthread_mutex_init(&r->lock, NULL);
+  return 0;
+}
+
+void visionring_publish(VisionRing *r, int idx, const VIPCBufExtra *extra) {
+  VisionRingShared *shared = r->shared;
+  assert(idx >= 0 && idx < shared->num_bufs);
+
+  pthread_mutex_lock(&r->lock);
+
+  uint32_t seq = shared->head;
+  int slot = seq % shared->depth;
+
+  // the frame depth back leaves the ring
+  int old = shared->slots[slot];
+  if (old >= 0 && old != idx) {
+    __atomic_store_n(&shared->buf_seq[old], 0, __ATOMIC_SEQ_CST);
+    r->retiring[old] = true;
+  }
+
+  shared->extra[idx] = *extra;
+  __atomic_store_n(&shared->buf_seq[idx], seq + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&shared->slots[slot], idx, __ATOMIC_RELEASE);
+  __atomic_store_n(&shared->head, seq + 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&shared->waiters, __ATOMIC_SEQ_CST) > 0) {
+    futex_wake_all(&shared->head);
+  }
+
+  // consumers that were reading them may be done by now
+  for (int i=0; i<shared->num_bufs; i++) {
+    if (r->retiring[i] && !is_held(shared, i)) {
+      r->retiring[i] = false;
+      if (r->release_cb) {
+        r->release_cb(r->cb_cookie, i);
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&r->lock);
+}
+
+int visionring_add_consumer(VisionRing *r) {
+  pthread_mutex_lock(&r->lock);
+  int c;
+  for (c=0; c<VISIONRING_MAX_CONSUMERS; c++) {
+    if (!r->consumers[c]) break;
+  }
+  if (c < VISIONRING_MAX_CONSUMERS) {
+    r->consumers[c] = true;
+    __atomic_store_n(&r->shared->holding[c], -1, __ATOMIC_SEQ_CST);
+  } else {
+    c = -1;
+  }
+  pthread_mutex_unlock(&r->lock);
+  return c;
+}
+
+void visionring_remove_consumer(VisionRing *r, int consumer) {
+  assert(consumer >= 0 && consumer < VISIONRING_MAX_CONSUMERS);
+  pthread_mutex_lock(&r->lock);
+  __atomic_store_n(&r->shared->holding[consumer], -1, __ATOMIC_SEQ_CST);
+  r->consumers[consumer] = false;
+  pthread_mutex_unlock(&r->lock);
+}
+
+void visionring_stop(VisionRing *r) {
+  __atomic_store_n(&r->shared->stopped, 1, __ATOMIC_SEQ_CST);
+  futex_wake_all(&r->shared->head);
+}
+
+void visionring_destroy(VisionRing *r) {
+  munmap(r->shared, sizeof(VisionRingShared));
+  close(r->fd);
+  pthread_mutex_destroy(&r->lock);
+}
+
+VisionRingShared* visionring_map(int fd) {
+  void *addr = mmap(NULL, sizeof(VisionRingShared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED) return NULL;
+  VisionRingShared *shared = (VisionRingShared*)addr;
+  if (shared->magic != VISIONRING_MAGIC) {
+    munmap(addr, sizeof(VisionRingShared));
+    return NULL;
+  }
+  return shared;
+}
+
+void visionring_unmap(VisionRingShared *shared) {
+  munmap(shared, sizeof(VisionRingShared));
+}
+
+int visionring_get(VisionRingShared *shared, int consumer, bool latest, uint32_t *seq,
+                   VIPCBufExtra *out_extra, int timeout_ms) {
+  double deadline = millis_since_boot() + timeout_ms;
+  while (true) {
+    if (__atomic_load_n(&shared->stopped, __ATOMIC_ACQUIRE)) {
+      return VISIONRING_STOPPED;
+    }
+
+    uint32_t head = __atomic_load_n(&shared->head, __ATOMIC_ACQUIRE);
+    if (head != *seq) {
+      uint32_t s = *seq;
+      if (latest || head - s > (uint32_t)shared->depth) {
+        s = latest ? head - 1 : head - shared->depth;
+      }
+
+      int idx = __atomic_load_n(&shared->slots[s % shared->depth], __ATOMIC_ACQUIRE);
+      if (idx >= 0 && idx < shared->num_bufs) {
+        __atomic_store_n(&shared->holding[consumer], idx, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&shared->buf_seq[idx], __ATOMIC_SEQ_CST) == s + 1) {
+          // ours until the next get or release
+          if (out_extra) {
+            *out_extra = shared->extra[idx];
+          }
+          *seq = s + 1;
+          return idx;
+        }
+        __atomic_store_n(&shared->holding[consumer], -1, __ATOMIC_SEQ_CST);
+      }
+      // the server went past it meanwhile, try again from the new head
+      continue;
+    }
+
+    double remaining = deadline - millis_since_boot();
+    if (remaining <= 0) {
+      return VISIONRING_TIMEOUT;
+    }
+    int wait_ms = (int)remaining + 1;
+    if (wait_ms > VISIONRING_WAIT_POLL_MS) wait_ms = VISIONRING_WAIT_POLL_MS;
+
+    __atomic_add_fetch(&shared->waiters, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&shared->head, __ATOMIC_SEQ_CST) == *seq) {
+      futex_wait(&shared->head, *seq, wait_ms);
+    }
+    __atomic_sub_fetch(&shared->waiters, 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+void visionring_release(VisionRingShared *shared, int consumer) {
+  __atomic_store_n(&shared->holding[consumer], -1, __ATOMIC_SEQ_CST);
+}
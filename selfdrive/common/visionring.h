@@ -0,0 +1,100 @@
+#ifndef VISIONRING_H
+#define VISIONRING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "visionipc.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Shared memory fan-out of a stream's buffers, so getting a frame costs its consumers no
+// round trip to the server.
+//
+// The server publishes buffer indices, with their VIPCBufExtra, into a ring of the last
+// depth frames. Any number of consumers read it straight from the mapping. Each consumer
+// holds at most one buffer, in its own holding slot, and the server only gives a buffer
+// back once it has left the ring and no slot holds it. A consumer takes a buffer by
+// setting its slot and then checking the buffer wasn't retired meanwhile, a retired buffer
+// is only reused after the server saw no slot holding it, so one of the two always backs
+// off. The fd of the mapping is handed out with the buffers over the socket, a futex on
+// the head wakes waiting consumers.
+
+#define VISIONRING_MAX_DEPTH 32
+#define VISIONRING_MAX_CONSUMERS 16
+
+// returned by visionring_get instead of a buffer
+#define VISIONRING_TIMEOUT -1
+#define VISIONRING_STOPPED -2
+
+typedef struct VisionRingShared {
+  uint32_t magic;
+  int num_bufs;
+  int depth;
+
+  // sequence number of the next frame, futex word
+  uint32_t head;
+  uint32_t waiters;
+  uint32_t stopped;
+
+  // buffer of frame seq at seq % depth
+  int32_t slots[VISIONRING_MAX_DEPTH];
+  // seq + 1 of the frame in the buffer, 0 once it left the ring
+  uint32_t buf_seq[VIPC_MAX_FDS];
+  VIPCBufExtra extra[VIPC_MAX_FDS];
+
+  // buffer each consumer is reading, or -1
+  int32_t holding[VISIONRING_MAX_CONSUMERS];
+} VisionRingShared;
+
+// server side
+typedef struct VisionRing {
+  int fd;
+  VisionRingShared *shared;
+
+  pthread_mutex_t lock;
+  bool consumers[VISIONRING_MAX_CONSUMERS];
+  // out of the ring but still held by a consumer
+  bool retiring[VIPC_MAX_FDS];
+
+  // called once a published buffer is free again
+  void (*release_cb)(void* c, int idx);
+  void *cb_cookie;
+} VisionRing;
+
+// depth is how many frames a consumer reading every frame can fall behind
+int visionring_init(VisionRing *r, int num_bufs, int depth,
+  void (*release_cb)(void* c, int idx), void* cb_cookie);
+
+// The buffer is the ring's until release_cb gives it back.
+void visionring_publish(VisionRing *r, int idx, const VIPCBufExtra *extra);
+
+// a holding slot for a new consumer, -1 when there are too many
+int visionring_add_consumer(VisionRing *r);
+// gives up whatever a consumer that went away was holding
+void visionring_remove_consumer(VisionRing *r, int consumer);
+
+// consumers get VISIONRING_STOPPED from now on
+void visionring_stop(VisionRing *r);
+void visionring_destroy(VisionRing *r);
+
+// consumer side
+VisionRingShared* visionring_map(int fd);
+void visionring_unmap(VisionRingShared *shared);
+
+// Waits up to timeout_ms for a frame after *seq and holds its buffer instead of the one
+// held before. latest skips to the newest frame, otherwise frames come in order unless
+// the consumer fell more than depth behind. Returns the buffer index and moves *seq past
+// the frame, or VISIONRING_TIMEOUT / VISIONRING_STOPPED.
+int visionring_get(VisionRingShared *shared, int consumer, bool latest, uint32_t *seq,
+                   VIPCBufExtra *out_extra, int timeout_ms);
+void visionring_release(VisionRingShared *shared, int consumer);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,207 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include "common/timing.h"
+#include "common/buffering.h"
+#include "common/visionipc.h"
+#include "common/visionring.h"
+
+// Publishes frames at a fixed rate to 1 to 6 consumer processes that always want the
+// latest frame, the way modeld reads the yuv stream, and reports the frames/sec each
+// consumer got and how long after publishing it got them. Once through the socket with a
+// server thread per consumer like camerad's visionserver, once through a VisionRing.
+// Both go through visionstream_get.
+//   ./visionring_bench [seconds] [frames/sec]
+
+#define NUM_BUFS 40
+#define RING_DEPTH 16
+#define MAX_CONSUMERS 6
+
+struct ConsumerResult {
+  uint64_t frames;
+  double mean_us, p99_us;
+};
+
+static VIPCBufExtra extras[NUM_BUFS];
+
+// what visionserver_client_thread does for a tbuffer stream
+static void serve_socket(int fd, TBuffer *tb) {
+  int outstanding = 0;
+  while (true) {
+    struct pollfd polls[2] = {{fd, POLLIN, 0}, {tbuffer_efd(tb), POLLIN, 0}};
+    int ret = poll(polls, outstanding < 2 ? 2 : 1, -1);
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    if (polls[0].revents) {
+      VisionPacket p;
+      if (vipc_recv(fd, &p) <= 0) break;
+      assert(p.type == VIPC_STREAM_RELEASE);
+      tbuffer_release(tb, p.d.stream_rel.idx);
+      outstanding--;
+    } else if (polls[1].revents) {
+      int idx = tbuffer_acquire(tb);
+      if (idx < 0) break;
+      outstanding++;
+      VisionPacket rep = {};
+      rep.type = VIPC_STREAM_ACQUIRE;
+      rep.d.stream_acq.type = VISION_STREAM_YUV;
+      rep.d.stream_acq.idx = idx;
+      rep.d.stream_acq.extra = extras[idx];
+      vipc_send(fd, &rep);
+    }
+  }
+  close(fd);
+}
+
+static ConsumerResult consume(VisionStream *stream) {
+  std::vector<uint64_t> latencies;
+  VIPCBufExtra extra;
+  while (visionstream_get(stream, &extra) != NULL) {
+    latencies.push_back(nanos_since_boot() - extra.timestamp_eof);
+  }
+
+  ConsumerResult res = {latencies.size(), 0, 0};
+  if (!latencies.empty()) {
+    uint64_t sum = 0;
+    for (uint64_t l : latencies) sum += l;
+    res.mean_us = sum / 1000.0 / latencies.size();
+    std::nth_element(latencies.begin(), latencies.begin() + latencies.size() * 99 / 100, latencies.end());
+    res.p99_us = latencies[latencies.size() * 99 / 100] / 1000.0;
+  }
+  return res;
+}
+
+static void run(bool use_ring, int num_consumers, int seconds, int fps) {
+  Pool pool;
+  pool_init(&pool, NUM_BUFS);
+  VisionRing ring;
+  if (use_ring) {
+    int err = visionring_init(&ring, NUM_BUFS, RING_DEPTH, (void (*)(void *, int))pool_release, &pool);
+    assert(err == 0);
+  }
+
+  std::vector<pid_t> pids;
+  std::vector<int> results;
+  std::vector<std::thread> servers;
+  // the server ends, no consumer may keep another one's open or it never sees the hangup
+  std::vector<int> server_fds;
+  for (int i = 0; i < num_consumers; i++) {
+    int socks[2], res_pipe[2];
+    int err = socketpair(AF_UNIX, SOCK_SEQPACKET, 0, socks);
+    assert(err == 0);
+    err = pipe(res_pipe);
+    assert(err == 0);
+
+    VisionStream stream = {};
+    stream.ipc_fd = socks[1];
+    stream.last_idx = -1;
+    stream.num_bufs = NUM_BUFS;
+    stream.bufs = (VIPCBuf*)calloc(NUM_BUFS, sizeof(VIPCBuf));
+    stream.bufs_info.type = VISION_STREAM_YUV;
+    if (use_ring) {
+      stream.bufs_info.ring = true;
+      stream.bufs_info.ring_consumer = visionring_add_consumer(&ring);
+      assert(stream.bufs_info.ring_consumer >= 0);
+      stream.ring_latest = true;
+    } else {
+      TBuffer *tb = pool_get_tbuffer(&pool);
+      servers.emplace_back(serve_socket, socks[0], tb);
+    }
+    server_fds.push_back(socks[0]);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(res_pipe[0]);
+      for (int fd : server_fds) close(fd);
+      if (use_ring) {
+        stream.ring = visionring_map(ring.fd);
+        assert(stream.ring);
+        stream.ring_seq = stream.ring->head;
+      }
+      ConsumerResult res = consume(&stream);
+      ssize_t n = write(res_pipe[1], &res, sizeof(res));
+      _exit(n == sizeof(res) ? 0 : 1);
+    }
+    close(socks[1]);
+    close(res_pipe[1]);
+    free(stream.bufs);
+    pids.push_back(pid);
+    results.push_back(res_pipe[0]);
+  }
+
+  // let every consumer get going
+  usleep(200000);
+
+  uint64_t period = 1000000000ULL / fps;
+  uint64_t next = nanos_since_boot();
+  uint64_t end = next + seconds * 1000000000ULL;
+  uint64_t published = 0;
+  while (next < end) {
+    struct timespec ts = {(time_t)(next / 1000000000ULL), (long)(next % 1000000000ULL)};
+    clock_nanosleep(CLOCK_BOOTTIME, TIMER_ABSTIME, &ts, NULL);
+
+    int idx = pool_select(&pool);
+    extras[idx].frame_id = published;
+    extras[idx].timestamp_eof = nanos_since_boot();
+    if (use_ring) {
+      pool_acquire(&pool, idx);
+      visionring_publish(&ring, idx, &extras[idx]);
+    }
+    pool_push(&pool, idx);
+    published++;
+    next += period;
+  }
+
+  if (use_ring) {
+    visionring_stop(&ring);
+  }
+  pool_stop(&pool);
+
+  double frames = 0, mean_us = 0, p99_us = 0;
+  for (int i = 0; i < num_consumers; i++) {
+    ConsumerResult res = {};
+    ssize_t n = read(results[i], &res, sizeof(res));
+    assert(n == sizeof(res));
+    close(results[i]);
+    int status;
+    waitpid(pids[i], &status, 0);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    frames += res.frames;
+    mean_us += res.mean_us * res.frames;
+    p99_us = std::max(p99_us, res.p99_us);
+  }
+  for (auto &t : servers) t.join();
+  if (use_ring) {
+    for (int fd : server_fds) close(fd);
+    visionring_destroy(&ring);
+  }
+
+  printf("%-6s %d consumers: %8.0f published/sec, %8.0f frames/sec per consumer, latency mean %7.1f us, worst p99 %7.1f us\n",
+         use_ring ? "ring" : "socket", num_consumers, published / (double)seconds,
+         frames / num_consumers / seconds, frames > 0 ? mean_us / frames : 0, p99_us);
+}
+
+int main(int argc, char** argv) {
+  int seconds = argc > 1 ? atoi(argv[1]) : 2;
+  int fps = argc > 2 ? atoi(argv[2]) : 2000;
+
+  for (int n = 1; n <= MAX_CONSUMERS; n++) {
+    run(false, n, seconds, fps);
+    run(true, n, seconds, fps);
+  }
+  return 0;
+}
@@ -0,0 +1,227 @@
+#include <assert.h>
+#include <string.h>
+#include <bzlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <thread>
+
+#include "common/swaglog.h"
+
+#include "block_writer.h"
+
+namespace {
+
+class CompressPool {
+public:
+  CompressPool(int num_threads) {
+    for (int i = 0; i < num_threads; i++) {
+      threads.emplace_back(&CompressPool::run, this);
+    }
+  }
+  ~CompressPool() {
+    {
+      std::lock_guard<std::mutex> lk(lock);
+      exit = true;
+    }
+    cv.notify_all();
+    for (auto &t : threads) t.join();
+  }
+
+  void push(BlockWriter::Block *b) {
+    {
+      std::lock_guard<std::mutex> lk(lock);
+      queue.push_back(b);
+    }
+    cv.notify_one();
+  }
+
+private:
+  void run() {
+    while (true) {
+      BlockWriter::Block *b;
+      {
+        std::unique_lock<std::mutex> lk(lock);
+        cv.wait(lk, [&] { return exit || !queue.empty(); });
+        if (queue.empty()) return;
+        b = queue.front();
+        queue.pop_front();
+      }
+      b->writer->compress(b);
+    }
+  }
+
+  std::mutex lock;
+  std::condition_variable cv;
+  std::deque<BlockWriter::Block *> queue;
+  std::vector<std::thread> threads;
+  bool exit = false;
+};
+
+CompressPool &pool() {
+  // leave a core for the loggerd main loop and the encoders
+  static CompressPool p(std::min(std::max((int)std::thread::hardware_concurrency() - 1, 1), 4));
+  return p;
+}
+
+std::atomic<uint64_t> compress_failures{0};
+
+}  // namespace
+
+uint64_t block_writer_failures() {
+  return compress_failures.exchange(0);
+}
+
+static void reset_block(BlockWriter::Block *b) {
+  b->in_size = 0;
+  b->start_mono_time = UINT64_MAX;
+  b->end_mono_time = 0;
+  b->services.clear();
+}
+
+static BlockWriter::Block *new_block(BlockWriter *writer) {
+  BlockWriter::Block *b = new BlockWriter::Block{writer};
+  b->in.reset(new char[LOG_BLOCK_SIZE]);
+  b->in_cap = LOG_BLOCK_SIZE;
+  reset_block(b);
+  return b;
+}
+
+BlockWriter::BlockWriter(StorageFile *file, bool indexed) : file(file), indexed(indexed) {
+  blocks.emplace_back(new_block(this));
+  cur = blocks.back().get();
+}
+
+BlockWriter::~BlockWriter() {
+  std::unique_lock<std::mutex> lk(lock);
+  cv.wait(lk, [&] { return in_flight == 0 && !writing; });
+}
+
+void BlockWriter::write_event(const uint8_t *data, size_t size, uint64_t mono_time, uint16_t service) {
+  memcpy(reserve_event(size), data, size);
+  commit_event(size, mono_time, service);
+}
+
+uint8_t *BlockWriter::reserve_event(size_t size) {
+  if (cur->in_size > 0 && cur->in_size + size > LOG_BLOCK_SIZE) {
+    submit();
+  }
+  // an event bigger than a block gets a block of its own
+  if (size > cur->in_cap) {
+    cur->in.reset(new char[size]);
+    cur->in_cap = size;
+  }
+  return (uint8_t *)&cur->in[cur->in_size];
+}
+
+void BlockWriter::commit_event(size_t size, uint64_t mono_time, uint16_t service) {
+  if (indexed) {
+    auto it = std::find_if(cur->services.begin(), cur->services.end(), [=](const LogIndexService &s) { return s.service == service; });
+    if (it == cur->services.end()) {
+      cur->services.push_back({service, 0, (uint32_t)cur->in_size, 1});
+    } else {
+      it->count++;
+    }
+    cur->start_mono_time = std::min(cur->start_mono_time, mono_time);
+    cur->end_mono_time = std::max(cur->end_mono_time, mono_time);
+  }
+  cur->in_size += size;
+
+  if (cur->in_size >= LOG_BLOCK_SIZE) {
+    submit();
+  }
+}
+
+void BlockWriter::close() {
+  if (cur->in_size > 0) {
+    submit();
+  }
+  std::unique_lock<std::mutex> lk(lock);
+  cv.wait(lk, [&] { return in_flight == 0 && !writing; });
+
+  if (indexed) {
+    LogIndexHeader header = {};
+    memcpy(header.magic, LOG_INDEX_MAGIC, sizeof(header.magic));
+    header.version = LOG_INDEX_VERSION;
+    header.num_chunks = index_chunks.size();
+    header.num_services = index_services.size();
+    LogIndexTrailer trailer = {file_offset};
+    memcpy(trailer.magic, LOG_INDEX_MAGIC, sizeof(trailer.magic));
+
+    storage_write(file, &header, sizeof(header));
+    storage_write(file, index_chunks.data(), index_chunks.size() * sizeof(LogIndexChunk));
+    storage_write(file, index_services.data(), index_services.size() * sizeof(LogIndexService));
+    storage_write(file, &trailer, sizeof(trailer));
+  }
+}
+
+void BlockWriter::submit() {
+  Block *b = cur;
+  {
+    std::unique_lock<std::mutex> lk(lock);
+    cv.wait(lk, [&] { return in_flight < LOG_BLOCKS_IN_FLIGHT; });
+    b->seq = next_seq++;
+    in_flight++;
+
+    if (free_blocks.empty()) {
+      blocks.emplace_back(new_block(this));
+      cur = blocks.back().get();
+    } else {
+      cur = free_blocks.back();
+      free_blocks.pop_back();
+    }
+  }
+  pool().push(b);
+}
+
+static int compress_block(BlockWriter::Block *b, int block_size_100k) {
+  b->out_len = b->out.size();
+  return BZ2_bzBuffToBuffCompress(b->out.data(), &b->out_len, b->in.get(), b->in_size, block_size_100k, 0, 30);
+}
+
+void BlockWriter::compress(Block *b) {
+  // worst case bz2 output, per the BZ2_bzBuffToBuffCompress docs
+  b->out.resize(b->in_size + b->in_size / 100 + 600);
+  int err = compress_block(b, 9);
+  if (err == BZ_OUTBUFF_FULL) {
+    LOGW("logger block outgrew the bz2 bound, retrying with a larger buffer");
+    b->out.resize(2 * b->in_size + 600);
+    err = compress_block(b, 9);
+  } else if (err == BZ_MEM_ERROR) {
+    // 100k blocks need an eighth of the memory, and still make a stream of their own
+    LOGW("logger out of memory compressing a block, retrying with 100k bz2 blocks");
+    err = compress_block(b, 1);
+  }
+  if (err != BZ_OK) {
+    LOGE("logger failed to compress block, dropping %zu bytes of events: %d", b->in_size, err);
+    compress_failures++;
+    b->out_len = 0;
+  }
+
+  std::unique_lock<std::mutex> lk(lock);
+  done[b->seq] = b;
+  // whoever is writing picks this one up once the blocks before it are in
+  if (writing) return;
+
+  writing = true;
+  while (!done.empty() && done.begin()->first == next_write) {
+    Block *w = done.begin()->second;
+    done.erase(done.begin());
+    lk.unlock();
+    storage_write(file, w->out.data(), w->out_len);
+    if (indexed && w->out_len > 0) {
+      index_chunks.push_back({file_offset, w->out_len, (uint32_t)w->in_size, w->start_mono_time, w->end_mono_time,
+                              (uint32_t)index_services.size(), (uint32_t)w->services.size()});
+      index_services.insert(index_services.end(), w->services.begin(), w->services.end());
+    }
+    file_offset += w->out_len;
+    lk.lock();
+    reset_block(w);
+    free_blocks.push_back(w);
+    next_write++;
+    in_flight--;
+  }
+  writing = false;
+  cv.notify_all();
+}
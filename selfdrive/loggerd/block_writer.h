@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "log_index.h"
+#include "storage.h"
+
+// bzip2 -9 compresses in 900k blocks, so a stream per block of input costs next to
+// nothing in ratio over one long stream
+#define LOG_BLOCK_SIZE 900000
+// blocks of one file queued or being compressed before write() waits for the pool
+#define LOG_BLOCKS_IN_FLIGHT 8
+
+// blocks dropped from their file since the last call, bzip2 failed on them even after a retry
+uint64_t block_writer_failures();
+
+// Writes a bz2 file as consecutive independent streams, one per LOG_BLOCK_SIZE of input.
+// Events are only copied into the current block, whole. Full blocks are compressed in
+// parallel on a worker pool shared by all files and written out in order. bzip2, bzcat
+// and python's bz2 module read concatenated streams back as one file.
+//
+// An indexed writer ends the file with the index described in log_index.h.
+struct BlockWriter {
+public:
+  BlockWriter(StorageFile *file, bool indexed = false);
+  ~BlockWriter();
+
+  // one serialized event, whole words as they come out of capnp
+  void write_event(const uint8_t *data, size_t size, uint64_t mono_time, uint16_t service);
+  // Room for the next event in the current block, for callers that fill it in place.
+  // Nothing is logged unless commit_event follows, before anything else is written.
+  uint8_t *reserve_event(size_t size);
+  void commit_event(size_t size, uint64_t mono_time, uint16_t service);
+  // compresses and writes the partial block and the index, then waits until everything
+  // is handed to the file. Nothing can be written after.
+  void close();
+
+  struct Block {
+    BlockWriter *writer;
+    uint64_t seq;
+    std::unique_ptr<char[]> in;
+    size_t in_size, in_cap;
+    std::vector<char> out;
+    unsigned int out_len;
+
+    uint64_t start_mono_time, end_mono_time;
+    std::vector<LogIndexService> services;
+  };
+  void compress(Block *b);
+
+private:
+  void submit();
+
+  StorageFile *file;
+  bool indexed;
+  Block *cur;
+
+  std::mutex lock;
+  std::condition_variable cv;
+  std::vector<std::unique_ptr<Block>> blocks;
+  std::vector<Block *> free_blocks;
+  // compressed blocks waiting on an earlier one
+  std::map<uint64_t, Block *> done;
+  uint64_t next_seq = 0, next_write = 0;
+  int in_flight = 0;
+  bool writing = false;
+
+  // filled in as blocks reach the file, only by the thread writing
+  uint64_t file_offset = 0;
+  std::vector<LogIndexChunk> index_chunks;
+  std::vector<LogIndexService> index_services;
+};
@@ -408,7 +408,7 @@ static void handle_out_buf(EncoderState *s, OMX_BUFFERHEADERTYPE *out_buf) {
 
   if (s->of) {
     //printf("write %d flags 0x%x\n", out_buf->nFilledLen, out_buf->nFlags);
-    fwrite(buf_data, out_buf->nFilledLen, 1, s->of);
+    storage_write(s->of, buf_data, out_buf->nFilledLen);
   }
 
   if (s->remuxing) {
@@ -587,10 +587,10 @@ void encoder_open(EncoderState *s, const char* path) {
 
     s->wrote_codec_config = false;
   } else {
-    s->of = fopen(s->vid_path, "wb");
+    s->of = storage_open(s->vid_path);
     assert(s->of);
     if (s->codec_config_len > 0) {
-      fwrite(s->codec_config, s->codec_config_len, 1, s->of);
+      storage_write(s->of, s->codec_config, s->codec_config_len);
     }
   }
 
@@ -640,10 +640,12 @@ void encoder_close(EncoderState *s) {
       av_write_trailer(s->ofmt_ctx);
       avio_closep(&s->ofmt_ctx->pb);
       avformat_free_context(s->ofmt_ctx);
+      unlink(s->lock_path);
     } else {
-      fclose(s->of);
+      // the lock goes once the file is written out and synced
+      storage_close(s->of, true, s->lock_path);
+      s->of = NULL;
     }
-    unlink(s->lock_path);
   }
   s->open = false;
 
@@ -13,6 +13,8 @@
 #include "common/cqueue.h"
 #include "common/visionipc.h"
 
+#include "storage.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -35,7 +37,7 @@ typedef struct EncoderState {
   int next_segment;
 
   const char* filename;
-  FILE *of;
+  StorageFile *of;
 
   size_t codec_config_len;
   uint8_t *codec_config;
@@ -4,6 +4,7 @@
 #include <cstdint>
 
 #include <string>
+#include <atomic>
 #include <mutex>
 
 class FrameLogger {
@@ -13,30 +14,38 @@ public:
   virtual void Open(const std::string &path) = 0;
   virtual void Close() = 0;
 
+  // Frames are logged from one thread, Rotate() can come from any. It only leaves a
+  // request behind, so LogFrame takes the lock when there is one to act on.
   int LogFrame(uint64_t ts, const uint8_t *y_ptr, const uint8_t *u_ptr, const uint8_t *v_ptr, int *frame_segment) {
-    std::lock_guard<std::recursive_mutex> guard(lock);
+    std::unique_lock<std::recursive_mutex> guard(lock, std::defer_lock);
+    bool changing = pending.load(std::memory_order_acquire);
+    if (changing) {
+      guard.lock();
+      pending = false;
+
+      if (opening) {
+        Open(next_path);
+        segment = next_segment;
+        opening = false;
+      }
 
-    if (opening) {
-      Open(next_path);
-      opening = false;
+      if (is_open && rotating) {
+        Close();
+        Open(next_path);
+        segment = next_segment;
+        rotating = false;
+      }
     }
 
     if (!is_open) return -1;
 
-    if (rotating) {
-      Close();
-      Open(next_path);
-      segment = next_segment;
-      rotating = false;
-    }
-
     int ret = ProcessFrame(ts, y_ptr, u_ptr, v_ptr);
 
     if (ret >= 0 && frame_segment) {
       *frame_segment = segment;
     }
 
-    if (closing) {
+    if (changing && closing) {
       Close();
       closing = false;
     }
@@ -56,9 +65,9 @@ public:
         rotating = true;
       }
     } else {
-      segment = next_segment;
       opening = true;
     }
+    pending.store(true, std::memory_order_release);
   }
 
 protected:
@@ -75,6 +84,7 @@ protected:
 private:
   int next_segment = -1;
   bool opening = false, closing = false, rotating = false;
+  std::atomic<bool> pending{false};
   std::string next_path;
 };
 
@@ -0,0 +1,136 @@
+#include <string.h>
+#include <bzlib.h>
+
+#include <algorithm>
+
+#include <capnp/serialize.h>
+
+#include "common/swaglog.h"
+
+#include "log_index.h"
+
+LogIndexReader::~LogIndexReader() {
+  if (file) fclose(file);
+}
+
+bool LogIndexReader::open(const std::string &path) {
+  if (file) fclose(file);
+  valid = false;
+  chunks.clear();
+  services.clear();
+
+  file = fopen(path.c_str(), "rb");
+  if (file == NULL) return false;
+
+  LogIndexTrailer trailer;
+  LogIndexHeader header;
+  if (fseek(file, 0, SEEK_END) != 0) return false;
+  long file_size = ftell(file);
+  if (file_size < (long)sizeof(trailer) ||
+      fseek(file, -(long)sizeof(trailer), SEEK_END) != 0 ||
+      fread(&trailer, sizeof(trailer), 1, file) != 1 ||
+      memcmp(trailer.magic, LOG_INDEX_MAGIC, sizeof(trailer.magic)) != 0) {
+    return false;
+  }
+
+  // the index sits between the last chunk and the trailer
+  uint64_t index_end = file_size - sizeof(trailer);
+  if (trailer.index_offset > index_end ||
+      fseek(file, trailer.index_offset, SEEK_SET) != 0 ||
+      fread(&header, sizeof(header), 1, file) != 1 ||
+      memcmp(header.magic, LOG_INDEX_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != LOG_INDEX_VERSION) {
+    return false;
+  }
+
+  uint64_t index_size = sizeof(header) + (uint64_t)header.num_chunks * sizeof(LogIndexChunk) +
+                        (uint64_t)header.num_services * sizeof(LogIndexService);
+  if (index_size > index_end - trailer.index_offset) return false;
+
+  chunks.resize(header.num_chunks);
+  services.resize(header.num_services);
+  if (fread(chunks.data(), sizeof(LogIndexChunk), chunks.size(), file) != chunks.size() ||
+      fread(services.data(), sizeof(LogIndexService), services.size(), file) != services.size() ||
+      !check_chunks(trailer.index_offset)) {
+    chunks.clear();
+    services.clear();
+    return false;
+  }
+
+  valid = true;
+  return true;
+}
+
+// everything read() takes from the index has to stay inside the file and the chunk
+bool LogIndexReader::check_chunks(uint64_t index_offset) {
+  for (const LogIndexChunk &chunk : chunks) {
+    if (chunk.offset > index_offset || chunk.size > index_offset - chunk.offset ||
+        chunk.raw_size % sizeof(capnp::word) != 0 ||
+        (uint64_t)chunk.first_service + chunk.num_services > services.size()) {
+      return false;
+    }
+    for (uint32_t i = chunk.first_service; i < chunk.first_service + chunk.num_services; i++) {
+      if (services[i].first_offset % sizeof(capnp::word) != 0 || services[i].first_offset > chunk.raw_size) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+int LogIndexReader::read(uint64_t start_mono_time, uint64_t end_mono_time, const std::vector<cereal::Event::Which> &want,
+                         std::function<void(cereal::Event::Reader)> f) {
+  skipped_chunks = 0;
+  if (!valid) return -1;
+
+  int decompressed = 0;
+  for (const LogIndexChunk &chunk : chunks) {
+    if (chunk.end_mono_time < start_mono_time || chunk.start_mono_time >= end_mono_time) continue;
+
+    // where the first wanted event starts, and how many there are to find
+    uint32_t first_offset = want.empty() ? 0 : chunk.raw_size;
+    uint32_t remaining = 0;
+    for (uint32_t i = chunk.first_service; i < chunk.first_service + chunk.num_services; i++) {
+      const LogIndexService &s = services[i];
+      if (want.empty() || std::find(want.begin(), want.end(), (cereal::Event::Which)s.service) != want.end()) {
+        first_offset = std::min(first_offset, s.first_offset);
+        remaining += s.count;
+      }
+    }
+    if (remaining == 0) continue;
+
+    compressed.resize(chunk.size);
+    raw.resize(chunk.raw_size / sizeof(capnp::word) + 1);
+    unsigned int raw_size = chunk.raw_size;
+    if (fseek(file, chunk.offset, SEEK_SET) != 0 ||
+        fread(compressed.data(), 1, chunk.size, file) != chunk.size ||
+        BZ2_bzBuffToBuffDecompress((char *)raw.data(), &raw_size, compressed.data(), chunk.size, 0, 0) != BZ_OK ||
+        raw_size != chunk.raw_size) {
+      LOGE("log index: chunk at %lu doesn't decompress, skipping it", chunk.offset);
+      skipped_chunks++;
+      continue;
+    }
+    decompressed++;
+
+    // events start on word boundaries, the chunk was written from whole serialized messages
+    kj::ArrayPtr<const capnp::word> rest(raw.data() + first_offset / sizeof(capnp::word), raw.data() + raw_size / sizeof(capnp::word));
+    try {
+      while (rest.size() > 0 && remaining > 0) {
+        capnp::FlatArrayMessageReader msg(rest);
+        cereal::Event::Reader event = msg.getRoot<cereal::Event>();
+        rest = kj::ArrayPtr<const capnp::word>(msg.getEnd(), rest.end());
+
+        if (!want.empty() && std::find(want.begin(), want.end(), event.which()) == want.end()) continue;
+        remaining--;
+        if (event.getLogMonoTime() >= start_mono_time && event.getLogMonoTime() < end_mono_time) {
+          f(event);
+        }
+      }
+    } catch (const kj::Exception& e) {
+      // the events before the bad one were already handed out
+      LOGE("log index: corrupt event in chunk at %lu, skipping the rest of it: %s", chunk.offset, e.getDescription().cStr());
+      skipped_chunks++;
+    }
+  }
+  return decompressed;
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "cereal/gen/cpp/log.capnp.h"
+
+// Indexed segments are the same chunked bz2 files BlockWriter writes, with whole events
+// per chunk and an index after the last chunk:
+//
+//   chunk 0 .. chunk n-1   independent bz2 streams
+//   LogIndexHeader
+//   LogIndexChunk[num_chunks]
+//   LogIndexService[num_services]
+//   LogIndexTrailer        where the header starts
+//
+// bzip2 and python's bz2 stop at the first thing that isn't a stream, so indexed files
+// still decompress to the plain log, with a trailing garbage warning from bzip2.
+
+#define LOG_INDEX_MAGIC "OPLOGIDX"
+#define LOG_INDEX_VERSION 1
+
+struct LogIndexHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t num_chunks;
+  uint32_t num_services;
+  uint32_t reserved;
+};
+
+struct LogIndexChunk {
+  uint64_t offset;
+  uint32_t size;
+  uint32_t raw_size;
+  uint64_t start_mono_time;
+  uint64_t end_mono_time;
+  // this chunk's LogIndexService entries
+  uint32_t first_service;
+  uint32_t num_services;
+};
+
+// where a service's events are in a decompressed chunk
+struct LogIndexService {
+  uint16_t service;  // cereal::Event::Which
+  uint16_t reserved;
+  uint32_t first_offset;
+  uint32_t count;
+};
+
+struct LogIndexTrailer {
+  uint64_t index_offset;
+  char magic[8];
+};
+
+// Reads events out of an indexed segment, decompressing only the chunks that overlap the
+// requested time range and carry one of the requested services
+class LogIndexReader {
+public:
+  ~LogIndexReader();
+
+  // false if the file can't be read, has no index or the index doesn't fit the file
+  bool open(const std::string &path);
+
+  // Calls f with every event of services (all if empty) with a logMonoTime in [start, end),
+  // in file order. Returns the number of chunks decompressed, -1 if open failed.
+  // A chunk that fails to decompress or holds an event that doesn't parse is skipped
+  // from there on and counted in skipped_chunks.
+  int read(uint64_t start_mono_time, uint64_t end_mono_time, const std::vector<cereal::Event::Which> &services,
+           std::function<void(cereal::Event::Reader)> f);
+
+  std::vector<LogIndexChunk> chunks;
+  std::vector<LogIndexService> services;
+  // by the last read
+  int skipped_chunks = 0;
+
+private:
+  bool check_chunks(uint64_t index_offset);
+
+  FILE *file = NULL;
+  bool valid = false;
+  std::vector<char> compressed;
+  std::vector<capnp::word> raw;
+};
@@ -0,0 +1,236 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <bzlib.h>
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include <capnp/serialize.h>
+
+#include "common/timing.h"
+
+#include "logger.h"
+#include "log_index.h"
+
+// Writes an indexed segment through the logger and reads it back: plain bz2 decoding
+// must still give the whole log, and index reads must return exactly the events asked
+// for while skipping the chunks that can't have them.
+
+#define LOG_ROOT "/tmp/log_index_test"
+#define NUM_EVENTS 20000
+#define EVENT_PERIOD_NS 10000000ULL
+
+struct Written {
+  uint64_t mono_time;
+  cereal::Event::Which which;
+};
+
+static kj::Array<capnp::word> build_event(uint64_t mono_time, int i, std::mt19937 &rng) {
+  capnp::MallocMessageBuilder msg;
+  auto event = msg.initRoot<cereal::Event>();
+  event.setLogMonoTime(mono_time);
+  if (i % 10 == 0) {
+    event.initCarState().setVEgo(i);
+  } else if (i % 10 == 1) {
+    event.initControlsState().setVEgo(i);
+  } else {
+    auto can = event.initCan(8);
+    for (int j = 0; j < 8; j++) {
+      uint8_t dat[8];
+      for (auto &d : dat) d = rng();
+      can[j].setAddress(0x100 + j);
+      can[j].setDat(kj::arrayPtr(dat, sizeof(dat)));
+    }
+  }
+  return capnp::messageToFlatArray(msg);
+}
+
+// every bz2 stream in the file back to back, the way bzip2 -d reads it
+static size_t decompress_all(const std::string &path) {
+  FILE *f = fopen(path.c_str(), "rb");
+  assert(f);
+  std::vector<char> data;
+  char buf[1 << 16];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) data.insert(data.end(), buf, buf + n);
+  fclose(f);
+
+  size_t out = 0, pos = 0;
+  while (data.size() - pos >= 3 && memcmp(&data[pos], "BZh", 3) == 0) {
+    bz_stream strm = {};
+    assert(BZ2_bzDecompressInit(&strm, 0, 0) == BZ_OK);
+    strm.next_in = &data[pos];
+    strm.avail_in = data.size() - pos;
+    int ret;
+    do {
+      strm.next_out = buf;
+      strm.avail_out = sizeof(buf);
+      ret = BZ2_bzDecompress(&strm);
+      assert(ret == BZ_OK || ret == BZ_STREAM_END);
+      out += sizeof(buf) - strm.avail_out;
+    } while (ret != BZ_STREAM_END);
+    pos = strm.next_in - data.data();
+    BZ2_bzDecompressEnd(&strm);
+  }
+  return out;
+}
+
+int main(int argc, char **argv) {
+  std::mt19937 rng(1);
+  std::vector<Written> written;
+  size_t written_bytes = 0;
+
+  LoggerState logger;
+  logger_init(&logger, "rlog", NULL, 0, true);
+  logger.indexed = true;
+  char segment_path[4096];
+  int err = logger_next(&logger, LOG_ROOT, segment_path, sizeof(segment_path), NULL);
+  assert(err == 0);
+
+  // after the start of route sentinel, and long after the end of route one is written
+  const uint64_t start = nanos_since_boot() + 1000000000ULL;
+  for (int i = 0; i < NUM_EVENTS; i++) {
+    uint64_t mono_time = start + i * EVENT_PERIOD_NS;
+    auto words = build_event(mono_time, i, rng);
+    auto bytes = words.asBytes();
+    logger_log(&logger, bytes.begin(), bytes.size(), false);
+
+    capnp::FlatArrayMessageReader msg(words);
+    written.push_back({mono_time, msg.getRoot<cereal::Event>().which()});
+    written_bytes += bytes.size();
+  }
+  logger_close(&logger);
+
+  // the file is done once its lock is gone
+  std::string path = std::string(segment_path) + "/rlog.bz2";
+  while (access((path + ".lock").c_str(), F_OK) == 0) usleep(1000);
+
+  // plain bz2 readers see the log, two sentinels and all
+  size_t raw = decompress_all(path);
+  printf("decompressed %zu bytes, logged %zu + sentinels\n", raw, written_bytes);
+  assert(raw > written_bytes && raw < written_bytes + 1024);
+
+  LogIndexReader reader;
+  assert(reader.open(path));
+  printf("%zu chunks, %zu service entries\n", reader.chunks.size(), reader.services.size());
+  assert(reader.chunks.size() > 4);
+
+  // everything
+  size_t count = 0;
+  int chunks = reader.read(0, UINT64_MAX, {}, [&](cereal::Event::Reader event) { count++; });
+  assert(count == written.size() + 2);
+  assert(chunks == (int)reader.chunks.size());
+
+  // one service over a time range in the middle
+  uint64_t range_start = start + NUM_EVENTS / 2 * EVENT_PERIOD_NS, range_end = range_start + 20 * 1000000000ULL;
+  std::vector<uint64_t> expected, got;
+  for (auto &w : written) {
+    if (w.which == cereal::Event::CAR_STATE && w.mono_time >= range_start && w.mono_time < range_end) {
+      expected.push_back(w.mono_time);
+    }
+  }
+  chunks = reader.read(range_start, range_end, {cereal::Event::CAR_STATE}, [&](cereal::Event::Reader event) {
+    assert(event.which() == cereal::Event::CAR_STATE);
+    got.push_back(event.getLogMonoTime());
+  });
+  printf("car state in 20s: %zu events from %d of %zu chunks\n", got.size(), chunks, reader.chunks.size());
+  assert(got == expected);
+  assert(chunks < (int)reader.chunks.size() / 2);
+
+  // a service that was never logged touches nothing
+  chunks = reader.read(0, UINT64_MAX, {cereal::Event::GPS_LOCATION}, [&](cereal::Event::Reader event) { assert(false); });
+  assert(chunks == 0);
+  assert(reader.skipped_chunks == 0);
+
+  // a chunk that decompresses to events that don't parse is skipped, the rest still reads
+  {
+    FILE *f = fopen(path.c_str(), "rb");
+    assert(f);
+    std::vector<char> data;
+    char buf[1 << 16];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) data.insert(data.end(), buf, buf + n);
+    fclose(f);
+
+    std::vector<LogIndexChunk> bad_chunks = reader.chunks;
+    LogIndexChunk &last = bad_chunks.back();
+    std::vector<char> raw_chunk(last.raw_size);
+    unsigned int raw_size = last.raw_size;
+    assert(BZ2_bzBuffToBuffDecompress(raw_chunk.data(), &raw_size, &data[last.offset], last.size, 0, 0) == BZ_OK);
+    // a segment table claiming more segments than the chunk holds
+    uint32_t num_segments = UINT32_MAX / 2;
+    memcpy(raw_chunk.data(), &num_segments, sizeof(num_segments));
+
+    std::vector<char> compressed(raw_size + raw_size / 100 + 600);
+    unsigned int compressed_size = compressed.size();
+    assert(BZ2_bzBuffToBuffCompress(compressed.data(), &compressed_size, raw_chunk.data(), raw_size, 9, 0, 30) == BZ_OK);
+    last.size = compressed_size;
+
+    LogIndexHeader header = {};
+    memcpy(header.magic, LOG_INDEX_MAGIC, sizeof(header.magic));
+    header.version = LOG_INDEX_VERSION;
+    header.num_chunks = bad_chunks.size();
+    header.num_services = reader.services.size();
+    LogIndexTrailer trailer = {last.offset + compressed_size};
+    memcpy(trailer.magic, LOG_INDEX_MAGIC, sizeof(trailer.magic));
+
+    std::string bad_path = std::string(LOG_ROOT) + "/bad_chunk.bz2";
+    f = fopen(bad_path.c_str(), "wb");
+    assert(f);
+    fwrite(data.data(), 1, last.offset, f);
+    fwrite(compressed.data(), 1, compressed_size, f);
+    fwrite(&header, sizeof(header), 1, f);
+    fwrite(bad_chunks.data(), sizeof(LogIndexChunk), bad_chunks.size(), f);
+    fwrite(reader.services.data(), sizeof(LogIndexService), reader.services.size(), f);
+    fwrite(&trailer, sizeof(trailer), 1, f);
+    fclose(f);
+
+    size_t in_last = 0;
+    for (uint32_t i = last.first_service; i < last.first_service + last.num_services; i++) {
+      in_last += reader.services[i].count;
+    }
+
+    LogIndexReader bad_reader;
+    assert(bad_reader.open(bad_path));
+    count = 0;
+    chunks = bad_reader.read(0, UINT64_MAX, {}, [&](cereal::Event::Reader event) { count++; });
+    printf("corrupt last chunk: %zu of %zu events read\n", count, written.size() + 2);
+    assert(chunks == (int)bad_chunks.size());
+    assert(bad_reader.skipped_chunks == 1);
+    assert(count == written.size() + 2 - in_last);
+    unlink(bad_path.c_str());
+  }
+
+  // a corrupt index fails the open, and the reader doesn't read with what it had before
+  FILE *f = fopen(path.c_str(), "r+b");
+  assert(f);
+  LogIndexTrailer trailer;
+  assert(fseek(f, -(long)sizeof(trailer), SEEK_END) == 0 && fread(&trailer, sizeof(trailer), 1, f) == 1);
+  long last_chunk = trailer.index_offset + sizeof(LogIndexHeader) + (reader.chunks.size() - 1) * sizeof(LogIndexChunk);
+  auto corrupt = [&](size_t field, uint32_t value) {
+    uint32_t prev;
+    assert(fseek(f, last_chunk + field, SEEK_SET) == 0 && fread(&prev, sizeof(prev), 1, f) == 1);
+    assert(fseek(f, last_chunk + field, SEEK_SET) == 0 && fwrite(&value, sizeof(value), 1, f) == 1);
+    fflush(f);
+
+    bool opened = reader.open(path);
+    int r = reader.read(0, UINT64_MAX, {}, [&](cereal::Event::Reader event) {});
+
+    assert(fseek(f, last_chunk + field, SEEK_SET) == 0 && fwrite(&prev, sizeof(prev), 1, f) == 1);
+    fflush(f);
+    return !opened && r == -1 && reader.chunks.empty();
+  };
+  assert(corrupt(offsetof(LogIndexChunk, first_service), reader.services.size()));
+  assert(corrupt(offsetof(LogIndexChunk, num_services), UINT32_MAX));
+  assert(corrupt(offsetof(LogIndexChunk, size), trailer.index_offset));
+  assert(corrupt(offsetof(LogIndexChunk, raw_size), 4));
+  fclose(f);
+
+  // the untouched index opens again
+  assert(reader.open(path));
+  return 0;
+}
@@ -8,14 +8,15 @@
 #include <errno.h>
 
 #include <unistd.h>
+#include <sched.h>
 #include <sys/stat.h>
 
 #include <pthread.h>
-#include <bzlib.h>
 
 #include "common/swaglog.h"
 
 #include "logger.h"
+#include "block_writer.h"
 
 #include <capnp/serialize.h>
 #include "cereal/gen/cpp/log.capnp.h"
@@ -32,6 +33,19 @@ static void log_sentinel(LoggerState *s, cereal::Sentinel::SentinelType type) {
   logger_log(s, bytes.begin(), bytes.size(), true);
 }
 
+// logMonoTime and service of a serialized event, for the segment index
+static void event_info(const uint8_t* data, size_t data_size, uint64_t* mono_time, uint16_t* service) {
+  try {
+    capnp::FlatArrayMessageReader msg(kj::ArrayPtr<const capnp::word>((const capnp::word*)data, data_size / sizeof(capnp::word)));
+    auto event = msg.getRoot<cereal::Event>();
+    *mono_time = event.getLogMonoTime();
+    *service = (uint16_t)event.which();
+  } catch (const kj::Exception& e) {
+    *mono_time = 0;
+    *service = UINT16_MAX;
+  }
+}
+
 static int mkpath(char* file_path) {
   assert(file_path && *file_path);
   char* p;
@@ -91,6 +105,7 @@ static LoggerHandle* logger_open(LoggerState *s, const char* root_path) {
   snprintf(h->log_path, sizeof(h->log_path), "%s/%s.bz2", h->segment_path, s->log_name);
   snprintf(h->qlog_path, sizeof(h->qlog_path), "%s/qlog.bz2", h->segment_path);
   snprintf(h->lock_path, sizeof(h->lock_path), "%s.lock", h->log_path);
+  snprintf(h->qlog_lock_path, sizeof(h->qlog_lock_path), "%s.lock", h->qlog_path);
 
   err = mkpath(h->log_path);
   if (err) return NULL;
@@ -99,31 +114,37 @@ static LoggerHandle* logger_open(LoggerState *s, const char* root_path) {
   if (lock_file == NULL) return NULL;
   fclose(lock_file);
 
-  h->log_file = fopen(h->log_path, "wb");
+  if (s->has_qlog) {
+    // the files finish writing in the background, each keeps its own lock until then
+    lock_file = fopen(h->qlog_lock_path, "wb");
+    if (lock_file == NULL) return NULL;
+    fclose(lock_file);
+  }
+
+  h->log_file = storage_open(h->log_path);
   if (h->log_file == NULL) goto fail;
 
   if (s->has_qlog) {
-    h->qlog_file = fopen(h->qlog_path, "wb");
+    h->qlog_file = storage_open(h->qlog_path);
     if (h->qlog_file == NULL) goto fail;
   }
 
-  int bzerror;
-  h->bz_file = BZ2_bzWriteOpen(&bzerror, h->log_file, 9, 0, 30);
-  if (bzerror != BZ_OK) goto fail;
-
+  // the files are bz2, compressed a block at a time off this thread
+  h->indexed = s->indexed;
+  h->log_writer = new BlockWriter(h->log_file, h->indexed);
   if (s->has_qlog) {
-    h->bz_qlog = BZ2_bzWriteOpen(&bzerror, h->qlog_file, 9, 0, 30);
-    if (bzerror != BZ_OK) goto fail;
+    h->qlog_writer = new BlockWriter(h->qlog_file, h->indexed);
   }
 
   if (s->init_data) {
-    BZ2_bzWrite(&bzerror, h->bz_file, s->init_data, s->init_data_len);
-    if (bzerror != BZ_OK) goto fail;
+    uint64_t mono_time = 0;
+    uint16_t service = 0;
+    if (h->indexed) event_info(s->init_data, s->init_data_len, &mono_time, &service);
+    h->log_writer->write_event(s->init_data, s->init_data_len, mono_time, service);
 
     if (s->has_qlog) {
       // init data goes in the qlog too
-      BZ2_bzWrite(&bzerror, h->bz_qlog, s->init_data, s->init_data_len);
-      if (bzerror != BZ_OK) goto fail;
+      h->qlog_writer->write_event(s->init_data, s->init_data_len, mono_time, service);
     }
   }
 
@@ -132,25 +153,51 @@ static LoggerHandle* logger_open(LoggerState *s, const char* root_path) {
   return h;
 fail:
   LOGE("logger failed to open files");
-  if (h->bz_file) {
-    BZ2_bzWriteClose(&bzerror, h->bz_file, 0, NULL, NULL);
-    h->bz_file = NULL;
-  }
-  if (h->bz_qlog) {
-    BZ2_bzWriteClose(&bzerror, h->bz_qlog, 0, NULL, NULL);
-    h->bz_qlog = NULL;
-  }
   if (h->qlog_file) {
-    fclose(h->qlog_file);
+    storage_close(h->qlog_file, false, NULL);
     h->qlog_file = NULL;
   }
   if (h->log_file) {
-    fclose(h->log_file);
+    storage_close(h->log_file, false, NULL);
     h->log_file = NULL;
   }
   return NULL;
 }
 
+// Writers pin the epoch they start in for as long as they use cur_handle. Rotation
+// publishes the new handle, moves to the next epoch and waits out the writers still
+// in the previous one before it drops the old handle, so writers never take a lock.
+static int logger_enter(LoggerState *s) {
+  while (true) {
+    uint64_t epoch = __atomic_load_n(&s->epoch, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&s->writers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&s->epoch, __ATOMIC_SEQ_CST) == epoch) {
+      return epoch & 1;
+    }
+    // raced a rotation, the epoch it's waiting out may be this one
+    __atomic_sub_fetch(&s->writers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+static void logger_exit(LoggerState *s, int parity) {
+  __atomic_sub_fetch(&s->writers[parity], 1, __ATOMIC_SEQ_CST);
+}
+
+// call with s->lock held
+static void logger_swap(LoggerState *s, LoggerHandle *next_h) {
+  LoggerHandle *prev_h = s->cur_handle;
+  __atomic_store_n(&s->cur_handle, next_h, __ATOMIC_SEQ_CST);
+  uint64_t prev_epoch = __atomic_fetch_add(&s->epoch, 1, __ATOMIC_SEQ_CST);
+
+  // writers that could have loaded prev_h are at most one lh_log from done
+  while (__atomic_load_n(&s->writers[prev_epoch & 1], __ATOMIC_SEQ_CST) > 0) {
+    sched_yield();
+  }
+  if (prev_h) {
+    lh_close(prev_h);
+  }
+}
+
 int logger_next(LoggerState *s, const char* root_path,
                             char* out_segment_path, size_t out_segment_path_len,
                             int* out_part) {
@@ -166,10 +213,7 @@ int logger_next(LoggerState *s, const char* root_path,
     return -1;
   }
 
-  if (s->cur_handle) {
-    lh_close(s->cur_handle);
-  }
-  s->cur_handle = next_h;
+  logger_swap(s, next_h);
 
   if (out_segment_path) {
     snprintf(out_segment_path, out_segment_path_len, "%s", next_h->segment_path);
@@ -185,23 +229,32 @@ int logger_next(LoggerState *s, const char* root_path,
 }
 
 LoggerHandle* logger_get_handle(LoggerState *s) {
-  pthread_mutex_lock(&s->lock);
-  LoggerHandle* h = s->cur_handle;
+  int parity = logger_enter(s);
+  LoggerHandle* h = __atomic_load_n(&s->cur_handle, __ATOMIC_SEQ_CST);
   if (h) {
     pthread_mutex_lock(&h->lock);
     h->refcnt++;
     pthread_mutex_unlock(&h->lock);
   }
-  pthread_mutex_unlock(&s->lock);
+  logger_exit(s, parity);
   return h;
 }
 
 void logger_log(LoggerState *s, uint8_t* data, size_t data_size, bool in_qlog) {
-  pthread_mutex_lock(&s->lock);
-  if (s->cur_handle) {
-    lh_log(s->cur_handle, data, data_size, in_qlog);
+  int parity = logger_enter(s);
+  LoggerHandle* h = __atomic_load_n(&s->cur_handle, __ATOMIC_SEQ_CST);
+  if (h) {
+    lh_log(h, data, data_size, in_qlog);
   }
-  pthread_mutex_unlock(&s->lock);
+  logger_exit(s, parity);
+}
+
+bool logger_log_with(LoggerState *s, size_t data_size, bool in_qlog, logger_fill_fn fill, void* ctx) {
+  int parity = logger_enter(s);
+  LoggerHandle* h = __atomic_load_n(&s->cur_handle, __ATOMIC_SEQ_CST);
+  bool ret = h ? lh_log_with(h, data_size, in_qlog, fill, ctx) : fill(NULL, data_size, ctx);
+  logger_exit(s, parity);
+  return ret;
 }
 
 void logger_close(LoggerState *s) {
@@ -209,22 +262,42 @@ void logger_close(LoggerState *s) {
 
   pthread_mutex_lock(&s->lock);
   free(s->init_data);
-  if (s->cur_handle) {
-    lh_close(s->cur_handle);
-  }
+  s->init_data = NULL;
+  logger_swap(s, NULL);
   pthread_mutex_unlock(&s->lock);
 }
 
 void lh_log(LoggerHandle* h, uint8_t* data, size_t data_size, bool in_qlog) {
   pthread_mutex_lock(&h->lock);
   assert(h->refcnt > 0);
-  int bzerror;
-  BZ2_bzWrite(&bzerror, h->bz_file, data, data_size);
+  uint64_t mono_time = 0;
+  uint16_t service = 0;
+  if (h->indexed) event_info(data, data_size, &mono_time, &service);
+  h->log_writer->write_event(data, data_size, mono_time, service);
 
-  if (in_qlog && h->bz_qlog != NULL) {
-    BZ2_bzWrite(&bzerror, h->bz_qlog, data, data_size);
+  if (in_qlog && h->qlog_writer != NULL) {
+    h->qlog_writer->write_event(data, data_size, mono_time, service);
+  }
+  pthread_mutex_unlock(&h->lock);
+}
+
+bool lh_log_with(LoggerHandle* h, size_t data_size, bool in_qlog, logger_fill_fn fill, void* ctx) {
+  pthread_mutex_lock(&h->lock);
+  assert(h->refcnt > 0);
+  uint8_t* dst = h->log_writer->reserve_event(data_size);
+  bool ok = fill(dst, data_size, ctx);
+  if (ok) {
+    uint64_t mono_time = 0;
+    uint16_t service = 0;
+    if (h->indexed) event_info(dst, data_size, &mono_time, &service);
+    // the qlog copies from the rlog block, before commit can hand it to the compressor
+    if (in_qlog && h->qlog_writer != NULL) {
+      h->qlog_writer->write_event(dst, data_size, mono_time, service);
+    }
+    h->log_writer->commit_event(data_size, mono_time, service);
   }
   pthread_mutex_unlock(&h->lock);
+  return ok;
 }
 
 void lh_close(LoggerHandle* h) {
@@ -232,23 +305,23 @@ void lh_close(LoggerHandle* h) {
   assert(h->refcnt > 0);
   h->refcnt--;
   if (h->refcnt == 0) {
-    if (h->bz_file){
-      int bzerror;
-      BZ2_bzWriteClose(&bzerror, h->bz_file, 0, NULL, NULL);
-      h->bz_file = NULL;
+    if (h->log_writer) {
+      h->log_writer->close();
+      delete h->log_writer;
+      h->log_writer = NULL;
     }
-    if (h->bz_qlog){
-      int bzerror;
-      BZ2_bzWriteClose(&bzerror, h->bz_qlog, 0, NULL, NULL);
-      h->bz_qlog = NULL;
+    if (h->qlog_writer) {
+      h->qlog_writer->close();
+      delete h->qlog_writer;
+      h->qlog_writer = NULL;
     }
+    // segments are fsynced on close, off this thread
     if (h->qlog_file) {
-      fclose(h->qlog_file);
+      storage_close(h->qlog_file, true, h->qlog_lock_path);
       h->qlog_file = NULL;
     }
-    fclose(h->log_file);
+    storage_close(h->log_file, true, h->lock_path);
     h->log_file = NULL;
-    unlink(h->lock_path);
     pthread_mutex_unlock(&h->lock);
     pthread_mutex_destroy(&h->lock);
     return;
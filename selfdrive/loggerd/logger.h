@@ -4,7 +4,8 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <pthread.h>
-#include <bzlib.h>
+
+#include "storage.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -18,12 +19,14 @@ typedef struct LoggerHandle {
   char segment_path[4096];
   char log_path[4096];
   char lock_path[4096];
-  FILE* log_file;
-  BZFILE* bz_file;
+  StorageFile* log_file;
+  struct BlockWriter* log_writer;
+  bool indexed;
 
-  FILE* qlog_file;
+  StorageFile* qlog_file;
   char qlog_path[4096];
-  BZFILE* bz_qlog;
+  char qlog_lock_path[4096];
+  struct BlockWriter* qlog_writer;
 } LoggerHandle;
 
 typedef struct LoggerState {
@@ -36,9 +39,15 @@ typedef struct LoggerState {
   char route_name[64];
   char log_name[64];
   bool has_qlog;
+  // write segments with a chunk index, see log_index.h
+  bool indexed;
 
   LoggerHandle handles[LOGGER_MAX_HANDLES];
+  // swapped atomically by logger_next, logger_log doesn't take the lock
   LoggerHandle* cur_handle;
+  // writers in flight, by the parity of the epoch they started in
+  uint64_t epoch;
+  int writers[2];
 } LoggerState;
 
 void logger_init(LoggerState *s, const char* log_name, const uint8_t* init_data, size_t init_data_len, bool has_qlog);
@@ -49,7 +58,14 @@ LoggerHandle* logger_get_handle(LoggerState *s);
 void logger_close(LoggerState *s);
 void logger_log(LoggerState *s, uint8_t* data, size_t data_size, bool in_qlog);
 
+// Fills data_size bytes of the event in place, straight into the rlog block. Returns
+// false if what it wrote can't be trusted, then nothing is logged. Called with dst NULL
+// when there is no segment to log to, so the caller still gets to let go of the source.
+typedef bool (*logger_fill_fn)(uint8_t* dst, size_t data_size, void* ctx);
+bool logger_log_with(LoggerState *s, size_t data_size, bool in_qlog, logger_fill_fn fill, void* ctx);
+
 void lh_log(LoggerHandle* h, uint8_t* data, size_t data_size, bool in_qlog);
+bool lh_log_with(LoggerHandle* h, size_t data_size, bool in_qlog, logger_fill_fn fill, void* ctx);
 void lh_close(LoggerHandle* h);
 
 #ifdef __cplusplus
@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <bzlib.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <capnp/serialize.h>
+
+#include "common/timing.h"
+
+#include "logger.h"
+
+// Replays a recorded segment through logger_log and reports throughput and CPU use,
+// next to the same bytes through one synchronous BZ2_bzWrite stream like loggerd used
+// to do on its main loop. Storage latency comes from the same histograms loggerd logs.
+//   ./logger_bench <rlog or rlog.bz2> [output dir]
+
+#define QLOG_DECIMATION 10
+
+static std::vector<char> read_log(const char *path) {
+  std::vector<char> data;
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) return data;
+
+  char buf[1 << 16];
+  if (strlen(path) > 4 && strcmp(path + strlen(path) - 4, ".bz2") == 0) {
+    int bzerror;
+    BZFILE *bz = BZ2_bzReadOpen(&bzerror, f, 0, 0, NULL, 0);
+    while (bzerror == BZ_OK) {
+      int n = BZ2_bzRead(&bzerror, bz, buf, sizeof(buf));
+      if (n > 0) data.insert(data.end(), buf, buf + n);
+    }
+    BZ2_bzReadClose(&bzerror, bz);
+  } else {
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+      data.insert(data.end(), buf, buf + n);
+    }
+  }
+  fclose(f);
+  return data;
+}
+
+static double cpu_seconds() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+}
+
+static double thread_cpu_seconds() {
+  struct rusage usage;
+  getrusage(RUSAGE_THREAD, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+}
+
+static void report(const char *name, size_t bytes, double wall, double cpu, double caller_cpu) {
+  printf("%-12s %7.2f MB/s  CPU %5.1f%%  calling thread %5.1f%%\n",
+         name, bytes / 1e6 / wall, 100. * cpu / wall, 100. * caller_cpu / wall);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    printf("usage: %s <rlog or rlog.bz2> [output dir]\n", argv[0]);
+    return 1;
+  }
+  std::string out_dir = argc > 2 ? argv[2] : "/tmp/logger_bench";
+
+  std::vector<char> log = read_log(argv[1]);
+  // copy into aligned words and split into events the way they'd come off the sockets
+  auto words = kj::heapArray<capnp::word>(log.size() / sizeof(capnp::word) + 1);
+  memcpy(words.begin(), log.data(), log.size());
+  std::vector<kj::ArrayPtr<capnp::word>> events;
+  kj::ArrayPtr<const capnp::word> rest(words.begin(), log.size() / sizeof(capnp::word));
+  while (rest.size() > 0) {
+    capnp::FlatArrayMessageReader reader(rest);
+    const capnp::word *end = reader.getEnd();
+    events.push_back(kj::ArrayPtr<capnp::word>((capnp::word *)rest.begin(), (capnp::word *)end));
+    rest = kj::ArrayPtr<const capnp::word>(end, rest.end());
+  }
+  if (events.empty()) {
+    printf("no events in %s\n", argv[1]);
+    return 1;
+  }
+  printf("%zu events, %.1f MB\n", events.size(), log.size() / 1e6);
+
+  // one bz2 stream written on the calling thread
+  {
+    std::string path = out_dir + "_sync.bz2";
+    FILE *f = fopen(path.c_str(), "wb");
+    int bzerror;
+    double start = seconds_since_boot(), start_cpu = cpu_seconds(), start_thread = thread_cpu_seconds();
+    BZFILE *bz = BZ2_bzWriteOpen(&bzerror, f, 9, 0, 30);
+    for (auto &e : events) {
+      BZ2_bzWrite(&bzerror, bz, e.begin(), e.asBytes().size());
+    }
+    BZ2_bzWriteClose(&bzerror, bz, 0, NULL, NULL);
+    fclose(f);
+    report("sync bz2", log.size(), seconds_since_boot() - start, cpu_seconds() - start_cpu, thread_cpu_seconds() - start_thread);
+    unlink(path.c_str());
+  }
+
+  // logger_log through the block writers, closing the segment includes the tail blocks
+  {
+    LoggerState logger;
+    logger_init(&logger, "rlog", NULL, 0, true);
+    char segment_path[4096];
+    if (logger_next(&logger, out_dir.c_str(), segment_path, sizeof(segment_path), NULL) != 0) {
+      printf("failed to open a segment in %s\n", out_dir.c_str());
+      return 1;
+    }
+
+    double start = seconds_since_boot(), start_cpu = cpu_seconds(), start_thread = thread_cpu_seconds();
+    double max_call = 0.;
+    for (size_t i = 0; i < events.size(); i++) {
+      auto bytes = events[i].asBytes();
+      double call_start = seconds_since_boot();
+      logger_log(&logger, bytes.begin(), bytes.size(), i % QLOG_DECIMATION == 0);
+      max_call = std::max(max_call, seconds_since_boot() - call_start);
+    }
+    double caller = thread_cpu_seconds() - start_thread;
+    logger_close(&logger);
+    // the file is done once its lock is gone
+    std::string lock_path = std::string(segment_path) + "/rlog.bz2.lock";
+    while (access(lock_path.c_str(), F_OK) == 0) usleep(1000);
+    report("logger_log", log.size(), seconds_since_boot() - start, cpu_seconds() - start_cpu, caller);
+    printf("slowest logger_log call: %.2f ms\n", max_call * 1e3);
+
+    StorageStats stats;
+    storage_stats(&stats);
+    printf("storage write p50 %lu us p99 %lu us max %lu us, flush p50 %lu us p99 %lu us max %lu us\n",
+           storage_hist_quantile(stats.write_us, 0.5), storage_hist_quantile(stats.write_us, 0.99), storage_hist_quantile(stats.write_us, 1.0),
+           storage_hist_quantile(stats.flush_us, 0.5), storage_hist_quantile(stats.flush_us, 0.99), storage_hist_quantile(stats.flush_us, 1.0));
+    printf("wrote %s\n", segment_path);
+  }
+  return 0;
+}
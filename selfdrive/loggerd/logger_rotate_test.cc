@@ -0,0 +1,181 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <bzlib.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <capnp/serialize.h>
+
+#include "common/timing.h"
+
+#include "logger.h"
+
+// Rotates every second while a main loop thread logs through logger_log(_with) and two encoder
+// like threads log through their own handles, all as fast as they can. Every message
+// must end up in exactly one segment, in the order each thread sent them.
+
+#define LOG_ROOT "/tmp/logger_rotate_test"
+#define NUM_ROTATIONS 10
+#define ROTATE_INTERVAL_US 1000000
+#define NUM_ENCODERS 2
+
+static std::atomic<bool> do_exit(false);
+
+static kj::Array<capnp::word> build_event(int thread, uint32_t seq) {
+  capnp::MallocMessageBuilder msg;
+  auto event = msg.initRoot<cereal::Event>();
+  event.setLogMonoTime(nanos_since_boot());
+  auto eidx = event.initEncodeIdx();
+  eidx.setEncodeId(thread);
+  eidx.setFrameId(seq);
+  return capnp::messageToFlatArray(msg);
+}
+
+static bool fill_copy(uint8_t *dst, size_t size, void *ctx) {
+  if (dst) memcpy(dst, ctx, size);
+  return true;
+}
+
+// half the messages go in place, the way loggerd logs from the msgq ring
+static uint32_t main_loop(LoggerState *logger) {
+  uint32_t seq = 0;
+  while (!do_exit) {
+    auto words = build_event(0, seq);
+    auto bytes = words.asBytes();
+    if (seq % 2 == 0) {
+      logger_log(logger, bytes.begin(), bytes.size(), seq % 10 == 0);
+    } else {
+      logger_log_with(logger, bytes.size(), seq % 10 == 1, fill_copy, bytes.begin());
+    }
+    seq++;
+  }
+  return seq;
+}
+
+// follows rotations like encoder_thread does, swapping handles when the part moves
+static uint32_t encoder(LoggerState *logger, int thread) {
+  uint32_t seq = 0;
+  int part = -1;
+  LoggerHandle *lh = NULL;
+  while (!do_exit) {
+    int cur_part = __atomic_load_n(&logger->part, __ATOMIC_SEQ_CST);
+    if (cur_part != part) {
+      if (lh) lh_close(lh);
+      lh = logger_get_handle(logger);
+      part = cur_part;
+    }
+    auto words = build_event(thread, seq);
+    auto bytes = words.asBytes();
+    lh_log(lh, bytes.begin(), bytes.size(), false);
+    seq++;
+  }
+  if (lh) lh_close(lh);
+  return seq;
+}
+
+static std::vector<char> decompress(const std::string &path) {
+  FILE *f = fopen(path.c_str(), "rb");
+  assert(f);
+  std::vector<char> data, out;
+  char buf[1 << 16];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) data.insert(data.end(), buf, buf + n);
+  fclose(f);
+
+  size_t pos = 0;
+  while (data.size() - pos >= 3 && memcmp(&data[pos], "BZh", 3) == 0) {
+    bz_stream strm = {};
+    assert(BZ2_bzDecompressInit(&strm, 0, 0) == BZ_OK);
+    strm.next_in = &data[pos];
+    strm.avail_in = data.size() - pos;
+    int ret;
+    do {
+      strm.next_out = buf;
+      strm.avail_out = sizeof(buf);
+      ret = BZ2_bzDecompress(&strm);
+      assert(ret == BZ_OK || ret == BZ_STREAM_END);
+      out.insert(out.end(), buf, buf + sizeof(buf) - strm.avail_out);
+    } while (ret != BZ_STREAM_END);
+    pos = strm.next_in - data.data();
+    BZ2_bzDecompressEnd(&strm);
+  }
+  return out;
+}
+
+int main(int argc, char **argv) {
+  LoggerState logger;
+  logger_init(&logger, "rlog", NULL, 0, true);
+
+  std::vector<std::string> segments;
+  char segment_path[4096];
+  int err = logger_next(&logger, LOG_ROOT, segment_path, sizeof(segment_path), NULL);
+  assert(err == 0);
+  segments.push_back(segment_path);
+
+  uint32_t sent[1 + NUM_ENCODERS];
+  std::vector<std::thread> threads;
+  threads.emplace_back([&] { sent[0] = main_loop(&logger); });
+  for (int i = 1; i <= NUM_ENCODERS; i++) {
+    threads.emplace_back([&, i] { sent[i] = encoder(&logger, i); });
+  }
+
+  for (int i = 0; i < NUM_ROTATIONS; i++) {
+    usleep(ROTATE_INTERVAL_US);
+    double start = millis_since_boot();
+    err = logger_next(&logger, LOG_ROOT, segment_path, sizeof(segment_path), NULL);
+    assert(err == 0);
+    printf("rotated to %s in %.1f ms\n", segment_path, millis_since_boot() - start);
+    segments.push_back(segment_path);
+  }
+
+  do_exit = true;
+  for (auto &t : threads) t.join();
+  logger_close(&logger);
+
+  // every thread's messages, across segments in order, must count up without a gap
+  uint32_t next[1 + NUM_ENCODERS] = {};
+  int sentinels = 0;
+  for (auto &segment : segments) {
+    // the file is done once its lock is gone
+    while (access((segment + "/rlog.bz2.lock").c_str(), F_OK) == 0) usleep(1000);
+    std::vector<char> log = decompress(segment + "/rlog.bz2");
+    auto words = kj::heapArray<capnp::word>(log.size() / sizeof(capnp::word));
+    memcpy(words.begin(), log.data(), words.asBytes().size());
+
+    size_t count = 0;
+    kj::ArrayPtr<const capnp::word> rest = words.asPtr();
+    while (rest.size() > 0) {
+      capnp::FlatArrayMessageReader msg(rest);
+      auto event = msg.getRoot<cereal::Event>();
+      rest = kj::ArrayPtr<const capnp::word>(msg.getEnd(), rest.end());
+
+      if (event.isSentinel()) {
+        sentinels++;
+        continue;
+      }
+      auto eidx = event.getEncodeIdx();
+      int thread = eidx.getEncodeId();
+      assert(thread >= 0 && thread <= NUM_ENCODERS);
+      if (eidx.getFrameId() != next[thread]) {
+        printf("%s: thread %d message %u, expected %u\n", segment.c_str(), thread, eidx.getFrameId(), next[thread]);
+        return 1;
+      }
+      next[thread]++;
+      count++;
+    }
+    printf("%s: %zu messages\n", segment.c_str(), count);
+  }
+
+  for (int i = 0; i <= NUM_ENCODERS; i++) {
+    printf("thread %d: sent %u, logged %u\n", i, sent[i], next[i]);
+    assert(next[i] == sent[i]);
+  }
+  // start and end of the route, and both ends of every rotation
+  assert(sentinels == 2 + 2 * NUM_ROTATIONS);
+  return 0;
+}
@@ -16,6 +16,7 @@
 #include <fstream>
 #include <streambuf>
 #include <thread>
+#include <atomic>
 #include <mutex>
 #include <condition_variable>
 #include <random>
@@ -35,6 +36,7 @@
 #include "common/util.h"
 
 #include "logger.h"
+#include "block_writer.h"
 #include "messaging.hpp"
 #include "services.h"
 
@@ -53,12 +55,16 @@
 
 #define CAMERA_FPS 20
 #define SEGMENT_LENGTH 60
+#define STATS_INTERVAL 10 // seconds between logged message and storage stats
 #define LOG_ROOT "/data/media/0/realdata"
 #define ENABLE_LIDAR 0
 
 #define RAW_CLIP_LENGTH 100 // 5 seconds at 20fps
 #define RAW_CLIP_FREQUENCY (randrange(61, 8*60)) // once every ~4 minutes
 
+// encoders read rotations out of a ring, a slot is only rewritten this many rotations later
+#define ROTATE_SLOTS 4
+
 namespace {
 
 double randrange(double a, double b) __attribute__((unused));
@@ -74,20 +80,94 @@ volatile sig_atomic_t do_exit = 0;
 static void set_do_exit(int sig) {
   do_exit = 1;
 }
+
+// what the encoders need to follow the log to a new segment
+struct RotateInfo {
+  char segment_path[4096];
+  int segment;
+  uint32_t last_frame_id;
+};
+
 struct LoggerdState {
   Context *ctx;
   LoggerState logger;
 
+  // only taken when the rear encoder is ahead of the log and has to sleep
   std::mutex lock;
   std::condition_variable cv;
+  std::atomic<int> waiting;
+  std::atomic<uint32_t> last_frame_id;
+
+  // main loop only
   char segment_path[4096];
-  uint32_t last_frame_id;
-  uint32_t rotate_last_frame_id;
   int rotate_segment;
+
+  // the main loop fills the next slot and bumps rotate_count, encoders read it lock free
+  RotateInfo rotations[ROTATE_SLOTS];
+  std::atomic<uint64_t> rotate_count;
 };
 LoggerdState s;
 
+static void publish_rotation(uint32_t last_frame_id) {
+  uint64_t n = s.rotate_count.load(std::memory_order_relaxed) + 1;
+  RotateInfo &r = s.rotations[n % ROTATE_SLOTS];
+  snprintf(r.segment_path, sizeof(r.segment_path), "%s", s.segment_path);
+  r.segment = s.rotate_segment;
+  r.last_frame_id = last_frame_id;
+  s.rotate_count.store(n, std::memory_order_release);
+}
+
+struct BorrowedMsg {
+  SubSocket *sock;
+  Message *msg;
+  bool is_frame;
+  bool frame_id_valid;
+  uint32_t frame_id;
+};
+
+// Copies a borrowed message into the log and hands it back to the ring. Camera frames
+// are read where they lie, msgq keeps messages word aligned for that. A publisher can
+// lap the reader meanwhile, so none of it counts unless the release says it was intact.
+static bool fill_borrowed(uint8_t *dst, size_t size, void *ctx) {
+  BorrowedMsg *b = (BorrowedMsg *)ctx;
+  const char *data = b->msg->getData();
+  if (dst) memcpy(dst, data, size);
+
+  b->frame_id_valid = false;
+  if (b->is_frame) {
+    try {
+      kj::ArrayPtr<const capnp::word> words((const capnp::word *)data, size / sizeof(capnp::word));
+      capnp::FlatArrayMessageReader cmsg(words);
+      cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
+      if (event.isFrame()) {
+        b->frame_id = event.getFrame().getFrameId();
+        b->frame_id_valid = true;
+      }
+    } catch (const kj::Exception &e) {
+      // overwritten under us, the release below catches it
+    }
+  }
+  return b->sock->release(b->msg);
+}
+
 #ifndef DISABLE_ENCODER
+// Copies out the newest rotation. Its slot can only be rewritten once rotate_count is
+// ROTATE_SLOTS - 1 further along, so seeing less than that after the copy means it's whole.
+static void read_rotation(RotateInfo *out) {
+  while (true) {
+    uint64_t n = s.rotate_count.load(std::memory_order_acquire);
+    *out = s.rotations[n % ROTATE_SLOTS];
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (s.rotate_count.load(std::memory_order_relaxed) < n + ROTATE_SLOTS - 1) return;
+  }
+}
+
+static bool log_behind(uint32_t frame_id) {
+  uint32_t last_frame_id = s.last_frame_id.load();
+  return frame_id > last_frame_id //if the log camera is older, wait for it to catch up.
+         && (frame_id - last_frame_id) < 8; // but if its too old then there probably was a discontinuity (visiond restarted)
+}
+
 void encoder_thread(bool is_streaming, bool raw_clips, bool front) {
   int err;
 
@@ -176,36 +256,39 @@ void encoder_thread(bool is_streaming, bool raw_clips, bool front) {
       uint8_t *v = u + (buf_info.width/2)*(buf_info.height/2);
 
       {
+        // wait if log camera is older on back camera
+        if (!front && log_behind(extra.frame_id) && !do_exit) {
+          std::unique_lock<std::mutex> lk(s.lock);
+          s.waiting++;
+          s.cv.wait(lk, [&] { return !log_behind(extra.frame_id) || do_exit; });
+          s.waiting--;
+        }
+        if (do_exit) break;
+
+        RotateInfo rotation;
+        read_rotation(&rotation);
         bool should_rotate = false;
-        std::unique_lock<std::mutex> lk(s.lock);
         if (!front) {
-          // wait if log camera is older on back camera
-          while ( extra.frame_id > s.last_frame_id //if the log camera is older, wait for it to catch up.
-                 && (extra.frame_id-s.last_frame_id) < 8 // but if its too old then there probably was a discontinuity (visiond restarted)
-                 && !do_exit) {
-            s.cv.wait(lk);
-          }
-          should_rotate = extra.frame_id > s.rotate_last_frame_id && encoder_segment < s.rotate_segment;
+          should_rotate = extra.frame_id > rotation.last_frame_id && encoder_segment < rotation.segment;
         } else {
           // front camera is best effort
-          should_rotate = encoder_segment < s.rotate_segment;
+          should_rotate = encoder_segment < rotation.segment;
         }
-        if (do_exit) break;
 
         // rotate the encoder if the logger is on a newer segment
         if (should_rotate) {
-          LOG("rotate encoder to %s", s.segment_path);
+          LOG("rotate encoder to %s", rotation.segment_path);
 
-          encoder_rotate(&encoder, s.segment_path, s.rotate_segment);
+          encoder_rotate(&encoder, rotation.segment_path, rotation.segment);
           if (has_encoder_alt) {
-            encoder_rotate(&encoder_alt, s.segment_path, s.rotate_segment);
+            encoder_rotate(&encoder_alt, rotation.segment_path, rotation.segment);
           }
 
           if (raw_clips) {
-            rawlogger->Rotate(s.segment_path, s.rotate_segment);
+            rawlogger->Rotate(rotation.segment_path, rotation.segment);
           }
 
-          encoder_segment = s.rotate_segment;
+          encoder_segment = rotation.segment;
           if (lh) {
             lh_close(lh);
           }
@@ -582,6 +665,7 @@ int main(int argc, char** argv) {
     auto words = gen_init_data();
     auto bytes = words.asBytes();
     logger_init(&s.logger, "rlog", bytes.begin(), bytes.size(), true);
+    s.logger.indexed = getenv("LOGGERD_INDEX") != NULL;
   }
 
   bool is_streaming = false;
@@ -599,9 +683,11 @@ int main(int argc, char** argv) {
     assert(err == 0);
     LOGW("logging to %s", s.segment_path);
   }
+  publish_rotation(0);
 
   double start_ts = seconds_since_boot();
   double last_rotate_ts = start_ts;
+  double last_stats_ts = start_ts;
 
 #ifndef DISABLE_ENCODER
   // rear camera
@@ -620,41 +706,33 @@ int main(int argc, char** argv) {
 
   while (!do_exit) {
     for (auto sock : poller->poll(100 * 1000)){
-      while (true) {
-        Message * msg = sock->receive(true);
-        if (msg == NULL){
-          break;
-        }
-
-        uint8_t* data = (uint8_t*)msg->getData();
+      // Messages are borrowed from the msgq ring and copied once, straight into the rlog
+      // block that gets compressed. The data is only known to be intact once it is released.
+      Message *msg;
+      while ((msg = sock->borrow(true)) != NULL) {
         size_t len = msg->getSize();
+        BorrowedMsg bmsg = {sock, msg, sock == frame_sock};
+        bool ok = logger_log_with(&s.logger, len, qlog_counter[sock] == 0, fill_borrowed, &bmsg);
 
-        if (sock == frame_sock) {
+        if (ok && bmsg.frame_id_valid) {
           // track camera frames to sync to encoder
-          auto amsg = kj::heapArray<capnp::word>((len / sizeof(capnp::word)) + 1);
-          memcpy(amsg.begin(), data, len);
-
-          capnp::FlatArrayMessageReader cmsg(amsg);
-          cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
-          if (event.isFrame()) {
-            std::unique_lock<std::mutex> lk(s.lock);
-            s.last_frame_id = event.getFrame().getFrameId();
-            lk.unlock();
+          s.last_frame_id = bmsg.frame_id;
+          if (s.waiting > 0) {
+            std::lock_guard<std::mutex> lk(s.lock);
             s.cv.notify_all();
           }
         }
 
-        logger_log(&s.logger, data, len, qlog_counter[sock] == 0);
-        delete msg;
-
         if (qlog_counter[sock] != -1) {
           //printf("%p: %d/%d\n", socks[i], qlog_counter[socks[i]], qlog_freqs[socks[i]]);
           qlog_counter[sock]++;
           qlog_counter[sock] %= qlog_freqs[sock];
         }
 
-        bytes_count += len;
-        msg_count++;
+        if (ok) {
+          bytes_count += len;
+          msg_count++;
+        }
       }
     }
 
@@ -664,23 +742,40 @@ int main(int argc, char** argv) {
 
       last_rotate_ts += SEGMENT_LENGTH;
 
-      std::lock_guard<std::mutex> guard(s.lock);
-      s.rotate_last_frame_id = s.last_frame_id;
-
+      uint32_t rotate_last_frame_id = s.last_frame_id;
       if (is_logging) {
         err = logger_next(&s.logger, LOG_ROOT, s.segment_path, sizeof(s.segment_path), &s.rotate_segment);
         assert(err == 0);
         LOGW("rotated to %s", s.segment_path);
       }
+      publish_rotation(rotate_last_frame_id);
     }
 
-    if ((msg_count%1000) == 0) {
+    // on a timer, the storage histograms are reset with every report
+    if (ts - last_stats_ts > STATS_INTERVAL) {
+      last_stats_ts = ts;
       LOGD("%lu messages, %.2f msg/sec, %.2f KB/sec", msg_count, msg_count*1.0/(ts-start_ts), bytes_count*0.001/(ts-start_ts));
+
+      uint64_t block_failures = block_writer_failures();
+      if (block_failures > 0) {
+        LOGE("%lu log blocks failed to compress and were dropped", block_failures);
+      }
+
+      // storage latency since the last report, in power of two buckets
+      StorageStats stats;
+      storage_stats(&stats);
+      LOGD("storage %.2f KB written, write p50 %lu us p99 %lu us max %lu us, flush p50 %lu us p99 %lu us max %lu us",
+           stats.bytes*0.001,
+           storage_hist_quantile(stats.write_us, 0.5), storage_hist_quantile(stats.write_us, 0.99), storage_hist_quantile(stats.write_us, 1.0),
+           storage_hist_quantile(stats.flush_us, 0.5), storage_hist_quantile(stats.flush_us, 0.99), storage_hist_quantile(stats.flush_us, 1.0));
     }
   }
 
   LOGW("joining threads");
-  s.cv.notify_all();
+  {
+    std::lock_guard<std::mutex> lk(s.lock);
+    s.cv.notify_all();
+  }
 
 
 #ifndef DISABLE_ENCODER
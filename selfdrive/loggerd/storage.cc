@@ -0,0 +1,310 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common/timing.h"
+#include "common/swaglog.h"
+
+#include "storage.h"
+
+// O_DIRECT wants buffers and offsets aligned to the logical block size
+#define STORAGE_ALIGN 4096
+#define STORAGE_THREADS 2
+
+struct StorageFile {
+  virtual ~StorageFile() {}
+  virtual void write(const void *data, size_t size) = 0;
+  virtual void close(bool sync, const std::string &done_path) = 0;
+};
+
+namespace {
+
+std::atomic<uint64_t> write_hist[STORAGE_HIST_BUCKETS];
+std::atomic<uint64_t> flush_hist[STORAGE_HIST_BUCKETS];
+std::atomic<uint64_t> total_bytes;
+
+void record(std::atomic<uint64_t> *hist, uint64_t start_ns) {
+  uint64_t us = (nanos_since_boot() - start_ns) / 1000;
+  int b = 0;
+  while (us > 0 && b < STORAGE_HIST_BUCKETS - 1) {
+    us >>= 1;
+    b++;
+  }
+  hist[b]++;
+}
+
+bool write_all(int fd, const uint8_t *data, size_t len, uint64_t offset) {
+  while (len > 0) {
+    ssize_t n = pwrite(fd, data, len, offset);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    data += n;
+    len -= n;
+    offset += n;
+  }
+  return true;
+}
+
+// Runs jobs in the order they were queued. A file's close is queued after its buffers,
+// so by the time it runs they are all done or being written.
+class IOPool {
+public:
+  IOPool(int num_threads) {
+    for (int i = 0; i < num_threads; i++) {
+      threads.emplace_back(&IOPool::run, this);
+    }
+  }
+  ~IOPool() {
+    {
+      std::lock_guard<std::mutex> lk(lock);
+      exit = true;
+    }
+    cv.notify_all();
+    for (auto &t : threads) t.join();
+  }
+
+  void push(std::function<void()> job) {
+    {
+      std::lock_guard<std::mutex> lk(lock);
+      queue.push_back(std::move(job));
+    }
+    cv.notify_one();
+  }
+
+private:
+  void run() {
+    while (true) {
+      std::function<void()> job;
+      {
+        std::unique_lock<std::mutex> lk(lock);
+        cv.wait(lk, [&] { return exit || !queue.empty(); });
+        if (queue.empty()) return;
+        job = std::move(queue.front());
+        queue.pop_front();
+      }
+      job();
+    }
+  }
+
+  std::mutex lock;
+  std::condition_variable cv;
+  std::deque<std::function<void()>> queue;
+  std::vector<std::thread> threads;
+  bool exit = false;
+};
+
+IOPool &pool() {
+  static IOPool p(STORAGE_THREADS);
+  return p;
+}
+
+// what loggerd did before, buffered by stdio and closed on the calling thread
+class StdioFile : public StorageFile {
+public:
+  StdioFile(FILE *file) : file(file) {}
+
+  void write(const void *data, size_t size) override {
+    uint64_t start = nanos_since_boot();
+    fwrite(data, 1, size, file);
+    record(write_hist, start);
+    total_bytes += size;
+  }
+
+  void close(bool sync, const std::string &done_path) override {
+    uint64_t start = nanos_since_boot();
+    fflush(file);
+    if (sync) fsync(fileno(file));
+    fclose(file);
+    record(flush_hist, start);
+    if (!done_path.empty()) unlink(done_path.c_str());
+    delete this;
+  }
+
+private:
+  FILE *file;
+};
+
+class WriteBehindFile : public StorageFile {
+public:
+  WriteBehindFile(int fd, bool direct) : fd(fd), direct(direct) {
+    cur = new_buffer();
+  }
+  ~WriteBehindFile() {
+    for (Buffer *b : buffers) {
+      free(b->data);
+      delete b;
+    }
+  }
+
+  void write(const void *data, size_t size) override {
+    uint64_t start = nanos_since_boot();
+    const uint8_t *p = (const uint8_t *)data;
+    while (size > 0) {
+      size_t n = std::min(size, STORAGE_BUFFER_SIZE - cur->len);
+      memcpy(cur->data + cur->len, p, n);
+      cur->len += n;
+      p += n;
+      size -= n;
+      if (cur->len == STORAGE_BUFFER_SIZE) {
+        submit();
+      }
+    }
+    record(write_hist, start);
+  }
+
+  void close(bool sync, const std::string &done_path) override {
+    Buffer *last = cur;
+    pool().push([=] {
+      finish(last, sync, done_path);
+      delete this;
+    });
+  }
+
+private:
+  struct Buffer {
+    uint8_t *data;
+    size_t len;
+    uint64_t offset;
+  };
+
+  Buffer *new_buffer() {
+    Buffer *b = new Buffer{};
+    int err = posix_memalign((void **)&b->data, STORAGE_ALIGN, STORAGE_BUFFER_SIZE);
+    assert(err == 0);
+    buffers.push_back(b);
+    return b;
+  }
+
+  void submit() {
+    Buffer *b = cur;
+    b->offset = offset;
+    offset += b->len;
+
+    std::unique_lock<std::mutex> lk(lock);
+    in_flight++;
+    pool().push([=] { flush(b); });
+
+    if (free_buffers.empty() && buffers.size() < STORAGE_MAX_BUFFERS) {
+      cur = new_buffer();
+    } else {
+      cv.wait(lk, [&] { return !free_buffers.empty(); });
+      cur = free_buffers.back();
+      free_buffers.pop_back();
+    }
+    cur->len = 0;
+  }
+
+  void write_buffer(Buffer *b) {
+    uint64_t start = nanos_since_boot();
+    if (!write_all(fd, b->data, b->len, b->offset)) {
+      LOGE("storage write failed: %s", strerror(errno));
+    }
+    record(flush_hist, start);
+    total_bytes += b->len;
+  }
+
+  void flush(Buffer *b) {
+    write_buffer(b);
+    std::lock_guard<std::mutex> lk(lock);
+    free_buffers.push_back(b);
+    in_flight--;
+    cv.notify_all();
+  }
+
+  void finish(Buffer *last, bool sync, const std::string &done_path) {
+    {
+      std::unique_lock<std::mutex> lk(lock);
+      cv.wait(lk, [&] { return in_flight == 0; });
+    }
+
+    if (last->len > 0) {
+      // O_DIRECT can't write a partial block, the tail goes through the page cache
+      if (direct) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+      }
+      last->offset = offset;
+      write_buffer(last);
+    }
+
+    if (sync) fsync(fd);
+    ::close(fd);
+    if (!done_path.empty()) unlink(done_path.c_str());
+  }
+
+  int fd;
+  bool direct;
+  uint64_t offset = 0;
+  Buffer *cur;
+  std::vector<Buffer *> buffers;
+
+  std::mutex lock;
+  std::condition_variable cv;
+  std::vector<Buffer *> free_buffers;
+  int in_flight = 0;
+};
+
+}  // namespace
+
+StorageFile* storage_open(const char* path) {
+  static bool use_stdio = getenv("LOGGERD_STORAGE") && strcmp(getenv("LOGGERD_STORAGE"), "stdio") == 0;
+  if (use_stdio) {
+    FILE *file = fopen(path, "wb");
+    return file ? new StdioFile(file) : NULL;
+  }
+
+  // not every filesystem takes O_DIRECT, those still get the write behind
+  bool direct = true;
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_DIRECT, 0666);
+  if (fd < 0 && errno == EINVAL) {
+    direct = false;
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  }
+  return fd >= 0 ? new WriteBehindFile(fd, direct) : NULL;
+}
+
+void storage_write(StorageFile* f, const void* data, size_t size) {
+  f->write(data, size);
+}
+
+void storage_close(StorageFile* f, bool sync, const char* done_path) {
+  f->close(sync, done_path ? done_path : "");
+}
+
+void storage_stats(StorageStats* out) {
+  for (int i = 0; i < STORAGE_HIST_BUCKETS; i++) {
+    out->write_us[i] = write_hist[i].exchange(0);
+    out->flush_us[i] = flush_hist[i].exchange(0);
+  }
+  out->bytes = total_bytes.exchange(0);
+}
+
+uint64_t storage_hist_quantile(const uint64_t* hist, double p) {
+  uint64_t total = 0;
+  for (int i = 0; i < STORAGE_HIST_BUCKETS; i++) total += hist[i];
+  if (total == 0) return 0;
+
+  uint64_t target = std::max((uint64_t)1, (uint64_t)std::ceil(p * total));
+  uint64_t seen = 0;
+  for (int i = 0; i < STORAGE_HIST_BUCKETS; i++) {
+    seen += hist[i];
+    if (seen >= target) return 1ULL << i;
+  }
+  return 1ULL << (STORAGE_HIST_BUCKETS - 1);
+}
@@ -0,0 +1,48 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Output files for loggerd. The default backend copies writes into large aligned buffers
+// that a small pool of threads writes out with pwrite, O_DIRECT where the filesystem
+// takes it, so a slow card stalls those threads instead of the caller. Setting
+// LOGGERD_STORAGE=stdio goes back to buffered FILE* writes.
+
+#define STORAGE_BUFFER_SIZE (1024 * 1024)
+// per file, a file only gets more than one once it has a buffer in flight
+#define STORAGE_MAX_BUFFERS 4
+// bucket 0 is under 1us, bucket i holds [2^(i-1), 2^i) us, the last one everything above
+#define STORAGE_HIST_BUCKETS 24
+
+typedef struct StorageFile StorageFile;
+
+typedef struct StorageStats {
+  // time callers spent in storage_write, waiting on a free buffer when the card is behind
+  uint64_t write_us[STORAGE_HIST_BUCKETS];
+  // time each buffer took to reach the file
+  uint64_t flush_us[STORAGE_HIST_BUCKETS];
+  uint64_t bytes;
+} StorageStats;
+
+StorageFile* storage_open(const char* path);
+void storage_write(StorageFile* f, const void* data, size_t size);
+// Writes out the rest, fsyncs if sync, closes, then unlinks done_path if there is one.
+// Only the handoff happens on the calling thread, f is gone after.
+void storage_close(StorageFile* f, bool sync, const char* done_path);
+
+// histograms since the last call
+void storage_stats(StorageStats* out);
+// upper bound in us of the bucket holding the p quantile
+uint64_t storage_hist_quantile(const uint64_t* hist, double p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
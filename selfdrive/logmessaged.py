@@ -16,23 +16,24 @@ def main():
   pub_sock = messaging.pub_sock('logMessage')
 
   while True:
-    dat = b''.join(sock.recv_multipart())
-    dat = dat.decode('utf8')
+    # one record per frame, the C++ swaglog batches several into a multipart message
+    for dat in sock.recv_multipart():
+      dat = dat.decode('utf8')
 
-    # print "RECV", repr(dat)
+      # print "RECV", repr(dat)
 
-    levelnum = ord(dat[0])
-    dat = dat[1:]
+      levelnum = ord(dat[0])
+      dat = dat[1:]
 
-    if levelnum >= le_level:
-      # push to logentries
-      # TODO: push to athena instead
-      le_handler.emit_raw(dat)
+      if levelnum >= le_level:
+        # push to logentries
+        # TODO: push to athena instead
+        le_handler.emit_raw(dat)
 
-    # then we publish them
-    msg = messaging.new_message()
-    msg.logMessage = dat
-    pub_sock.send(msg.to_bytes())
+      # then we publish them
+      msg = messaging.new_message()
+      msg.logMessage = dat
+      pub_sock.send(msg.to_bytes())
 
 
 if __name__ == "__main__":
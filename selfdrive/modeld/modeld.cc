@@ -1,7 +1,9 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <signal.h>
 #include <eigen3/Eigen/Dense>
+#include <vector>
 
 #include "common/visionbuf.h"
 #include "common/visionipc.h"
@@ -71,6 +73,50 @@ void* live_thread(void *arg) {
   return NULL;
 }
 
+// dropped frames through a 5 s low pass, as a fraction of the frames expected
+static float update_frame_drop(float *frames_dropped, uint32_t vipc_dropped_frames) {
+  const float dt = 1. / MODEL_FREQ;
+  const float ts = 5.0;  // 5 s filter time constant
+  const float frame_filter_k = (dt / ts) / (1. + dt / ts);
+  *frames_dropped = (1. - frame_filter_k) * *frames_dropped + frame_filter_k * (float)std::min(vipc_dropped_frames, 10U);
+  return *frames_dropped / MODEL_FREQ;
+}
+
+struct ModelThreadState {
+  ModelState *model;
+  PubMaster *pm;
+};
+
+// pipelined mode: the main loop only warps frames, the model runs on them here
+void* model_thread(void *arg) {
+  ModelThreadState *s = (ModelThreadState*)arg;
+  set_thread_name("model");
+
+  float frames_dropped = 0;
+  uint32_t last_vipc_frame_id = 0;
+  double last = 0;
+  while (!do_exit) {
+    ModelDataRaw model_buf;
+    ModelFrameInfo info;
+    double mt1 = millis_since_boot();
+    if (!model_eval_queued(s->model, 100, &model_buf, &info)) continue;
+    double mt2 = millis_since_boot();
+
+    uint32_t vipc_dropped_frames = info.vipc_frame_id - last_vipc_frame_id - 1;
+    float frame_drop_perc = update_frame_drop(&frames_dropped, vipc_dropped_frames);
+
+    model_publish(*s->pm, info.vipc_frame_id, info.frame_id, vipc_dropped_frames, frame_drop_perc, model_buf, info.timestamp_eof);
+    posenet_publish(*s->pm, info.vipc_frame_id, info.frame_id, vipc_dropped_frames, frame_drop_perc, model_buf, info.timestamp_eof);
+
+    LOGD("model process: %.2fms, from last %.2fms, from eof %.2fms, vipc_frame_id %u, frame_id %u, frame_drop %.3f",
+         mt2-mt1, mt1-last, (nanos_since_boot() - info.timestamp_eof) / 1e6, info.vipc_frame_id, info.frame_id, frame_drop_perc);
+    last = mt1;
+    last_vipc_frame_id = info.vipc_frame_id;
+  }
+  model_queue_stop(s->model);
+  return NULL;
+}
+
 int main(int argc, char **argv) {
   int err;
   set_realtime_priority(51);
@@ -152,6 +198,22 @@ int main(int argc, char **argv) {
   model_init(&model, device_id, context, true);
   LOGW("models loaded, modeld starting");
 
+  // MODELD_PIPELINED=1 warps the next frame while the model runs. It hasn't been checked
+  // on device against recorded model outputs yet, so one frame at a time is the default.
+  const char* pipelined_env = getenv("MODELD_PIPELINED");
+  const bool pipelined = pipelined_env && strcmp(pipelined_env, "1") == 0;
+  pthread_t model_thread_handle;
+  ModelThreadState model_thread_state = {&model, &pm};
+  if (pipelined) {
+    err = pthread_create(&model_thread_handle, NULL, model_thread, &model_thread_state);
+    assert(err == 0);
+  }
+
+  // running the model on the camera buffers instead of a copy of each frame hasn't been
+  // checked on device yet, MODELD_ZERO_COPY=1 turns it on
+  const char* zero_copy_env = getenv("MODELD_ZERO_COPY");
+  const bool zero_copy = zero_copy_env && strcmp(zero_copy_env, "1") == 0;
+
   // debayering does a 2x downscale
   mat3 yuv_transform = transform_scale_buffer((mat3){{
     1.0, 0.0, 0.0,
@@ -172,14 +234,15 @@ int main(int argc, char **argv) {
     LOGW("connected with buffer size: %d", buf_info.buf_len);
 
     // setup filter to track dropped frames
-    const float dt = 1. / MODEL_FREQ;
-    const float ts = 5.0;  // 5 s filter time constant
-    const float frame_filter_k = (dt / ts) / (1. + dt / ts);
     float frames_dropped = 0;
 
-    // one frame in memory
-    cl_mem yuv_cl;
-    VisionBuf yuv_ion = visionbuf_allocate_cl(buf_info.buf_len, device_id, context, &yuv_cl);
+    // zero copy: the camera buffers themselves as cl_mem, wrapped the first time each comes up.
+    // Otherwise one frame in memory.
+    std::vector<VisionBuf> yuv_ion(zero_copy ? stream.num_bufs : 1);
+    std::vector<cl_mem> yuv_cl(yuv_ion.size(), nullptr);
+    if (!zero_copy) {
+      yuv_ion[0] = visionbuf_allocate_cl(buf_info.buf_len, device_id, context, &yuv_cl[0]);
+    }
 
     uint32_t frame_id = 0, last_vipc_frame_id = 0;
     double last = 0;
@@ -215,18 +278,33 @@ int main(int argc, char **argv) {
         
         mt1 = millis_since_boot();
 
-        // TODO: don't make copies!
-        memcpy(yuv_ion.addr, buf->addr, buf_info.buf_len);
+        int buf_idx = 0;
+        if (zero_copy) {
+          buf_idx = buf - stream.bufs;
+          if (yuv_cl[buf_idx] == nullptr) {
+            yuv_ion[buf_idx] = visionbuf_import_cl(buf->addr, buf->fd, buf_info.buf_len, device_id, context, &yuv_cl[buf_idx]);
+          }
+          visionbuf_sync(&yuv_ion[buf_idx], VISIONBUF_SYNC_TO_DEVICE);
+        } else {
+          memcpy(yuv_ion[0].addr, buf->addr, buf_info.buf_len);
+        }
+
+        if (pipelined) {
+          ModelFrameInfo info = {extra.frame_id, frame_id, extra.timestamp_eof};
+          memcpy(info.desire, vec_desire, sizeof(vec_desire));
+          model_queue_frame(&model, q, yuv_cl[buf_idx], buf_info.width, buf_info.height,
+                            model_transform, info);
+          continue;
+        }
 
         ModelDataRaw model_buf =
-            model_eval_frame(&model, q, yuv_cl, buf_info.width, buf_info.height,
+            model_eval_frame(&model, q, yuv_cl[buf_idx], buf_info.width, buf_info.height,
                              model_transform, NULL, vec_desire);
         mt2 = millis_since_boot();
 
         // tracked dropped frames
         uint32_t vipc_dropped_frames = extra.frame_id - last_vipc_frame_id - 1;
-        frames_dropped = (1. - frame_filter_k) * frames_dropped + frame_filter_k * (float)std::min(vipc_dropped_frames, 10U);
-        float frame_drop_perc = frames_dropped / MODEL_FREQ;
+        float frame_drop_perc = update_frame_drop(&frames_dropped, vipc_dropped_frames);
 
         model_publish(pm, extra.frame_id, frame_id,  vipc_dropped_frames, frame_drop_perc, model_buf, extra.timestamp_eof);
         posenet_publish(pm, extra.frame_id, frame_id, vipc_dropped_frames, frame_drop_perc, model_buf, extra.timestamp_eof);
@@ -237,10 +315,17 @@ int main(int argc, char **argv) {
       }
 
     }
-    visionbuf_free(&yuv_ion);
+    for (size_t i = 0; i < yuv_cl.size(); i++) {
+      if (yuv_cl[i] != nullptr) visionbuf_free(&yuv_ion[i]);
+    }
     visionstream_destroy(&stream);
   }
 
+  if (pipelined) {
+    model_queue_stop(&model);
+    err = pthread_join(model_thread_handle, NULL);
+    assert(err == 0);
+  }
   model_free(&model);
 
   LOG("joining live_thread");
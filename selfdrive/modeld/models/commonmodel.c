@@ -51,6 +51,27 @@ float *frame_prepare(ModelFrame* frame, cl_command_queue q,
   return net_input_buf;
 }
 
+void frame_prepare_async(ModelFrame* frame, cl_command_queue q,
+                         cl_mem yuv_cl, int width, int height,
+                         mat3 transform, float **dsts, int num_dsts, cl_event *done) {
+  int err;
+  transform_queue(&frame->transform, q,
+                  yuv_cl, width, height,
+                  frame->transformed_y_cl, frame->transformed_u_cl, frame->transformed_v_cl,
+                  frame->transformed_width, frame->transformed_height,
+                  transform);
+  loadyuv_queue(&frame->loadyuv, q,
+                frame->transformed_y_cl, frame->transformed_u_cl, frame->transformed_v_cl,
+                frame->net_input);
+  // the queue is in order, the last read finishing means everything did
+  for (int i = 0; i < num_dsts; i++) {
+    err = clEnqueueReadBuffer(q, frame->net_input, CL_FALSE, 0, frame->net_input_size, dsts[i],
+                              0, NULL, i == num_dsts - 1 ? done : NULL);
+    assert(err == 0);
+  }
+  clFlush(q);
+}
+
 void frame_free(ModelFrame* frame) {
   transform_destroy(&frame->transform);
   loadyuv_destroy(&frame->loadyuv);
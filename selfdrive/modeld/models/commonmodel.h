@@ -37,6 +37,11 @@ void frame_init(ModelFrame* frame, int width, int height,
 float *frame_prepare(ModelFrame* frame, cl_command_queue q,
                            cl_mem yuv_cl, int width, int height,
                            mat3 transform);
+// Like frame_prepare without waiting for any of it. The net input is read into each of
+// dsts, *done completes once they are all filled and yuv_cl is no longer needed.
+void frame_prepare_async(ModelFrame* frame, cl_command_queue q,
+                         cl_mem yuv_cl, int width, int height,
+                         mat3 transform, float **dsts, int num_dsts, cl_event *done);
 void frame_free(ModelFrame* frame);
 
 #ifdef __cplusplus
@@ -4,6 +4,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <eigen3/Eigen/Dense>
+#include <chrono>
 
 #include "common/timing.h"
 #include "common/params.h"
@@ -65,6 +66,14 @@ void model_init(ModelState* s, cl_device_id device_id, cl_context context, int t
   }
 #endif
 
+  for (int i = 0; i < MODEL_INPUT_BUFS; i++) {
+    s->inputs[i] = (float*)calloc(MODEL_FRAME_SIZE * 2, sizeof(float));
+  }
+  s->input_next = 0;
+  s->input_queued = -1;
+  s->input_running = -1;
+  s->input_stopped = false;
+
   // Build Vandermonde matrix
   for(int i = 0; i < MODEL_PATH_DISTANCE; i++) {
     for(int j = 0; j < POLYFIT_DEGREE - 1; j++) {
@@ -73,10 +82,7 @@ void model_init(ModelState* s, cl_device_id device_id, cl_context context, int t
   }
 }
 
-ModelDataRaw model_eval_frame(ModelState* s, cl_command_queue q,
-                           cl_mem yuv_cl, int width, int height,
-                           mat3 transform, void* sock,
-                           float *desire_in) {
+static void update_desire(ModelState* s, const float *desire_in) {
 #ifdef DESIRE
   if (desire_in != NULL) {
     for (int i = 0; i < DESIRE_LEN; i++) {
@@ -91,6 +97,27 @@ ModelDataRaw model_eval_frame(ModelState* s, cl_command_queue q,
     }
   }
 #endif
+}
+
+static ModelDataRaw get_net_outputs(ModelState* s) {
+  ModelDataRaw net_outputs;
+  net_outputs.path = &s->output[PATH_IDX];
+  net_outputs.left_lane = &s->output[LL_IDX];
+  net_outputs.right_lane = &s->output[RL_IDX];
+  net_outputs.lead = &s->output[LEAD_IDX];
+  net_outputs.long_x = &s->output[LONG_X_IDX];
+  net_outputs.long_v = &s->output[LONG_V_IDX];
+  net_outputs.long_a = &s->output[LONG_A_IDX];
+  net_outputs.meta = &s->output[DESIRE_STATE_IDX];
+  net_outputs.pose = &s->output[POSE_IDX];
+  return net_outputs;
+}
+
+ModelDataRaw model_eval_frame(ModelState* s, cl_command_queue q,
+                           cl_mem yuv_cl, int width, int height,
+                           mat3 transform, void* sock,
+                           float *desire_in) {
+  update_desire(s, desire_in);
 
   //for (int i = 0; i < OUTPUT_SIZE + TEMPORAL_SIZE; i++) { printf("%f ", s->output[i]); } printf("\n");
 
@@ -109,22 +136,99 @@ ModelDataRaw model_eval_frame(ModelState* s, cl_command_queue q,
   clEnqueueUnmapMemObject(q, s->frame.net_input, (void*)new_frame_buf, 0, NULL, NULL);
 
   // net outputs
-  ModelDataRaw net_outputs;
-  net_outputs.path = &s->output[PATH_IDX];
-  net_outputs.left_lane = &s->output[LL_IDX];
-  net_outputs.right_lane = &s->output[RL_IDX];
-  net_outputs.lead = &s->output[LEAD_IDX];
-  net_outputs.long_x = &s->output[LONG_X_IDX];
-  net_outputs.long_v = &s->output[LONG_V_IDX];
-  net_outputs.long_a = &s->output[LONG_A_IDX];
-  net_outputs.meta = &s->output[DESIRE_STATE_IDX];
-  net_outputs.pose = &s->output[POSE_IDX];
-  return net_outputs;
+  return get_net_outputs(s);
+}
+
+// with input_lock held
+static void drop_queued(ModelState* s) {
+  if (s->input_queued >= 0) {
+    clReleaseEvent(s->input_ready);
+    s->input_queued = -1;
+  }
+}
+
+void model_queue_frame(ModelState* s, cl_command_queue q,
+                       cl_mem yuv_cl, int width, int height,
+                       mat3 transform, const ModelFrameInfo &info) {
+  cl_event ready;
+  {
+    std::lock_guard<std::mutex> lk(s->input_lock);
+
+    // The frame completes the input it's paired into and starts the one the frame after
+    // goes to. Neither is the one the model is running on.
+    int input = s->input_next;
+    int next = 0;
+    while (next == input || next == s->input_running) next++;
+
+    // the model didn't get to it
+    drop_queued(s);
+
+    float *dsts[2] = {&s->inputs[input][MODEL_FRAME_SIZE], &s->inputs[next][0]};
+    frame_prepare_async(&s->frame, q, yuv_cl, width, height, transform, dsts, 2, &ready);
+
+    clRetainEvent(ready);
+    s->input_ready = ready;
+    s->input_info = info;
+    s->input_queued = input;
+    s->input_next = next;
+  }
+  s->input_cv.notify_one();
+
+  // yuv_cl goes back to camerad once we return
+  clWaitForEvents(1, &ready);
+  clReleaseEvent(ready);
+}
+
+bool model_eval_queued(ModelState* s, int timeout_ms, ModelDataRaw *net_outputs, ModelFrameInfo *info) {
+  int input;
+  cl_event ready;
+  {
+    std::unique_lock<std::mutex> lk(s->input_lock);
+    s->input_cv.wait_for(lk, std::chrono::milliseconds(timeout_ms),
+                         [s] { return s->input_queued >= 0 || s->input_stopped; });
+    if (s->input_stopped || s->input_queued < 0) return false;
+
+    input = s->input_queued;
+    ready = s->input_ready;
+    *info = s->input_info;
+    s->input_queued = -1;
+    s->input_running = input;
+  }
+
+  clWaitForEvents(1, &ready);
+  clReleaseEvent(ready);
+
+  update_desire(s, info->desire);
+  s->m->execute(s->inputs[input], MODEL_FRAME_SIZE*2);
+  {
+    std::lock_guard<std::mutex> lk(s->input_lock);
+    s->input_running = -1;
+  }
+
+  *net_outputs = get_net_outputs(s);
+  return true;
+}
+
+void model_queue_stop(ModelState* s) {
+  {
+    std::lock_guard<std::mutex> lk(s->input_lock);
+    s->input_stopped = true;
+    // nothing evaluates it anymore
+    drop_queued(s);
+  }
+  s->input_cv.notify_all();
 }
 
 void model_free(ModelState* s) {
+  {
+    std::lock_guard<std::mutex> lk(s->input_lock);
+    drop_queued(s);
+  }
   free(s->output);
   free(s->input_frames);
+  for (int i = 0; i < MODEL_INPUT_BUFS; i++) {
+    free(s->inputs[i]);
+  }
   frame_free(&s->frame);
   delete s->m;
 }
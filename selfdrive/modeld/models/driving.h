@@ -14,7 +14,9 @@
 #include "runners/run.h"
 
 #include <czmq.h>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
 #include "messaging.hpp"
 
 #define MODEL_WIDTH 512
@@ -39,6 +41,10 @@
 #define MODEL_FREQ 20
 #define MAX_FRAME_DROP 0.05
 
+// model inputs in the pipelined mode: the one the model runs on, the one being filled and
+// the one the next frame goes to
+#define MODEL_INPUT_BUFS 3
+
 struct ModelDataRaw {
     float *path;
     float *left_lane;
@@ -52,6 +58,13 @@ struct ModelDataRaw {
     float *pose;
   };
 
+// what goes along with a frame through the pipelined mode
+struct ModelFrameInfo {
+  uint32_t vipc_frame_id;
+  uint32_t frame_id;
+  uint64_t timestamp_eof;
+  float desire[DESIRE_LEN];
+};
 
 typedef struct ModelState {
   ModelFrame frame;
@@ -65,6 +78,16 @@ typedef struct ModelState {
 #ifdef TRAFFIC_CONVENTION
   std::unique_ptr<float[]> traffic_convention;
 #endif
+
+  // pipelined mode, each input holds the frame before and the frame itself
+  float *inputs[MODEL_INPUT_BUFS];
+  std::mutex input_lock;
+  std::condition_variable input_cv;
+  // the input the next frame is paired with, the one waiting for the model and the one it runs on
+  int input_next, input_queued, input_running;
+  cl_event input_ready;
+  ModelFrameInfo input_info;
+  bool input_stopped;
 } ModelState;
 
 void model_init(ModelState* s, cl_device_id device_id,
@@ -72,6 +95,19 @@ void model_init(ModelState* s, cl_device_id device_id,
 ModelDataRaw model_eval_frame(ModelState* s, cl_command_queue q,
                            cl_mem yuv_cl, int width, int height,
                            mat3 transform, void* sock, float *desire_in);
+
+// Pipelined mode, the warp and yuv load of a frame run while the model still runs on the
+// frame before. model_queue_frame starts preparing a frame and returns once yuv_cl isn't
+// needed anymore, a queued frame the model didn't get to yet is dropped. model_eval_queued
+// waits up to timeout_ms for a queued frame and runs the model on it, the outputs stay
+// valid until it's called again. Queue frames from one thread and evaluate them on another.
+void model_queue_frame(ModelState* s, cl_command_queue q,
+                       cl_mem yuv_cl, int width, int height,
+                       mat3 transform, const ModelFrameInfo &info);
+bool model_eval_queued(ModelState* s, int timeout_ms, ModelDataRaw *net_outputs, ModelFrameInfo *info);
+// model_eval_queued returns false from now on
+void model_queue_stop(ModelState* s);
+
 void model_free(ModelState* s);
 void poly_fit(float *in_pts, float *in_stds, float *out);
 
@@ -0,0 +1,502 @@
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "cpu_kernels.h"
+
+// GEMM blocking. A task computes a tile of at most MC x NC of C, K is taken KC at a time:
+// the KC x NC block of B is packed into NR wide panels that stay in L2, then each MR rows
+// of A run over every panel with the MR x NR micro-kernel.
+#define MR 6
+#define NR 16
+#define KC 256
+#define MC_MAX 72
+#define NC_MAX 128
+
+// rows of A per task of a matrix-vector product
+#define GEMV_ROWS 32
+
+// elementwise work smaller than this isn't worth waking the pool for
+#define PARALLEL_MIN_ELEMENTS (1 << 15)
+
+ThreadPool::ThreadPool(int num_threads) {
+  for (int i = 1; i < num_threads; i++) {
+    workers.emplace_back(&ThreadPool::worker_thread, this);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lk(lock);
+    exit = true;
+  }
+  cv.notify_all();
+  for (auto &t : workers) t.join();
+}
+
+void ThreadPool::run_tasks() {
+  const std::function<void(int)> &fn = *job;
+  int i;
+  while ((i = next_task.fetch_add(1)) < job_n) {
+    fn(i);
+  }
+}
+
+void ThreadPool::worker_thread() {
+  uint64_t seen = 0;
+  std::unique_lock<std::mutex> lk(lock);
+  while (true) {
+    cv.wait(lk, [&] { return exit || generation != seen; });
+    if (exit) return;
+    seen = generation;
+
+    lk.unlock();
+    run_tasks();
+    lk.lock();
+    if (--active == 0) done_cv.notify_one();
+  }
+}
+
+void ThreadPool::parallel_for(int n, const std::function<void(int)> &fn) {
+  if (n <= 0) return;
+  if (workers.empty() || n == 1) {
+    for (int i = 0; i < n; i++) fn(i);
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lk(lock);
+    job = &fn;
+    job_n = n;
+    next_task = 0;
+    active = workers.size();
+    generation++;
+  }
+  cv.notify_all();
+  run_tasks();
+
+  std::unique_lock<std::mutex> lk(lock);
+  done_cv.wait(lk, [&] { return active == 0; });
+  job = NULL;
+}
+
+// micro-kernels: acc[r * NR + j] = sum_k a[r][k] * b[k * NR + j]
+
+typedef void (*MicroKernel)(int kc, const float *const *a, const float *b, float *acc);
+typedef float (*DotKernel)(const float *a, const float *b, int n);
+
+static void micro_kernel_c(int kc, const float *const *a, const float *b, float *acc) {
+  for (int i = 0; i < MR * NR; i++) acc[i] = 0;
+  for (int k = 0; k < kc; k++) {
+    for (int r = 0; r < MR; r++) {
+      float av = a[r][k];
+      for (int j = 0; j < NR; j++) {
+        acc[r * NR + j] += av * b[j];
+      }
+    }
+    b += NR;
+  }
+}
+
+static float dot_c(const float *a, const float *b, int n) {
+  float sum = 0;
+  for (int i = 0; i < n; i++) sum += a[i] * b[i];
+  return sum;
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("avx2,fma")))
+static void micro_kernel_avx2(int kc, const float *const *a, const float *b, float *acc) {
+  const float *a0 = a[0], *a1 = a[1], *a2 = a[2], *a3 = a[3], *a4 = a[4], *a5 = a[5];
+  __m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps();
+  __m256 c10 = _mm256_setzero_ps(), c11 = _mm256_setzero_ps();
+  __m256 c20 = _mm256_setzero_ps(), c21 = _mm256_setzero_ps();
+  __m256 c30 = _mm256_setzero_ps(), c31 = _mm256_setzero_ps();
+  __m256 c40 = _mm256_setzero_ps(), c41 = _mm256_setzero_ps();
+  __m256 c50 = _mm256_setzero_ps(), c51 = _mm256_setzero_ps();
+  for (int k = 0; k < kc; k++) {
+    __m256 b0 = _mm256_loadu_ps(b), b1 = _mm256_loadu_ps(b + 8);
+    __m256 t;
+    t = _mm256_broadcast_ss(a0 + k); c00 = _mm256_fmadd_ps(t, b0, c00); c01 = _mm256_fmadd_ps(t, b1, c01);
+    t = _mm256_broadcast_ss(a1 + k); c10 = _mm256_fmadd_ps(t, b0, c10); c11 = _mm256_fmadd_ps(t, b1, c11);
+    t = _mm256_broadcast_ss(a2 + k); c20 = _mm256_fmadd_ps(t, b0, c20); c21 = _mm256_fmadd_ps(t, b1, c21);
+    t = _mm256_broadcast_ss(a3 + k); c30 = _mm256_fmadd_ps(t, b0, c30); c31 = _mm256_fmadd_ps(t, b1, c31);
+    t = _mm256_broadcast_ss(a4 + k); c40 = _mm256_fmadd_ps(t, b0, c40); c41 = _mm256_fmadd_ps(t, b1, c41);
+    t = _mm256_broadcast_ss(a5 + k); c50 = _mm256_fmadd_ps(t, b0, c50); c51 = _mm256_fmadd_ps(t, b1, c51);
+    b += NR;
+  }
+  _mm256_storeu_ps(acc + 0 * NR, c00); _mm256_storeu_ps(acc + 0 * NR + 8, c01);
+  _mm256_storeu_ps(acc + 1 * NR, c10); _mm256_storeu_ps(acc + 1 * NR + 8, c11);
+  _mm256_storeu_ps(acc + 2 * NR, c20); _mm256_storeu_ps(acc + 2 * NR + 8, c21);
+  _mm256_storeu_ps(acc + 3 * NR, c30); _mm256_storeu_ps(acc + 3 * NR + 8, c31);
+  _mm256_storeu_ps(acc + 4 * NR, c40); _mm256_storeu_ps(acc + 4 * NR + 8, c41);
+  _mm256_storeu_ps(acc + 5 * NR, c50); _mm256_storeu_ps(acc + 5 * NR + 8, c51);
+}
+
+__attribute__((target("avx2,fma")))
+static float dot_avx2(const float *a, const float *b, int n) {
+  __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), s0);
+    s1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), s1);
+  }
+  s0 = _mm256_add_ps(s0, s1);
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(s0), _mm256_extractf128_ps(s0, 1));
+  s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+  float sum = _mm_cvtss_f32(s);
+  for (; i < n; i++) sum += a[i] * b[i];
+  return sum;
+}
+
+#elif defined(__aarch64__)
+
+static void micro_kernel_neon(int kc, const float *const *a, const float *b, float *acc) {
+  float32x4_t c[MR][4];
+  for (int r = 0; r < MR; r++) {
+    for (int j = 0; j < 4; j++) c[r][j] = vdupq_n_f32(0);
+  }
+  for (int k = 0; k < kc; k++) {
+    float32x4_t b0 = vld1q_f32(b), b1 = vld1q_f32(b + 4), b2 = vld1q_f32(b + 8), b3 = vld1q_f32(b + 12);
+    for (int r = 0; r < MR; r++) {
+      float av = a[r][k];
+      c[r][0] = vfmaq_n_f32(c[r][0], b0, av);
+      c[r][1] = vfmaq_n_f32(c[r][1], b1, av);
+      c[r][2] = vfmaq_n_f32(c[r][2], b2, av);
+      c[r][3] = vfmaq_n_f32(c[r][3], b3, av);
+    }
+    b += NR;
+  }
+  for (int r = 0; r < MR; r++) {
+    for (int j = 0; j < 4; j++) vst1q_f32(acc + r * NR + j * 4, c[r][j]);
+  }
+}
+
+static float dot_neon(const float *a, const float *b, int n) {
+  float32x4_t s0 = vdupq_n_f32(0), s1 = vdupq_n_f32(0);
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    s0 = vfmaq_f32(s0, vld1q_f32(a + i), vld1q_f32(b + i));
+    s1 = vfmaq_f32(s1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+  }
+  float sum = vaddvq_f32(vaddq_f32(s0, s1));
+  for (; i < n; i++) sum += a[i] * b[i];
+  return sum;
+}
+
+#endif
+
+static bool have_avx2() {
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#else
+  return false;
+#endif
+}
+
+static MicroKernel pick_micro_kernel() {
+#if defined(__x86_64__)
+  if (have_avx2()) return micro_kernel_avx2;
+#elif defined(__aarch64__)
+  return micro_kernel_neon;
+#endif
+  return micro_kernel_c;
+}
+
+static DotKernel pick_dot() {
+#if defined(__x86_64__)
+  if (have_avx2()) return dot_avx2;
+#elif defined(__aarch64__)
+  return dot_neon;
+#endif
+  return dot_c;
+}
+
+static const MicroKernel micro_kernel = pick_micro_kernel();
+static const DotKernel dot = pick_dot();
+
+void apply_activation(float *x, size_t n, int act, float alpha, float beta) {
+  switch (act) {
+  case CPU_ACT_NONE:
+    break;
+  case CPU_ACT_RELU:
+    for (size_t i = 0; i < n; i++) x[i] = x[i] > 0 ? x[i] : 0;
+    break;
+  case CPU_ACT_LEAKY_RELU:
+    for (size_t i = 0; i < n; i++) x[i] = x[i] > 0 ? x[i] : alpha * x[i];
+    break;
+  case CPU_ACT_ELU:
+    for (size_t i = 0; i < n; i++) x[i] = x[i] > 0 ? x[i] : alpha * (expf(x[i]) - 1.0f);
+    break;
+  case CPU_ACT_SIGMOID:
+    for (size_t i = 0; i < n; i++) x[i] = 1.0f / (1.0f + expf(-x[i]));
+    break;
+  case CPU_ACT_TANH:
+    for (size_t i = 0; i < n; i++) x[i] = tanhf(x[i]);
+    break;
+  case CPU_ACT_CLIP:
+    for (size_t i = 0; i < n; i++) x[i] = std::min(std::max(x[i], alpha), beta);
+    break;
+  default:
+    assert(false);
+  }
+}
+
+// the kc x nv block of B at (k0, n0) as an NR wide panel, zero past nv
+static void pack_b(const GemmB &B, int k0, int kc, int n0, int nv, float *dst) {
+  if (B.conv == NULL) {
+    for (int k = 0; k < kc; k++) {
+      const float *src = B.data + (size_t)(k0 + k) * B.ld + n0;
+      float *d = dst + k * NR;
+      memcpy(d, src, nv * sizeof(float));
+      for (int j = nv; j < NR; j++) d[j] = 0;
+    }
+    return;
+  }
+
+  // im2col, only for the panel
+  const ConvGeom &g = *B.conv;
+  int iy0[NR], ix0[NR];
+  int oy = n0 / g.out_w, ox = n0 % g.out_w;
+  for (int j = 0; j < NR; j++) {
+    if (j < nv) {
+      iy0[j] = oy * g.stride_h - g.pad_t;
+      ix0[j] = ox * g.stride_w - g.pad_l;
+      if (++ox == g.out_w) {
+        ox = 0;
+        oy++;
+      }
+    } else {
+      // never inside the input
+      iy0[j] = -(1 << 28);
+      ix0[j] = 0;
+    }
+  }
+
+  const int ksize = g.kh * g.kw;
+  for (int k = 0; k < kc; k++) {
+    int c = (k0 + k) / ksize, r = (k0 + k) % ksize;
+    int dy = (r / g.kw) * g.dil_h, dx = (r % g.kw) * g.dil_w;
+    const float *plane = g.input + (size_t)c * g.in_h * g.in_w;
+    float *d = dst + k * NR;
+    for (int j = 0; j < NR; j++) {
+      int iy = iy0[j] + dy, ix = ix0[j] + dx;
+      d[j] = (unsigned)iy < (unsigned)g.in_h && (unsigned)ix < (unsigned)g.in_w ? plane[iy * g.in_w + ix] : 0;
+    }
+  }
+}
+
+static void gemm_tile(int M, int K, const float *A, const GemmB &B, const float *bias,
+                      float *C, int ldc, int m0, int m1, int n0, int n1) {
+  alignas(64) static thread_local float packed[KC * NC_MAX];
+  alignas(64) float acc[MR * NR];
+
+  const int nn = n1 - n0;
+  const int panels = (nn + NR - 1) / NR;
+  for (int k0 = 0; k0 < K; k0 += KC) {
+    const int kc = std::min(KC, K - k0);
+    for (int p = 0; p < panels; p++) {
+      pack_b(B, k0, kc, n0 + p * NR, std::min(NR, nn - p * NR), packed + p * kc * NR);
+    }
+
+    for (int m = m0; m < m1; m += MR) {
+      // rows past the end repeat the last one, their results are dropped
+      const float *a[MR];
+      for (int r = 0; r < MR; r++) {
+        a[r] = A + (size_t)std::min(m + r, M - 1) * K + k0;
+      }
+      const int mv = std::min(MR, m1 - m);
+
+      for (int p = 0; p < panels; p++) {
+        micro_kernel(kc, a, packed + p * kc * NR, acc);
+        const int nv = std::min(NR, nn - p * NR);
+        for (int r = 0; r < mv; r++) {
+          float *c = C + (size_t)(m + r) * ldc + n0 + p * NR;
+          const float *ar = acc + r * NR;
+          if (k0 == 0) {
+            float base = bias ? bias[m + r] : 0;
+            for (int j = 0; j < nv; j++) c[j] = base + ar[j];
+          } else {
+            for (int j = 0; j < nv; j++) c[j] += ar[j];
+          }
+        }
+      }
+    }
+  }
+}
+
+void gemm(ThreadPool &pool, int M, int N, int K, const float *A, const GemmB &B,
+          const float *bias, float *C, int ldc, int act, float alpha, float beta) {
+  if (N == 1 && B.conv == NULL) {
+    // a dense layer, bound by reading A
+    const int tasks = (M + GEMV_ROWS - 1) / GEMV_ROWS;
+    pool.parallel_for(tasks, [&](int t) {
+      const int m1 = std::min(M, (t + 1) * GEMV_ROWS);
+      for (int m = t * GEMV_ROWS; m < m1; m++) {
+        float v;
+        if (B.ld == 1) {
+          v = dot(A + (size_t)m * K, B.data, K);
+        } else {
+          v = 0;
+          for (int k = 0; k < K; k++) v += A[(size_t)m * K + k] * B.data[(size_t)k * B.ld];
+        }
+        C[(size_t)m * ldc] = (bias ? bias[m] : 0) + v;
+        apply_activation(&C[(size_t)m * ldc], 1, act, alpha, beta);
+      }
+    });
+    return;
+  }
+
+  // smaller tiles until every thread has a couple of them
+  int mc = MC_MAX, nc = NC_MAX;
+  auto num_tasks = [&] { return ((M + mc - 1) / mc) * ((N + nc - 1) / nc); };
+  while (num_tasks() < 2 * pool.size() && (nc > NR || mc > MR)) {
+    if (nc > NR && nc >= mc) {
+      nc /= 2;
+    } else {
+      mc = std::max(MR, (mc / 2) / MR * MR);
+    }
+  }
+
+  const int mt = (M + mc - 1) / mc, nt = (N + nc - 1) / nc;
+  pool.parallel_for(mt * nt, [&](int t) {
+    const int m0 = (t / nt) * mc, n0 = (t % nt) * nc;
+    const int m1 = std::min(M, m0 + mc), n1 = std::min(N, n0 + nc);
+    gemm_tile(M, K, A, B, bias, C, ldc, m0, m1, n0, n1);
+    if (act != CPU_ACT_NONE) {
+      for (int m = m0; m < m1; m++) {
+        apply_activation(C + (size_t)m * ldc + n0, n1 - n0, act, alpha, beta);
+      }
+    }
+  });
+}
+
+void depthwise_conv(ThreadPool &pool, int channels, const ConvGeom &g, const float *weights,
+                    const float *bias, float *out, int act, float alpha, float beta) {
+  pool.parallel_for(channels, [&](int c) {
+    const float *in = g.input + (size_t)c * g.in_h * g.in_w;
+    const float *w = weights + c * g.kh * g.kw;
+    float *o = out + (size_t)c * g.out_h * g.out_w;
+    const float b = bias ? bias[c] : 0;
+
+    for (int oy = 0; oy < g.out_h; oy++) {
+      float *orow = o + oy * g.out_w;
+      for (int ox = 0; ox < g.out_w; ox++) orow[ox] = b;
+
+      for (int ky = 0; ky < g.kh; ky++) {
+        const int iy = oy * g.stride_h - g.pad_t + ky * g.dil_h;
+        if (iy < 0 || iy >= g.in_h) continue;
+        const float *irow = in + iy * g.in_w;
+
+        for (int kx = 0; kx < g.kw; kx++) {
+          const float wv = w[ky * g.kw + kx];
+          const int off = kx * g.dil_w - g.pad_l;
+          // the outputs whose input ox * stride + off is inside the row
+          const int lo = off < 0 ? (-off + g.stride_w - 1) / g.stride_w : 0;
+          const int hi = g.in_w - 1 - off < 0 ? 0 : std::min(g.out_w, (g.in_w - 1 - off) / g.stride_w + 1);
+          if (g.stride_w == 1) {
+            for (int ox = lo; ox < hi; ox++) orow[ox] += wv * irow[ox + off];
+          } else {
+            for (int ox = lo; ox < hi; ox++) orow[ox] += wv * irow[ox * g.stride_w + off];
+          }
+        }
+      }
+    }
+    apply_activation(o, (size_t)g.out_h * g.out_w, act, alpha, beta);
+  });
+}
+
+void pool2d(ThreadPool &pool, bool max, int channels, const ConvGeom &g, float *out) {
+  pool.parallel_for(channels, [&](int c) {
+    const float *in = g.input + (size_t)c * g.in_h * g.in_w;
+    float *o = out + (size_t)c * g.out_h * g.out_w;
+    for (int oy = 0; oy < g.out_h; oy++) {
+      const int y0 = oy * g.stride_h - g.pad_t;
+      const int ys = std::max(y0, 0), ye = std::min(y0 + g.kh, g.in_h);
+      for (int ox = 0; ox < g.out_w; ox++) {
+        const int x0 = ox * g.stride_w - g.pad_l;
+        const int xs = std::max(x0, 0), xe = std::min(x0 + g.kw, g.in_w);
+        float v = max ? -INFINITY : 0;
+        for (int y = ys; y < ye; y++) {
+          for (int x = xs; x < xe; x++) {
+            v = max ? std::max(v, in[y * g.in_w + x]) : v + in[y * g.in_w + x];
+          }
+        }
+        const int count = std::max(ye - ys, 0) * std::max(xe - xs, 0);
+        o[oy * g.out_w + ox] = count == 0 ? 0 : (max ? v : v / count);
+      }
+    }
+  });
+}
+
+template <int OP>
+static inline float binary(float a, float b) {
+  switch (OP) {
+  case CPU_BINARY_ADD: return a + b;
+  case CPU_BINARY_SUB: return a - b;
+  case CPU_BINARY_MUL: return a * b;
+  default: return a / b;
+  }
+}
+
+template <int OP>
+static void binary_rows(ThreadPool &pool, const float *a, const int adims[4], const float *b,
+                        const int bdims[4], float *out, const int odims[4]) {
+  // strides of a and b in output coordinates, 0 along broadcast dims
+  size_t as[4], bs[4];
+  size_t asz = 1, bsz = 1;
+  for (int d = 3; d >= 0; d--) {
+    as[d] = adims[d] == 1 ? 0 : asz;
+    bs[d] = bdims[d] == 1 ? 0 : bsz;
+    asz *= adims[d];
+    bsz *= bdims[d];
+  }
+
+  const int rows = odims[0] * odims[1] * odims[2];
+  const int w = odims[3];
+  auto row = [&](int r) {
+    const int d0 = r / (odims[1] * odims[2]), d1 = (r / odims[2]) % odims[1], d2 = r % odims[2];
+    const float *ar = a + d0 * as[0] + d1 * as[1] + d2 * as[2];
+    const float *br = b + d0 * bs[0] + d1 * bs[1] + d2 * bs[2];
+    float *orow = out + (size_t)r * w;
+    if (as[3] && bs[3]) {
+      for (int x = 0; x < w; x++) orow[x] = binary<OP>(ar[x], br[x]);
+    } else if (as[3]) {
+      const float bv = br[0];
+      for (int x = 0; x < w; x++) orow[x] = binary<OP>(ar[x], bv);
+    } else if (bs[3]) {
+      const float av = ar[0];
+      for (int x = 0; x < w; x++) orow[x] = binary<OP>(av, br[x]);
+    } else {
+      for (int x = 0; x < w; x++) orow[x] = binary<OP>(ar[0], br[0]);
+    }
+  };
+
+  if ((size_t)rows * w < PARALLEL_MIN_ELEMENTS) {
+    for (int r = 0; r < rows; r++) row(r);
+  } else {
+    pool.parallel_for(rows, row);
+  }
+}
+
+void binary_op(ThreadPool &pool, int op, const float *a, const int adims[4],
+               const float *b, const int bdims[4], float *out, const int odims[4]) {
+  switch (op) {
+  case CPU_BINARY_ADD: binary_rows<CPU_BINARY_ADD>(pool, a, adims, b, bdims, out, odims); break;
+  case CPU_BINARY_SUB: binary_rows<CPU_BINARY_SUB>(pool, a, adims, b, bdims, out, odims); break;
+  case CPU_BINARY_MUL: binary_rows<CPU_BINARY_MUL>(pool, a, adims, b, bdims, out, odims); break;
+  case CPU_BINARY_DIV: binary_rows<CPU_BINARY_DIV>(pool, a, adims, b, bdims, out, odims); break;
+  default: assert(false);
+  }
+}
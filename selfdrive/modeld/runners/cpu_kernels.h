@@ -0,0 +1,96 @@
+#ifndef CPU_KERNELS_H
+#define CPU_KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Float kernels for CPUModel. Tensors are NCHW with a batch of 1, every kernel splits its
+// work over a ThreadPool. The GEMM has AVX2/FMA (picked at runtime), NEON and plain C
+// micro-kernels.
+
+enum CPUActivation {
+  CPU_ACT_NONE = 0,
+  CPU_ACT_RELU = 1,
+  CPU_ACT_LEAKY_RELU = 2,  // alpha is the slope
+  CPU_ACT_ELU = 3,         // alpha
+  CPU_ACT_SIGMOID = 4,
+  CPU_ACT_TANH = 5,
+  CPU_ACT_CLIP = 6,        // to [alpha, beta]
+};
+
+// The calling thread and num_threads - 1 workers share the tasks of a parallel_for.
+class ThreadPool {
+public:
+  explicit ThreadPool(int num_threads);
+  ~ThreadPool();
+  int size() const { return workers.size() + 1; }
+  // runs fn(i) for every i in [0, n) and returns once they all ran
+  void parallel_for(int n, const std::function<void(int)> &fn);
+
+private:
+  void worker_thread();
+  void run_tasks();
+
+  std::vector<std::thread> workers;
+  std::mutex lock;
+  std::condition_variable cv, done_cv;
+  const std::function<void(int)> *job = NULL;
+  int job_n = 0;
+  std::atomic<int> next_task{0};
+  // workers still in the current job
+  int active = 0;
+  uint64_t generation = 0;
+  bool exit = false;
+};
+
+// B of a GEMM, a row major matrix with ld columns, or when conv is set the patches of a
+// convolution, K = channels * kh * kw rows and N = out_h * out_w columns.
+struct ConvGeom {
+  const float *input;
+  int in_h, in_w;
+  int kh, kw;
+  int stride_h, stride_w;
+  int pad_t, pad_l;
+  int dil_h, dil_w;
+  int out_h, out_w;
+};
+
+struct GemmB {
+  const float *data;
+  int ld;
+  const ConvGeom *conv;
+};
+
+void apply_activation(float *x, size_t n, int act, float alpha, float beta);
+
+// C[m, n] = act(bias[m] + sum_k A[m, k] * B[k, n]) for m < M, n < N. A is row major with
+// K columns, C with ldc. bias may be NULL.
+void gemm(ThreadPool &pool, int M, int N, int K, const float *A, const GemmB &B,
+          const float *bias, float *C, int ldc, int act, float alpha, float beta);
+
+// a convolution with one filter per channel, weights are channels x kh x kw
+void depthwise_conv(ThreadPool &pool, int channels, const ConvGeom &g, const float *weights,
+                    const float *bias, float *out, int act, float alpha, float beta);
+
+// max or average, the average over the part of the window inside the input
+void pool2d(ThreadPool &pool, bool max, int channels, const ConvGeom &g, float *out);
+
+enum CPUBinaryOp {
+  CPU_BINARY_ADD = 0,
+  CPU_BINARY_SUB = 1,
+  CPU_BINARY_MUL = 2,
+  CPU_BINARY_DIV = 3,
+};
+
+// out = a op b on 4-D shapes, broadcast the way numpy does
+void binary_op(ThreadPool &pool, int op, const float *a, const int adims[4],
+               const float *b, const int bdims[4], float *out, const int odims[4]);
+
+#endif
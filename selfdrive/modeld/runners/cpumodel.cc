@@ -0,0 +1,464 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <thread>
+
+#include "common/util.h"
+#include "cpumodel.h"
+
+// activations start on a cache line
+#define ARENA_ALIGN_FLOATS 16
+
+namespace {
+
+// The file is checked in every build, asserts only cover what load() already made sure of
+[[noreturn]] void model_error(const char *path, const char *what) {
+  fprintf(stderr, "cpu model %s: %s\n", path, what);
+  exit(EXIT_FAILURE);
+}
+
+struct Reader {
+  const char *path;
+  const uint8_t *data;
+  size_t size, pos;
+
+  const void *take(size_t n) {
+    if (n > size - pos) model_error(path, "file is truncated");
+    const void *p = data + pos;
+    pos += n;
+    return p;
+  }
+  template <class T>
+  T get() {
+    T v;
+    memcpy(&v, take(sizeof(T)), sizeof(T));
+    return v;
+  }
+};
+
+size_t align_floats(size_t n) {
+  return (n + ARENA_ALIGN_FLOATS - 1) / ARENA_ALIGN_FLOATS * ARENA_ALIGN_FLOATS;
+}
+
+}  // namespace
+
+CPUModel::CPUModel(const char *path, float *loutput, size_t loutput_size, int runtime) {
+  output = loutput;
+  output_size = loutput_size;
+
+  // the graph sits next to the model SNPE would load
+  std::string model_path = path;
+  size_t ext = model_path.rfind(".dlc");
+  if (ext != std::string::npos && ext + 4 == model_path.size()) {
+    model_path = model_path.substr(0, ext) + ".cpumodel";
+  }
+  load(model_path.c_str());
+  plan_arena();
+
+  const Tensor &out = tensors[output_tensor];
+  if (output_size != 0) {
+    if (output_size != out.size) model_error(model_path.c_str(), "output size doesn't match the model's");
+  } else {
+    output_size = out.size;
+  }
+
+  int num_threads = std::thread::hardware_concurrency();
+  const char *env_threads = getenv("CPUMODEL_THREADS");
+  if (env_threads) {
+    num_threads = atoi(env_threads);
+  }
+  pool = std::make_unique<ThreadPool>(std::max(num_threads, 1));
+
+  printf("loaded cpu model %s: %lu ops, %.1f MB of activations, %d threads\n", model_path.c_str(),
+         ops.size(), arena_size * sizeof(float) / 1e6, pool->size());
+}
+
+CPUModel::~CPUModel() {
+  free(arena);
+  free(model_data);
+}
+
+void CPUModel::load(const char *path) {
+  auto require = [&](bool ok, const char *what) {
+    if (!ok) model_error(path, what);
+  };
+
+  size_t model_size;
+  model_data = (uint8_t *)read_file(path, &model_size);
+  require(model_data != NULL, "can't be read");
+  Reader r = {path, model_data, model_size, 0};
+
+  require(memcmp(r.take(8), CPUMODEL_MAGIC, 8) == 0, "not a cpu model");
+  require(r.get<uint32_t>() == CPUMODEL_VERSION, "unsupported version");
+
+  const uint32_t num_tensors = r.get<uint32_t>();
+  // each takes at least 32 bytes
+  require(num_tensors <= model_size / 32, "file is truncated");
+  tensors.resize(num_tensors);
+  for (Tensor &t : tensors) {
+    t.kind = r.get<uint8_t>();
+    require(t.kind >= CPUMODEL_TENSOR_ACTIVATION && t.kind <= CPUMODEL_TENSOR_INPUT, "unknown tensor kind");
+    r.take(3);
+    t.size = 1;
+    for (int d = 0; d < 4; d++) {
+      t.dims[d] = r.get<int32_t>();
+      require(t.dims[d] > 0, "tensor with an empty dimension");
+      // the kernels index with int
+      require(t.size <= (size_t)(INT32_MAX / t.dims[d]), "tensor too large");
+      t.size *= t.dims[d];
+    }
+    const uint64_t data_offset = r.get<uint64_t>();
+    const uint32_t name_len = r.get<uint32_t>();
+    t.name = std::string((const char *)r.take(name_len), name_len);
+
+    t.data = NULL;
+    if (t.kind == CPUMODEL_TENSOR_CONSTANT) {
+      require(data_offset % sizeof(float) == 0 && data_offset <= model_size &&
+              t.size <= (model_size - data_offset) / sizeof(float), "constant outside the file");
+      t.data = (float *)(model_data + data_offset);
+    }
+    t.first_use = t.last_use = -1;
+    t.arena_offset = 0;
+  }
+
+  for (int i = 0; i < CPUMODEL_NUM_INPUTS; i++) {
+    inputs[i] = r.get<int32_t>();
+    require(inputs[i] < 0 || (inputs[i] < (int)num_tensors && tensors[inputs[i]].kind == CPUMODEL_TENSOR_INPUT),
+            "graph input isn't an input tensor");
+  }
+  require(inputs[CPUMODEL_INPUT_NET] >= 0, "no net input");
+  output_tensor = r.get<int32_t>();
+  require(output_tensor >= 0 && output_tensor < (int)num_tensors &&
+          tensors[output_tensor].kind == CPUMODEL_TENSOR_ACTIVATION, "output isn't an activation");
+
+  const uint32_t num_ops = r.get<uint32_t>();
+  // each takes at least 72 bytes
+  require(num_ops <= model_size / 72, "file is truncated");
+  ops.resize(num_ops);
+  // in op order, every activation is written once before it's read
+  std::vector<bool> written(num_tensors, false);
+  for (Op &op : ops) {
+    op.type = r.get<int32_t>();
+    op.output = r.get<int32_t>();
+    op.act = r.get<int32_t>();
+    op.alpha = r.get<float>();
+    op.beta = r.get<float>();
+    for (int i = 0; i < CPUMODEL_OP_ATTRS; i++) {
+      op.attrs[i] = r.get<int32_t>();
+    }
+    const uint32_t num_inputs = r.get<uint32_t>();
+    require(num_inputs > 0 && num_inputs <= num_tensors, "op with a bad number of inputs");
+    for (uint32_t i = 0; i < num_inputs; i++) {
+      const int in = r.get<int32_t>();
+      require(in >= 0 && in < (int)num_tensors, "op input out of range");
+      require(tensors[in].kind != CPUMODEL_TENSOR_ACTIVATION || written[in], "op reads an activation before it's written");
+      op.inputs.push_back(in);
+    }
+    require(op.output >= 0 && op.output < (int)num_tensors &&
+            tensors[op.output].kind == CPUMODEL_TENSOR_ACTIVATION, "op output isn't an activation");
+    require(!written[op.output], "activation written twice");
+    written[op.output] = true;
+
+    const char *err = check_op(op);
+    if (err) model_error(path, err);
+  }
+  for (int i = 0; i < (int)num_tensors; i++) {
+    require(tensors[i].kind != CPUMODEL_TENSOR_ACTIVATION || written[i], "activation never written");
+  }
+}
+
+// NULL if run_op can run op on the tensors it names, otherwise what's wrong
+const char *CPUModel::check_op(const Op &op) const {
+  const Tensor &x = tensors[op.inputs[0]];
+  const Tensor &y = tensors[op.output];
+  const int *a = op.attrs;
+  if (op.act < CPU_ACT_NONE || op.act > CPU_ACT_CLIP) return "unknown activation";
+
+  switch (op.type) {
+  case CPUMODEL_OP_CONV: {
+    if (op.inputs.size() < 2 || op.inputs.size() > 3) return "conv takes x, weights and maybe a bias";
+    const Tensor &w = tensors[op.inputs[1]];
+    const int groups = a[10];
+    if (x.dims[0] != 1 || y.dims[0] != 1) return "conv over a batch";
+    if (a[0] <= 0 || a[1] <= 0 || a[2] <= 0 || a[3] <= 0 || a[8] <= 0 || a[9] <= 0) return "conv with an empty kernel, stride or dilation";
+    if (a[4] < 0 || a[5] < 0 || a[6] < 0 || a[7] < 0) return "conv with negative padding";
+    if (groups <= 0 || x.dims[1] % groups != 0 || y.dims[1] % groups != 0) return "conv groups don't divide the channels";
+    if (w.dims[0] != y.dims[1] || w.dims[1] != x.dims[1] / groups || w.dims[2] != a[0] || w.dims[3] != a[1]) return "conv weights don't match";
+    if (op.inputs.size() > 2 && tensors[op.inputs[2]].size != (size_t)y.dims[1]) return "conv bias doesn't match";
+    break;
+  }
+  case CPUMODEL_OP_GEMM: {
+    if (op.inputs.size() < 2 || op.inputs.size() > 3) return "gemm takes x, weights and maybe a bias";
+    const Tensor &w = tensors[op.inputs[1]];
+    if (w.dims[0] != 1 || w.dims[1] != 1 || x.size != (size_t)w.dims[3] || y.size != (size_t)w.dims[2]) return "gemm weights don't match";
+    if (op.inputs.size() > 2 && tensors[op.inputs[2]].size != y.size) return "gemm bias doesn't match";
+    break;
+  }
+  case CPUMODEL_OP_ADD:
+  case CPUMODEL_OP_SUB:
+  case CPUMODEL_OP_MUL:
+  case CPUMODEL_OP_DIV: {
+    if (op.inputs.size() != 2) return "binary op without two inputs";
+    const Tensor &b = tensors[op.inputs[1]];
+    for (int d = 0; d < 4; d++) {
+      if ((x.dims[d] != 1 && x.dims[d] != y.dims[d]) || (b.dims[d] != 1 && b.dims[d] != y.dims[d])) return "binary op inputs don't broadcast to the output";
+    }
+    break;
+  }
+  case CPUMODEL_OP_ACTIVATION:
+  case CPUMODEL_OP_RESHAPE:
+    if (x.size != y.size) return "reshape changes the size";
+    break;
+  case CPUMODEL_OP_CONCAT: {
+    const int axis = a[0];
+    if (axis < 0 || axis > 3) return "concat axis out of range";
+    size_t outer = 1, total = 0;
+    for (int d = 0; d < axis; d++) outer *= y.dims[d];
+    for (int in : op.inputs) {
+      if (tensors[in].size % outer != 0) return "concat inputs don't match the output";
+      total += tensors[in].size;
+    }
+    if (total != y.size) return "concat inputs don't add up to the output";
+    break;
+  }
+  case CPUMODEL_OP_TRANSPOSE: {
+    bool seen[4] = {};
+    for (int d = 0; d < 4; d++) {
+      if (a[d] < 0 || a[d] > 3 || seen[a[d]]) return "transpose perm isn't a permutation";
+      seen[a[d]] = true;
+      if (y.dims[d] != x.dims[a[d]]) return "transpose output doesn't match";
+    }
+    break;
+  }
+  case CPUMODEL_OP_MAXPOOL:
+  case CPUMODEL_OP_AVGPOOL:
+    if (x.dims[0] != 1 || y.dims[0] != 1 || x.dims[1] != y.dims[1]) return "pool output doesn't match";
+    if (a[0] <= 0 || a[1] <= 0 || a[2] <= 0 || a[3] <= 0) return "pool with an empty kernel or stride";
+    break;
+  case CPUMODEL_OP_GLOBAL_AVGPOOL:
+    if (x.dims[0] != 1 || y.size != (size_t)x.dims[1]) return "global pool output doesn't match";
+    break;
+  default:
+    return "unknown op";
+  }
+  return NULL;
+}
+
+// Greedy placement, biggest first, each at the lowest offset that doesn't collide with
+// an already placed tensor that is alive at the same time.
+void CPUModel::plan_arena() {
+  for (int i = 0; i < (int)ops.size(); i++) {
+    for (int in : ops[i].inputs) {
+      tensors[in].last_use = i;
+    }
+    Tensor &out = tensors[ops[i].output];
+    assert(out.first_use == -1);  // written once
+    out.first_use = out.last_use = i;
+  }
+  // read after the last op
+  tensors[output_tensor].last_use = ops.size();
+
+  std::vector<int> order;
+  for (int i = 0; i < (int)tensors.size(); i++) {
+    if (tensors[i].kind != CPUMODEL_TENSOR_ACTIVATION) continue;
+    assert(tensors[i].first_use >= 0);
+    order.push_back(i);
+  }
+  std::sort(order.begin(), order.end(), [&](int a, int b) { return tensors[a].size > tensors[b].size; });
+
+  std::vector<int> placed;
+  arena_size = 0;
+  for (int i : order) {
+    Tensor &t = tensors[i];
+    const size_t size = align_floats(t.size);
+
+    std::vector<std::pair<size_t, size_t>> taken;
+    for (int j : placed) {
+      const Tensor &o = tensors[j];
+      if (t.first_use <= o.last_use && o.first_use <= t.last_use) {
+        taken.push_back({o.arena_offset, o.arena_offset + align_floats(o.size)});
+      }
+    }
+    std::sort(taken.begin(), taken.end());
+
+    size_t offset = 0;
+    for (auto &range : taken) {
+      if (offset + size <= range.first) break;
+      offset = std::max(offset, range.second);
+    }
+    t.arena_offset = offset;
+    arena_size = std::max(arena_size, offset + size);
+    placed.push_back(i);
+  }
+
+  arena = (float *)aligned_alloc(ARENA_ALIGN_FLOATS * sizeof(float), std::max(arena_size, (size_t)ARENA_ALIGN_FLOATS) * sizeof(float));
+  assert(arena);
+  memset(arena, 0, arena_size * sizeof(float));
+  for (int i : order) {
+    tensors[i].data = arena + tensors[i].arena_offset;
+  }
+}
+
+void CPUModel::addInput(int role, float *state, int state_size) {
+  const int idx = inputs[role];
+  // the model may have no use for it
+  if (idx < 0) return;
+  Tensor &t = tensors[idx];
+  assert(t.size == (size_t)state_size);
+  t.data = state;
+  printf("adding index %d: %s\n", role, t.name.c_str());
+}
+
+void CPUModel::addRecurrent(float *state, int state_size) {
+  addInput(CPUMODEL_INPUT_RECURRENT, state, state_size);
+}
+
+void CPUModel::addTrafficConvention(float *state, int state_size) {
+  addInput(CPUMODEL_INPUT_TRAFFIC_CONVENTION, state, state_size);
+}
+
+void CPUModel::addDesire(float *state, int state_size) {
+  addInput(CPUMODEL_INPUT_DESIRE, state, state_size);
+}
+
+void CPUModel::run_op(const Op &op) {
+  const Tensor &x = tensors[op.inputs[0]];
+  Tensor &y = tensors[op.output];
+
+  switch (op.type) {
+  case CPUMODEL_OP_CONV: {
+    assert(op.inputs.size() >= 2);
+    const Tensor &w = tensors[op.inputs[1]];
+    const float *bias = op.inputs.size() > 2 ? tensors[op.inputs[2]].data : NULL;
+    const int *a = op.attrs;
+    const int groups = a[10];
+    const int channels = x.dims[1], out_channels = y.dims[1];
+    const int cin_g = channels / groups, cout_g = out_channels / groups;
+    assert(w.dims[0] == out_channels && w.dims[1] == cin_g && w.dims[2] == a[0] && w.dims[3] == a[1]);
+
+    ConvGeom g = {x.data, x.dims[2], x.dims[3], a[0], a[1], a[2], a[3], a[4], a[5], a[8], a[9], y.dims[2], y.dims[3]};
+    if (groups == channels && groups == out_channels) {
+      depthwise_conv(*pool, channels, g, w.data, bias, y.data, op.act, op.alpha, op.beta);
+      break;
+    }
+
+    const bool pointwise = g.kh == 1 && g.kw == 1 && g.stride_h == 1 && g.stride_w == 1 &&
+                           a[4] == 0 && a[5] == 0 && a[6] == 0 && a[7] == 0;
+    const int K = cin_g * g.kh * g.kw, N = g.out_h * g.out_w;
+    for (int grp = 0; grp < groups; grp++) {
+      ConvGeom gg = g;
+      gg.input = x.data + (size_t)grp * cin_g * g.in_h * g.in_w;
+      GemmB b = {gg.input, g.in_h * g.in_w, pointwise ? NULL : &gg};
+      gemm(*pool, cout_g, N, K, w.data + (size_t)grp * cout_g * K, b, bias ? bias + grp * cout_g : NULL,
+           y.data + (size_t)grp * cout_g * N, N, op.act, op.alpha, op.beta);
+    }
+    break;
+  }
+  case CPUMODEL_OP_GEMM: {
+    assert(op.inputs.size() >= 2);
+    const Tensor &w = tensors[op.inputs[1]];
+    const float *bias = op.inputs.size() > 2 ? tensors[op.inputs[2]].data : NULL;
+    const int M = w.dims[2], K = w.dims[3];
+    assert(x.size == (size_t)K && y.size == (size_t)M);
+    GemmB b = {x.data, 1, NULL};
+    gemm(*pool, M, 1, K, w.data, b, bias, y.data, 1, op.act, op.alpha, op.beta);
+    break;
+  }
+  case CPUMODEL_OP_ADD:
+  case CPUMODEL_OP_SUB:
+  case CPUMODEL_OP_MUL:
+  case CPUMODEL_OP_DIV: {
+    assert(op.inputs.size() == 2);
+    const Tensor &b = tensors[op.inputs[1]];
+    binary_op(*pool, op.type - CPUMODEL_OP_ADD, x.data, x.dims, b.data, b.dims, y.data, y.dims);
+    apply_activation(y.data, y.size, op.act, op.alpha, op.beta);
+    break;
+  }
+  case CPUMODEL_OP_ACTIVATION:
+  case CPUMODEL_OP_RESHAPE:
+    assert(x.size == y.size);
+    memcpy(y.data, x.data, y.size * sizeof(float));
+    apply_activation(y.data, y.size, op.act, op.alpha, op.beta);
+    break;
+  case CPUMODEL_OP_CONCAT: {
+    const int axis = op.attrs[0];
+    size_t outer = 1;
+    for (int d = 0; d < axis; d++) outer *= y.dims[d];
+    float *dst = y.data;
+    for (size_t o = 0; o < outer; o++) {
+      for (int in : op.inputs) {
+        const Tensor &t = tensors[in];
+        const size_t inner = t.size / outer;
+        memcpy(dst, t.data + o * inner, inner * sizeof(float));
+        dst += inner;
+      }
+    }
+    apply_activation(y.data, y.size, op.act, op.alpha, op.beta);
+    break;
+  }
+  case CPUMODEL_OP_TRANSPOSE: {
+    const int *perm = op.attrs;
+    size_t in_strides[4], s = 1;
+    for (int d = 3; d >= 0; d--) {
+      in_strides[d] = s;
+      s *= x.dims[d];
+    }
+    size_t ps[4];
+    for (int d = 0; d < 4; d++) ps[d] = in_strides[perm[d]];
+    float *dst = y.data;
+    for (int i0 = 0; i0 < y.dims[0]; i0++) {
+      for (int i1 = 0; i1 < y.dims[1]; i1++) {
+        for (int i2 = 0; i2 < y.dims[2]; i2++) {
+          const float *src = x.data + i0 * ps[0] + i1 * ps[1] + i2 * ps[2];
+          for (int i3 = 0; i3 < y.dims[3]; i3++) {
+            *dst++ = src[i3 * ps[3]];
+          }
+        }
+      }
+    }
+    apply_activation(y.data, y.size, op.act, op.alpha, op.beta);
+    break;
+  }
+  case CPUMODEL_OP_MAXPOOL:
+  case CPUMODEL_OP_AVGPOOL: {
+    const int *a = op.attrs;
+    ConvGeom g = {x.data, x.dims[2], x.dims[3], a[0], a[1], a[2], a[3], a[4], a[5], 1, 1, y.dims[2], y.dims[3]};
+    pool2d(*pool, op.type == CPUMODEL_OP_MAXPOOL, x.dims[1], g, y.data);
+    apply_activation(y.data, y.size, op.act, op.alpha, op.beta);
+    break;
+  }
+  case CPUMODEL_OP_GLOBAL_AVGPOOL: {
+    const size_t plane = (size_t)x.dims[2] * x.dims[3];
+    for (int c = 0; c < x.dims[1]; c++) {
+      const float *src = x.data + c * plane;
+      float sum = 0;
+      for (size_t i = 0; i < plane; i++) sum += src[i];
+      y.data[c] = sum / plane;
+    }
+    apply_activation(y.data, y.size, op.act, op.alpha, op.beta);
+    break;
+  }
+  default:
+    assert(false);
+  }
+}
+
+void CPUModel::execute(float *net_input_buf, int buf_size) {
+  Tensor &in = tensors[inputs[CPUMODEL_INPUT_NET]];
+  assert(in.size == (size_t)buf_size);
+  in.data = net_input_buf;
+  for (int i = 0; i < CPUMODEL_NUM_INPUTS; i++) {
+    assert(inputs[i] < 0 || tensors[inputs[i]].data != NULL);
+  }
+
+  for (const Op &op : ops) {
+    run_op(op);
+  }
+
+  // the recurrent state may be part of output, only written once nothing reads it anymore
+  memcpy(output, tensors[output_tensor].data, output_size * sizeof(float));
+}
@@ -0,0 +1,121 @@
+#ifndef CPUMODEL_H
+#define CPUMODEL_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "runmodel.h"
+#include "cpu_kernels.h"
+
+// Runs a model on the CPU, from a graph written by onnx_to_cpumodel.py next to the .dlc
+// with a .cpumodel extension. All activations live in one arena laid out when the model
+// is loaded, tensors whose lifetimes don't overlap share memory. CPUMODEL_THREADS sets
+// the size of the thread pool, all cores by default.
+
+#define CPUMODEL_MAGIC "CPUMODEL"
+#define CPUMODEL_VERSION 1
+
+// what the inputs of the graph are fed with
+#define CPUMODEL_INPUT_NET 0
+#define CPUMODEL_INPUT_DESIRE 1
+#define CPUMODEL_INPUT_TRAFFIC_CONVENTION 2
+#define CPUMODEL_INPUT_RECURRENT 3
+#define CPUMODEL_NUM_INPUTS 4
+
+enum CPUModelTensorKind {
+  CPUMODEL_TENSOR_ACTIVATION = 0,
+  CPUMODEL_TENSOR_CONSTANT = 1,
+  CPUMODEL_TENSOR_INPUT = 2,
+};
+
+enum CPUModelOpType {
+  // inputs x, weights, bias. attrs kh, kw, stride h, w, pads top, left, bottom, right,
+  // dilation h, w, groups
+  CPUMODEL_OP_CONV = 0,
+  // inputs x, weights out x in, bias
+  CPUMODEL_OP_GEMM = 1,
+  CPUMODEL_OP_ADD = 2,
+  CPUMODEL_OP_SUB = 3,
+  CPUMODEL_OP_MUL = 4,
+  CPUMODEL_OP_DIV = 5,
+  // only the activation
+  CPUMODEL_OP_ACTIVATION = 6,
+  // attrs axis
+  CPUMODEL_OP_CONCAT = 7,
+  CPUMODEL_OP_RESHAPE = 8,
+  // attrs perm
+  CPUMODEL_OP_TRANSPOSE = 9,
+  // attrs kh, kw, stride h, w, pads top, left, bottom, right
+  CPUMODEL_OP_MAXPOOL = 10,
+  CPUMODEL_OP_AVGPOOL = 11,
+  CPUMODEL_OP_GLOBAL_AVGPOOL = 12,
+};
+
+#define CPUMODEL_OP_ATTRS 12
+
+// same as SNPEModel's
+#ifndef USE_CPU_RUNTIME
+#define USE_CPU_RUNTIME 0
+#define USE_GPU_RUNTIME 1
+#define USE_DSP_RUNTIME 2
+#endif
+
+class CPUModel : public RunModel {
+public:
+  // runtime is ignored
+  CPUModel(const char *path, float *loutput, size_t loutput_size, int runtime);
+  ~CPUModel();
+  void addRecurrent(float *state, int state_size);
+  void addTrafficConvention(float *state, int state_size);
+  void addDesire(float *state, int state_size);
+  void execute(float *net_input_buf, int buf_size);
+
+private:
+  struct Tensor {
+    std::string name;
+    int kind;
+    // NCHW, 1 padded at the front
+    int dims[4];
+    size_t size;
+    // constants point into model_data, inputs to what they were given
+    float *data;
+    // first and last op using an activation, for placing it in the arena
+    int first_use, last_use;
+    size_t arena_offset;
+  };
+
+  struct Op {
+    int type;
+    std::vector<int> inputs;
+    int output;
+    int act;
+    float alpha, beta;
+    int attrs[CPUMODEL_OP_ATTRS];
+  };
+
+  // exits on a file onnx_to_cpumodel.py couldn't have written
+  void load(const char *path);
+  const char *check_op(const Op &op) const;
+  void plan_arena();
+  void addInput(int role, float *state, int state_size);
+  void run_op(const Op &op);
+
+  uint8_t *model_data = NULL;
+  std::vector<Tensor> tensors;
+  std::vector<Op> ops;
+  int inputs[CPUMODEL_NUM_INPUTS];
+  int output_tensor;
+
+  float *arena = NULL;
+  size_t arena_size = 0;
+  std::unique_ptr<ThreadPool> pool;
+
+  float *output;
+  size_t output_size;
+};
+
+#endif
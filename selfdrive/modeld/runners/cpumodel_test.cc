@@ -0,0 +1,416 @@
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include "common/timing.h"
+
+#include "cpu_kernels.h"
+#include "cpumodel.h"
+
+// Checks the kernels against plain loops over convs of every shape the GEMM blocking has
+// edges for, and runs a small recurrent graph through CPUModel the way modeld feeds
+// supercombo, and has it turn away broken copies of that graph. Then times a conv of the size supercombo is made of.
+
+#define MODEL_PATH "/tmp/cpumodel_test.dlc"
+#define TEST_THREADS 4
+
+static std::mt19937 rng(1);
+
+static std::vector<float> random_vec(size_t n) {
+  std::uniform_real_distribution<float> dist(-1, 1);
+  std::vector<float> v(n);
+  for (float &x : v) x = dist(rng);
+  return v;
+}
+
+static void check(const char *what, const float *got, const float *ref, size_t n) {
+  float worst = 0;
+  for (size_t i = 0; i < n; i++) {
+    worst = std::max(worst, fabsf(got[i] - ref[i]) / (1.0f + fabsf(ref[i])));
+  }
+  printf("%-50s max error %g\n", what, worst);
+  assert(worst < 1e-4);
+}
+
+struct ConvCase {
+  int channels, h, w, out_channels, kh, kw, stride_h, stride_w, pad_t, pad_l, pad_b, pad_r, dil_h, dil_w, groups;
+};
+
+static void reference_conv(const ConvCase &c, int out_h, int out_w, const float *in, const float *w,
+                           const float *b, float *out) {
+  const int cin_g = c.channels / c.groups, cout_g = c.out_channels / c.groups;
+  for (int co = 0; co < c.out_channels; co++) {
+    const int g = co / cout_g;
+    for (int oy = 0; oy < out_h; oy++) {
+      for (int ox = 0; ox < out_w; ox++) {
+        double sum = b[co];
+        for (int ci = 0; ci < cin_g; ci++) {
+          for (int ky = 0; ky < c.kh; ky++) {
+            for (int kx = 0; kx < c.kw; kx++) {
+              int iy = oy * c.stride_h - c.pad_t + ky * c.dil_h;
+              int ix = ox * c.stride_w - c.pad_l + kx * c.dil_w;
+              if (iy < 0 || iy >= c.h || ix < 0 || ix >= c.w) continue;
+              sum += w[((co * cin_g + ci) * c.kh + ky) * c.kw + kx] * in[((g * cin_g + ci) * c.h + iy) * c.w + ix];
+            }
+          }
+        }
+        out[(co * out_h + oy) * out_w + ox] = sum > 0 ? sum : 0;
+      }
+    }
+  }
+}
+
+static void test_conv(ThreadPool &pool, const ConvCase &c) {
+  const int out_h = (c.h + c.pad_t + c.pad_b - c.dil_h * (c.kh - 1) - 1) / c.stride_h + 1;
+  const int out_w = (c.w + c.pad_l + c.pad_r - c.dil_w * (c.kw - 1) - 1) / c.stride_w + 1;
+  const int cin_g = c.channels / c.groups, cout_g = c.out_channels / c.groups;
+  auto in = random_vec(c.channels * c.h * c.w);
+  auto w = random_vec(c.out_channels * cin_g * c.kh * c.kw);
+  auto b = random_vec(c.out_channels);
+  std::vector<float> out(c.out_channels * out_h * out_w), ref(out.size());
+
+  ConvGeom g = {in.data(), c.h, c.w, c.kh, c.kw, c.stride_h, c.stride_w, c.pad_t, c.pad_l, c.dil_h, c.dil_w, out_h, out_w};
+  if (c.groups == c.channels && c.groups == c.out_channels) {
+    depthwise_conv(pool, c.channels, g, w.data(), b.data(), out.data(), CPU_ACT_RELU, 0, 0);
+  } else {
+    // what CPUModel does
+    const int K = cin_g * c.kh * c.kw, N = out_h * out_w;
+    for (int grp = 0; grp < c.groups; grp++) {
+      ConvGeom gg = g;
+      gg.input = in.data() + grp * cin_g * c.h * c.w;
+      GemmB gb = {gg.input, c.h * c.w, &gg};
+      gemm(pool, cout_g, N, K, w.data() + grp * cout_g * K, gb, b.data() + grp * cout_g,
+           out.data() + grp * cout_g * N, N, CPU_ACT_RELU, 0, 0);
+    }
+  }
+  reference_conv(c, out_h, out_w, in.data(), w.data(), b.data(), ref.data());
+
+  char what[128];
+  snprintf(what, sizeof(what), "conv %dx%dx%d -> %d, %dx%d/%d, groups %d", c.channels, c.h, c.w,
+           c.out_channels, c.kh, c.kw, c.stride_h, c.groups);
+  check(what, out.data(), ref.data(), out.size());
+}
+
+static void test_gemm(ThreadPool &pool, int M, int N, int K) {
+  auto a = random_vec(M * K), b = random_vec(K * N), bias = random_vec(M);
+  std::vector<float> out(M * N), ref(M * N);
+  for (int m = 0; m < M; m++) {
+    for (int n = 0; n < N; n++) {
+      double sum = bias[m];
+      for (int k = 0; k < K; k++) sum += a[m * K + k] * b[k * N + n];
+      ref[m * N + n] = tanh(sum);
+    }
+  }
+  GemmB gb = {b.data(), N, NULL};
+  gemm(pool, M, N, K, a.data(), gb, bias.data(), out.data(), N, CPU_ACT_TANH, 0, 0);
+
+  char what[128];
+  snprintf(what, sizeof(what), "gemm %dx%dx%d", M, N, K);
+  check(what, out.data(), ref.data(), out.size());
+}
+
+static void test_pool(ThreadPool &pool, bool max) {
+  const int channels = 5, h = 11, w = 14, k = 3, stride = 2, pad = 1;
+  const int out_h = (h + 2 * pad - k) / stride + 1, out_w = (w + 2 * pad - k) / stride + 1;
+  auto in = random_vec(channels * h * w);
+  std::vector<float> out(channels * out_h * out_w), ref(out.size());
+  for (int c = 0; c < channels; c++) {
+    for (int oy = 0; oy < out_h; oy++) {
+      for (int ox = 0; ox < out_w; ox++) {
+        float v = max ? -INFINITY : 0;
+        int count = 0;
+        for (int y = oy * stride - pad; y < oy * stride - pad + k; y++) {
+          for (int x = ox * stride - pad; x < ox * stride - pad + k; x++) {
+            if (y < 0 || y >= h || x < 0 || x >= w) continue;
+            float iv = in[(c * h + y) * w + x];
+            v = max ? std::max(v, iv) : v + iv;
+            count++;
+          }
+        }
+        ref[(c * out_h + oy) * out_w + ox] = max ? v : v / count;
+      }
+    }
+  }
+  ConvGeom g = {in.data(), h, w, k, k, stride, stride, pad, pad, 1, 1, out_h, out_w};
+  pool2d(pool, max, channels, g, out.data());
+  check(max ? "maxpool 3x3/2" : "avgpool 3x3/2", out.data(), ref.data(), out.size());
+}
+
+static void test_broadcast(ThreadPool &pool) {
+  const int adims[4] = {1, 8, 5, 7}, bdims[4] = {1, 8, 1, 1}, cdims[4] = {1, 1, 5, 1};
+  auto a = random_vec(8 * 5 * 7), b = random_vec(8), c = random_vec(5);
+  std::vector<float> out(a.size()), ref(a.size());
+
+  binary_op(pool, CPU_BINARY_SUB, a.data(), adims, b.data(), bdims, out.data(), adims);
+  for (int i = 0; i < 8 * 5 * 7; i++) ref[i] = a[i] - b[i / 35];
+  check("sub per channel", out.data(), ref.data(), out.size());
+
+  binary_op(pool, CPU_BINARY_MUL, c.data(), cdims, a.data(), adims, out.data(), adims);
+  for (int i = 0; i < 8 * 5 * 7; i++) ref[i] = c[(i / 7) % 5] * a[i];
+  check("mul per row", out.data(), ref.data(), out.size());
+}
+
+// net input 4x8x8 -> 3x3 conv to 6, relu -> global average -> with desire and the
+// recurrent state -> dense to 4 outputs and 6 of new state, tanh
+#define NET_C 4
+#define NET_HW 8
+#define CONV_C 6
+#define DESIRE_LEN 3
+#define STATE_LEN 6
+#define OUTPUT_LEN 4
+#define DENSE_IN (CONV_C + DESIRE_LEN + STATE_LEN)
+#define DENSE_OUT (OUTPUT_LEN + STATE_LEN)
+
+struct TestModel {
+  std::vector<float> conv_w, conv_b, dense_w, dense_b;
+};
+
+static void write_model(const TestModel &m) {
+  std::string meta, data;
+  auto put = [](std::string &s, const void *p, size_t n) { s.append((const char *)p, n); };
+  auto put_i = [&](std::string &s, int32_t v) { put(s, &v, 4); };
+
+  struct T { const char *name; int kind; int dims[4]; const std::vector<float> *values; };
+  std::vector<T> tensors = {
+    {"net", CPUMODEL_TENSOR_INPUT, {1, NET_C, NET_HW, NET_HW}, NULL},
+    {"desire", CPUMODEL_TENSOR_INPUT, {1, 1, 1, DESIRE_LEN}, NULL},
+    {"state", CPUMODEL_TENSOR_INPUT, {1, 1, 1, STATE_LEN}, NULL},
+    {"conv_w", CPUMODEL_TENSOR_CONSTANT, {CONV_C, NET_C, 3, 3}, &m.conv_w},
+    {"conv_b", CPUMODEL_TENSOR_CONSTANT, {1, 1, 1, CONV_C}, &m.conv_b},
+    {"conv", CPUMODEL_TENSOR_ACTIVATION, {1, CONV_C, NET_HW, NET_HW}, NULL},
+    {"pooled", CPUMODEL_TENSOR_ACTIVATION, {1, CONV_C, 1, 1}, NULL},
+    {"flat", CPUMODEL_TENSOR_ACTIVATION, {1, 1, 1, CONV_C}, NULL},
+    {"cat", CPUMODEL_TENSOR_ACTIVATION, {1, 1, 1, DENSE_IN}, NULL},
+    {"dense_w", CPUMODEL_TENSOR_CONSTANT, {1, 1, DENSE_OUT, DENSE_IN}, &m.dense_w},
+    {"dense_b", CPUMODEL_TENSOR_CONSTANT, {1, 1, 1, DENSE_OUT}, &m.dense_b},
+    {"out", CPUMODEL_TENSOR_ACTIVATION, {1, 1, 1, DENSE_OUT}, NULL},
+  };
+
+  struct O { int type, output, act; std::vector<int> attrs, inputs; };
+  std::vector<O> ops = {
+    {CPUMODEL_OP_CONV, 5, CPU_ACT_RELU, {3, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1}, {0, 3, 4}},
+    {CPUMODEL_OP_GLOBAL_AVGPOOL, 6, CPU_ACT_NONE, {}, {5}},
+    {CPUMODEL_OP_RESHAPE, 7, CPU_ACT_NONE, {}, {6}},
+    {CPUMODEL_OP_CONCAT, 8, CPU_ACT_NONE, {3}, {7, 1, 2}},
+    {CPUMODEL_OP_GEMM, 11, CPU_ACT_TANH, {}, {8, 9, 10}},
+  };
+
+  // everything but the constants, to know where they go
+  size_t meta_size = 8 + 4 + 4 + tensors.size() * 32 + 4 * 4 + 4 + 4;
+  for (auto &t : tensors) meta_size += strlen(t.name);
+  for (auto &o : ops) meta_size += 5 * 4 + CPUMODEL_OP_ATTRS * 4 + 4 + o.inputs.size() * 4;
+
+  meta = CPUMODEL_MAGIC;
+  put_i(meta, CPUMODEL_VERSION);
+  put_i(meta, tensors.size());
+  for (auto &t : tensors) {
+    uint8_t kind[4] = {(uint8_t)t.kind, 0, 0, 0};
+    put(meta, kind, 4);
+    for (int d = 0; d < 4; d++) put_i(meta, t.dims[d]);
+    uint64_t offset = t.values ? meta_size + data.size() : 0;
+    put(meta, &offset, 8);
+    put_i(meta, strlen(t.name));
+    put(meta, t.name, strlen(t.name));
+    if (t.values) put(data, t.values->data(), t.values->size() * sizeof(float));
+  }
+  // net, desire, no traffic convention, recurrent
+  int32_t inputs[4] = {0, 1, -1, 2};
+  put(meta, inputs, sizeof(inputs));
+  put_i(meta, 11);
+  put_i(meta, ops.size());
+  for (auto &o : ops) {
+    float alpha = 0, beta = 0;
+    put_i(meta, o.type);
+    put_i(meta, o.output);
+    put_i(meta, o.act);
+    put(meta, &alpha, 4);
+    put(meta, &beta, 4);
+    for (int i = 0; i < CPUMODEL_OP_ATTRS; i++) put_i(meta, i < (int)o.attrs.size() ? o.attrs[i] : 0);
+    put_i(meta, o.inputs.size());
+    for (int in : o.inputs) put_i(meta, in);
+  }
+  assert(meta.size() == meta_size);
+
+  std::string path = std::string(MODEL_PATH).substr(0, strlen(MODEL_PATH) - 4) + ".cpumodel";
+  FILE *f = fopen(path.c_str(), "wb");
+  assert(f);
+  fwrite(meta.data(), 1, meta.size(), f);
+  fwrite(data.data(), 1, data.size(), f);
+  fclose(f);
+}
+
+static void reference_model(const TestModel &m, const float *net, const float *desire, float *output) {
+  ConvCase c = {NET_C, NET_HW, NET_HW, CONV_C, 3, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1};
+  std::vector<float> conv(CONV_C * NET_HW * NET_HW);
+  reference_conv(c, NET_HW, NET_HW, net, m.conv_w.data(), m.conv_b.data(), conv.data());
+
+  float cat[DENSE_IN];
+  for (int ch = 0; ch < CONV_C; ch++) {
+    double sum = 0;
+    for (int i = 0; i < NET_HW * NET_HW; i++) sum += conv[ch * NET_HW * NET_HW + i];
+    cat[ch] = sum / (NET_HW * NET_HW);
+  }
+  memcpy(cat + CONV_C, desire, DESIRE_LEN * sizeof(float));
+  memcpy(cat + CONV_C + DESIRE_LEN, output + OUTPUT_LEN, STATE_LEN * sizeof(float));
+
+  for (int o = 0; o < DENSE_OUT; o++) {
+    double sum = m.dense_b[o];
+    for (int i = 0; i < DENSE_IN; i++) sum += m.dense_w[o * DENSE_IN + i] * cat[i];
+    output[o] = tanh(sum);
+  }
+}
+
+static void test_model() {
+  TestModel m = {random_vec(CONV_C * NET_C * 9), random_vec(CONV_C), random_vec(DENSE_OUT * DENSE_IN), random_vec(DENSE_OUT)};
+  write_model(m);
+
+  std::vector<float> output(DENSE_OUT, 0), ref(DENSE_OUT, 0);
+  std::vector<float> desire(DESIRE_LEN, 0);
+  CPUModel model(MODEL_PATH, output.data(), output.size(), USE_GPU_RUNTIME);
+  model.addRecurrent(&output[OUTPUT_LEN], STATE_LEN);
+  model.addDesire(desire.data(), DESIRE_LEN);
+  // not an input of this graph
+  float traffic_convention[2] = {1, 0};
+  model.addTrafficConvention(traffic_convention, 2);
+
+  for (int frame = 0; frame < 5; frame++) {
+    auto net = random_vec(NET_C * NET_HW * NET_HW);
+    desire.assign(DESIRE_LEN, 0);
+    desire[frame % DESIRE_LEN] = 1;
+    model.execute(net.data(), net.size());
+    reference_model(m, net.data(), desire.data(), ref.data());
+
+    char what[64];
+    snprintf(what, sizeof(what), "model frame %d", frame);
+    check(what, output.data(), ref.data(), output.size());
+  }
+}
+
+// loads a copy of the test model changed by edit, in a child since a bad file exits
+static bool model_rejected(const char *what, std::string (*edit)(std::string)) {
+  std::string path = std::string(MODEL_PATH).substr(0, strlen(MODEL_PATH) - 4) + ".cpumodel";
+  FILE *f = fopen(path.c_str(), "rb");
+  assert(f);
+  std::string good;
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) good.append(buf, n);
+  fclose(f);
+
+  std::string bad_path = "/tmp/cpumodel_test_bad.cpumodel";
+  f = fopen(bad_path.c_str(), "wb");
+  assert(f);
+  std::string bad = edit(good);
+  fwrite(bad.data(), 1, bad.size(), f);
+  fclose(f);
+
+  // the child leaves through exit(), which would print what's buffered a second time
+  fflush(stdout);
+  pid_t pid = fork();
+  assert(pid >= 0);
+  if (pid == 0) {
+    float output[DENSE_OUT];
+    CPUModel model(bad_path.c_str(), output, DENSE_OUT, USE_GPU_RUNTIME);
+    _exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  unlink(bad_path.c_str());
+  printf("%-50s %s\n", what, WIFEXITED(status) ? "rejected" : "crashed");
+  return WIFEXITED(status) && WEXITSTATUS(status) == EXIT_FAILURE;
+}
+
+template <class T>
+static std::string put_at(std::string s, size_t pos, T v) {
+  memcpy(&s[pos], &v, sizeof(v));
+  return s;
+}
+
+// where write_model's ops start, counted back from the constants after them
+static size_t ops_end(const std::string &s) {
+  return s.size() - (CONV_C * NET_C * 9 + CONV_C + DENSE_OUT * DENSE_IN + DENSE_OUT) * sizeof(float);
+}
+#define OP_CONV_AT(s) (ops_end(s) - 404)
+#define OP_GEMM_AT(s) (ops_end(s) - 84)
+
+static void test_bad_models() {
+  // what load() checks holds without asserts too
+  assert(model_rejected("empty", [](std::string s) { return std::string(); }));
+  assert(model_rejected("cut in the header", [](std::string s) { return s.substr(0, 10); }));
+  assert(model_rejected("cut in the ops", [](std::string s) { return s.substr(0, ops_end(s) - 10); }));
+  assert(model_rejected("cut in the constants", [](std::string s) { return s.substr(0, s.size() - 4); }));
+  assert(model_rejected("wrong magic", [](std::string s) { s[0] = 'X'; return s; }));
+  assert(model_rejected("wrong version", [](std::string s) { return put_at<uint32_t>(s, 8, CPUMODEL_VERSION + 1); }));
+  assert(model_rejected("huge tensor count", [](std::string s) { return put_at<uint32_t>(s, 12, UINT32_MAX); }));
+  assert(model_rejected("empty dimension", [](std::string s) { return put_at<int32_t>(s, 16 + 8, 0); }));
+  assert(model_rejected("huge name", [](std::string s) { return put_at<uint32_t>(s, 16 + 28, UINT32_MAX); }));
+  assert(model_rejected("unknown op", [](std::string s) { return put_at<int32_t>(s, OP_GEMM_AT(s), 99); }));
+  assert(model_rejected("op input out of range", [](std::string s) { return put_at<int32_t>(s, ops_end(s) - 12, 1000); }));
+  assert(model_rejected("op reads an unwritten activation", [](std::string s) { return put_at<int32_t>(s, ops_end(s) - 12, 11); }));
+  assert(model_rejected("conv groups don't divide channels", [](std::string s) { return put_at<int32_t>(s, OP_CONV_AT(s) + 20 + 10 * 4, 4); }));
+  assert(model_rejected("conv with a bigger kernel than its weights", [](std::string s) { return put_at<int32_t>(s, OP_CONV_AT(s) + 20, 5); }));
+  assert(model_rejected("activation written twice", [](std::string s) { return put_at<int32_t>(s, OP_GEMM_AT(s) + 4, 7); }));
+  assert(model_rejected("gemm on the wrong size", [](std::string s) { return put_at<int32_t>(s, ops_end(s) - 12, 7); }));
+}
+
+static void bench_conv(ThreadPool &pool) {
+  const int channels = 64, h = 64, w = 128, iters = 10;
+  auto in = random_vec(channels * h * w), weights = random_vec(channels * channels * 9), bias = random_vec(channels);
+  std::vector<float> out(channels * h * w);
+  ConvGeom g = {in.data(), h, w, 3, 3, 1, 1, 1, 1, 1, 1, h, w};
+  GemmB gb = {in.data(), h * w, &g};
+
+  double start = millis_since_boot();
+  for (int i = 0; i < iters; i++) {
+    gemm(pool, channels, h * w, channels * 9, weights.data(), gb, bias.data(), out.data(), h * w, CPU_ACT_ELU, 1, 0);
+  }
+  double ms = (millis_since_boot() - start) / iters;
+  printf("conv 64x64x128 3x3 -> 64 on %d threads: %.2f ms, %.1f GFLOP/s\n", pool.size(), ms,
+         2.0 * channels * h * w * channels * 9 / (ms * 1e6));
+}
+
+int main(int argc, char **argv) {
+  ThreadPool pool(TEST_THREADS);
+
+  const ConvCase convs[] = {
+    // pointwise, B read straight from the input
+    {16, 9, 13, 37, 1, 1, 1, 1, 0, 0, 0, 0, 1, 1, 1},
+    {12, 17, 23, 20, 3, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1},
+    // K over one KC block
+    {64, 10, 12, 13, 3, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1},
+    {3, 31, 40, 8, 5, 5, 2, 2, 2, 1, 2, 3, 1, 1, 1},
+    {8, 20, 20, 7, 3, 3, 1, 2, 2, 2, 2, 2, 2, 2, 1},
+    {16, 12, 15, 8, 3, 3, 1, 1, 1, 1, 1, 1, 1, 1, 4},
+    // depthwise
+    {24, 19, 22, 24, 3, 3, 2, 2, 1, 1, 1, 1, 1, 1, 24},
+    {10, 9, 30, 10, 5, 5, 1, 3, 2, 4, 2, 0, 1, 1, 10},
+    {6, 14, 14, 6, 3, 3, 1, 1, 2, 2, 2, 2, 2, 2, 6},
+  };
+  for (const ConvCase &c : convs) {
+    test_conv(pool, c);
+  }
+
+  test_gemm(pool, 7, 5, 3);
+  test_gemm(pool, 130, 70, 300);
+  // dense layers
+  test_gemm(pool, 100, 1, 1000);
+  test_gemm(pool, 3, 1, 7);
+
+  test_pool(pool, true);
+  test_pool(pool, false);
+  test_broadcast(pool);
+  test_model();
+  test_bad_models();
+
+  bench_conv(pool);
+  printf("all passed\n");
+  return 0;
+}
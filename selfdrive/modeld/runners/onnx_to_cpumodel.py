@@ -0,0 +1,446 @@
+#!/usr/bin/env python3
+"""Converts an ONNX model into the graph CPUModel (runners/cpumodel.cc) runs.
+
+  ./onnx_to_cpumodel.py ../../models/supercombo.onnx ../../models/supercombo.cpumodel
+
+BatchNormalization, zero Pad, bias adds and activations are folded into the convs and
+dense layers before them. Inputs named like desire, traffic_convention and rnn_state are
+fed by addDesire, addTrafficConvention and addRecurrent, the remaining one is the net
+input, override with --desire etc. The graph needs static shapes and one output.
+"""
+import argparse
+import struct
+import sys
+
+import numpy as np
+import onnx
+from onnx import helper, numpy_helper, shape_inference
+
+MAGIC = b"CPUMODEL"
+VERSION = 1
+
+TENSOR_ACTIVATION, TENSOR_CONSTANT, TENSOR_INPUT = 0, 1, 2
+
+OP_CONV, OP_GEMM, OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_ACTIVATION, OP_CONCAT, OP_RESHAPE, \
+  OP_TRANSPOSE, OP_MAXPOOL, OP_AVGPOOL, OP_GLOBAL_AVGPOOL = range(13)
+NUM_ATTRS = 12
+
+ACT_NONE, ACT_RELU, ACT_LEAKY_RELU, ACT_ELU, ACT_SIGMOID, ACT_TANH, ACT_CLIP = range(7)
+
+# in the order of CPUMODEL_INPUT_*
+ROLES = ['net', 'desire', 'traffic_convention', 'recurrent']
+ROLE_HINTS = {'desire': ['desire'], 'traffic_convention': ['traffic_convention'],
+              'recurrent': ['rnn_state', 'recurrent']}
+
+BINARY_OPS = {'Add': OP_ADD, 'Sub': OP_SUB, 'Mul': OP_MUL, 'Div': OP_DIV}
+BINARY_FNS = {'Add': np.add, 'Sub': np.subtract, 'Mul': np.multiply, 'Div': np.divide}
+ALIAS_OPS = ['Identity', 'Dropout']
+RESHAPE_OPS = ['Reshape', 'Flatten', 'Squeeze', 'Unsqueeze']
+
+
+class ConvertError(Exception):
+  pass
+
+
+def pad4(shape):
+  shape = [int(d) for d in shape]
+  if len(shape) > 4:
+    raise ConvertError(f"rank {len(shape)} tensors are not supported")
+  return [1] * (4 - len(shape)) + shape
+
+
+class Op:
+  def __init__(self, type, inputs, output, attrs=(), act=ACT_NONE, alpha=0., beta=0.):
+    self.type = type
+    self.inputs = list(inputs)
+    self.output = output
+    self.attrs = list(attrs) + [0] * (NUM_ATTRS - len(attrs))
+    self.act, self.alpha, self.beta = act, alpha, beta
+
+
+class Converter:
+  def __init__(self, model, roles):
+    # batch of 1 wherever it was left open
+    for value in list(model.graph.input) + list(model.graph.output):
+      for dim in value.type.tensor_type.shape.dim:
+        if not dim.HasField('dim_value'):
+          dim.dim_value = 1
+    model = shape_inference.infer_shapes(model)
+    self.graph = model.graph
+
+    self.consts = {i.name: numpy_helper.to_array(i) for i in self.graph.initializer}
+    self.shapes = {}
+    for value in list(self.graph.input) + list(self.graph.value_info) + list(self.graph.output):
+      dims = value.type.tensor_type.shape.dim
+      if all(d.HasField('dim_value') for d in dims):
+        self.shapes[value.name] = [d.dim_value for d in dims]
+
+    self.inputs = [i.name for i in self.graph.input if i.name not in self.consts]
+    if len(self.graph.output) != 1:
+      raise ConvertError(f"the model has {len(self.graph.output)} outputs, CPUModel needs one")
+    self.output = self.graph.output[0].name
+    self.roles = self.assign_roles(roles)
+
+    self.ops = []
+    self.producer = {}  # tensor -> op writing it
+    self.alias = {}     # tensor -> tensor with the same data
+    self.padded = {}    # output of a folded Pad -> (input, [t, l, b, r])
+    self.consumers = {}
+    for node in self.graph.node:
+      for name in node.input:
+        self.consumers[name] = self.consumers.get(name, 0) + 1
+    self.consumers[self.output] = self.consumers.get(self.output, 0) + 1
+
+  def assign_roles(self, roles):
+    assigned = {}
+    for role in ROLES[1:]:
+      if roles.get(role):
+        assigned[role] = roles[role]
+        continue
+      for name in self.inputs:
+        if any(h in name for h in ROLE_HINTS[role]) and name not in assigned.values():
+          assigned[role] = name
+    rest = [n for n in self.inputs if n not in assigned.values()]
+    if roles.get('net'):
+      assigned['net'] = roles['net']
+    elif len(rest) == 1:
+      assigned['net'] = rest[0]
+    else:
+      raise ConvertError(f"can't tell which input is the net input: {rest}")
+    for role, name in assigned.items():
+      if name not in self.inputs:
+        raise ConvertError(f"{role} input {name} is not an input of the model")
+    if len(set(assigned.values())) != len(self.inputs):
+      raise ConvertError(f"inputs {self.inputs} don't match roles {assigned}")
+    return assigned
+
+  def name(self, n):
+    while n in self.alias:
+      n = self.alias[n]
+    return n
+
+  def shape(self, n):
+    n = self.name(n)
+    if n in self.consts:
+      return list(self.consts[n].shape)
+    if n not in self.shapes:
+      raise ConvertError(f"no static shape for {n}")
+    return self.shapes[n]
+
+  def const(self, n):
+    n = self.name(n)
+    return self.consts[n] if n in self.consts else None
+
+  def add_const(self, name, value):
+    self.consts[name] = np.asarray(value, dtype=np.float32)
+    return name
+
+  def single_use(self, n):
+    return self.consumers.get(n, 0) == 1 and n != self.output
+
+  def emit(self, op):
+    self.ops.append(op)
+    self.producer[op.output] = op
+
+  # the nodes the output depends on, the shape input of a Reshape doesn't count
+  def live_nodes(self):
+    producers = {out: node for node in self.graph.node for out in node.output}
+    live, stack = set(), [self.output]
+    while stack:
+      n = stack.pop()
+      node = producers.get(n)
+      if node is None or id(node) in live:
+        continue
+      live.add(id(node))
+      stack.extend(node.input[:1] if node.op_type == 'Reshape' else [i for i in node.input if i])
+    return [node for node in self.graph.node if id(node) in live]
+
+  def convert(self):
+    for node in self.live_nodes():
+      attrs = {a.name: helper.get_attribute_value(a) for a in node.attribute}
+      handler = getattr(self, 'op_' + node.op_type, None)
+      if handler is None:
+        raise ConvertError(f"unsupported op {node.op_type} ({node.name})")
+      handler(node, attrs)
+
+  def take_pads(self, node, pads):
+    src = self.name(node.input[0])
+    if src in self.padded:
+      src, extra = self.padded[src]
+      pads = [a + b for a, b in zip(pads, extra)]
+    return src, pads
+
+  def spatial_pads(self, node, attrs, kernel, strides, dilations):
+    auto_pad = attrs.get('auto_pad', b'NOTSET')
+    auto_pad = auto_pad.decode() if isinstance(auto_pad, bytes) else auto_pad
+    if auto_pad in ('NOTSET', 'VALID'):
+      return list(attrs.get('pads', [0, 0, 0, 0]))
+    in_h, in_w = self.shape(node.input[0])[2:]
+    out_h, out_w = self.shape(node.output[0])[2:]
+    total = [max((o - 1) * s + (k - 1) * d + 1 - i, 0) for o, s, k, d, i in
+             zip((out_h, out_w), strides, kernel, dilations, (in_h, in_w))]
+    begin = [t // 2 if auto_pad == 'SAME_UPPER' else (t + 1) // 2 for t in total]
+    return [begin[0], begin[1], total[0] - begin[0], total[1] - begin[1]]
+
+  def op_Constant(self, node, attrs):
+    self.consts[node.output[0]] = numpy_helper.to_array(attrs['value'])
+
+  def op_Conv(self, node, attrs):
+    w = self.const(node.input[1])
+    if w is None or w.ndim != 4:
+      raise ConvertError(f"{node.name}: only 2d convs with constant weights are supported")
+    kernel = list(w.shape[2:])
+    strides = list(attrs.get('strides', [1, 1]))
+    dilations = list(attrs.get('dilations', [1, 1]))
+    pads = self.spatial_pads(node, attrs, kernel, strides, dilations)
+    src, pads = self.take_pads(node, pads)
+    inputs = [src, self.add_const(node.output[0] + '_w', w)]
+    if len(node.input) > 2 and node.input[2]:
+      inputs.append(self.add_const(node.output[0] + '_b', self.const(node.input[2])))
+    attrs = kernel + strides + pads + dilations + [attrs.get('group', 1)]
+    self.emit(Op(OP_CONV, inputs, node.output[0], attrs))
+
+  def op_BatchNormalization(self, node, attrs):
+    gamma, beta, mean, var = [self.const(n) for n in node.input[1:5]]
+    scale = gamma / np.sqrt(var + attrs.get('epsilon', 1e-5))
+    shift = beta - mean * scale
+    src = self.name(node.input[0])
+    conv = self.producer.get(src)
+    if conv is not None and conv.type == OP_CONV and conv.act == ACT_NONE and self.single_use(src):
+      w = self.consts[conv.inputs[1]]
+      b = self.consts[conv.inputs[2]] if len(conv.inputs) > 2 else np.zeros(w.shape[0], dtype=np.float32)
+      self.consts[conv.inputs[1]] = (w * scale[:, None, None, None]).astype(np.float32)
+      bias = self.add_const(conv.output + '_b', b * scale + shift)
+      conv.inputs = conv.inputs[:2] + [bias]
+      self.alias[node.output[0]] = src
+      return
+    c = len(scale)
+    scaled = node.output[0] + '_scaled'
+    self.emit(Op(OP_MUL, [src, self.add_const(scaled + '_c', scale.reshape(c, 1, 1))], scaled))
+    self.emit(Op(OP_ADD, [scaled, self.add_const(node.output[0] + '_c', shift.reshape(c, 1, 1))], node.output[0]))
+
+  def op_Pad(self, node, attrs):
+    mode = attrs.get('mode', b'constant')
+    pads = attrs.get('pads')
+    if pads is None:
+      pads = self.const(node.input[1]).tolist()
+    value = attrs.get('value', 0.)
+    if len(node.input) > 2 and node.input[2]:
+      value = float(self.const(node.input[2]))
+    if mode not in (b'constant', 'constant') or value != 0 or len(pads) != 8 or any(pads[i] for i in (0, 1, 4, 5)):
+      raise ConvertError(f"{node.name}: only zero padding of H and W before a conv or pool is supported")
+    self.padded[node.output[0]] = (self.name(node.input[0]), [pads[2], pads[3], pads[6], pads[7]])
+
+  def pool(self, node, attrs, op_type):
+    if attrs.get('count_include_pad', 0):
+      raise ConvertError(f"{node.name}: count_include_pad is not supported")
+    kernel = list(attrs['kernel_shape'])
+    strides = list(attrs.get('strides', [1, 1]))
+    pads = self.spatial_pads(node, attrs, kernel, strides, [1, 1])
+    src, pads = self.take_pads(node, pads)
+    self.emit(Op(op_type, [src], node.output[0], kernel + strides + pads))
+
+  def op_MaxPool(self, node, attrs):
+    self.pool(node, attrs, OP_MAXPOOL)
+
+  def op_AveragePool(self, node, attrs):
+    self.pool(node, attrs, OP_AVGPOOL)
+
+  def op_GlobalAveragePool(self, node, attrs):
+    self.emit(Op(OP_GLOBAL_AVGPOOL, [self.name(node.input[0])], node.output[0]))
+
+  def dense(self, node, w, bias):
+    x = self.name(node.input[0])
+    if int(np.prod(self.shape(x))) != w.shape[1]:
+      raise ConvertError(f"{node.name}: only a batch of 1 is supported")
+    inputs = [x, self.add_const(node.output[0] + '_w', w)]
+    if bias is not None:
+      inputs.append(self.add_const(node.output[0] + '_b', np.broadcast_to(bias, (w.shape[0],))))
+    self.emit(Op(OP_GEMM, inputs, node.output[0]))
+
+  def op_Gemm(self, node, attrs):
+    b = self.const(node.input[1])
+    if b is None or attrs.get('transA', 0):
+      raise ConvertError(f"{node.name}: only x * W with constant W is supported")
+    w = b if attrs.get('transB', 0) else b.T
+    c = self.const(node.input[2]) if len(node.input) > 2 and node.input[2] else None
+    bias = None if c is None else attrs.get('beta', 1.) * c.reshape(-1)
+    self.dense(node, attrs.get('alpha', 1.) * w, bias)
+
+  def op_MatMul(self, node, attrs):
+    b = self.const(node.input[1])
+    if b is None or b.ndim != 2:
+      raise ConvertError(f"{node.name}: only x * W with constant 2d W is supported")
+    self.dense(node, b.T, None)
+
+  def binary(self, node, attrs):
+    a, b = [self.name(n) for n in node.input]
+    out = node.output[0]
+    ca, cb = self.const(a), self.const(b)
+    if ca is not None and cb is not None:
+      self.consts[out] = BINARY_FNS[node.op_type](ca, cb)
+      return
+
+    # a bias, into the conv or dense layer before it
+    if node.op_type == 'Add' and (ca is None) != (cb is None):
+      x, c = (a, cb) if cb is not None else (b, ca)
+      prev = self.producer.get(x)
+      if prev is not None and prev.type in (OP_CONV, OP_GEMM) and prev.act == ACT_NONE and self.single_use(x):
+        n = self.consts[prev.inputs[1]].shape[0]
+        out_shape = pad4(self.shape(out))
+        per_channel = prev.type == OP_CONV and pad4(c.shape)[1] in (1, n) and np.prod(c.shape) in (1, n) and \
+          all(d == 1 for i, d in enumerate(pad4(c.shape)) if i != 1)
+        per_unit = prev.type == OP_GEMM and np.prod(c.shape) in (1, n) and out_shape[-1] == n
+        if per_channel or per_unit:
+          old = self.consts[prev.inputs[2]] if len(prev.inputs) > 2 else 0
+          bias = self.add_const(x + '_b', old + np.broadcast_to(c.reshape(-1), (n,)))
+          prev.inputs = prev.inputs[:2] + [bias]
+          self.alias[out] = x
+          return
+
+    inputs = []
+    for n, c in ((a, ca), (b, cb)):
+      inputs.append(self.add_const(n, c) if c is not None else n)
+    shapes = [pad4(self.shape(n)) for n in inputs]
+    if list(np.broadcast_shapes(*shapes)) != pad4(self.shape(out)):
+      raise ConvertError(f"{node.name}: unexpected broadcast {shapes}")
+    self.emit(Op(BINARY_OPS[node.op_type], inputs, out))
+
+  op_Add = op_Sub = op_Mul = op_Div = binary
+
+  def activation(self, node, act, alpha=0., beta=0.):
+    src = self.name(node.input[0])
+    prev = self.producer.get(src)
+    if prev is not None and prev.act == ACT_NONE and self.single_use(src):
+      prev.act, prev.alpha, prev.beta = act, alpha, beta
+      self.alias[node.output[0]] = src
+      return
+    self.emit(Op(OP_ACTIVATION, [src], node.output[0], act=act, alpha=alpha, beta=beta))
+
+  def op_Relu(self, node, attrs):
+    self.activation(node, ACT_RELU)
+
+  def op_LeakyRelu(self, node, attrs):
+    self.activation(node, ACT_LEAKY_RELU, attrs.get('alpha', 0.01))
+
+  def op_Elu(self, node, attrs):
+    self.activation(node, ACT_ELU, attrs.get('alpha', 1.))
+
+  def op_Sigmoid(self, node, attrs):
+    self.activation(node, ACT_SIGMOID)
+
+  def op_Tanh(self, node, attrs):
+    self.activation(node, ACT_TANH)
+
+  def op_Clip(self, node, attrs):
+    lo, hi = attrs.get('min', -np.inf), attrs.get('max', np.inf)
+    if len(node.input) > 1 and node.input[1]:
+      lo = float(self.const(node.input[1]))
+    if len(node.input) > 2 and node.input[2]:
+      hi = float(self.const(node.input[2]))
+    self.activation(node, ACT_CLIP, max(lo, np.finfo(np.float32).min), min(hi, np.finfo(np.float32).max))
+
+  def op_Concat(self, node, attrs):
+    rank = len(self.shape(node.output[0]))
+    axis = attrs['axis'] % rank + 4 - rank
+    inputs = []
+    for n in node.input:
+      c = self.const(n)
+      inputs.append(self.add_const(self.name(n), c) if c is not None else self.name(n))
+    self.emit(Op(OP_CONCAT, inputs, node.output[0], [axis]))
+
+  def reshape(self, node, attrs):
+    src = self.name(node.input[0])
+    if self.const(src) is not None:
+      self.consts[node.output[0]] = self.const(src).reshape(self.shape(node.output[0]))
+      return
+    self.emit(Op(OP_RESHAPE, [src], node.output[0]))
+
+  op_Reshape = op_Flatten = op_Squeeze = op_Unsqueeze = reshape
+
+  def op_Transpose(self, node, attrs):
+    rank = len(self.shape(node.input[0]))
+    perm = attrs.get('perm', list(reversed(range(rank))))
+    lead = 4 - rank
+    self.emit(Op(OP_TRANSPOSE, [self.name(node.input[0])], node.output[0],
+                 list(range(lead)) + [p + lead for p in perm]))
+
+  def alias_op(self, node, attrs):
+    self.alias[node.output[0]] = self.name(node.input[0])
+
+  op_Identity = op_Dropout = alias_op
+
+  def serialize(self):
+    output = self.name(self.output)
+    if output not in self.producer:
+      raise ConvertError("the output is not computed by the graph")
+
+    names, kinds = [], {}
+    def tensor(n):
+      if n not in kinds:
+        names.append(n)
+        kinds[n] = TENSOR_INPUT if n in self.inputs else TENSOR_CONSTANT if n in self.consts else TENSOR_ACTIVATION
+      return names.index(n)
+
+    for role in ROLES:
+      if role in self.roles:
+        tensor(self.roles[role])
+    for op in self.ops:
+      for n in op.inputs:
+        tensor(n)
+      tensor(op.output)
+
+    def meta(offsets):
+      out = MAGIC + struct.pack('<II', VERSION, len(names))
+      for n in names:
+        shape = pad4(self.shape(n))
+        encoded = n.encode()
+        out += struct.pack('<B3x4iQI', kinds[n], *shape, offsets.get(n, 0), len(encoded)) + encoded
+      out += struct.pack('<4i', *[names.index(self.roles[r]) if r in self.roles else -1 for r in ROLES])
+      out += struct.pack('<iI', names.index(output), len(self.ops))
+      for op in self.ops:
+        out += struct.pack('<iiiff', op.type, names.index(op.output), op.act, op.alpha, op.beta)
+        out += struct.pack(f'<{NUM_ATTRS}i', *op.attrs)
+        out += struct.pack(f'<I{len(op.inputs)}i', len(op.inputs), *[names.index(n) for n in op.inputs])
+      return out
+
+    def align(n):
+      return (n + 63) // 64 * 64
+
+    consts = [n for n in names if kinds[n] == TENSOR_CONSTANT]
+    offsets, pos = {}, align(len(meta({n: 0 for n in consts})))
+    for n in consts:
+      offsets[n] = pos
+      pos = align(pos + self.consts[n].size * 4)
+
+    out = bytearray(meta(offsets))
+    for n in consts:
+      out += b'\0' * (offsets[n] - len(out))
+      out += np.ascontiguousarray(self.consts[n], dtype='<f4').tobytes()
+    return bytes(out)
+
+
+def main():
+  parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+  parser.add_argument('onnx')
+  parser.add_argument('output')
+  for role in ROLES:
+    parser.add_argument('--' + role.replace('_', '-'), dest=role, help=f"name of the {role} input")
+  args = parser.parse_args()
+
+  try:
+    conv = Converter(onnx.load(args.onnx), {r: getattr(args, r) for r in ROLES})
+    conv.convert()
+    data = conv.serialize()
+  except ConvertError as e:
+    print(f"{args.onnx}: {e}", file=sys.stderr)
+    return 1
+
+  with open(args.output, 'wb') as f:
+    f.write(data)
+  print(f"{args.output}: {len(conv.ops)} ops, inputs {conv.roles}, {len(data) / 1e6:.1f} MB")
+  return 0
+
+
+if __name__ == "__main__":
+  sys.exit(main())
@@ -10,6 +10,9 @@
   #ifdef USE_TF_MODEL
     #include "tfmodel.h"
     #define DefaultRunModel TFModel
+  #elif defined(USE_CPU_MODEL)
+    #include "cpumodel.h"
+    #define DefaultRunModel CPUModel
   #else
     #define DefaultRunModel SNPEModel
   #endif